@@ -0,0 +1,201 @@
+#pragma once
+
+
+#include <cstddef>
+#include <optional>
+
+#include <boost/iterator/iterator_facade.hpp>
+
+#include <ed/core/quantity.h>
+
+#include <lde/cellfy/boox/area.h>
+#include <lde/cellfy/boox/cell_addr.h>
+#include <lde/cellfy/boox/cell_value.h>
+#include <lde/cellfy/boox/format.h>
+#include <lde/cellfy/boox/fwd.h>
+#include <lde/cellfy/boox/node.h>
+
+
+namespace lde::cellfy::boox {
+
+
+struct column_info {
+  column_index        index = 0;
+  ed::twips<double>   left  = 0._tw;
+  ed::twips<double>   width = 0._tw;
+  column_node::opt_it node;
+};
+
+
+struct row_info {
+  row_index         index  = 0;
+  ed::twips<double> top    = 0._tw;
+  ed::twips<double> height = 0._tw;
+  row_node::opt_it  node;
+};
+
+
+/// Лёгкий дескриптор существующей ячейки. Не владеет данными и не выделяет память.
+/// Действителен, пока не изменилась структура строки, в которой лежит ячейка.
+class cell_ref final {
+public:
+  cell_ref(worksheet& sheet, cell_node::it node) noexcept;
+
+  worksheet& sheet() const noexcept;
+
+  cell_node::it it() const noexcept;
+  const cell_node& node() const noexcept;
+
+  cell_index index() const noexcept;
+  cell_addr addr() const noexcept;
+
+  cell_value_type value_type() const noexcept;
+  bool has_formula() const noexcept;
+
+  /// Ячейка входит в объединение и не является его верхней левой ячейкой.
+  bool merged() const noexcept;
+
+  /// Формат ячейки. nullptr, если у ячейки нет своего формата.
+  const cell_format* format() const noexcept;
+
+  /// Значение ячейки. Для формулы - результат вычисления.
+  cell_value value() const;
+
+  /// Диапазон из одной этой ячейки.
+  range as_range() const;
+
+private:
+  worksheet*    sheet_;
+  cell_node::it node_;
+};
+
+
+/// Существующие ячейки диапазона в порядке строк.
+/// Обход идёт напрямую по forest, без std::function и без создания range на каждую ячейку.
+class existing_cells final {
+public:
+  class iterator final : public boost::iterator_facade<iterator, cell_ref, boost::forward_traversal_tag, cell_ref> {
+    friend class boost::iterator_core_access;
+    friend class existing_cells;
+
+  public:
+    iterator() = default;
+
+  private:
+    explicit iterator(const existing_cells& owner);
+
+    cell_ref dereference() const;
+    bool equal(const iterator& rhs) const noexcept;
+    void increment();
+
+    /// Продвинуться до ближайшей ячейки, попадающей в текущую или следующие области.
+    void settle();
+
+  private:
+    const existing_cells* owner_  = nullptr;
+    std::size_t           area_i_ = 0;
+    row_node::opt_it      row_i_;
+    row_node::opt_it      row_end_;
+    cell_node::opt_it     cell_i_;
+    cell_node::opt_it     cell_end_;
+  };
+
+  using const_iterator = iterator;
+
+public:
+  existing_cells(worksheet& sheet, const area::list& areas) noexcept;
+
+  iterator begin() const;
+  iterator end() const noexcept;
+
+  bool empty() const;
+
+private:
+  worksheet* sheet_;
+  area::list areas_;
+};
+
+
+/// Колонки области с накопленной координатой left.
+class column_cursor final {
+public:
+  class iterator final : public boost::iterator_facade<iterator, column_info, boost::forward_traversal_tag, column_info> {
+    friend class boost::iterator_core_access;
+    friend class column_cursor;
+
+  public:
+    iterator() = default;
+
+  private:
+    iterator(const column_cursor& owner, column_index index);
+
+    column_info dereference() const;
+    bool equal(const iterator& rhs) const noexcept;
+    void increment();
+
+    void settle();
+
+  private:
+    const column_cursor* owner_ = nullptr;
+    column_index         index_ = 0;
+    column_node::opt_it  col_i_;
+    column_node::opt_it  col_end_;
+    column_info          info_;
+  };
+
+  using const_iterator = iterator;
+
+public:
+  column_cursor(worksheet& sheet, const area& ar) noexcept;
+
+  iterator begin() const;
+  iterator end() const noexcept;
+
+private:
+  worksheet* sheet_;
+  area       area_;
+};
+
+
+/// Строки области с накопленной координатой top.
+class row_cursor final {
+public:
+  class iterator final : public boost::iterator_facade<iterator, row_info, boost::forward_traversal_tag, row_info> {
+    friend class boost::iterator_core_access;
+    friend class row_cursor;
+
+  public:
+    iterator() = default;
+
+  private:
+    iterator(const row_cursor& owner, row_index index);
+
+    row_info dereference() const;
+    bool equal(const iterator& rhs) const noexcept;
+    void increment();
+
+    void settle();
+
+  private:
+    const row_cursor* owner_ = nullptr;
+    row_index         index_ = 0;
+    row_node::opt_it  row_i_;
+    row_node::opt_it  row_end_;
+    row_info          info_;
+  };
+
+  using const_iterator = iterator;
+
+public:
+  row_cursor(worksheet& sheet, const area& ar) noexcept;
+
+  iterator begin() const;
+  iterator end() const noexcept;
+
+private:
+  worksheet* sheet_;
+  area       area_;
+};
+
+
+} // namespace lde::cellfy::boox
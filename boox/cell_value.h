@@ -2,7 +2,9 @@
 
 
 #include <cstddef>
+#include <cstdint>
 #include <string>
+#include <type_traits>
 #include <variant>
 #include <vector>
 
@@ -10,9 +12,12 @@
 #include <boost/date_time/posix_time/posix_time_types.hpp>
 #include <boost/operators.hpp>
 
+#include <ed/core/rw.h>
+
 #include <lde/cellfy/boox/enums.h>
 #include <lde/cellfy/boox/exception.h>
 #include <lde/cellfy/boox/format.h>
+#include <lde/cellfy/boox/shared_string.h>
 #include <lde/cellfy/boox/vector_2d.h>
 
 
@@ -47,9 +52,10 @@ public:
   cell_value(boost::gregorian::date v) noexcept;
   cell_value(boost::posix_time::time_duration v) noexcept;
   cell_value(std::wstring v) noexcept;
-  cell_value(const wchar_t* v) noexcept;
-  cell_value(std::string v) noexcept;
-  cell_value(const char* v) noexcept;
+  cell_value(shared_string v) noexcept;
+  cell_value(const wchar_t* v);
+  cell_value(std::string v);
+  cell_value(const char* v);
   cell_value(rich_text v) noexcept;
   cell_value(cell_value_error v) noexcept;
 
@@ -67,6 +73,9 @@ public:
   bool is_nil() const noexcept;
 
   /// Проверка типа содержащегося в data_.
+  /// Строка хранится как std::wstring или, если прочитана из ячейки, как shared_string.
+  /// is<std::wstring>() и as<std::wstring>() возвращают текст в обоих случаях.
+  /// В пул строка попадает только при записи в ячейку, to<shared_string>().
   template<typename T>
   bool is() const noexcept;
 
@@ -74,20 +83,100 @@ public:
   template<typename T>
   const T& as() const;
 
-  /// Получение данных требуемого типа.
-  template<typename T>
+  /// Получение данных требуемого типа. Строку можно только заменить целиком,
+  /// для неё всегда выбирается константная перегрузка.
+  template<typename T, typename = std::enable_if_t<!std::is_same_v<T, std::wstring>>>
   T& as();
 
   /// Преобразование к требуемому типу.
   template<typename T>
   T to() const;
 
+  template<typename OStream>
+  friend void write(OStream& os, const cell_value& v) {
+    using ed::write;
+    const auto type = v.type();
+    write(os, type);
+    switch (type) {
+      case cell_value_type::boolean:
+        write(os, v.as<bool>());
+        break;
+      case cell_value_type::number:
+        write(os, v.as<double>());
+        break;
+      case cell_value_type::string:
+        write(os, v.as<std::wstring>());
+        break;
+      case cell_value_type::rich_text:
+        write(os, static_cast<std::uint32_t>(v.as<rich_text>().size()));
+        for (auto& run : v.as<rich_text>()) {
+          write(os, run.text);
+          write(os, run.format);
+        }
+        break;
+      case cell_value_type::error:
+        write(os, v.as<cell_value_error>());
+        break;
+      case cell_value_type::none:
+        break;
+    }
+  }
+
+  template<typename IStream>
+  friend void read(IStream& is, cell_value& v) {
+    using ed::read;
+    auto type = cell_value_type::none;
+    read(is, type);
+    switch (type) {
+      case cell_value_type::boolean: {
+          bool b = false;
+          read(is, b);
+          v = b;
+        }
+        break;
+      case cell_value_type::number: {
+          double d = 0;
+          read(is, d);
+          v = d;
+        }
+        break;
+      case cell_value_type::string: {
+          std::wstring text;
+          read(is, text);
+          v = std::move(text);
+        }
+        break;
+      case cell_value_type::rich_text: {
+          std::uint32_t count = 0;
+          read(is, count);
+          rich_text runs;
+          for (; count > 0 && is; --count) {
+            auto& run = runs.emplace_back();
+            read(is, run.text);
+            read(is, run.format);
+          }
+          v = std::move(runs);
+        }
+        break;
+      case cell_value_type::error: {
+          auto e = cell_value_error::na;
+          read(is, e);
+          v = e;
+        }
+        break;
+      default:
+        v = cell_value();
+        break;
+    }
+  }
+
 private:
   std::variant<
     std::nullptr_t,
     bool,
     double,
     std::wstring,
+    shared_string,
     rich_text,
     cell_value_error
   > data_;
@@ -106,12 +195,27 @@ const T& cell_value::as() const {
 }
 
 
-template<typename T>
+template<typename T, typename>
 T& cell_value::as() {
   return std::get<T>(data_);
 }
 
 
+template<>
+inline bool cell_value::is<std::wstring>() const noexcept {
+  return std::holds_alternative<std::wstring>(data_) || std::holds_alternative<shared_string>(data_);
+}
+
+
+template<>
+inline const std::wstring& cell_value::as<std::wstring>() const {
+  if (auto s = std::get_if<shared_string>(&data_)) {
+    return s->str();
+  }
+  return std::get<std::wstring>(data_);
+}
+
+
 template<typename T>
 T cell_value::to() const {
   if constexpr (std::is_arithmetic_v<T>) {
@@ -142,5 +246,8 @@ std::wstring cell_value::to<std::wstring>() const;
 template<>
 std::string cell_value::to<std::string>() const;
 
+template<>
+shared_string cell_value::to<shared_string>() const;
+
 
 } // namespace lde::cellfy::boox
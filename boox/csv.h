@@ -0,0 +1,45 @@
+#pragma once
+
+
+#include <filesystem>
+#include <iosfwd>
+#include <locale>
+#include <string>
+#include <string_view>
+
+#include <lde/cellfy/boox/forest.h>
+#include <lde/cellfy/boox/workbook.h>
+
+
+namespace lde::cellfy::boox {
+
+
+/// Параметры текста с разделителями (CSV, TSV). Текст в UTF-8.
+struct csv_options final {
+  char         delimiter  = ',';
+  char         quote      = '"';
+  std::wstring sheet_name = L"Sheet1";              ///< Имя листа при чтении. При записи - какой лист писать, если такой есть.
+  std::locale  loc        = std::locale::classic(); ///< Локаль для распознавания и форматирования чисел и дат.
+};
+
+
+/// Прочитать текст в пустой лес книги. Получается книга с одним листом, значения распознаются value_parser.
+/// Текст делится на части по границам строк и разбирается параллельно, узлы добавляются в лес по порядку.
+void read_csv(std::string_view text, forest_t& forest, const csv_options& options = {});
+
+/// Прочитать файл. Файл отображается в память и не копируется.
+void read_csv(const std::filesystem::path& path, forest_t& forest, const csv_options& options = {});
+
+/// Функция чтения для workbook::add_file_reader. Поток читается в память целиком.
+workbook::file_reader make_csv_reader(csv_options options = {});
+
+/// Записать лист options.sheet_name, а если его нет - первый лист.
+/// Строки и ячейки обходятся прямо по лесу и пишутся в поток через буфер постоянного размера.
+/// Значения с числовым форматом выводятся через value_format, остальные числа - в кратчайшей точной записи.
+void write_csv(std::ostream& os, const forest_t& forest, const csv_options& options = {});
+
+/// Функция записи для workbook::add_file_writer.
+workbook::file_writer make_csv_writer(csv_options options = {});
+
+
+} // namespace lde::cellfy::boox
@@ -18,11 +18,11 @@ enum class cell_value_error : unsigned char {
 /// Тип значения ячейки
 enum class cell_value_type : unsigned char {
   none      = 0,
-  boolean   = 1, // cell_node -> cell_data_node
-  number    = 2, // cell_node -> cell_data_node
+  boolean   = 1, // cell_node::value
+  number    = 2, // cell_node::value
   string    = 3, // cell_node -> cell_data_node
   rich_text = 4, // cell_node -> text_run_node [1, ...]
-  error     = 5  // cell_node -> cell_data_node
+  error     = 5  // cell_node::value
 };
 
 
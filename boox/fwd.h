@@ -17,6 +17,7 @@ using node_version = std::uint8_t;
 class area;
 class cell_addr;
 class cell_value;
+class deferred_sheet;
 class file_io;
 class range;
 class scoped_transaction;
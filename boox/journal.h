@@ -0,0 +1,118 @@
+#pragma once
+
+
+#include <cstddef>
+#include <cstdint>
+#include <filesystem>
+#include <fstream>
+#include <memory>
+#include <string_view>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include <boost/functional/hash.hpp>
+
+#include <ed/core/property.h>
+
+#include <lde/cellfy/boox/forest.h>
+#include <lde/cellfy/boox/format.h>
+#include <lde/cellfy/boox/fwd.h>
+#include <lde/cellfy/boox/workbook.h>
+
+
+namespace lde::cellfy::boox {
+
+
+/// Журнал изменений книги для автосохранения и восстановления после сбоя.
+///
+/// Документ хранится снимком (snapshot.h) в файле path, журнал - рядом, в path + ".journal".
+/// После каждой транзакции в журнал дописывается новое состояние затронутых строк и заголовков листов,
+/// поэтому запись стоит столько, сколько изменилось, а не сколько весит книга.
+/// Когда журнал перерастает снимок, flush() записывает книгу новым снимком и начинает журнал заново.
+///
+/// Журнал привязан к поколению снимка: журнал от другого снимка при открытии пропускается.
+/// Книга должна читать application/x-cellfy через make_snapshot_reader, как по умолчанию. Журнал удаляется раньше книги.
+class journal final {
+public:
+  journal(workbook& book, std::filesystem::path path);
+  ~journal();
+
+  journal(const journal&) = delete;
+  journal& operator=(const journal&) = delete;
+
+  /// Открыть документ: снимок и записи журнала после него. Записи применяются к прочитанному снимку до создания листов,
+  /// поэтому книга открывается без истории undo. Оборванная при сбое последняя запись отбрасывается.
+  /// Если целая запись не применяется (file_is_broken), открывается один снимок, а журнал копируется в path + ".journal.broken".
+  void open();
+
+  /// Записать книгу новым снимком и начать журнал заново. Снимок пишется во временный файл и переименовывается
+  /// после записи на диск, поэтому при сбое остаётся старый снимок с журналом или новый.
+  void compact();
+
+  /// Сбросить записи на диск и дождаться их записи (fdatasync, FlushFileBuffers). Если журнал стал больше снимка - compact().
+  void flush();
+
+  /// Размер журнала в байтах.
+  std::uint64_t size() const noexcept;
+
+private:
+  /// Изменения листа с прошлой записи.
+  struct sheet_changes final {
+    std::uint32_t                                id         = 0;
+    std::vector<std::pair<row_index, row_index>> rows;               ///< Затронутые строки, включительно.
+    bool                                         properties = false; ///< Узел листа, столбцы или области форматов.
+  };
+
+  /// Номер формата в журнале. Ключ удалённого формата лес может выдать новому, поэтому номер сверяется с самим форматом.
+  struct format_id final {
+    std::uint32_t                    id = 0;
+    std::weak_ptr<const cell_format> format;
+  };
+
+  using any_connections = std::vector<ed::scoped_any_connection>;
+  using sheet_conns     = std::unordered_map<const worksheet*, any_connections>;
+  using sheets_changes  = std::unordered_map<const worksheet*, sheet_changes>;
+  using format_ids      = std::unordered_map<node_key_type, format_id, boost::hash<node_key_type>>;
+  using sheet_nodes     = std::vector<std::pair<std::uint32_t, worksheet_node::it>>;
+
+  /// Журнал не меньше этого размера сворачивается в снимок, даже если снимок больше.
+  static constexpr std::uint64_t min_compact_size = 16 << 20;
+
+  /// Номера листов и форматов по их порядку в книге, как в только что записанном снимке.
+  void reset();
+
+  /// Следить за изменениями листа.
+  void watch(worksheet& sheet);
+
+  void close() noexcept;
+
+  /// Начать пустой журнал.
+  void start();
+
+  /// Дописать запись об изменениях с прошлой записи.
+  void append();
+
+  /// Применить записи журнала к прочитанному лесу книги. Возвращает размер целых записей, оборванный хвост не применяется.
+  /// В sheets - номера листов в журнале, листов книги ещё нет.
+  std::size_t replay(std::string_view records, forest_t& forest, sheet_nodes& sheets);
+
+  workbook&                  book_;
+  std::filesystem::path      path_;
+  std::filesystem::path      journal_path_;
+  std::ofstream              out_;
+  std::uint64_t              size_             = 0;
+  std::uint64_t              snapshot_size_    = 0;
+  std::uint32_t              generation_       = 0;
+  std::uint32_t              next_sheet_id_    = 0;
+  std::uint32_t              next_format_id_   = 0;
+  any_connections            book_conns_;
+  sheet_conns                sheet_conns_;
+  sheets_changes             sheets_;
+  std::vector<std::uint32_t> erased_sheets_;
+  format_ids                 formats_;
+  bool                       needs_compaction_ = false;
+};
+
+
+} // namespace lde::cellfy::boox
@@ -1,8 +1,10 @@
 #pragma once
 
 
+#include <memory>
 #include <optional>
 #include <tuple>
+#include <variant>
 
 #include <boost/uuid/string_generator.hpp>
 
@@ -20,6 +22,7 @@
 #include <lde/cellfy/boox/format.h>
 #include <lde/cellfy/boox/fwd.h>
 #include <lde/cellfy/boox/fx_ast.h>
+#include <lde/cellfy/boox/shared_string.h>
 
 
 namespace lde::cellfy::boox {
@@ -57,12 +60,13 @@ struct worksheet_node final {
 
   constexpr static node_version version = 2;
 
-  std::wstring                 name;
-  bool                         hidden = false;
-  std::optional<ed::color>     tab_color;
-  std::optional<node_key_type> format_key; // Ключ cell_format_node
-  mutable worksheet*           sheet = nullptr;
-  mutable cell_format::ptr     format;
+  std::wstring                            name;
+  bool                                    hidden = false;
+  std::optional<ed::color>                tab_color;
+  std::optional<node_key_type>            format_key; // Ключ cell_format_node
+  mutable worksheet*                      sheet = nullptr;
+  mutable cell_format::ptr                format;
+  mutable std::shared_ptr<deferred_sheet> deferred; // Содержимое листа ещё в снимке (snapshot.h)
 
   template<typename OStream>
   friend void write(OStream& os, const worksheet_node& n) {
@@ -209,12 +213,48 @@ struct row_node final {
 };
 
 
+// Прямоугольная область с общим форматом пустых ячеек.
+// Ячейка, созданная внутри области, получает её формат. Области одного листа не пересекаются.
+struct format_run_node final {
+  using it     = forest_iterator<format_run_node>;
+  using opt_it = std::optional<it>;
+
+  constexpr static node_version version = 1;
+
+  cell_index                   first = 0; // Верхняя левая ячейка
+  cell_index                   last  = 0; // Нижняя правая ячейка
+  std::optional<node_key_type> format_key; // Ключ cell_format_node
+  mutable cell_format::ptr     format;
+
+  template<typename OStream>
+  friend void write(OStream& os, const format_run_node& n) {
+    using ed::write;
+    write(os, version);
+    write(os, n.first);
+    write(os, n.last);
+    write(os, n.format_key);
+  }
+
+  template<typename IStream>
+  friend void read(IStream& is, format_run_node& n) {
+    using ed::read;
+    node_version v;
+    read(is, v);
+    ED_EXPECTS(v == version);
+    read(is, n.first);
+    read(is, n.last);
+    read(is, n.format_key);
+  }
+};
+
+
 struct cell_node final {
   using it              = forest_iterator<cell_node>;
   using opt_it          = std::optional<it>;
   using text_layout_ptr = std::shared_ptr<ed::rasta::text_layout>;
+  using scalar          = std::variant<bool, double, cell_value_error>;
 
-  constexpr static node_version version = 1;
+  constexpr static node_version version = 2;
 
   cell_index                   index            = 0;
   std::uint32_t                column_span      = 1;
@@ -223,6 +263,7 @@ struct cell_node final {
   bool                         has_formula      = false;
   std::optional<cell_index>    merged_with;
   std::optional<node_key_type> format_key;                 // Ключ cell_format_node
+  std::optional<scalar>        value;                      // boolean, number и error. Строки - в cell_data_node
   mutable const cell_node*     merged_with_node = nullptr; // Кэш указателя на ячейку по адресу merged_with
   mutable cell_format::ptr     format;
   mutable text_layout_ptr      layout;
@@ -233,13 +274,13 @@ struct cell_node final {
   }
 
   bool operator==(const cell_node& rhs) const noexcept {
-    return std::tie(index, column_span, row_span, value_type, has_formula, merged_with, format_key) ==
-           std::tie(rhs.index, rhs.column_span, rhs.row_span, rhs.value_type, rhs.has_formula, rhs.merged_with, rhs.format_key);
+    return std::tie(index, column_span, row_span, value_type, has_formula, merged_with, format_key, value) ==
+           std::tie(rhs.index, rhs.column_span, rhs.row_span, rhs.value_type, rhs.has_formula, rhs.merged_with, rhs.format_key, rhs.value);
   }
 
   bool operator!=(const cell_node& rhs) const noexcept {
-    return std::tie(index, column_span, row_span, value_type, has_formula, merged_with, format_key) !=
-           std::tie(rhs.index, rhs.column_span, rhs.row_span, rhs.value_type, rhs.has_formula, rhs.merged_with, rhs.format_key);
+    return std::tie(index, column_span, row_span, value_type, has_formula, merged_with, format_key, value) !=
+           std::tie(rhs.index, rhs.column_span, rhs.row_span, rhs.value_type, rhs.has_formula, rhs.merged_with, rhs.format_key, rhs.value);
   }
 
   template<typename OStream>
@@ -253,6 +294,7 @@ struct cell_node final {
     write(os, n.has_formula);
     write(os, n.merged_with);
     write(os, n.format_key);
+    write(os, n.value);
   }
 
   template<typename IStream>
@@ -260,7 +302,7 @@ struct cell_node final {
     using ed::read;
     node_version v;
     read(is, v);
-    ED_EXPECTS(v == version);
+    ED_EXPECTS(v == 1 || v == version);
     read(is, n.index);
     read(is, n.column_span);
     read(is, n.row_span);
@@ -268,10 +310,16 @@ struct cell_node final {
     read(is, n.has_formula);
     read(is, n.merged_with);
     read(is, n.format_key);
+    // В версии 1 скалярные значения хранились в дочернем cell_data_node.
+    if (v == version) {
+      read(is, n.value);
+    }
   }
 };
 
 
+/// Строковое значение ячейки. Текст лежит в общем пуле строк.
+/// В узлах cell_node версии 1 здесь хранились и скаляры.
 struct cell_data_node final {
   using it     = forest_iterator<cell_data_node>;
   using opt_it = std::optional<it>;
@@ -281,7 +329,7 @@ struct cell_data_node final {
   std::variant<
     bool,
     double,
-    std::wstring,
+    shared_string,
     cell_value_error
   > data;
 
@@ -320,8 +368,8 @@ struct text_run_node final {
 
   constexpr static node_version version = 2;
 
-  std::wstring text;
-  font_format  format;
+  shared_string text;
+  font_format   format;
 
   template<typename OStream>
   friend void write(OStream& os, const text_run_node& n) {
@@ -357,7 +405,7 @@ struct cell_formula_node final {
   using it     = forest_iterator<cell_formula_node>;
   using opt_it = std::optional<it>;
 
-  constexpr static node_version version = 1;
+  constexpr static node_version version = 2;
 
   std::wstring            formula;
   mutable fx::ast::tokens ast;
@@ -367,11 +415,18 @@ struct cell_formula_node final {
   mutable bool            in_calculating  = false; // Для определения циклических зависимостей
   mutable cell_value      result;
 
+  /// Посчитанный результат пишется вместе с формулой, и открытая книга показывает его без пересчёта.
+  /// Признак действительности - is_result_dirty на момент записи: зависимости формул пока не отслеживаются.
   template<typename OStream>
   friend void write(OStream& os, const cell_formula_node& n) {
     using ed::write;
     write(os, version);
     write(os, n.formula);
+    const bool has_result = !n.is_result_dirty;
+    write(os, has_result);
+    if (has_result) {
+      write(os, n.result);
+    }
   }
 
   template<typename IStream>
@@ -379,8 +434,16 @@ struct cell_formula_node final {
     using ed::read;
     node_version v;
     read(is, v);
-    ED_EXPECTS(v == version);
+    ED_EXPECTS(v <= version);
     read(is, n.formula);
+    if (v > 1) {
+      bool has_result = false;
+      read(is, has_result);
+      if (has_result) {
+        read(is, n.result);
+        n.is_result_dirty = false;
+      }
+    }
   }
 };
 
@@ -463,4 +526,13 @@ struct type_id<cellfy::boox::cell_formula_node> {
 };
 
 
+template<>
+struct type_id<cellfy::boox::format_run_node> {
+  static const type_id_t& value() noexcept {
+    static type_id_t id = "00000000-0000-0000-0000-000000000009"_uuid;
+    return id;
+  }
+};
+
+
 } // namespace lde::forest
@@ -19,6 +19,7 @@
 #include <ed/rasta/fwd.h>
 
 #include <lde/cellfy/boox/area.h>
+#include <lde/cellfy/boox/cell_cursor.h>
 #include <lde/cellfy/boox/cell_value.h>
 #include <lde/cellfy/boox/exception.h>
 #include <lde/cellfy/boox/format.h>
@@ -36,21 +37,11 @@ public:
   struct paint_options {
     ed::color                grid_line_color = default_line_color;
     std::optional<cell_addr> hidden_cell;
+    double                   zoom            = 1.; ///< Масштаб вида. Модели ячеек разных масштабов кэшируются отдельно.
   };
 
-  struct column_info {
-    column_index        index = 0;
-    ed::twips<double>   left  = 0._tw;
-    ed::twips<double>   width = 0._tw;
-    column_node::opt_it node;
-  };
-
-  struct row_info {
-    row_index         index  = 0;
-    ed::twips<double> top    = 0._tw;
-    ed::twips<double>     height = 0._tw;
-    row_node::opt_it  node;
-  };
+  using column_info = boox::column_info;
+  using row_info    = boox::row_info;
 
   using area_fn   = std::function<void(const range&)>;
   using column_fn = std::function<void(const column_info&)>;
@@ -218,6 +209,15 @@ public:
   /// Пройтись по существующим ячейкам.
   void for_existing_cells(const cell_fn& fn) const;
 
+  /// Существующие ячейки для range-for. Без выделения памяти на каждую ячейку.
+  existing_cells existing() const;
+
+  /// Колонки для range-for. Только для single_area.
+  column_cursor columns() const;
+
+  /// Строки для range-for. Только для single_area.
+  row_cursor rows() const;
+
   /// Координата x относительно A1.
   ed::twips<double> left() const;
 
@@ -388,6 +388,8 @@ void range::apply(Op&& op) const {
     range_op::for_all_cells(ctx, op);
   } else if constexpr (std::is_same_v<processing, for_existing_cells_tag>) {
     range_op::for_existing_cells(ctx, op);
+  } else if constexpr (std::is_same_v<processing, for_existing_rows_and_cells_tag>) {
+    range_op::for_existing_rows_and_cells(ctx, op);
   }
 }
 
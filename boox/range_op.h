@@ -1,10 +1,16 @@
 #pragma once
 
 
+#include <algorithm>
 #include <memory>
+#include <optional>
+#include <tuple>
 #include <type_traits>
+#include <utility>
 #include <vector>
 
+#include <ed/core/quantity.h>
+
 #include <lde/cellfy/boox/area.h>
 #include <lde/cellfy/boox/forest.h>
 #include <lde/cellfy/boox/fwd.h>
@@ -14,6 +20,10 @@
 namespace lde::cellfy::boox {
 
 
+class layout_cache;
+class row_height_index;
+
+
 class range_op_ctx final {
 public:
   range_op_ctx(worksheet& sheet, const area::list& areas) noexcept;
@@ -27,8 +37,29 @@ public:
   const forest_t& forest() const noexcept;
   forest_t& forest() noexcept;
 
+  worksheet_node::it sheet_node() const noexcept;
+  ed::twips<double> default_row_height() const noexcept;
+
   const area::list& areas() const noexcept;
 
+  /// Область формата, содержащая ячейку.
+  format_run_node::opt_it find_format_run(cell_addr addr) const;
+
+  /// Области формата, пересекающиеся с областями контекста.
+  std::vector<format_run_node::it> find_format_runs() const;
+
+  /// Новая ячейка внутри области формата получает формат этой области.
+  void inherit_format(cell_node& node) const;
+
+  /// Кэш посчитанных layout ячеек листа.
+  layout_cache& layouts() noexcept;
+
+  /// Высоты содержимого ячеек по строкам листа.
+  row_height_index& row_heights() noexcept;
+
+  /// Узел перестал ссылаться на формат.
+  void release_format(const std::optional<node_key_type>& key);
+
 private:
   worksheet& sheet_;
   area::list areas_;
@@ -41,16 +72,29 @@ struct for_all_rows_tag {};
 struct for_existing_rows_tag {};
 struct for_all_cells_tag {};
 struct for_existing_cells_tag {};
+/// Существующие строки и их существующие ячейки за один проход.
+/// Для строки вызывается on_existing_node до её ячеек и on_row_finished после.
+struct for_existing_rows_and_cells_tag {};
 
 
+/// Обходы вызывают обработчики операции напрямую по её типу Op.
+/// Для final-операций это убирает виртуальный вызов на каждый узел.
 class range_op {
 public:
-  static void for_all_columns(range_op_ctx& ctx, range_op& op);
-  static void for_existing_columns(range_op_ctx& ctx, range_op& op);
-  static void for_all_rows(range_op_ctx& ctx, range_op& op);
-  static void for_existing_rows(range_op_ctx& ctx, range_op& op);
-  static void for_all_cells(range_op_ctx& ctx, range_op& op);
-  static void for_existing_cells(range_op_ctx& ctx, range_op& op);
+  template<typename Op>
+  static void for_all_columns(range_op_ctx& ctx, Op& op);
+  template<typename Op>
+  static void for_existing_columns(range_op_ctx& ctx, Op& op);
+  template<typename Op>
+  static void for_all_rows(range_op_ctx& ctx, Op& op);
+  template<typename Op>
+  static void for_existing_rows(range_op_ctx& ctx, Op& op);
+  template<typename Op>
+  static void for_all_cells(range_op_ctx& ctx, Op& op);
+  template<typename Op>
+  static void for_existing_cells(range_op_ctx& ctx, Op& op);
+  template<typename Op>
+  static void for_existing_rows_and_cells(range_op_ctx& ctx, Op& op);
 
 public:
   virtual ~range_op() = default;
@@ -66,6 +110,7 @@ public:
   virtual bool on_new_node(range_op_ctx& ctx, row_node& node);
   virtual bool on_new_node(range_op_ctx& ctx, row_node::it node);
   virtual bool on_existing_node(range_op_ctx& ctx, row_node::it node);
+  virtual bool on_row_finished(range_op_ctx& ctx, row_node::it node);
 
   virtual bool on_new_node(range_op_ctx& ctx, cell_node& node);
   virtual bool on_new_node(range_op_ctx& ctx, cell_node::it node);
@@ -76,51 +121,160 @@ protected:
 };
 
 
+namespace _ {
+
+template<typename Op, typename Node, typename = void>
+struct has_on_new_node : std::false_type {};
+
+template<typename Op, typename Node>
+struct has_on_new_node<Op, Node, std::void_t<
+  decltype(std::declval<Op&>().on_new_node(std::declval<range_op_ctx&>(), std::declval<Node>()))
+>> : std::true_type {};
+
+
+template<typename Op, typename Node, typename = void>
+struct has_on_existing_node : std::false_type {};
+
+template<typename Op, typename Node>
+struct has_on_existing_node<Op, Node, std::void_t<
+  decltype(std::declval<Op&>().on_existing_node(std::declval<range_op_ctx&>(), std::declval<Node>()))
+>> : std::true_type {};
+
+
+template<typename Op, typename = void>
+struct has_on_row_finished : std::false_type {};
+
+template<typename Op>
+struct has_on_row_finished<Op, std::void_t<
+  decltype(std::declval<Op&>().on_row_finished(std::declval<range_op_ctx&>(), std::declval<row_node::it>()))
+>> : std::true_type {};
+
+
+// Если обработчик для узла виден в Op, то он вызывается по статическому типу.
+// Иначе (перекрыт перегрузкой в наследнике) - через базовый класс, как раньше.
+template<typename Op, typename Node>
+bool on_new_node(Op& op, range_op_ctx& ctx, Node&& node) {
+  if constexpr (has_on_new_node<Op, Node&&>::value) {
+    return op.on_new_node(ctx, std::forward<Node>(node));
+  } else {
+    return static_cast<range_op&>(op).on_new_node(ctx, std::forward<Node>(node));
+  }
+}
+
+
+template<typename Op, typename Node>
+bool on_existing_node(Op& op, range_op_ctx& ctx, Node&& node) {
+  if constexpr (has_on_existing_node<Op, Node&&>::value) {
+    return op.on_existing_node(ctx, std::forward<Node>(node));
+  } else {
+    return static_cast<range_op&>(op).on_existing_node(ctx, std::forward<Node>(node));
+  }
+}
+
+
+template<typename Op>
+bool on_row_finished(Op& op, range_op_ctx& ctx, row_node::it node) {
+  if constexpr (has_on_row_finished<Op>::value) {
+    return op.on_row_finished(ctx, node);
+  } else {
+    return static_cast<range_op&>(op).on_row_finished(ctx, node);
+  }
+}
+
+
+template<typename Processing1, typename Processing2>
+struct merge_processing;
+
+template<typename Processing>
+struct merge_processing<Processing, Processing> {
+  using type = Processing;
+};
+
+template<>
+struct merge_processing<for_all_columns_tag, for_existing_columns_tag> {
+  using type = for_all_columns_tag;
+};
+
+template<>
+struct merge_processing<for_existing_columns_tag, for_all_columns_tag> {
+  using type = for_all_columns_tag;
+};
+
+template<>
+struct merge_processing<for_all_rows_tag, for_existing_rows_tag> {
+  using type = for_all_rows_tag;
+};
+
+template<>
+struct merge_processing<for_existing_rows_tag, for_all_rows_tag> {
+  using type = for_all_rows_tag;
+};
+
+template<>
+struct merge_processing<for_all_cells_tag, for_existing_cells_tag> {
+  using type = for_all_cells_tag;
+};
+
+template<>
+struct merge_processing<for_existing_cells_tag, for_all_cells_tag> {
+  using type = for_all_cells_tag;
+};
+
+template<>
+struct merge_processing<for_existing_rows_tag, for_existing_cells_tag> {
+  using type = for_existing_rows_and_cells_tag;
+};
+
+template<>
+struct merge_processing<for_existing_cells_tag, for_existing_rows_tag> {
+  using type = for_existing_rows_and_cells_tag;
+};
+
+template<>
+struct merge_processing<for_existing_rows_and_cells_tag, for_existing_rows_tag> {
+  using type = for_existing_rows_and_cells_tag;
+};
+
+template<>
+struct merge_processing<for_existing_rows_tag, for_existing_rows_and_cells_tag> {
+  using type = for_existing_rows_and_cells_tag;
+};
+
+template<>
+struct merge_processing<for_existing_rows_and_cells_tag, for_existing_cells_tag> {
+  using type = for_existing_rows_and_cells_tag;
+};
+
+template<>
+struct merge_processing<for_existing_cells_tag, for_existing_rows_and_cells_tag> {
+  using type = for_existing_rows_and_cells_tag;
+};
+
+
+template<typename Processing, typename ... Processings>
+struct merge_all_processing {
+  using type = Processing;
+};
+
+template<typename Processing1, typename Processing2, typename ... Processings>
+struct merge_all_processing<Processing1, Processing2, Processings...> {
+  using type = typename merge_all_processing<
+    typename merge_processing<Processing1, Processing2>::type,
+    Processings...
+  >::type;
+};
+
+} // namespace _
+
+
+
 template<typename Op1, typename Op2>
 class composite_range_op : public range_op {
   static_assert(std::is_base_of_v<range_op, Op1>);
   static_assert(std::is_base_of_v<range_op, Op2>);
 
 public:
-  template<typename Processing1, typename Processing2>
-  struct choose_processing;
-
-  template<typename Processing>
-  struct choose_processing<Processing, Processing> {
-    using type = Processing;
-  };
-
-  template<>
-  struct choose_processing<for_all_columns_tag, for_existing_columns_tag> {
-    using type = for_all_columns_tag;
-  };
-
-  template<>
-  struct choose_processing<for_existing_columns_tag, for_all_columns_tag> {
-    using type = for_all_columns_tag;
-  };
-
-  template<>
-  struct choose_processing<for_all_rows_tag, for_existing_rows_tag> {
-    using type = for_all_rows_tag;
-  };
-
-  template<>
-  struct choose_processing<for_existing_rows_tag, for_all_rows_tag> {
-    using type = for_all_rows_tag;
-  };
-
-  template<>
-  struct choose_processing<for_all_cells_tag, for_existing_cells_tag> {
-    using type = for_all_cells_tag;
-  };
-
-  template<>
-  struct choose_processing<for_existing_cells_tag, for_all_cells_tag> {
-    using type = for_all_cells_tag;
-  };
-
-  using processing = typename choose_processing<
+  using processing = typename _::merge_processing<
     typename Op1::processing,
     typename Op2::processing
   >::type;
@@ -165,6 +319,10 @@ public:
     return on_existing_node_impl(ctx, node);
   }
 
+  bool on_row_finished(range_op_ctx& ctx, row_node::it node) override {
+    return _::on_row_finished(op1_, ctx, node) && _::on_row_finished(op2_, ctx, node);
+  }
+
   bool on_new_node(range_op_ctx& ctx, cell_node& node) override {
     return on_new_node_impl(ctx, node);
   }
@@ -179,22 +337,22 @@ public:
 
 private:
   template<typename Node>
-  bool on_new_node_impl(range_op_ctx& ctx, Node&& node) {
-    if (!static_cast<range_op&>(op1_).on_new_node(ctx, std::forward<Node>(node))) {
+  bool on_new_node_impl(range_op_ctx& ctx, Node& node) {
+    if (!_::on_new_node(op1_, ctx, node)) {
       return false;
     }
-    if (!static_cast<range_op&>(op2_).on_new_node(ctx, std::forward<Node>(node))) {
+    if (!_::on_new_node(op2_, ctx, node)) {
       return false;
     }
     return true;
   }
 
   template<typename Node>
-  bool on_existing_node_impl(range_op_ctx& ctx, Node&& node) {
-    if (!static_cast<range_op&>(op1_).on_existing_node(ctx, std::forward<Node>(node))) {
+  bool on_existing_node_impl(range_op_ctx& ctx, Node& node) {
+    if (!_::on_existing_node(op1_, ctx, node)) {
       return false;
     }
-    if (!static_cast<range_op&>(op2_).on_existing_node(ctx, std::forward<Node>(node))) {
+    if (!_::on_existing_node(op2_, ctx, node)) {
       return false;
     }
     return true;
@@ -216,4 +374,397 @@ operator|(Op1&& op1, Op2&& op2) {
 }
 
 
+/// Конвейер операций, выполняемых за один обход.
+/// Тип обхода выводится из processing всех операций. Строковые и ячеечные операции
+/// по существующим узлам сливаются в for_existing_rows_and_cells_tag.
+/// Обработчики операций вызываются в порядке перечисления, без виртуальной диспетчеризации.
+template<typename ... Ops>
+class range_pipeline final : public range_op {
+  static_assert(sizeof...(Ops) > 0);
+  static_assert((std::is_base_of_v<range_op, Ops> && ...));
+
+public:
+  using processing = typename _::merge_all_processing<typename Ops::processing...>::type;
+
+public:
+  explicit range_pipeline(Ops&& ... ops)
+    : ops_(std::move(ops)...) {
+  }
+
+  void on_start(range_op_ctx& ctx) override {
+    std::apply([&ctx](auto& ... op) { (op.on_start(ctx), ...); }, ops_);
+  }
+
+  void on_finish(range_op_ctx& ctx) override {
+    std::apply([&ctx](auto& ... op) { (op.on_finish(ctx), ...); }, ops_);
+  }
+
+  void on_break(range_op_ctx& ctx) override {
+    std::apply([&ctx](auto& ... op) { (op.on_break(ctx), ...); }, ops_);
+  }
+
+  bool on_new_node(range_op_ctx& ctx, column_node& node) override {
+    return on_new_node_impl(ctx, node);
+  }
+
+  bool on_new_node(range_op_ctx& ctx, column_node::it node) override {
+    return on_new_node_impl(ctx, node);
+  }
+
+  bool on_existing_node(range_op_ctx& ctx, column_node::it node) override {
+    return on_existing_node_impl(ctx, node);
+  }
+
+  bool on_new_node(range_op_ctx& ctx, row_node& node) override {
+    return on_new_node_impl(ctx, node);
+  }
+
+  bool on_new_node(range_op_ctx& ctx, row_node::it node) override {
+    return on_new_node_impl(ctx, node);
+  }
+
+  bool on_existing_node(range_op_ctx& ctx, row_node::it node) override {
+    return on_existing_node_impl(ctx, node);
+  }
+
+  bool on_row_finished(range_op_ctx& ctx, row_node::it node) override {
+    return std::apply([&ctx, &node](auto& ... op) { return (_::on_row_finished(op, ctx, node) && ...); }, ops_);
+  }
+
+  bool on_new_node(range_op_ctx& ctx, cell_node& node) override {
+    return on_new_node_impl(ctx, node);
+  }
+
+  bool on_new_node(range_op_ctx& ctx, cell_node::it node) override {
+    return on_new_node_impl(ctx, node);
+  }
+
+  bool on_existing_node(range_op_ctx& ctx, cell_node::it node) override {
+    return on_existing_node_impl(ctx, node);
+  }
+
+private:
+  template<typename Node>
+  bool on_new_node_impl(range_op_ctx& ctx, Node& node) {
+    return std::apply([&ctx, &node](auto& ... op) { return (_::on_new_node(op, ctx, node) && ...); }, ops_);
+  }
+
+  template<typename Node>
+  bool on_existing_node_impl(range_op_ctx& ctx, Node& node) {
+    return std::apply([&ctx, &node](auto& ... op) { return (_::on_existing_node(op, ctx, node) && ...); }, ops_);
+  }
+
+private:
+  std::tuple<Ops...> ops_;
+};
+
+
+template<typename ... Ops>
+range_pipeline<std::decay_t<Ops>...> make_pipeline(Ops&& ... ops) {
+  return range_pipeline<std::decay_t<Ops>...>(std::move(ops)...);
+}
+
+
+/// Выполняет строковую операцию после обхода ячеек строки.
+/// Нужна операциям, которым важен результат обработки ячеек, например actualize_row_height_op.
+template<typename Op>
+class after_cells_op final : public range_op {
+  static_assert(std::is_base_of_v<range_op, Op>);
+  static_assert(std::is_same_v<typename Op::processing, for_existing_rows_tag>);
+
+public:
+  using processing = for_existing_rows_and_cells_tag;
+
+public:
+  explicit after_cells_op(Op&& op)
+    : op_(std::move(op)) {
+  }
+
+  void on_start(range_op_ctx& ctx) override {
+    op_.on_start(ctx);
+  }
+
+  void on_finish(range_op_ctx& ctx) override {
+    op_.on_finish(ctx);
+  }
+
+  void on_break(range_op_ctx& ctx) override {
+    op_.on_break(ctx);
+  }
+
+  bool on_row_finished(range_op_ctx& ctx, row_node::it node) override {
+    return _::on_existing_node(op_, ctx, node);
+  }
+
+private:
+  Op op_;
+};
+
+
+template<typename Op>
+after_cells_op<std::decay_t<Op>> after_cells(Op&& op) {
+  return after_cells_op<std::decay_t<Op>>(std::move(op));
+}
+
+
+template<typename Op>
+void range_op::for_all_columns(range_op_ctx& ctx, Op& op) {
+  op.on_start(ctx);
+  auto columns = ctx.forest().get<column_node>(ctx.sheet_node());
+
+  for (auto&& ar : ctx.areas()) {
+    auto col_i = std::lower_bound(columns.begin(), columns.end(), column_node{ar.left_column()});
+
+    for (auto index = ar.left_column(); index <= ar.right_column(); ++index) {
+      if (col_i != columns.end() && col_i->index == index) {
+        if (!_::on_existing_node(op, ctx, col_i++)) {
+          op.on_break(ctx);
+          return;
+        }
+      } else {
+        column_node n;
+        n.index = index;
+
+        if (!_::on_new_node(op, ctx, n)) {
+          op.on_break(ctx);
+          return;
+        }
+
+        col_i = ctx.forest().insert(ctx.sheet_node(), col_i, std::move(n));
+
+        if (!_::on_new_node(op, ctx, col_i++)) {
+          op.on_break(ctx);
+          return;
+        }
+      }
+    }
+  }
+
+  op.on_finish(ctx);
+}
+
+
+template<typename Op>
+void range_op::for_existing_columns(range_op_ctx& ctx, Op& op) {
+  op.on_start(ctx);
+  auto columns = ctx.forest().get<column_node>(ctx.sheet_node());
+
+  for (auto&& ar : ctx.areas()) {
+    auto col_i = std::lower_bound(columns.begin(), columns.end(), column_node{ar.left_column()});
+
+    while (col_i != columns.end() && col_i->index <= ar.right_column()) {
+      if (!_::on_existing_node(op, ctx, col_i++)) {
+        op.on_break(ctx);
+        return;
+      }
+    }
+  }
+
+  op.on_finish(ctx);
+}
+
+
+template<typename Op>
+void range_op::for_all_rows(range_op_ctx& ctx, Op& op) {
+  op.on_start(ctx);
+  auto rows = ctx.forest().get<row_node>(ctx.sheet_node());
+
+  for (auto&& ar : ctx.areas()) {
+    auto row_i = std::lower_bound(rows.begin(), rows.end(), row_node{ar.top_row()});
+
+    for (auto index = ar.top_row(); index <= ar.bottom_row(); ++index) {
+      if (row_i != rows.end() && row_i->index == index) {
+        if (!_::on_existing_node(op, ctx, row_i++)) {
+          op.on_break(ctx);
+          return;
+        }
+      } else {
+        row_node n;
+        n.index = index;
+
+        if (!_::on_new_node(op, ctx, n)) {
+          op.on_break(ctx);
+          return;
+        }
+
+        row_i = ctx.forest().insert(ctx.sheet_node(), row_i, std::move(n));
+
+        if (!_::on_new_node(op, ctx, row_i++)) {
+          op.on_break(ctx);
+          return;
+        }
+      }
+    }
+  }
+
+  op.on_finish(ctx);
+}
+
+
+template<typename Op>
+void range_op::for_existing_rows(range_op_ctx& ctx, Op& op) {
+  op.on_start(ctx);
+  auto rows = ctx.forest().get<row_node>(ctx.sheet_node());
+
+  for (auto&& ar : ctx.areas()) {
+    auto row_i = std::lower_bound(rows.begin(), rows.end(), row_node{ar.top_row()});
+
+    while (row_i != rows.end() && row_i->index <= ar.bottom_row()) {
+      if (!_::on_existing_node(op, ctx, row_i++)) {
+        op.on_break(ctx);
+        return;
+      }
+    }
+  }
+
+  op.on_finish(ctx);
+}
+
+
+template<typename Op>
+void range_op::for_all_cells(range_op_ctx& ctx, Op& op) {
+  op.on_start(ctx);
+  auto rows = ctx.forest().get<row_node>(ctx.sheet_node());
+
+  for (auto&& ar : ctx.areas()) {
+    auto row_i = std::lower_bound(rows.begin(), rows.end(), row_node{ar.top_row()});
+
+    for (auto row = ar.top_row(); row <= ar.bottom_row(); ++row) {
+      if (row_i != rows.end() && row_i->index == row) {
+        auto cells = ctx.forest().get<cell_node>(row_i);
+        auto cell_i = std::lower_bound(cells.begin(), cells.end(), cell_node{cell_addr(ar.left_column(), row).index()});
+
+        for (auto col = ar.left_column(); col <= ar.right_column(); ++col) {
+          cell_addr addr(col, row);
+          if (cell_i != cells.end() && cell_i->index == addr.index()) {
+            if (!_::on_existing_node(op, ctx, cell_i++)) {
+              op.on_break(ctx);
+              return;
+            }
+          } else {
+            cell_node cell_n;
+            cell_n.index = addr.index();
+            ctx.inherit_format(cell_n);
+
+            if (!_::on_new_node(op, ctx, cell_n)) {
+              op.on_break(ctx);
+              return;
+            }
+
+            cell_i = ctx.forest().insert(row_i, cell_i, std::move(cell_n));
+
+            if (!_::on_new_node(op, ctx, cell_i++)) {
+              op.on_break(ctx);
+              return;
+            }
+          }
+        }
+      } else {
+        row_node row_n;
+        row_n.index = row;
+        row_n.height = ctx.default_row_height();
+
+        if (!_::on_new_node(op, ctx, row_n)) {
+          op.on_break(ctx);
+          return;
+        }
+
+        row_i = ctx.forest().insert(ctx.sheet_node(), row_i, std::move(row_n));
+        // После вставки новой строки, нужно обновить range строк.
+        rows = ctx.forest().get<row_node>(ctx.sheet_node());
+
+        if (!_::on_new_node(op, ctx, row_i)) {
+          op.on_break(ctx);
+          return;
+        }
+
+        for (auto col = ar.left_column(); col <= ar.right_column(); ++col) {
+          cell_node cell_n;
+          cell_n.index = cell_addr(col, row).index();
+          ctx.inherit_format(cell_n);
+
+          if (!_::on_new_node(op, ctx, cell_n)) {
+            op.on_break(ctx);
+            return;
+          }
+
+          auto cell_i = ctx.forest().push_back(row_i, std::move(cell_n));
+
+          if (!_::on_new_node(op, ctx, cell_i)) {
+            op.on_break(ctx);
+            return;
+          }
+        }
+      }
+
+      ++row_i;
+    }
+  }
+
+  op.on_finish(ctx);
+}
+
+
+template<typename Op>
+void range_op::for_existing_cells(range_op_ctx& ctx, Op& op) {
+  op.on_start(ctx);
+  auto rows = ctx.forest().get<row_node>(ctx.sheet_node());
+
+  for (auto&& ar : ctx.areas()) {
+    auto row_i = std::lower_bound(rows.begin(), rows.end(), row_node{ar.top_row()});
+
+    while (row_i != rows.end() && row_i->index <= ar.bottom_row()) {
+      auto cells = ctx.forest().get<cell_node>(row_i);
+      auto cell_i = std::lower_bound(cells.begin(), cells.end(), cell_node{cell_addr(ar.left_column(), row_i->index).index()});
+
+      while (cell_i != cells.end() && cell_i->index <= cell_addr(ar.right_column(), row_i->index).index()) {
+        if (!_::on_existing_node(op, ctx, cell_i++)) {
+          op.on_break(ctx);
+          return;
+        }
+      }
+
+      ++row_i;
+    }
+  }
+
+  op.on_finish(ctx);
+}
+
+
+template<typename Op>
+void range_op::for_existing_rows_and_cells(range_op_ctx& ctx, Op& op) {
+  op.on_start(ctx);
+  auto rows = ctx.forest().get<row_node>(ctx.sheet_node());
+
+  for (auto&& ar : ctx.areas()) {
+    auto row_i = std::lower_bound(rows.begin(), rows.end(), row_node{ar.top_row()});
+
+    while (row_i != rows.end() && row_i->index <= ar.bottom_row()) {
+      if (!_::on_existing_node(op, ctx, row_i)) {
+        op.on_break(ctx);
+        return;
+      }
+
+      auto cells = ctx.forest().get<cell_node>(row_i);
+      auto cell_i = std::lower_bound(cells.begin(), cells.end(), cell_node{cell_addr(ar.left_column(), row_i->index).index()});
+
+      while (cell_i != cells.end() && cell_i->index <= cell_addr(ar.right_column(), row_i->index).index()) {
+        if (!_::on_existing_node(op, ctx, cell_i++)) {
+          op.on_break(ctx);
+          return;
+        }
+      }
+
+      if (!_::on_row_finished(op, ctx, row_i++)) {
+        op.on_break(ctx);
+        return;
+      }
+    }
+  }
+
+  op.on_finish(ctx);
+}
+
+
 } // namespace lde::cellfy::boox
@@ -11,6 +11,7 @@ namespace lde::cellfy::boox {
 class scoped_transaction final {
 public:
   explicit scoped_transaction(forest_t& f);
+  /// Изменение книги. Отложенные листы читаются при обращении к ним (workbook::load_sheet), в том числе внутри транзакции.
   explicit scoped_transaction(workbook& book);
   ~scoped_transaction();
 
@@ -0,0 +1,72 @@
+#pragma once
+
+
+#include <cstddef>
+#include <memory>
+#include <string>
+#include <string_view>
+
+#include <boost/operators.hpp>
+
+#include <ed/core/rw.h>
+
+
+namespace lde::cellfy::boox {
+
+
+/// Неизменяемая строка из общего пула (аналог sharedStrings в XLSX).
+/// Одинаковые строки разделяют одну запись, поэтому равенство - это сравнение указателей.
+/// Запись удаляется из пула вместе с последней ссылкой на неё.
+class shared_string final :
+  public boost::equality_comparable<shared_string> {
+
+public:
+  /// Запись пула. Определена в shared_string.cpp.
+  struct entry;
+
+public:
+  shared_string();
+  shared_string(std::wstring_view text);
+  shared_string(const std::wstring& text);
+  shared_string(const wchar_t* text);
+
+  bool operator==(const shared_string& rhs) const noexcept;
+
+  const std::wstring& str() const noexcept;
+  operator const std::wstring&() const noexcept;
+
+  bool empty() const noexcept;
+  std::size_t size() const noexcept;
+
+  /// Хэш строки, посчитанный при добавлении в пул.
+  std::size_t hash() const noexcept;
+
+  /// Строка в нижнем регистре для сравнения без учёта регистра.
+  const std::wstring& folded() const noexcept;
+
+  /// Хэш folded().
+  std::size_t folded_hash() const noexcept;
+
+  /// Сравнение без учёта регистра.
+  friend bool iequals(const shared_string& lhs, const shared_string& rhs) noexcept;
+
+  template<typename OStream>
+  friend void write(OStream& os, const shared_string& s) {
+    using ed::write;
+    write(os, s.str());
+  }
+
+  template<typename IStream>
+  friend void read(IStream& is, shared_string& s) {
+    using ed::read;
+    std::wstring text;
+    read(is, text);
+    s = shared_string(text);
+  }
+
+private:
+  std::shared_ptr<const entry> entry_;
+};
+
+
+} // namespace lde::cellfy::boox
@@ -0,0 +1,108 @@
+#pragma once
+
+
+#include <cstdint>
+#include <filesystem>
+#include <iosfwd>
+#include <memory>
+#include <string_view>
+
+#include <lde/cellfy/boox/forest.h>
+#include <lde/cellfy/boox/node.h>
+#include <lde/cellfy/boox/workbook.h>
+
+
+namespace lde::cellfy::boox {
+
+
+/// Версия колоночного снимка книги. Снимки других версий не читаются.
+constexpr std::uint32_t snapshot_version = 1;
+
+
+/// Колоночный снимок книги - формат для application/x-cellfy, который не требует разбора узел за узлом.
+///
+/// Файл состоит из разделов, выровненных на 8 байт. Смещения отсчитываются от начала файла:
+///   заголовок      - сигнатура, версия и поколение, по которому к снимку привязывается журнал (journal.h);
+///   разделы листов - узлы листа, столбцов, строк и областей форматов, затем блоки ячеек;
+///   форматы        - узлы cell_format_node, остальные узлы ссылаются на них по номеру;
+///   строки         - все строки книги в UTF-8, ячейки и формулы ссылаются на них по номеру;
+///   каталог        - смещение и размер раздела каждого листа;
+///   концевик       - смещения и размеры форматов, строк и каталога, затем снова сигнатура.
+/// Каталог и таблица строк пишутся в конце, поэтому запись идёт потоком и держит в памяти только один лист.
+///
+/// Блок содержит до snapshot_block_size ячеек, лежащих подряд по строкам. Данные блока хранятся по колонкам:
+/// индексы, номера строк, номера форматов, типы, флаги и числа, а редкие данные (объединения, формулы,
+/// форматированный текст) - отдельными списками после колонок. Разделы листов и блоки не зависят друг от друга:
+/// отображённый в память файл можно читать по блокам.
+/// Ячейки блока в колонках идут по колонкам листа, а колонки сжаты (src/column_codec.h):
+/// целые - разностями разностей с сериями повторов, дробные числа - XOR с предыдущим значением.
+/// Сжатый блок декодируется целиком.
+/// Формула хранится вместе с посчитанным результатом: открытая книга показывает его без пересчёта.
+/// Числа записываются в порядке байт little-endian.
+constexpr std::uint32_t snapshot_block_size = 1 << 16;
+
+
+/// Проверить сигнатуру снимка.
+bool is_snapshot(std::string_view data) noexcept;
+
+/// Начинаются ли данные с сигнатуры снимка. Достаточно первых 8 байт. Файлы application/x-cellfy прежнего
+/// формата записаны узел за узлом и сигнатуры не имеют.
+bool starts_as_snapshot(std::string_view head) noexcept;
+
+/// Начинается ли файл с сигнатуры снимка.
+bool is_snapshot_file(const std::filesystem::path& path);
+
+/// Поколение снимка. Достаточно заголовка - первых 16 байт файла.
+std::uint32_t snapshot_generation(std::string_view head);
+
+/// Записать книгу из леса.
+void write_snapshot(std::ostream& os, const forest_t& forest, std::uint32_t generation = 0);
+
+/// Прочитать снимок в пустой лес книги. Повреждённый снимок - file_is_broken, снимок другой версии - unsupported_file_format.
+/// Листы читаются сразу все.
+void read_snapshot(std::string_view data, forest_t& forest);
+
+/// Прочитать файл. Файл отображается в память и не копируется.
+/// Читаются форматы и узлы листов, содержимое листов откладывается (deferred_sheet) и держит отображение файла.
+void read_snapshot(const std::filesystem::path& path, forest_t& forest);
+
+/// Функция чтения для workbook::add_file_reader. Поток читается в память целиком, содержимое листов откладывается.
+/// Данные без сигнатуры снимка читает legacy - прежний формат узел за узлом. Без legacy они не читаются
+/// (unsupported_file_format). Книга регистрирует её для application/x-cellfy сама.
+workbook::file_reader make_snapshot_reader(workbook::file_reader legacy = nullptr);
+
+/// Функция записи для workbook::add_file_writer.
+workbook::file_writer make_snapshot_writer();
+
+
+namespace _ {
+
+class snapshot_source;
+
+} // namespace _
+
+
+/// Содержимое листа, которое ещё лежит в снимке: столбцы, строки, области форматов и ячейки.
+/// Узел листа читается сразу, а содержимое - при первом обращении к листу (workbook::load_sheet).
+/// Лист не прочитан, пока его узел держит deferred_sheet. Чтение снимает отметку в той же транзакции,
+/// поэтому отмена этой транзакции возвращает лист в снимок. Пока объект держит хоть одна копия узла,
+/// в том числе в истории undo, снимок держит данные файла и все форматы книги.
+class deferred_sheet final {
+public:
+  deferred_sheet(std::shared_ptr<_::snapshot_source> source, std::string_view section) noexcept;
+  ~deferred_sheet();
+
+  deferred_sheet(const deferred_sheet&) = delete;
+  deferred_sheet& operator=(const deferred_sheet&) = delete;
+
+  /// Прочитать содержимое в пустой лист sheet, который держит этот объект. Внутри открытой транзакции чтение
+  /// входит в неё, иначе выполняется отдельной транзакцией. Повреждённый раздел - file_is_broken.
+  void load(forest_t& forest, worksheet_node::it sheet);
+
+private:
+  std::shared_ptr<_::snapshot_source> source_;
+  std::string_view                    section_;
+};
+
+
+} // namespace lde::cellfy::boox
@@ -0,0 +1,155 @@
+#pragma once
+
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <limits>
+#include <sstream>
+#include <string>
+#include <string_view>
+#include <type_traits>
+#include <utility>
+
+#include <ed/core/assert.h>
+#include <ed/core/rw.h>
+
+#include <lde/cellfy/boox/exception.h>
+
+
+/// Двоичные разделы файлов книги: снимка и журнала.
+/// Числа пишутся как есть, узлы - через их write/read.
+namespace lde::cellfy::boox::blob {
+
+
+constexpr std::uint64_t align(std::uint64_t size) noexcept {
+  return (size + 7) / 8 * 8;
+}
+
+
+/// Значения в формате write узлов.
+template<typename... Values>
+std::string pack(const Values&... values) {
+  using ed::write;
+  std::ostringstream os(std::ios::binary);
+  (write(os, values), ...);
+  return std::move(os).str();
+}
+
+
+template<typename... Values>
+void unpack(std::string_view bytes, Values&... values) {
+  using ed::read;
+  std::istringstream is(std::string(bytes), std::ios::binary);
+  (read(is, values), ...);
+  if (!is) {
+    ED_THROW_EXCEPTION(file_is_broken());
+  }
+}
+
+
+/// Раздел в памяти.
+class writer final {
+public:
+  template<typename T>
+  void pod(const T& value) {
+    static_assert(std::is_trivially_copyable_v<T>);
+    data_.append(reinterpret_cast<const char*>(&value), sizeof(value));
+  }
+
+  /// Данные с длиной впереди.
+  void bytes(std::string_view bytes) {
+    ED_EXPECTS(bytes.size() <= std::numeric_limits<std::uint32_t>::max());
+    pod(static_cast<std::uint32_t>(bytes.size()));
+    data_ += bytes;
+  }
+
+  void raw(std::string_view bytes) {
+    data_ += bytes;
+  }
+
+  void align() {
+    data_.resize(blob::align(data_.size()));
+  }
+
+  std::size_t size() const noexcept {
+    return data_.size();
+  }
+
+  const std::string& data() const noexcept {
+    return data_;
+  }
+
+  void clear() noexcept {
+    data_.clear();
+  }
+
+private:
+  std::string data_;
+};
+
+
+/// Чтение раздела. Выход за границы раздела - file_is_broken.
+class reader final {
+public:
+  explicit reader(std::string_view data) noexcept
+    : data_(data) {
+  }
+
+  template<typename T>
+  T pod() {
+    static_assert(std::is_trivially_copyable_v<T>);
+    T value;
+    std::memcpy(&value, take(sizeof(T)).data(), sizeof(T));
+    return value;
+  }
+
+  std::string_view bytes() {
+    return take(pod<std::uint32_t>());
+  }
+
+  std::string_view take(std::size_t size) {
+    if (size > data_.size() - pos_) {
+      ED_THROW_EXCEPTION(file_is_broken());
+    }
+    auto result = data_.substr(pos_, size);
+    pos_ += size;
+    return result;
+  }
+
+  /// Данные от текущего места со смещением offset до конца раздела.
+  std::string_view tail(std::uint64_t offset) const {
+    if (offset > data_.size() - pos_) {
+      ED_THROW_EXCEPTION(file_is_broken());
+    }
+    return data_.substr(pos_ + static_cast<std::size_t>(offset));
+  }
+
+  void align() noexcept {
+    pos_ = static_cast<std::size_t>(std::min<std::uint64_t>(data_.size(), blob::align(pos_)));
+  }
+
+  bool at_end() const noexcept {
+    return pos_ == data_.size();
+  }
+
+  std::size_t position() const noexcept {
+    return pos_;
+  }
+
+private:
+  std::string_view data_;
+  std::size_t      pos_ = 0;
+};
+
+
+inline std::string_view slice(std::string_view data, std::uint64_t offset, std::uint64_t size) {
+  if (offset > data.size() || size > data.size() - offset) {
+    ED_THROW_EXCEPTION(file_is_broken());
+  }
+  return data.substr(static_cast<std::size_t>(offset), static_cast<std::size_t>(size));
+}
+
+
+} // namespace lde::cellfy::boox::blob
@@ -0,0 +1,304 @@
+#include <lde/cellfy/boox/cell_cursor.h>
+
+#include <algorithm>
+
+#include <ed/core/assert.h>
+
+#include <ed/rasta/dpi.h>
+
+#include <lde/cellfy/boox/range.h>
+#include <lde/cellfy/boox/workbook.h>
+#include <lde/cellfy/boox/worksheet.h>
+#include <lde/cellfy/boox/src/cell_op.h>
+
+
+namespace lde::cellfy::boox {
+
+
+cell_ref::cell_ref(worksheet& sheet, cell_node::it node) noexcept
+  : sheet_(&sheet)
+  , node_(node) {
+}
+
+
+worksheet& cell_ref::sheet() const noexcept {
+  return *sheet_;
+}
+
+
+cell_node::it cell_ref::it() const noexcept {
+  return node_;
+}
+
+
+const cell_node& cell_ref::node() const noexcept {
+  return *node_;
+}
+
+
+cell_index cell_ref::index() const noexcept {
+  return node_->index;
+}
+
+
+cell_addr cell_ref::addr() const noexcept {
+  return cell_addr(node_->index);
+}
+
+
+cell_value_type cell_ref::value_type() const noexcept {
+  return node_->value_type;
+}
+
+
+bool cell_ref::has_formula() const noexcept {
+  return node_->has_formula;
+}
+
+
+bool cell_ref::merged() const noexcept {
+  return node_->merged_with.has_value();
+}
+
+
+const cell_format* cell_ref::format() const noexcept {
+  return node_->format.get();
+}
+
+
+cell_value cell_ref::value() const {
+  return get_cell_node_value(*sheet_, node_);
+}
+
+
+range cell_ref::as_range() const {
+  return sheet_->cell(addr());
+}
+
+
+existing_cells::iterator::iterator(const existing_cells& owner)
+  : owner_(&owner) {
+
+  settle();
+}
+
+
+cell_ref existing_cells::iterator::dereference() const {
+  ED_ASSERT(owner_ && cell_i_);
+  return {*owner_->sheet_, *cell_i_};
+}
+
+
+bool existing_cells::iterator::equal(const iterator& rhs) const noexcept {
+  return area_i_ == rhs.area_i_ && cell_i_ == rhs.cell_i_;
+}
+
+
+void existing_cells::iterator::increment() {
+  ED_ASSERT(owner_ && cell_i_);
+  ++*cell_i_;
+  settle();
+}
+
+
+void existing_cells::iterator::settle() {
+  auto& forest = owner_->sheet_->book().forest();
+  auto& areas = owner_->areas_;
+
+  while (area_i_ < areas.size()) {
+    auto& ar = areas[area_i_];
+
+    if (!row_i_) {
+      auto rows = forest.get<row_node>(owner_->sheet_->node());
+      row_i_ = std::lower_bound(rows.begin(), rows.end(), row_node{ar.top_row()});
+      row_end_ = rows.end();
+    }
+
+    while (*row_i_ != *row_end_ && (*row_i_)->index <= ar.bottom_row()) {
+      if (!cell_i_) {
+        auto cells = forest.get<cell_node>(*row_i_);
+        cell_i_ = std::lower_bound(cells.begin(), cells.end(), cell_node{cell_addr(ar.left_column(), (*row_i_)->index).index()});
+        cell_end_ = cells.end();
+      }
+
+      if (*cell_i_ != *cell_end_ && (*cell_i_)->index <= cell_addr(ar.right_column(), (*row_i_)->index).index()) {
+        return;
+      }
+
+      ++*row_i_;
+      cell_i_.reset();
+      cell_end_.reset();
+    }
+
+    ++area_i_;
+    row_i_.reset();
+    row_end_.reset();
+  }
+}
+
+
+existing_cells::existing_cells(worksheet& sheet, const area::list& areas) noexcept
+  : sheet_(&sheet)
+  , areas_(areas) {
+}
+
+
+existing_cells::iterator existing_cells::begin() const {
+  return iterator(*this);
+}
+
+
+existing_cells::iterator existing_cells::end() const noexcept {
+  iterator result;
+  result.owner_ = this;
+  result.area_i_ = areas_.size();
+  return result;
+}
+
+
+bool existing_cells::empty() const {
+  return begin() == end();
+}
+
+
+column_cursor::iterator::iterator(const column_cursor& owner, column_index index)
+  : owner_(&owner)
+  , index_(index) {
+
+  if (index_ <= owner_->area_.right_column()) {
+    auto columns = owner_->sheet_->book().forest().get<column_node>(owner_->sheet_->node());
+    col_i_ = std::lower_bound(columns.begin(), columns.end(), column_node{index_});
+    col_end_ = columns.end();
+    settle();
+  }
+}
+
+
+column_info column_cursor::iterator::dereference() const {
+  return info_;
+}
+
+
+bool column_cursor::iterator::equal(const iterator& rhs) const noexcept {
+  return index_ == rhs.index_;
+}
+
+
+void column_cursor::iterator::increment() {
+  info_.left += info_.width;
+  ++index_;
+  settle();
+}
+
+
+void column_cursor::iterator::settle() {
+  if (index_ > owner_->area_.right_column()) {
+    return;
+  }
+
+  info_.index = index_;
+
+  if (*col_i_ != *col_end_ && (*col_i_)->index < index_) {
+    ++*col_i_;
+  }
+
+  if (*col_i_ != *col_end_ && (*col_i_)->index == index_) {
+    info_.width = ed::pixels<long long>((*col_i_)->width);
+    info_.node = *col_i_;
+  } else {
+    info_.width = ed::pixels<long long>(owner_->sheet_->default_column_width());
+    info_.node = std::nullopt;
+  }
+}
+
+
+column_cursor::column_cursor(worksheet& sheet, const area& ar) noexcept
+  : sheet_(&sheet)
+  , area_(ar) {
+}
+
+
+column_cursor::iterator column_cursor::begin() const {
+  return iterator(*this, area_.left_column());
+}
+
+
+column_cursor::iterator column_cursor::end() const noexcept {
+  iterator result;
+  result.owner_ = this;
+  result.index_ = area_.right_column() + 1;
+  return result;
+}
+
+
+row_cursor::iterator::iterator(const row_cursor& owner, row_index index)
+  : owner_(&owner)
+  , index_(index) {
+
+  if (index_ <= owner_->area_.bottom_row()) {
+    auto rows = owner_->sheet_->book().forest().get<row_node>(owner_->sheet_->node());
+    row_i_ = std::lower_bound(rows.begin(), rows.end(), row_node{index_});
+    row_end_ = rows.end();
+    settle();
+  }
+}
+
+
+row_info row_cursor::iterator::dereference() const {
+  return info_;
+}
+
+
+bool row_cursor::iterator::equal(const iterator& rhs) const noexcept {
+  return index_ == rhs.index_;
+}
+
+
+void row_cursor::iterator::increment() {
+  info_.top += info_.height;
+  ++index_;
+  settle();
+}
+
+
+void row_cursor::iterator::settle() {
+  if (index_ > owner_->area_.bottom_row()) {
+    return;
+  }
+
+  info_.index = index_;
+
+  if (*row_i_ != *row_end_ && (*row_i_)->index < index_) {
+    ++*row_i_;
+  }
+
+  if (*row_i_ != *row_end_ && (*row_i_)->index == index_) {
+    info_.height = ed::pixels<long long>((*row_i_)->height);
+    info_.node = *row_i_;
+  } else {
+    info_.height = ed::pixels<long long>(owner_->sheet_->default_row_height());
+    info_.node = std::nullopt;
+  }
+}
+
+
+row_cursor::row_cursor(worksheet& sheet, const area& ar) noexcept
+  : sheet_(&sheet)
+  , area_(ar) {
+}
+
+
+row_cursor::iterator row_cursor::begin() const {
+  return iterator(*this, area_.top_row());
+}
+
+
+row_cursor::iterator row_cursor::end() const noexcept {
+  iterator result;
+  result.owner_ = this;
+  result.index_ = area_.bottom_row() + 1;
+  return result;
+}
+
+
+} // namespace lde::cellfy::boox
@@ -1,7 +1,9 @@
 #include <lde/cellfy/boox/src/cell_op.h>
 
 #include <algorithm>
+#include <optional>
 #include <type_traits>
+#include <unordered_map>
 
 #include <ed/core/aggregate_equal.h>
 #include <ed/core/assert.h>
@@ -20,6 +22,9 @@
 #include <lde/cellfy/boox/value_format.h>
 #include <lde/cellfy/boox/workbook.h>
 #include <lde/cellfy/boox/worksheet.h>
+#include <lde/cellfy/boox/src/format_runs.h>
+#include <lde/cellfy/boox/src/layout_cache.h>
+#include <lde/cellfy/boox/src/parallel.h>
 
 
 namespace lde::cellfy::boox {
@@ -27,6 +32,16 @@ namespace _ {
 namespace {
 
 
+std::optional<cell_node::scalar> get_cell_node_scalar(const cell_value& value) {
+  switch (value.type()) {
+    case cell_value_type::boolean: return value.as<bool>();
+    case cell_value_type::number:  return value.as<double>();
+    case cell_value_type::error:   return value.as<cell_value_error>();
+    default:                       return std::nullopt;
+  }
+}
+
+
 cell_value get_cell_value(range_op_ctx& ctx, cell_node::it node) {
   ED_ASSERT(!node->merged_with);
   ED_ASSERT(!node->has_formula);
@@ -36,7 +51,7 @@ cell_value get_cell_value(range_op_ctx& ctx, cell_node::it node) {
       rich_text rt;
       for (auto& child : ctx.forest().get<text_run_node>(node)) {
         rt.emplace_back();
-        rt.back().text = child.text;
+        rt.back().text = child.text.str();
         if (node->format) {
           rt.back().format = child.format.unite(*node->format);
         } else {
@@ -44,6 +59,14 @@ cell_value get_cell_value(range_op_ctx& ctx, cell_node::it node) {
         }
       }
       return rt;
+    } else if (node->value) {
+      if (node->value_type == cell_value_type::boolean) {
+        return std::get<bool>(*node->value);
+      } else if (node->value_type == cell_value_type::number) {
+        return std::get<double>(*node->value);
+      } else if (node->value_type == cell_value_type::error) {
+        return std::get<cell_value_error>(*node->value);
+      }
     } else {
       auto children = ctx.forest().get<cell_data_node>(node);
       ED_ASSERT(children.size() == 1);
@@ -52,7 +75,7 @@ cell_value get_cell_value(range_op_ctx& ctx, cell_node::it node) {
       } else if (node->value_type == cell_value_type::number) {
         return std::get<double>(children.front().data);
       } else if (node->value_type == cell_value_type::string) {
-        return std::get<std::wstring>(children.front().data);
+        return std::get<shared_string>(children.front().data);
       } else if (node->value_type == cell_value_type::error) {
         return std::get<cell_value_error>(children.front().data);
       }
@@ -155,33 +178,35 @@ auto get_columns_width(const worksheet& sheet, cell_node::it node) {
 }
 
 
-/// Сформировать и вернуть text_format и value_format_result.
-auto formatter_result(const cell_value& val, const std::locale& loc, const cell_format& fmt, ed::pixels<double> columns_width) {
-  value_format::result result;
-  value_format formatter(fmt.get_or_default<number_format>(), loc);
-  auto text_fmt = make_text_format(fmt);
+/// Отформатировать значение по number_format. Шрифты не нужны, можно вызывать из любого потока.
+value_format::result format_value(const cell_value& val, const std::locale& loc, const cell_format& fmt) {
+  const auto formatter = value_format::compiled(fmt.get_or_default<number_format>(), loc);
 
   if (val.type() == cell_value_type::rich_text) {
-    result = formatter(val.to<std::wstring>());
-  } else {
-    // Если выставлен default в number_format и тип данных double, то большие числа представляем в виде експоненты.
-    // todo: Временное решение. Сейчас экспонента не подбирается под размер столбца.
-    if (val.type() == cell_value_type::number && !formatter.has_any_section() && static_cast<int>(std::log10(val.as<double>()) + 1) > std::numeric_limits<double>::digits10) {
-      result = value_format(L"0.00E+00")(val.as<double>());
-    } else {
-      result = formatter(val);
-      // layout хранит ширину текста.
-      // Но для обработки ошибки или для вставки заполнителя нужно расширить layout на ширину столбца, чтобы заполнить его определённым символом.
-      // Если ячейки объединены, то берётся ширина нескольких столбцов [column, column + node->column_span - 1].
-      if (result.fill_positions) {
-        const auto text_width   = text_fmt.fnt.text_extents(result.text).width;
-        const auto glyph_width  = text_fmt.fnt.text_extents(result.text.substr(*result.fill_positions, 1)).width;
-        const auto fill_count   = static_cast<std::size_t>(std::max((columns_width - text_width) / glyph_width, {}));
-
-        result.text.reserve(result.text.size() + fill_count);
-        result.text.insert(*result.fill_positions, fill_count, result.text.at(*result.fill_positions));
-      }
-    }
+    return (*formatter)(val.to<std::wstring>());
+  }
+
+  // Если выставлен default в number_format и тип данных double, то большие числа представляем в виде експоненты.
+  // todo: Временное решение. Сейчас экспонента не подбирается под размер столбца.
+  if (val.type() == cell_value_type::number && !formatter->has_any_section() && static_cast<int>(std::log10(val.as<double>()) + 1) > std::numeric_limits<double>::digits10) {
+    return (*value_format::compiled(L"0.00E+00"))(val.as<double>());
+  }
+  return (*formatter)(val);
+}
+
+
+/// Сформировать и вернуть текст и text_format по результату форматирования. text_fmt - шрифт, построенный по формату.
+auto formatter_result(value_format::result result, ed::rasta::text_layout::text_format text_fmt, ed::pixels<double> columns_width) {
+  // layout хранит ширину текста.
+  // Но для обработки ошибки или для вставки заполнителя нужно расширить layout на ширину столбца, чтобы заполнить его определённым символом.
+  // Если ячейки объединены, то берётся ширина нескольких столбцов [column, column + node->column_span - 1].
+  if (result.fill_positions) {
+    const auto text_width   = text_fmt.fnt.text_extents(result.text).width;
+    const auto glyph_width  = text_fmt.fnt.text_extents(result.text.substr(*result.fill_positions, 1)).width;
+    const auto fill_count   = static_cast<std::size_t>(std::max((columns_width - text_width) / glyph_width, {}));
+
+    result.text.reserve(result.text.size() + fill_count);
+    result.text.insert(*result.fill_positions, fill_count, result.text.at(*result.fill_positions));
   }
 
   if (result.text_color) {
@@ -191,9 +216,133 @@ auto formatter_result(const cell_value& val, const std::locale& loc, const cell_
   return std::pair{std::move(result.text), std::move(text_fmt)};
 }
 
+
+/// Блок ячеек на поток. Меньшие объёмы дешевле считать в одном потоке.
+constexpr std::size_t min_layout_block = 256;
+
+
+/// Шрифты по формату: построение шрифта дорогое, а форматов в диапазоне мало.
+using text_format_cache = std::unordered_map<const cell_format*, ed::rasta::text_layout::text_format>;
+
+
+/// Последовательная часть: значение ячейки (с расчётом формулы) и всё, что читает лист.
+/// Пустой результат - layout не нужен или актуален.
+std::optional<cell_layout_job> prepare_layout(range_op_ctx& ctx, cell_node::it node) {
+  if (node->value_type == cell_value_type::none && !node->has_formula) {
+    if (node->layout) {
+      ctx.layouts().erase(*node);
+      node->layout = nullptr;
+    }
+    ctx.row_heights().erase(*node);
+    node->is_layout_dirty = false;
+    return std::nullopt;
+  }
+
+  // Результат формулы мог устареть, тогда get_formula_result выставит is_layout_dirty.
+  if (!node->is_layout_dirty && !node->has_formula) {
+    ctx.layouts().touch(*node);
+    return std::nullopt;
+  }
+
+  cell_layout_job job;
+  job.node = node;
+  job.value = get_cell_value_from_node(ctx, node);
+
+  if (!node->is_layout_dirty) {
+    ctx.layouts().touch(*node);
+    return std::nullopt;
+  }
+
+  if (node->format_key) {
+    ED_ASSERT(node->format);
+    job.format = node->format.get();
+  }
+
+  if (job.format ? job.format->get_or_default<text_wrap>() : text_wrap::default_value) {
+    column_index column = cell_addr(node->index).column();
+    job.max_line_width = ctx.sheet().columns_width(column, column);
+  }
+
+  job.columns_width = get_columns_width(ctx.sheet(), node);
+  return job;
+}
+
+
+/// Формат задания, для ячейки без формата - формат по умолчанию.
+const cell_format& job_format(const cell_layout_job& job) {
+  static const cell_format default_format;
+  return job.format ? *job.format : default_format;
+}
+
+
+/// Параллельная часть: форматирование значения. Лист, лес и шрифты не читаются,
+/// общие locale, форматы и кэш value_format::compiled только читаются.
+void format_layout_value(const std::locale& loc, cell_layout_job& job) {
+  job.formatted = format_value(job.value, loc, job_format(job));
+}
+
+
+/// Последовательная часть: шрифты и разбивка текста в text_layout. Потокобезопасность кэша
+/// физических шрифтов ed::rasta не гарантируется, поэтому всё, что касается шрифтов, строится в потоке листа.
+void build_layout(text_format_cache& fonts, cell_layout_job& job) {
+  const cell_format& fmt = job_format(job);
+
+  auto font_i = fonts.find(&fmt);
+  if (font_i == fonts.end()) {
+    font_i = fonts.emplace(&fmt, make_text_format(fmt)).first;
+  }
+
+  job.layout = std::make_shared<ed::rasta::text_layout>();
+  job.layout->alignment(h_alignment_to_rasta_text_alignment(job.value.type(), fmt.get_or_default<text_horizontal_alignment>()));
+  job.layout->enable_soft_breaks(fmt.get_or_default<text_wrap>());
+
+  if (job.max_line_width) {
+    job.layout->max_line_width(*job.max_line_width);
+  }
+
+  const auto result = formatter_result(std::move(job.formatted), font_i->second, job.columns_width);
+  job.layout->add(result.first, result.second);
+}
+
+
+/// Формат ячейки без собственного формата после изменений: строка, затем столбец, затем лист.
+cell_format_node::it apply_inherited_format(range_op_ctx& ctx, format_transitions& transitions, cell_addr addr) {
+  const cell_format* row_format = nullptr;
+  const cell_format* column_format = nullptr;
+
+  if (auto row_i = ctx.sheet().find_row(addr.row()); row_i && row_i.value()->format) {
+    row_format = row_i.value()->format.get();
+  }
+
+  if (auto col_i = ctx.sheet().find_column(addr.column()); col_i && col_i.value()->format) {
+    column_format = col_i.value()->format.get();
+  }
+
+  return transitions.apply(ctx.sheet().book(), row_format, column_format, ctx.sheet().node()->format.get());
+}
+
+
+/// Последовательная часть: привязка готового layout к ячейке.
+void attach_layout(range_op_ctx& ctx, cell_layout_job& job) {
+  job.node->layout = std::move(job.layout);
+  job.node->is_layout_dirty = false;
+  ctx.layouts().attached(*job.node);
+  ctx.row_heights().update(*job.node);
+}
+
 }} // namespace _
 
 
+cell_value get_cell_node_value(worksheet& sheet, cell_node::it node) {
+  if (node->merged_with) {
+    return {};
+  }
+
+  range_op_ctx ctx(sheet, {});
+  return _::get_cell_value_from_node(ctx, node);
+}
+
+
 get_cell_format_op::get_cell_format_op(cell_format& format) noexcept
   : format_(&format) {
 }
@@ -203,24 +352,65 @@ void get_cell_format_op::on_start(range_op_ctx& ctx) {
   ED_ASSERT(format_);
   *format_ = {};
   processed_count_ = 0;
+  last_format_ = nullptr;
+
+  // Формат области действует только на адреса без ячеек: у ячейки свой формат, он главнее области.
+  runs_.clear();
+  for (auto run : ctx.find_format_runs()) {
+    ED_ASSERT(run->format);
+    const auto run_area = format_runs::area_of(*run);
+    std::uint64_t cells = 0;
+    for (auto&& ar : ctx.areas()) {
+      if (auto common = ar.intersect(run_area)) {
+        cells += common->cells_count();
+      }
+    }
+    runs_.push_back({&*run, cells});
+  }
+  std::sort(runs_.begin(), runs_.end());
+}
+
+
+void get_cell_format_op::on_finish(range_op_ctx& ctx) {
+  for (auto& cover : runs_) {
+    if (cover.uncovered > 0) {
+      intersect(*cover.run->format);
+    }
+  }
 }
 
 
 bool get_cell_format_op::on_existing_node(range_op_ctx& ctx, cell_node::it node) {
   ED_ASSERT(format_);
+  if (!runs_.empty()) {
+    if (auto run = ctx.find_format_run(cell_addr(node->index))) {
+      const auto i = std::lower_bound(runs_.begin(), runs_.end(), run_cover{&**run});
+      if (i != runs_.end() && i->run == &**run) {
+        ED_ASSERT(i->uncovered > 0);
+        --i->uncovered;
+      }
+    }
+  }
+
   if (!node->merged_with && node->format_key) {
     ED_ASSERT(node->format);
-    if (processed_count_ == 0) {
-      *format_ = *node->format;
-    } else {
-      *format_ = format_->intersect(*node->format);
-    }
-    ++processed_count_;
+    intersect(*node->format);
   }
   return true;
 }
 
 
+void get_cell_format_op::intersect(const cell_format& format) {
+  if (processed_count_ == 0) {
+    *format_ = format;
+  } else if (&format != last_format_) { // Пересечение с тем же форматом ничего не меняет
+    *format_ = format_->intersect(format);
+  }
+  last_format_ = &format;
+  ++processed_count_;
+}
+
+
 clear_cell_format_op::clear_cell_format_op(cell_index_set&& except) noexcept
   : except_(std::move(except)) {
 }
@@ -229,6 +419,7 @@ clear_cell_format_op::clear_cell_format_op(cell_index_set&& except) noexcept
 bool clear_cell_format_op::on_existing_node(range_op_ctx& ctx, cell_node::it node) {
   if (node->format_key && except_.count(node->index) == 0) {
     ED_ASSERT(node->format);
+    ctx.release_format(node->format_key);
     cell_node n = *node;
     n.format_key = std::nullopt;
     n.format = nullptr;
@@ -239,7 +430,7 @@ bool clear_cell_format_op::on_existing_node(range_op_ctx& ctx, cell_node::it nod
 
 
 change_existing_cell_format_op::change_existing_cell_format_op(cell_format::changes changes) noexcept
-  : changes_(std::move(changes)) {
+  : transitions_(std::move(changes)) {
 }
 
 
@@ -247,35 +438,15 @@ bool change_existing_cell_format_op::on_existing_node(range_op_ctx& ctx, cell_no
   if (!node->merged_with) {
     if (node->format_key) {
       ED_ASSERT(node->format);
-      auto new_fmt = node->format->apply(changes_);
-      if (new_fmt != *node->format) {
-        auto format_node = ctx.sheet().book().ensure_format(std::move(new_fmt));
-        ED_ENSURES(format_node->format);
-
+      auto format_node = transitions_.apply(ctx.sheet().book(), node->format);
+      if (format_node->format != node->format) {
         cell_node n = *node;
         n.format_key = forest_t::key_of(format_node);
         n.format = format_node->format;
         ctx.forest().modify(node) = n;
       }
     } else {
-      cell_addr addr(node->index);
-      cell_format fmt;
-
-      if (auto row_i = ctx.sheet().find_row(addr.row()); row_i && row_i.value()->format) {
-        fmt = *row_i.value()->format;
-      }
-
-      if (auto col_i = ctx.sheet().find_column(addr.column()); col_i && col_i.value()->format) {
-        fmt = fmt.unite(*col_i.value()->format);
-      }
-
-      if (ctx.sheet().node()->format) {
-        fmt = fmt.unite(*ctx.sheet().node()->format);
-      }
-
-      fmt = fmt.apply(changes_);
-      auto format_node = ctx.sheet().book().ensure_format(std::move(fmt));
-      ED_ENSURES(format_node->format);
+      auto format_node = _::apply_inherited_format(ctx, transitions_, cell_addr(node->index));
 
       cell_node n = *node;
       n.format_key = forest_t::key_of(format_node);
@@ -293,24 +464,10 @@ change_cell_format_op::change_cell_format_op(cell_format::changes changes) noexc
 
 
 bool change_cell_format_op::on_new_node(range_op_ctx& ctx, cell_node& node) {
-  cell_addr addr(node.index);
-  cell_format fmt;
-
-  if (auto row_i = ctx.sheet().find_row(addr.row()); row_i && row_i.value()->format) {
-    fmt = *row_i.value()->format;
-  }
-
-  if (auto col_i = ctx.sheet().find_column(addr.column()); col_i && col_i.value()->format) {
-    fmt = fmt.unite(*col_i.value()->format);
-  }
-
-  if (ctx.sheet().node()->format) {
-    fmt = fmt.unite(*ctx.sheet().node()->format);
-  }
-
-  fmt = fmt.apply(changes_);
-  auto format_node = ctx.sheet().book().ensure_format(std::move(fmt));
-  ED_ENSURES(format_node->format);
+  // Ячейка могла унаследовать формат области.
+  auto format_node = node.format ?
+    transitions_.apply(ctx.sheet().book(), node.format) :
+    _::apply_inherited_format(ctx, transitions_, cell_addr(node.index));
 
   node.format_key = forest_t::key_of(format_node);
   node.format = format_node->format;
@@ -472,7 +629,7 @@ bool split_by_format_and_type::on_existing_node(range_op_ctx& ctx, cell_node::it
 auto split_by_format_and_type::get_value_data_from_node(range_op_ctx& ctx, cell_node::it it) {
   value_data result;
 
-  const auto fill_result_from_cell_value = [](auto&& cell_value, auto& result) {
+  const auto fill_result_from_cell_value = [](const auto& cell_value, auto& result) {
     if (cell_value.type() == cell_value_type::number) {
       result = cell_value.template as<double>();
     } else if (cell_value.type() == cell_value_type::rich_text) {
@@ -557,6 +714,7 @@ bool clear_cell_value_op::on_existing_node(range_op_ctx& ctx, cell_node::it node
     if (node->value_type != cell_value_type::none) {
       cell_node n = *node;
       n.value_type = cell_value_type::none;
+      n.value = std::nullopt;
 
       if (node->value_type == cell_value_type::rich_text) {
         auto children = ctx.forest().get<text_run_node>(node);
@@ -576,15 +734,19 @@ bool clear_cell_value_op::on_existing_node(range_op_ctx& ctx, cell_node::it node
 }
 
 
-set_cell_value_op::set_cell_value_op(const cell_value& value) noexcept
+set_cell_value_op::set_cell_value_op(const cell_value& value)
   : value_(&value) {
   ED_ASSERT(!value.is_nil());
+  if (value.type() == cell_value_type::string) {
+    text_ = value.to<shared_string>();
+  }
 }
 
 
 bool set_cell_value_op::on_new_node(range_op_ctx& ctx, cell_node& node) {
   ED_ASSERT(value_);
   node.value_type = value_->type();
+  node.value = _::get_cell_node_scalar(*value_);
   return true;
 }
 
@@ -599,17 +761,9 @@ bool set_cell_value_op::on_new_node(range_op_ctx& ctx, cell_node::it node) {
         child.format = run.format;
         ctx.forest().push_back(node, std::move(child));
       }
-    } else {
+    } else if (node->value_type == cell_value_type::string) {
       cell_data_node child;
-      if (node->value_type == cell_value_type::boolean) {
-        child.data = value_->as<bool>();
-      } else if (node->value_type == cell_value_type::number) {
-        child.data = value_->as<double>();
-      } else if (node->value_type == cell_value_type::string) {
-        child.data = value_->as<std::wstring>();
-      } else if (node->value_type == cell_value_type::error) {
-        child.data = value_->as<cell_value_error>();
-      }
+      child.data = text_;
       ctx.forest().push_back(node, std::move(child));
     }
   }
@@ -625,12 +779,16 @@ bool set_cell_value_op::on_existing_node(range_op_ctx& ctx, cell_node::it node)
     if (node->value_type == cell_value_type::rich_text) {
       auto children = ctx.forest().get<text_run_node>(node);
       ctx.forest().erase(children.begin(), children.end());
-    } else if (type == cell_value_type::rich_text) {
-      auto children = ctx.forest().get<cell_data_node>(node);
-      ctx.forest().erase(children.begin(), children.end());
     }
   }
 
+  // Строка хранится в cell_data_node, скаляр - в самой ячейке.
+  // Узлы старой версии могут держать скаляр в cell_data_node, его тоже убираем.
+  if (type != cell_value_type::string) {
+    auto children = ctx.forest().get<cell_data_node>(node);
+    ctx.forest().erase(children.begin(), children.end());
+  }
+
   if (type == cell_value_type::rich_text) {
     auto children = ctx.forest().get<text_run_node>(node);
     auto child_it = children.begin();
@@ -653,17 +811,9 @@ bool set_cell_value_op::on_existing_node(range_op_ctx& ctx, cell_node::it node)
     }
 
     ctx.forest().erase(child_it, children.end());
-  } else {
+  } else if (type == cell_value_type::string) {
     cell_data_node child;
-    if (type == cell_value_type::boolean) {
-      child.data = value_->as<bool>();
-    } else if (type == cell_value_type::number) {
-      child.data = value_->as<double>();
-    } else if (type == cell_value_type::string) {
-      child.data = value_->as<std::wstring>();
-    } else if (type == cell_value_type::error) {
-      child.data = value_->as<cell_value_error>();
-    }
+    child.data = text_;
 
     auto children = ctx.forest().get<cell_data_node>(node);
     auto child_it = children.begin();
@@ -675,9 +825,11 @@ bool set_cell_value_op::on_existing_node(range_op_ctx& ctx, cell_node::it node)
     }
   }
 
-  if (node->value_type != type) {
+  auto value = _::get_cell_node_scalar(*value_);
+  if (node->value_type != type || node->value != value) {
     cell_node n = *node;
     n.value_type = type;
+    n.value = std::move(value);
     ctx.forest().modify(node) = n;
   }
 
@@ -866,10 +1018,14 @@ bool erase_empty_cells_op::on_existing_node(range_op_ctx& ctx, cell_node::it nod
       node->column_span == 1 &&
       node->value_type == cell_value_type::none &&
       !node->has_formula &&
-      !node->merged_with &&
-      !node->format_key) {
+      !node->merged_with) {
 
-    ctx.forest().erase(node);
+    if (!node->format_key) {
+      ctx.forest().erase(node);
+    } else if (auto run = ctx.find_format_run(cell_addr(node->index)); run && (*run)->format_key == node->format_key) {
+      // Формат ячейки совпадает с форматом области, ячейка не нужна.
+      ctx.forest().erase(node);
+    }
   }
   return true;
 }
@@ -886,46 +1042,50 @@ bool actualize_cell_format_op::on_existing_node(range_op_ctx& ctx, cell_node::it
 }
 
 
-bool actualize_layout_op::on_existing_node(range_op_ctx& ctx, cell_node::it node) {
-  if (node->value_type == cell_value_type::none && !node->has_formula) {
-    node->layout = nullptr;
-  } else {
-    const auto value = _::get_cell_value_from_node(ctx, node);
-    const auto& loc = ctx.sheet().book().get_locale();
+void actualize_cell_layout(range_op_ctx& ctx, cell_node::it node) {
+  if (auto job = _::prepare_layout(ctx, node)) {
+    _::text_format_cache fonts;
+    _::format_layout_value(ctx.sheet().book().get_locale(), *job);
+    _::build_layout(fonts, *job);
+    _::attach_layout(ctx, *job);
+  }
+}
 
-    if (node->is_layout_dirty) {
-      if (!node->layout) {
-        node->layout = std::make_shared<ed::rasta::text_layout>();
-      } else {
-        node->layout->clear();
-      }
 
-      cell_format fmt;
-      if (node->format_key) {
-        ED_ASSERT(node->format);
-        fmt = *node->format;
-      }
+void actualize_layout_op::on_start(range_op_ctx& ctx) {
+  jobs_.clear();
+}
 
-      node->layout->alignment(_::h_alignment_to_rasta_text_alignment(value.type(), fmt.get_or_default<text_horizontal_alignment>()));
-      node->layout->enable_soft_breaks(fmt.get_or_default<text_wrap>());
 
-      if (fmt.get_or_default<text_wrap>()) {
-        column_index column = cell_addr(node->index).column();
-        node->layout->max_line_width(ctx.sheet().columns_width(column, column));
-      }
+bool actualize_layout_op::on_existing_node(range_op_ctx& ctx, cell_node::it node) {
+  if (auto job = _::prepare_layout(ctx, node)) {
+    jobs_.push_back(std::move(*job));
+  }
+  return true;
+}
 
-      const auto result = _::formatter_result(value, loc, fmt, _::get_columns_width(ctx.sheet(), node));
-      node->layout->add(result.first, result.second);
+
+void actualize_layout_op::on_finish(range_op_ctx& ctx) {
+  const auto& loc = ctx.sheet().book().get_locale();
+
+  // Значения и формулы уже посчитаны, потоки только форматируют текст.
+  parallel_blocks(jobs_.size(), _::min_layout_block, [this, &loc](std::size_t first, std::size_t last) {
+    for (auto i = first; i < last; ++i) {
+      _::format_layout_value(loc, jobs_[i]);
     }
-  }
+  });
 
-  node->is_layout_dirty = false;
-  return true;
+  _::text_format_cache fonts;
+  for (auto& job : jobs_) {
+    _::build_layout(fonts, job);
+    _::attach_layout(ctx, job);
+  }
+  jobs_.clear();
 }
 
 
 bool invalidate_layout_op::on_existing_node(range_op_ctx& ctx, cell_node::it node) {
-  if (!node->is_layout_dirty && node->value_type != cell_value_type::none) {
+  if (!node->is_layout_dirty && (node->value_type != cell_value_type::none || node->has_formula)) {
     node->is_layout_dirty = true;
   }
   return true;
@@ -947,9 +1107,14 @@ bool invalidate_layout_width_op::on_existing_node(range_op_ctx& ctx, cell_node::
 }
 
 
+parse_formulas_op::parse_formulas_op(const bool keep_results) noexcept
+  : keep_results_(keep_results) {
+}
+
+
 bool parse_formulas_op::on_existing_node(range_op_ctx& ctx, cell_node::it node) {
   if (node->has_formula) {
-    ctx.sheet().parse_formula(node);
+    ctx.sheet().parse_formula(node, keep_results_);
   }
   return true;
 }
@@ -2,13 +2,17 @@
 
 
 #include <cstdint>
+#include <optional>
 #include <unordered_set>
+#include <vector>
 
 #include <lde/cellfy/boox/cell_value.h>
 #include <lde/cellfy/boox/format.h>
 #include <lde/cellfy/boox/fwd.h>
 #include <lde/cellfy/boox/node.h>
 #include <lde/cellfy/boox/range_op.h>
+#include <lde/cellfy/boox/value_format.h>
+#include <lde/cellfy/boox/src/format_transitions.h>
 
 
 namespace lde::cellfy::boox {
@@ -43,6 +47,14 @@ using error_subrange     = std::pair<std::optional<cell_format>, error_table>;
 using value_ranges = std::vector<std::variant<double_subrange, wstring_subrange, rich_text_subrange, ast_subrange, bool_subrange, error_subrange>>;
 
 
+/// Значение существующей ячейки. Для формулы - результат вычисления, для объединённой - пустое значение.
+cell_value get_cell_node_value(worksheet& sheet, cell_node::it node);
+
+
+/// Посчитать layout ячейки, если он устарел или был вытеснен из кэша листа.
+void actualize_cell_layout(range_op_ctx& ctx, cell_node::it node);
+
+
 template<typename Fn>
 class cell_nodes_visitor_op final : public range_op {
 public:
@@ -70,11 +82,26 @@ public:
   explicit get_cell_format_op(cell_format& format) noexcept;
 
   void on_start(range_op_ctx& ctx) override;
+  void on_finish(range_op_ctx& ctx) override;
   bool on_existing_node(range_op_ctx& ctx, cell_node::it node) override;
 
 private:
-  cell_format* format_          = nullptr;
-  std::size_t  processed_count_ = 0;
+  /// Область форматов и число её адресов в диапазоне без узла ячейки.
+  struct run_cover final {
+    const format_run_node* run       = nullptr;
+    std::uint64_t          uncovered = 0;
+
+    bool operator<(const run_cover& rhs) const noexcept {
+      return run < rhs.run;
+    }
+  };
+
+  void intersect(const cell_format& format);
+
+  cell_format*           format_          = nullptr;
+  const cell_format*     last_format_     = nullptr;
+  std::size_t            processed_count_ = 0;
+  std::vector<run_cover> runs_;
 };
 
 
@@ -103,7 +130,7 @@ public:
   bool on_existing_node(range_op_ctx& ctx, cell_node::it node) override;
 
 protected:
-  cell_format::changes changes_;
+  format_transitions transitions_;
 };
 
 
@@ -222,7 +249,7 @@ public:
   using processing = for_all_cells_tag;
 
 public:
-  explicit set_cell_value_op(const cell_value& value) noexcept;
+  explicit set_cell_value_op(const cell_value& value);
 
   bool on_new_node(range_op_ctx& ctx, cell_node& node) override;
   bool on_new_node(range_op_ctx& ctx, cell_node::it node) override;
@@ -230,6 +257,7 @@ public:
 
 private:
   const cell_value* value_ = nullptr;
+  shared_string     text_; // Строка значения в пуле, одна на все ячейки диапазона
 };
 
 
@@ -324,12 +352,32 @@ public:
 };
 
 
+/// Построение layout одной ячейки. Готовится последовательно, значение форматируется в любом потоке,
+/// text_layout строится в потоке листа.
+struct cell_layout_job final {
+  cell_node::it                    node;
+  cell_value                       value;
+  const cell_format*               format = nullptr;
+  std::optional<ed::twips<double>> max_line_width;
+  ed::twips<double>                columns_width;
+  value_format::result             formatted;
+  cell_node::text_layout_ptr       layout;
+};
+
+
+/// Устаревшие layout ячеек диапазона. Значения и формулы считаются при обходе,
+/// в on_finish текст форматируется блоками в нескольких потоках и раскладывается в text_layout в потоке листа.
 class actualize_layout_op final : public range_op {
 public:
   using processing = for_existing_cells_tag;
 
 public:
+  void on_start(range_op_ctx& ctx) override;
   bool on_existing_node(range_op_ctx& ctx, cell_node::it node) override;
+  void on_finish(range_op_ctx& ctx) override;
+
+private:
+  std::vector<cell_layout_job> jobs_;
 };
 
 
@@ -356,7 +404,13 @@ public:
   using processing = for_existing_cells_tag;
 
 public:
+  /// keep_results - оставить прочитанные из файла результаты формул, не помечая их устаревшими.
+  explicit parse_formulas_op(bool keep_results = false) noexcept;
+
   bool on_existing_node(range_op_ctx& ctx, cell_node::it node) override;
+
+private:
+  bool keep_results_ = false;
 };
 
 
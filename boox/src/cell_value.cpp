@@ -91,19 +91,24 @@ cell_value::cell_value(std::wstring v) noexcept
 }
 
 
-cell_value::cell_value(const wchar_t* v) noexcept {
+cell_value::cell_value(shared_string v) noexcept
+  : data_(std::move(v)) {
+}
+
+
+cell_value::cell_value(const wchar_t* v) {
   if (v) {
     data_ = std::wstring(v);
   }
 }
 
 
-cell_value::cell_value(std::string v) noexcept
+cell_value::cell_value(std::string v)
   : data_(ed::from_utf8(v)) {
 }
 
 
-cell_value::cell_value(const char* v) noexcept {
+cell_value::cell_value(const char* v) {
   if (v) {
     data_ = ed::from_utf8(v);
   }
@@ -124,6 +129,12 @@ bool cell_value::operator==(const cell_value& rhs) const noexcept {
   if (auto l = std::get_if<double>(&data_), r = std::get_if<double>(&rhs.data_); l && r) {
     return ed::fuzzy_equal(*l, *r);
   }
+  if (is<std::wstring>() && rhs.is<std::wstring>()) {
+    // Записи пула сравниваются указателями, остальные строки - текстом.
+    auto l = std::get_if<shared_string>(&data_);
+    auto r = std::get_if<shared_string>(&rhs.data_);
+    return l && r ? *l == *r : as<std::wstring>() == rhs.as<std::wstring>();
+  }
   return data_ == rhs.data_;
 }
 
@@ -141,16 +152,18 @@ bool cell_value::operator<(const cell_value& rhs) const {
     return std::visit([&rhs, this](auto&& l_data, auto&& r_data) {
       using lt = std::decay_t<decltype(l_data)>;
       using rt = std::decay_t<decltype(r_data)>;
+      constexpr bool l_text = std::is_same_v<lt, std::wstring> || std::is_same_v<lt, shared_string>;
+      constexpr bool r_text = std::is_same_v<rt, std::wstring> || std::is_same_v<rt, shared_string>;
       if constexpr (std::is_same_v<lt, std::nullptr_t> && std::is_same_v<rt, std::nullptr_t>) {
         return false;
       } else if constexpr (std::is_same_v<lt, double> && std::is_same_v<rt, double>) {
         return l_data < r_data;
-      } else if constexpr (std::is_same_v<lt, std::wstring> && std::is_same_v<rt, std::wstring>) {
-        return l_data < r_data;
-      } else if constexpr (std::is_same_v<lt, std::wstring> && std::is_same_v<rt, rich_text>) {
-        return l_data < rhs.to<std::wstring>();
-      } else if constexpr (std::is_same_v<lt, rich_text> && std::is_same_v<rt, std::wstring>) {
-        return to<std::wstring>() < r_data;
+      } else if constexpr (l_text && r_text) {
+        return as<std::wstring>() < rhs.as<std::wstring>();
+      } else if constexpr (l_text && std::is_same_v<rt, rich_text>) {
+        return as<std::wstring>() < rhs.to<std::wstring>();
+      } else if constexpr (std::is_same_v<lt, rich_text> && r_text) {
+        return to<std::wstring>() < rhs.as<std::wstring>();
       } else if constexpr (std::is_same_v<lt, rich_text> && std::is_same_v<rt, rich_text>) {
         return to<std::wstring>() < rhs.to<std::wstring>();
       } else if constexpr (std::is_same_v<lt, bool> && std::is_same_v<rt, bool>) {
@@ -313,4 +326,13 @@ std::string cell_value::to<std::string>() const {
 }
 
 
+template<>
+shared_string cell_value::to<shared_string>() const {
+  if (auto s = std::get_if<shared_string>(&data_)) {
+    return *s;
+  }
+  return shared_string(to<std::wstring>());
+}
+
+
 } // namespace lde::cellfy::boox
@@ -0,0 +1,128 @@
+#pragma once
+
+
+#include <cmath>
+#include <cstdint>
+#include <optional>
+
+
+/// Перевод дат без boost::date_time.
+/// Алгоритмы days_from_civil/civil_from_days: http://howardhinnant.github.io/date_algorithms.html
+namespace lde::cellfy::boox::civil {
+
+
+constexpr std::int64_t ms_per_day = 24 * 60 * 60 * 1000;
+
+/// Диапазон лет, который поддерживает boost::gregorian::date.
+constexpr int min_year = 1400;
+constexpr int max_year = 9999;
+
+
+struct date final {
+  int      year  = 0;
+  unsigned month = 1; ///< 1 - 12.
+  unsigned day   = 1; ///< 1 - 31.
+};
+
+
+struct date_time final {
+  int      year    = 0;
+  unsigned month   = 1; ///< 1 - 12.
+  unsigned day     = 1; ///< 1 - 31.
+  unsigned weekday = 0; ///< 0 - воскресенье.
+  unsigned hour    = 0;
+  unsigned minute  = 0;
+  unsigned second  = 0;
+};
+
+
+constexpr bool is_leap(int year) noexcept {
+  return year % 4 == 0 && (year % 100 != 0 || year % 400 == 0);
+}
+
+
+constexpr unsigned last_day_of_month(int year, unsigned month) noexcept {
+  constexpr unsigned char days[] = {31, 28, 31, 30, 31, 30, 31, 31, 30, 31, 30, 31};
+  return month == 2 && is_leap(year) ? 29 : days[month - 1];
+}
+
+
+/// Число дней от 1970-01-01.
+constexpr std::int64_t days_from_civil(int year, unsigned month, unsigned day) noexcept {
+  const std::int64_t y = static_cast<std::int64_t>(year) - (month <= 2 ? 1 : 0);
+  const std::int64_t era = (y >= 0 ? y : y - 399) / 400;
+  const auto yoe = static_cast<unsigned>(y - era * 400);
+  const unsigned doy = (153 * (month > 2 ? month - 3 : month + 9) + 2) / 5 + day - 1;
+  const unsigned doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+  return era * 146097 + static_cast<std::int64_t>(doe) - 719468;
+}
+
+
+constexpr date civil_from_days(std::int64_t days) noexcept {
+  days += 719468;
+  const std::int64_t era = (days >= 0 ? days : days - 146096) / 146097;
+  const auto doe = static_cast<unsigned>(days - era * 146097);
+  const unsigned yoe = (doe - doe / 1460 + doe / 36524 - doe / 146096) / 365;
+  const unsigned doy = doe - (365 * yoe + yoe / 4 - yoe / 100);
+  const unsigned mp = (5 * doy + 2) / 153;
+  const unsigned month = mp < 10 ? mp + 3 : mp - 9;
+  return {static_cast<int>(static_cast<std::int64_t>(yoe) + era * 400 + (month <= 2 ? 1 : 0)), month, doy - (153 * mp + 2) / 5 + 1};
+}
+
+
+constexpr unsigned weekday_from_days(std::int64_t days) noexcept {
+  return static_cast<unsigned>(days >= -4 ? (days + 4) % 7 : (days + 5) % 7 + 6);
+}
+
+
+/// Числом 2 в ячейке записывается 1900-01-01 (как в cell_value).
+constexpr std::int64_t serial_epoch = days_from_civil(1900, 1, 1) - 2;
+
+
+/// Число для ячейки по дате и времени в миллисекундах от начала дня. Время больше суток переносится на следующие дни.
+constexpr double to_serial(int year, unsigned month, unsigned day, std::int64_t ms_of_day) noexcept {
+  const std::int64_t days = days_from_civil(year, month, day) + ms_of_day / ms_per_day;
+  return static_cast<double>(days - serial_epoch) + static_cast<double>(ms_of_day % ms_per_day) / static_cast<double>(ms_per_day);
+}
+
+
+/// Дата и время по числу из ячейки. Время округляется до секунд.
+/// Пустое значение, если дата вне диапазона [min_year, max_year].
+inline std::optional<date_time> from_serial(double serial) noexcept {
+  double integral = 0;
+  const double decimal = std::modf(serial, &integral);
+
+  constexpr double max_serial = static_cast<double>(days_from_civil(max_year + 1, 1, 1) - serial_epoch);
+  constexpr double min_serial = static_cast<double>(days_from_civil(min_year, 1, 1) - serial_epoch);
+  if (!(integral >= min_serial && integral < max_serial)) {
+    return std::nullopt;
+  }
+
+  const auto ms = static_cast<std::int64_t>(decimal * ms_per_day);
+  auto seconds = static_cast<std::int64_t>(std::round(ms / 1000.));
+  auto days = static_cast<std::int64_t>(integral) + serial_epoch;
+  if (seconds < 0) {
+    seconds += 24 * 60 * 60;
+    --days;
+  }
+  days += seconds / (24 * 60 * 60);
+  seconds %= 24 * 60 * 60;
+
+  const auto d = civil_from_days(days);
+  if (d.year < min_year || d.year > max_year) {
+    return std::nullopt;
+  }
+
+  date_time result;
+  result.year = d.year;
+  result.month = d.month;
+  result.day = d.day;
+  result.weekday = weekday_from_days(days);
+  result.hour = static_cast<unsigned>(seconds / 3600);
+  result.minute = static_cast<unsigned>(seconds / 60 % 60);
+  result.second = static_cast<unsigned>(seconds % 60);
+  return result;
+}
+
+
+} // namespace lde::cellfy::boox::civil
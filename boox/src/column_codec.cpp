@@ -0,0 +1,298 @@
+#include <lde/cellfy/boox/src/column_codec.h>
+
+#include <algorithm>
+#include <bit>
+#include <cmath>
+#include <cstring>
+#include <string>
+#include <string_view>
+
+
+namespace lde::cellfy::boox::codec {
+
+namespace _ {
+namespace {
+
+
+/// Вид записи чисел колонки.
+constexpr std::uint8_t numbers_as_integers = 0;
+constexpr std::uint8_t numbers_as_xor      = 1;
+
+/// Целые до 2^53 представимы в double точно.
+constexpr double max_exact_integer = 9007199254740992.0;
+
+
+void write_varint(blob::writer& out, std::uint64_t value) {
+  while (value >= 0x80) {
+    out.pod(static_cast<std::uint8_t>(value | 0x80));
+    value >>= 7;
+  }
+  out.pod(static_cast<std::uint8_t>(value));
+}
+
+
+std::uint64_t read_varint(blob::reader& in) {
+  std::uint64_t value = 0;
+  for (unsigned shift = 0; shift < 64; shift += 7) {
+    const auto byte = in.pod<std::uint8_t>();
+    value |= static_cast<std::uint64_t>(byte & 0x7f) << shift;
+    if ((byte & 0x80) == 0) {
+      return value;
+    }
+  }
+  ED_THROW_EXCEPTION(file_is_broken());
+}
+
+
+/// Малые по модулю разности любого знака - малые числа без знака.
+constexpr std::uint64_t zigzag(std::uint64_t value) noexcept {
+  return (value << 1) ^ (0 - (value >> 63));
+}
+
+
+constexpr std::uint64_t unzigzag(std::uint64_t value) noexcept {
+  return (value >> 1) ^ (0 - (value & 1));
+}
+
+
+bool is_exact_integer(double value) noexcept {
+  return value >= -max_exact_integer && value <= max_exact_integer &&
+         value == std::trunc(value) && !(value == 0 && std::signbit(value));
+}
+
+
+/// Запись битов, старшие биты первыми.
+class bit_writer final {
+public:
+  /// Записать младшие bits бит value, bits от 1 до 64.
+  void write(std::uint64_t value, unsigned bits) {
+    while (bits > 0) {
+      if (used_ == 0) {
+        data_.push_back(0);
+      }
+      const unsigned free = 8 - used_;
+      const unsigned n = std::min(free, bits);
+      const auto chunk = static_cast<unsigned>(value >> (bits - n)) & ((1u << n) - 1);
+      data_.back() = static_cast<char>(static_cast<unsigned char>(data_.back()) | (chunk << (free - n)));
+      used_ = (used_ + n) % 8;
+      bits -= n;
+    }
+  }
+
+  const std::string& data() const noexcept {
+    return data_;
+  }
+
+private:
+  std::string data_;
+  unsigned    used_ = 0;
+};
+
+
+/// Чтение битов. Выход за границы - file_is_broken.
+class bit_reader final {
+public:
+  explicit bit_reader(std::string_view data) noexcept
+    : data_(data) {
+  }
+
+  /// Прочитать bits бит, от 1 до 64.
+  std::uint64_t read(unsigned bits) {
+    if (bits > data_.size() * 8 - pos_) {
+      ED_THROW_EXCEPTION(file_is_broken());
+    }
+
+    // 64 бита со смещением внутри байта занимают до 9 байт.
+    unsigned char bytes[9] = {};
+    const auto first = pos_ / 8;
+    std::memcpy(bytes, data_.data() + first, std::min<std::size_t>(sizeof(bytes), data_.size() - first));
+
+    std::uint64_t word = 0;
+    for (std::size_t i = 0; i < 8; ++i) {
+      word = (word << 8) | bytes[i];
+    }
+    if (const unsigned shift = pos_ % 8; shift != 0) {
+      word = (word << shift) | (bytes[8] >> (8 - shift));
+    }
+
+    pos_ += bits;
+    return word >> (64 - bits);
+  }
+
+private:
+  std::string_view data_;
+  std::size_t      pos_ = 0;
+};
+
+
+/// XOR с предыдущим значением. Ноль - бит 0. Иначе значащие биты XOR:
+/// 10 - в окне прошлого значения, 11 - новое окно: 6 бит нулей слева, 6 бит длины минус 1, затем сами биты.
+std::string xor_encode(std::span<const double> values) {
+  bit_writer out;
+  std::uint64_t prev = 0;
+  unsigned lead = 0;
+  unsigned length = 0;
+
+  for (std::size_t i = 0; i < values.size(); ++i) {
+    const auto bits = std::bit_cast<std::uint64_t>(values[i]);
+    if (i == 0) {
+      out.write(bits, 64);
+      prev = bits;
+      continue;
+    }
+
+    const auto x = bits ^ prev;
+    prev = bits;
+    if (x == 0) {
+      out.write(0, 1);
+      continue;
+    }
+
+    const auto l = static_cast<unsigned>(std::countl_zero(x));
+    const auto t = static_cast<unsigned>(std::countr_zero(x));
+    if (length > 0 && l >= lead && t >= 64 - lead - length) {
+      out.write(0b10, 2);
+      out.write(x >> (64 - lead - length), length);
+    } else {
+      lead = l;
+      length = 64 - l - t;
+      out.write(0b11, 2);
+      out.write(lead, 6);
+      out.write(length - 1, 6);
+      out.write(x >> t, length);
+    }
+  }
+
+  return out.data();
+}
+
+
+void xor_decode(std::string_view data, std::size_t count, std::vector<double>& values) {
+  bit_reader in(data);
+  std::uint64_t prev = 0;
+  unsigned lead = 0;
+  unsigned length = 0;
+
+  for (std::size_t i = 0; i < count; ++i) {
+    if (i == 0) {
+      prev = in.read(64);
+    } else if (in.read(1) != 0) {
+      if (in.read(1) != 0) {
+        lead = static_cast<unsigned>(in.read(6));
+        length = static_cast<unsigned>(in.read(6)) + 1;
+        if (lead + length > 64) {
+          ED_THROW_EXCEPTION(file_is_broken());
+        }
+      } else if (length == 0) {
+        ED_THROW_EXCEPTION(file_is_broken());
+      }
+      prev ^= in.read(length) << (64 - lead - length);
+    }
+    values.push_back(std::bit_cast<double>(prev));
+  }
+}
+
+
+void write_run(blob::writer& out, std::uint64_t value, std::uint64_t length) {
+  write_varint(out, zigzag(value));
+  write_varint(out, length);
+}
+
+}} // namespace _
+
+
+integer_writer::integer_writer(blob::writer& out) noexcept
+  : out_(out) {
+}
+
+
+void integer_writer::push(const std::uint64_t value) {
+  const auto delta = value - prev_;
+  const auto dod = delta - delta_;
+  prev_ = value;
+  delta_ = delta;
+
+  if (run_length_ > 0 && dod == run_value_) {
+    ++run_length_;
+    return;
+  }
+
+  if (run_length_ > 0) {
+    _::write_run(out_, run_value_, run_length_);
+  }
+  run_value_ = dod;
+  run_length_ = 1;
+}
+
+
+void integer_writer::finish() {
+  if (run_length_ > 0) {
+    _::write_run(out_, run_value_, run_length_);
+    run_length_ = 0;
+  }
+}
+
+
+integer_reader::integer_reader(blob::reader& in) noexcept
+  : in_(in) {
+}
+
+
+std::uint64_t integer_reader::next() {
+  if (run_length_ == 0) {
+    run_value_ = _::unzigzag(_::read_varint(in_));
+    run_length_ = _::read_varint(in_);
+    if (run_length_ == 0) {
+      ED_THROW_EXCEPTION(file_is_broken());
+    }
+  }
+
+  --run_length_;
+  delta_ += run_value_;
+  prev_ += delta_;
+  return prev_;
+}
+
+
+void integer_reader::finish() const {
+  if (run_length_ != 0) {
+    ED_THROW_EXCEPTION(file_is_broken());
+  }
+}
+
+
+void write_numbers(blob::writer& out, std::span<const double> values) {
+  if (std::all_of(values.begin(), values.end(), _::is_exact_integer)) {
+    out.pod(_::numbers_as_integers);
+    integer_writer w(out);
+    for (auto v : values) {
+      w.push(static_cast<std::uint64_t>(static_cast<std::int64_t>(v)));
+    }
+    w.finish();
+  } else {
+    out.pod(_::numbers_as_xor);
+    out.bytes(_::xor_encode(values));
+  }
+}
+
+
+void read_numbers(blob::reader& in, std::size_t count, std::vector<double>& values) {
+  switch (in.pod<std::uint8_t>()) {
+    case _::numbers_as_integers: {
+        integer_reader r(in);
+        for (std::size_t i = 0; i < count; ++i) {
+          values.push_back(static_cast<double>(static_cast<std::int64_t>(r.next())));
+        }
+        r.finish();
+      }
+      break;
+    case _::numbers_as_xor:
+      _::xor_decode(in.bytes(), count, values);
+      break;
+    default:
+      ED_THROW_EXCEPTION(file_is_broken());
+  }
+}
+
+
+} // namespace lde::cellfy::boox::codec
@@ -0,0 +1,81 @@
+#pragma once
+
+
+#include <cstddef>
+#include <cstdint>
+#include <limits>
+#include <span>
+#include <vector>
+
+#include <ed/core/assert.h>
+
+#include <lde/cellfy/boox/exception.h>
+#include <lde/cellfy/boox/src/blob.h>
+
+
+/// Сжатие колонок блока снимка.
+///
+/// Целые пишутся разностями разностей соседних значений, одинаковые подряд разности разностей - одной серией (RLE).
+/// Поэтому возрастающие индексы ячеек, метки времени с постоянным шагом и повторы занимают несколько байт на серию.
+/// Дробные числа пишутся XOR с предыдущим значением: повтор стоит один бит, плавно меняющееся значение -
+/// только изменившиеся биты. Колонка читается целиком, поэтому каждый блок снимка декодируется отдельно.
+namespace lde::cellfy::boox::codec {
+
+
+/// Запись целых. Значения сравниваются по модулю 2^64, поэтому подходят и знаковые, приведённые к std::uint64_t.
+class integer_writer final {
+public:
+  explicit integer_writer(blob::writer& out) noexcept;
+
+  void push(std::uint64_t value);
+
+  /// Дописать последнюю серию.
+  void finish();
+
+private:
+  blob::writer& out_;
+  std::uint64_t prev_       = 0;
+  std::uint64_t delta_      = 0;
+  std::uint64_t run_value_  = 0;
+  std::uint64_t run_length_ = 0;
+};
+
+
+/// Чтение целых. Выход за границы раздела - file_is_broken.
+class integer_reader final {
+public:
+  explicit integer_reader(blob::reader& in) noexcept;
+
+  std::uint64_t next();
+
+  /// Последняя серия прочитана до конца, иначе file_is_broken.
+  void finish() const;
+
+private:
+  blob::reader& in_;
+  std::uint64_t prev_       = 0;
+  std::uint64_t delta_      = 0;
+  std::uint64_t run_value_  = 0;
+  std::uint64_t run_length_ = 0;
+};
+
+
+/// Прочитать целое типа T. Значение вне диапазона T - file_is_broken.
+template<typename T>
+T next_integer(integer_reader& in) {
+  const auto value = in.next();
+  if (value > std::numeric_limits<T>::max()) {
+    ED_THROW_EXCEPTION(file_is_broken());
+  }
+  return static_cast<T>(value);
+}
+
+
+/// Записать числа одной колонки листа. Целые числа пишутся как целые, остальные - XOR.
+void write_numbers(blob::writer& out, std::span<const double> values);
+
+/// Прочитать count чисел и дописать их в конец values.
+void read_numbers(blob::reader& in, std::size_t count, std::vector<double>& values);
+
+
+} // namespace lde::cellfy::boox::codec
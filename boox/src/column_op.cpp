@@ -6,6 +6,7 @@
 
 #include <lde/cellfy/boox/workbook.h>
 #include <lde/cellfy/boox/worksheet.h>
+#include <lde/cellfy/boox/src/cell_op.h>
 
 
 namespace lde::cellfy::boox {
@@ -55,6 +56,7 @@ void get_column_format_op::on_start(range_op_ctx& ctx) {
   ED_ASSERT(format_);
   *format_ = {};
   processed_count_ = 0;
+  last_format_ = nullptr;
 }
 
 
@@ -64,9 +66,10 @@ bool get_column_format_op::on_existing_node(range_op_ctx& ctx, column_node::it n
     ED_ASSERT(node->format);
     if (processed_count_ == 0) {
       *format_ = *node->format;
-    } else {
+    } else if (node->format.get() != last_format_) { // Пересечение с тем же форматом ничего не меняет
       *format_ = format_->intersect(*node->format);
     }
+    last_format_ = node->format.get();
     ++processed_count_;
   }
   return true;
@@ -76,6 +79,7 @@ bool get_column_format_op::on_existing_node(range_op_ctx& ctx, column_node::it n
 bool clear_column_format_op::on_existing_node(range_op_ctx& ctx, column_node::it node) {
   if (node->format_key) {
     ED_ASSERT(node->format);
+    ctx.release_format(node->format_key);
     column_node n = *node;
     n.format_key = std::nullopt;
     n.format = nullptr;
@@ -86,27 +90,22 @@ bool clear_column_format_op::on_existing_node(range_op_ctx& ctx, column_node::it
 
 
 change_existing_column_format_op::change_existing_column_format_op(cell_format::changes changes) noexcept
-  : changes_(std::move(changes)) {
+  : transitions_(std::move(changes)) {
 }
 
 
 bool change_existing_column_format_op::on_existing_node(range_op_ctx& ctx, column_node::it node) {
   if (node->format_key) {
     ED_ASSERT(node->format);
-    auto new_fmt = node->format->apply(changes_);
-    if (new_fmt != *node->format) {
-      auto format_node = ctx.sheet().book().ensure_format(std::move(new_fmt));
-      ED_ENSURES(format_node->format);
-
+    auto format_node = transitions_.apply(ctx.sheet().book(), node->format);
+    if (format_node->format != node->format) {
       column_node n = *node;
       n.format_key = forest_t::key_of(format_node);
       n.format = format_node->format;
       ctx.forest().modify(node) = n;
     }
   } else {
-    cell_format fmt = ctx.sheet().node()->format ? ctx.sheet().node()->format->apply(changes_) : cell_format().apply(changes_);
-    auto format_node = ctx.sheet().book().ensure_format(std::move(fmt));
-    ED_ENSURES(format_node->format);
+    auto format_node = transitions_.apply(ctx.sheet().book(), nullptr, nullptr, ctx.sheet().node()->format.get());
 
     column_node n = *node;
     n.format_key = forest_t::key_of(format_node);
@@ -123,9 +122,7 @@ change_column_format_op::change_column_format_op(cell_format::changes changes) n
 
 
 bool change_column_format_op::on_new_node(range_op_ctx& ctx, column_node& node) {
-  cell_format fmt = ctx.sheet().node()->format ? ctx.sheet().node()->format->apply(changes_) : cell_format().apply(changes_);
-  auto format_node = ctx.sheet().book().ensure_format(std::move(fmt));
-  ED_ENSURES(format_node->format);
+  auto format_node = transitions_.apply(ctx.sheet().book(), nullptr, nullptr, ctx.sheet().node()->format.get());
 
   node.width = ctx.sheet().default_column_width();
   node.format_key = forest_t::key_of(format_node);
@@ -168,10 +165,12 @@ ed::twips<double> change_column_width::get_max_cells_width(range_op_ctx& ctx, co
     if (auto cell = std::lower_bound(cells.begin(), cells.end(), cell_node{cell_index});
         cell != cells.end()       &&
         cell->index == cell_index &&
-        cell->layout              &&
         cell->column_span == 1) { // Обьединённые ячейки не участвуют в расширении по ширине. Только обычные ячейки.
 
-      max_width = std::max(max_width, ed::twips<double>{cell->layout->width()});
+      actualize_cell_layout(ctx, cell);
+      if (cell->layout) {
+        max_width = std::max(max_width, ed::twips<double>{cell->layout->width()});
+      }
     }
   }
 
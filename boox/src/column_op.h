@@ -5,6 +5,7 @@
 
 #include <lde/cellfy/boox/format.h>
 #include <lde/cellfy/boox/range_op.h>
+#include <lde/cellfy/boox/src/format_transitions.h>
 
 
 namespace lde::cellfy::boox {
@@ -45,8 +46,9 @@ public:
   bool on_existing_node(range_op_ctx& ctx, column_node::it node) override;
 
 private:
-  cell_format* format_          = nullptr;
-  std::size_t  processed_count_ = 0;
+  cell_format*       format_          = nullptr;
+  const cell_format* last_format_     = nullptr;
+  std::size_t        processed_count_ = 0;
 };
 
 
@@ -69,7 +71,7 @@ public:
   bool on_existing_node(range_op_ctx& ctx, column_node::it node) override;
 
 protected:
-  cell_format::changes changes_;
+  format_transitions transitions_;
 };
 
 
@@ -0,0 +1,347 @@
+#include <lde/cellfy/boox/csv.h>
+
+#include <algorithm>
+#include <cstddef>
+#include <istream>
+#include <memory>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include <boost/interprocess/file_mapping.hpp>
+#include <boost/interprocess/mapped_region.hpp>
+
+#include <ed/core/assert.h>
+#include <ed/core/unicode.h>
+
+#include <lde/cellfy/boox/cell_addr.h>
+#include <lde/cellfy/boox/exception.h>
+#include <lde/cellfy/boox/node.h>
+#include <lde/cellfy/boox/scoped_transaction.h>
+#include <lde/cellfy/boox/src/parallel.h>
+#include <lde/cellfy/boox/src/value_parser.h>
+
+
+namespace lde::cellfy::boox {
+
+namespace _ {
+namespace {
+
+
+/// Текст меньше этого размера не делится на части.
+constexpr std::size_t min_chunk_size = 1 << 20;
+
+
+struct parsed_cell final {
+  column_index column = 0;
+  cell_value   value;
+  std::wstring format;
+};
+
+
+/// Разобранная часть текста. Пустые строки тоже учитываются.
+struct parsed_chunk final {
+  std::vector<parsed_cell> cells;
+  std::vector<std::size_t> row_ends;        ///< Конец ячеек каждой строки в cells.
+  bool                     complete = true; ///< Текст не оборвался внутри поля в кавычках.
+};
+
+
+/// Предполагаемые начала частей текста и конец текста. Часть начинается сразу после перевода строки вне кавычек.
+/// Находится ли начало части внутри кавычек, угадывается по чётности числа кавычек перед ним. Кавычка внутри
+/// поля без кавычек сбивает чётность, поэтому границу проверяет разбор: часть перед ложной границей обрывается
+/// внутри поля в кавычках (parsed_chunk::complete).
+std::vector<std::size_t> split_chunks(std::string_view text, char quote) {
+  const std::size_t count = std::max<std::size_t>(text.size() / min_chunk_size, 1);
+
+  std::vector<std::size_t> bounds(count + 1);
+  for (std::size_t i = 0; i <= count; ++i) {
+    bounds[i] = text.size() / count * i;
+  }
+  bounds.back() = text.size();
+
+  std::vector<std::size_t> quotes(count);
+  parallel_blocks(count, 1, [&](std::size_t first, std::size_t last) {
+    for (auto i = first; i < last; ++i) {
+      quotes[i] = static_cast<std::size_t>(std::count(text.begin() + bounds[i], text.begin() + bounds[i + 1], quote));
+    }
+  });
+
+  std::vector<std::size_t> starts{0};
+  bool in_quotes = false;
+  for (std::size_t i = 1; i < count; ++i) {
+    in_quotes = in_quotes != (quotes[i - 1] % 2 == 1);
+
+    bool q = in_quotes;
+    std::size_t pos = bounds[i];
+    for (; pos < text.size(); ++pos) {
+      if (text[pos] == quote) {
+        q = !q;
+      } else if (!q && text[pos] == '\n') {
+        ++pos;
+        break;
+      }
+    }
+
+    // Длинное поле в кавычках может накрыть несколько частей целиком.
+    if (pos > starts.back() && pos < text.size()) {
+      starts.push_back(pos);
+    }
+  }
+  starts.push_back(text.size());
+  return starts;
+}
+
+
+std::wstring to_wstring(std::string_view raw) {
+  if (std::all_of(raw.begin(), raw.end(), [](char c) { return static_cast<unsigned char>(c) < 0x80; })) {
+    return std::wstring(raw.begin(), raw.end());
+  }
+  return ed::from_utf8(std::string(raw));
+}
+
+
+/// Разбор части текста. Значения распознаются так же, как при вводе в ячейку.
+class chunk_parser final {
+public:
+  explicit chunk_parser(const csv_options& options)
+    : options_(options)
+    , parser_(options_.loc) {
+  }
+
+  parsed_chunk operator()(std::string_view text) {
+    parsed_chunk result;
+    complete_ = true;
+
+    const char* p = text.data();
+    const char* end = p + text.size();
+
+    while (p != end) {
+      column_index column = 0;
+      for (;;) {
+        p = parse_field(p, end);
+        add(column, result);
+
+        if (p != end && *p == options_.delimiter) {
+          ++p;
+          ++column;
+          continue;
+        }
+        if (p != end && *p == '\r') {
+          ++p;
+        }
+        if (p != end && *p == '\n') {
+          ++p;
+        }
+        break;
+      }
+      result.row_ends.push_back(result.cells.size());
+    }
+
+    result.complete = complete_;
+    return result;
+  }
+
+private:
+  /// Поле до разделителя или конца строки. Результат в field_. Конец текста внутри кавычек сбрасывает complete_.
+  const char* parse_field(const char* p, const char* end) {
+    field_.clear();
+
+    if (p != end && *p == options_.quote) {
+      ++p;
+      for (;;) {
+        if (p == end) {
+          complete_ = false;
+          return p;
+        }
+        if (*p == options_.quote) {
+          if (p + 1 != end && p[1] == options_.quote) {
+            field_ += options_.quote;
+            p += 2;
+            continue;
+          }
+          ++p;
+          break;
+        }
+        field_ += *p++;
+      }
+    }
+
+    // Текст после закрывающей кавычки остаётся частью поля.
+    const char* first = p;
+    while (p != end && *p != options_.delimiter && *p != '\n' && *p != '\r') {
+      ++p;
+    }
+    field_.append(first, p);
+    return p;
+  }
+
+  void add(column_index column, parsed_chunk& result) {
+    if (field_.empty()) {
+      return;
+    }
+
+    if (column >= cell_addr::max_column_count) {
+      ED_THROW_EXCEPTION(file_is_broken());
+    }
+
+    auto [value, format] = parser_(to_wstring(field_));
+    result.cells.push_back({column, std::move(value), std::move(format)});
+  }
+
+private:
+  const csv_options& options_;
+  value_parser       parser_;
+  std::string        field_;
+  bool               complete_ = true;
+};
+
+
+std::optional<cell_node::scalar> scalar_of(const cell_value& value) {
+  switch (value.type()) {
+    case cell_value_type::boolean: return value.as<bool>();
+    case cell_value_type::number:  return value.as<double>();
+    case cell_value_type::error:   return value.as<cell_value_error>();
+    default:                       return std::nullopt;
+  }
+}
+
+
+/// Добавить разобранные части в лес. Строки и ячейки идут по возрастанию индексов,
+/// поэтому каждый узел добавляется в конец своего родителя.
+void load(const std::vector<parsed_chunk>& chunks, forest_t& forest, const csv_options& options) {
+  scoped_transaction tr(forest);
+
+  auto book_node = forest.push_back(workbook_node{});
+
+  worksheet_node sheet_n;
+  sheet_n.name = options.sheet_name;
+  auto sheet_node = forest.push_back(book_node, std::move(sheet_n));
+
+  std::unordered_map<std::wstring, node_key_type> format_keys;
+  auto format_key = [&](const std::wstring& number_fmt) {
+    if (auto i = format_keys.find(number_fmt); i != format_keys.end()) {
+      return i->second;
+    }
+    cell_format fmt;
+    fmt.set<number_format>(std::wstring(number_fmt));
+    cell_format_node n;
+    n.format = std::make_shared<cell_format>(std::move(fmt));
+    auto key = forest_t::key_of(forest.push_back(book_node, std::move(n)));
+    format_keys.emplace(number_fmt, key);
+    return key;
+  };
+
+  std::size_t row = 0;
+  for (auto& chunk : chunks) {
+    std::size_t first = 0;
+    for (auto last : chunk.row_ends) {
+      if (first != last) {
+        if (row >= cell_addr::max_row_count) {
+          ED_THROW_EXCEPTION(file_is_broken());
+        }
+
+        row_node row_n;
+        row_n.index = static_cast<row_index>(row);
+        auto row_it = forest.push_back(sheet_node, std::move(row_n));
+
+        for (auto i = first; i != last; ++i) {
+          auto& c = chunk.cells[i];
+
+          cell_node n;
+          n.index = cell_addr(c.column, static_cast<row_index>(row)).index();
+          n.value_type = c.value.type();
+          n.value = scalar_of(c.value);
+          if (!c.format.empty()) {
+            n.format_key = format_key(c.format);
+          }
+          auto cell_it = forest.push_back(row_it, std::move(n));
+
+          if (c.value.type() == cell_value_type::string) {
+            cell_data_node child;
+            child.data = c.value.to<shared_string>();
+            forest.push_back(cell_it, std::move(child));
+          }
+        }
+      }
+      first = last;
+      ++row;
+    }
+  }
+
+  tr.commit();
+}
+
+}} // namespace _
+
+
+void read_csv(std::string_view text, forest_t& forest, const csv_options& options) {
+  if (text.size() >= 3 && text.substr(0, 3) == "\xEF\xBB\xBF") {
+    text.remove_prefix(3);
+  }
+
+  const auto starts = _::split_chunks(text, options.quote);
+
+  std::vector<_::parsed_chunk> chunks(starts.size() - 1);
+  parallel_blocks(chunks.size(), 1, [&](std::size_t first, std::size_t last) {
+    _::chunk_parser parser(options);
+    for (auto i = first; i < last; ++i) {
+      chunks[i] = parser(text.substr(starts[i], starts[i + 1] - starts[i]));
+    }
+  });
+
+  // Часть, оборванная внутри кавычек, разобрана от верного начала строки, а следующая - нет.
+  // Остаток текста с такой части разбирается последовательно.
+  for (std::size_t i = 0; i + 1 < chunks.size(); ++i) {
+    if (!chunks[i].complete) {
+      chunks[i] = _::chunk_parser(options)(text.substr(starts[i]));
+      chunks.resize(i + 1);
+      break;
+    }
+  }
+
+  _::load(chunks, forest, options);
+}
+
+
+void read_csv(const std::filesystem::path& path, forest_t& forest, const csv_options& options) {
+  namespace bip = boost::interprocess;
+
+  // Пустой файл нельзя отобразить в память.
+  if (std::filesystem::file_size(path) == 0) {
+    read_csv(std::string_view(), forest, options);
+    return;
+  }
+
+  bip::file_mapping file(path.string().c_str(), bip::read_only);
+  bip::mapped_region region(file, bip::read_only);
+  region.advise(bip::mapped_region::advice_sequential);
+
+  read_csv(std::string_view(static_cast<const char*>(region.get_address()), region.get_size()), forest, options);
+}
+
+
+workbook::file_reader make_csv_reader(csv_options options) {
+  return [options = std::move(options)](std::istream& is, forest_t& forest) {
+    constexpr std::size_t block_size = 1 << 20;
+
+    std::string text;
+    for (;;) {
+      const auto size = text.size();
+      text.resize(size + block_size);
+      is.read(text.data() + size, block_size);
+      text.resize(size + static_cast<std::size_t>(is.gcount()));
+      if (!is) {
+        break;
+      }
+    }
+
+    read_csv(std::string_view(text), forest, options);
+  };
+}
+
+
+} // namespace lde::cellfy::boox
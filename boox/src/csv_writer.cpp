@@ -0,0 +1,288 @@
+#include <lde/cellfy/boox/csv.h>
+
+#include <array>
+#include <charconv>
+#include <cstddef>
+#include <locale>
+#include <ostream>
+#include <string>
+#include <string_view>
+#include <type_traits>
+#include <utility>
+#include <variant>
+
+#include <ed/core/assert.h>
+
+#include <lde/cellfy/boox/cell_addr.h>
+#include <lde/cellfy/boox/node.h>
+#include <lde/cellfy/boox/value_format.h>
+
+
+namespace lde::cellfy::boox {
+
+namespace _ {
+namespace {
+
+
+/// Буфер пишется в поток, когда в нём набирается столько байт.
+constexpr std::size_t flush_size = 1 << 20;
+
+
+/// Запись текста с разделителями в поток через буфер постоянного размера.
+class csv_stream final {
+public:
+  csv_stream(std::ostream& os, const csv_options& options)
+    : os_(os)
+    , options_(options)
+    , decimal_point_(std::use_facet<std::numpunct<wchar_t>>(options.loc).decimal_point()) {
+    buffer_.reserve(flush_size + flush_size / 4);
+  }
+
+  csv_stream(const csv_stream&) = delete;
+  csv_stream& operator=(const csv_stream&) = delete;
+
+  void delimiter() {
+    buffer_ += options_.delimiter;
+  }
+
+  void end_row() {
+    buffer_ += '\n';
+    if (buffer_.size() >= flush_size) {
+      flush();
+    }
+  }
+
+  void flush() {
+    os_.write(buffer_.data(), static_cast<std::streamsize>(buffer_.size()));
+    buffer_.clear();
+  }
+
+  /// Текст поля. В кавычки берётся, только если в нём есть разделитель, кавычка или перевод строки.
+  void text(std::wstring_view text) {
+    const wchar_t special[] = {static_cast<wchar_t>(options_.delimiter), static_cast<wchar_t>(options_.quote), L'\n', L'\r', 0};
+    if (text.find_first_of(special) == std::wstring_view::npos) {
+      append_utf8(text);
+      return;
+    }
+
+    buffer_ += options_.quote;
+    for (std::size_t first = 0;;) {
+      const auto pos = text.find(static_cast<wchar_t>(options_.quote), first);
+      append_utf8(text.substr(first, pos == std::wstring_view::npos ? pos : pos - first + 1));
+      if (pos == std::wstring_view::npos) {
+        break;
+      }
+      buffer_ += options_.quote;
+      first = pos + 1;
+    }
+    buffer_ += options_.quote;
+  }
+
+  /// Число в кратчайшей записи, которая читается обратно без потерь.
+  void number(double value) {
+    std::array<char, 32> chars;
+    auto [last, ec] = std::to_chars(chars.data(), chars.data() + chars.size(), value);
+    ED_ASSERT(ec == std::errc());
+
+    const std::string_view symbols(chars.data(), static_cast<std::size_t>(last - chars.data()));
+    const auto dot = symbols.find('.');
+    if (dot == std::string_view::npos || decimal_point_ == L'.') {
+      buffer_ += symbols;
+      return;
+    }
+
+    // Десятичный разделитель локали может совпасть с разделителем полей, тогда нужны кавычки.
+    std::wstring localized(symbols.begin(), symbols.end());
+    localized[dot] = decimal_point_;
+    text(localized);
+  }
+
+private:
+  void append_utf8(std::wstring_view text) {
+    for (std::size_t i = 0; i < text.size(); ++i) {
+      auto c = static_cast<char32_t>(text[i]);
+      if constexpr (sizeof(wchar_t) == 2) {
+        if (c >= 0xD800 && c < 0xDC00 && i + 1 < text.size()) {
+          c = 0x10000 + ((c - 0xD800) << 10) + (static_cast<char32_t>(text[++i]) - 0xDC00);
+        }
+      }
+
+      if (c < 0x80) {
+        buffer_ += static_cast<char>(c);
+      } else if (c < 0x800) {
+        buffer_ += static_cast<char>(0xC0 | (c >> 6));
+        buffer_ += static_cast<char>(0x80 | (c & 0x3F));
+      } else if (c < 0x10000) {
+        buffer_ += static_cast<char>(0xE0 | (c >> 12));
+        buffer_ += static_cast<char>(0x80 | ((c >> 6) & 0x3F));
+        buffer_ += static_cast<char>(0x80 | (c & 0x3F));
+      } else {
+        buffer_ += static_cast<char>(0xF0 | (c >> 18));
+        buffer_ += static_cast<char>(0x80 | ((c >> 12) & 0x3F));
+        buffer_ += static_cast<char>(0x80 | ((c >> 6) & 0x3F));
+        buffer_ += static_cast<char>(0x80 | (c & 0x3F));
+      }
+    }
+  }
+
+private:
+  std::ostream&      os_;
+  const csv_options& options_;
+  wchar_t            decimal_point_;
+  std::string        buffer_;
+};
+
+
+/// Запись значения одной ячейки.
+class cell_writer final {
+public:
+  cell_writer(const forest_t& forest, const csv_options& options, csv_stream& out) noexcept
+    : forest_(forest)
+    , options_(options)
+    , out_(out) {
+  }
+
+  template<typename It>
+  void operator()(const It& node) {
+    if (node->has_formula) {
+      auto formulas = forest_.get<cell_formula_node>(node);
+      if (!formulas.empty()) {
+        auto& f = *formulas.begin();
+        if (f.is_result_dirty) {
+          out_.text(L"=" + f.formula);
+        } else {
+          value(*node, f.result);
+        }
+        return;
+      }
+    }
+
+    switch (node->value_type) {
+      case cell_value_type::string: {
+          auto children = forest_.get<cell_data_node>(node);
+          if (!children.empty()) {
+            data(*node, children.begin()->data);
+          }
+        }
+        break;
+
+      case cell_value_type::rich_text: {
+          std::wstring text;
+          for (auto& run : forest_.get<text_run_node>(node)) {
+            text += run.text.str();
+          }
+          out_.text(text);
+        }
+        break;
+
+      case cell_value_type::none:
+        // В узлах версии 1 скаляр лежит в cell_data_node.
+        if (auto children = forest_.get<cell_data_node>(node); !children.empty()) {
+          data(*node, children.begin()->data);
+        }
+        break;
+
+      default:
+        if (node->value) {
+          std::visit([&](auto&& v) { value(*node, cell_value(v)); }, *node->value);
+        }
+        break;
+    }
+  }
+
+private:
+  void data(const cell_node& node, const decltype(cell_data_node::data)& d) {
+    std::visit([&](auto&& v) {
+      if constexpr (std::is_same_v<std::decay_t<decltype(v)>, shared_string>) {
+        out_.text(v.str());
+      } else {
+        value(node, cell_value(v));
+      }
+    }, d);
+  }
+
+  void value(const cell_node& node, const cell_value& v) {
+    if (v.type() != cell_value_type::number) {
+      out_.text(v.to<std::wstring>());
+      return;
+    }
+
+    if (node.format) {
+      if (auto& fmt = node.format->get_or_default<number_format>(); !fmt.empty()) {
+        out_.text((*value_format::compiled(fmt, options_.loc))(v).text);
+        return;
+      }
+    }
+    out_.number(v.as<double>());
+  }
+
+private:
+  const forest_t&    forest_;
+  const csv_options& options_;
+  csv_stream&        out_;
+};
+
+}} // namespace _
+
+
+void write_csv(std::ostream& os, const forest_t& forest, const csv_options& options) {
+  auto books = forest.get<workbook_node>();
+  ED_EXPECTS(!books.empty());
+
+  auto sheets = forest.get<worksheet_node>(books.begin());
+  ED_EXPECTS(!sheets.empty());
+
+  auto sheet = sheets.begin();
+  for (auto i = sheets.begin(); i != sheets.end(); ++i) {
+    if (i->name == options.sheet_name) {
+      sheet = i;
+      break;
+    }
+  }
+
+  _::csv_stream out(os, options);
+  _::cell_writer write_cell(forest, options, out);
+
+  auto rows = forest.get<row_node>(sheet);
+
+  row_index next_row = 0;
+  for (auto row = rows.begin(); row != rows.end(); ++row) {
+    auto cells = forest.get<cell_node>(row);
+    if (cells.empty()) {
+      continue;
+    }
+
+    for (; next_row < row->index; ++next_row) {
+      out.end_row();
+    }
+
+    column_index next_column = 0;
+    for (auto cell = cells.begin(); cell != cells.end(); ++cell) {
+      // Ячейки, закрытые объединением, пустые.
+      if (cell->merged_with) {
+        continue;
+      }
+
+      const auto column = cell_addr(cell->index).column();
+      for (; next_column < column; ++next_column) {
+        out.delimiter();
+      }
+      write_cell(cell);
+    }
+
+    out.end_row();
+    next_row = row->index + 1;
+  }
+
+  out.flush();
+}
+
+
+workbook::file_writer make_csv_writer(csv_options options) {
+  return [options = std::move(options)](std::ostream& os, const forest_t& forest) {
+    write_csv(os, forest, options);
+  };
+}
+
+
+} // namespace lde::cellfy::boox
@@ -0,0 +1,80 @@
+#include <lde/cellfy/boox/src/format_runs.h>
+
+#include <boost/geometry/algorithms/intersects.hpp>
+
+
+namespace lde::cellfy::boox {
+
+
+format_runs::format_runs(forest_t& forest, worksheet_node::it sheet_node) noexcept
+  : forest_(forest)
+  , sheet_node_(sheet_node) {
+}
+
+
+area format_runs::area_of(const format_run_node& node) noexcept {
+  return {cell_addr(node.first), cell_addr(node.last)};
+}
+
+
+void format_runs::invalidate() noexcept {
+  dirty_ = true;
+}
+
+
+format_run_node::opt_it format_runs::find(cell_addr addr) const {
+  actualize();
+
+  // Области не пересекаются, поэтому достаточно первой найденной.
+  auto i = index_.qbegin(boost::geometry::index::intersects(point(addr.column(), addr.row())));
+  if (i != index_.qend()) {
+    return i->second;
+  }
+  return std::nullopt;
+}
+
+
+format_runs::list format_runs::find(const area& ar) const {
+  actualize();
+
+  list result;
+  for (auto i = index_.qbegin(boost::geometry::index::intersects(box_of(ar))); i != index_.qend(); ++i) {
+    result.push_back(i->second);
+  }
+  return result;
+}
+
+
+bool format_runs::empty() const {
+  actualize();
+  return index_.empty();
+}
+
+
+format_runs::box format_runs::box_of(const area& ar) noexcept {
+  return {
+    point(ar.left_column(), ar.top_row()),
+    point(ar.right_column(), ar.bottom_row())
+  };
+}
+
+
+void format_runs::actualize() const {
+  if (!dirty_) {
+    return;
+  }
+
+  auto runs = forest_.get<format_run_node>(sheet_node_);
+  std::vector<value> values;
+  values.reserve(runs.size());
+  for (auto i = runs.begin(); i != runs.end(); ++i) {
+    values.emplace_back(box_of(area_of(*i)), i);
+  }
+
+  // Пакетная загрузка строит более сбалансированное дерево, чем поэлементная вставка.
+  index_ = index(values.begin(), values.end());
+  dirty_ = false;
+}
+
+
+} // namespace lde::cellfy::boox
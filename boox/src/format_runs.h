@@ -0,0 +1,64 @@
+#pragma once
+
+
+#include <cstdint>
+#include <utility>
+#include <vector>
+
+#include <boost/geometry/geometries/box.hpp>
+#include <boost/geometry/geometries/point.hpp>
+#include <boost/geometry/index/rtree.hpp>
+
+#include <lde/cellfy/boox/area.h>
+#include <lde/cellfy/boox/forest.h>
+#include <lde/cellfy/boox/node.h>
+
+
+namespace lde::cellfy::boox {
+
+
+/// Пространственный индекс (R-tree) областей format_run_node одного листа.
+/// Строится лениво по узлам леса и сбрасывается при любом их изменении.
+class format_runs final {
+public:
+  using list = std::vector<format_run_node::it>;
+
+public:
+  format_runs(forest_t& forest, worksheet_node::it sheet_node) noexcept;
+
+  format_runs(const format_runs&) = delete;
+  format_runs& operator=(const format_runs&) = delete;
+
+  /// Область узла.
+  static area area_of(const format_run_node& node) noexcept;
+
+  /// Сбросить индекс. Будет перестроен при следующем поиске.
+  void invalidate() noexcept;
+
+  /// Область, содержащая ячейку.
+  format_run_node::opt_it find(cell_addr addr) const;
+
+  /// Области, пересекающиеся с ar.
+  list find(const area& ar) const;
+
+  bool empty() const;
+
+private:
+  using point = boost::geometry::model::point<std::uint32_t, 2, boost::geometry::cs::cartesian>;
+  using box   = boost::geometry::model::box<point>;
+  using value = std::pair<box, format_run_node::it>;
+  using index = boost::geometry::index::rtree<value, boost::geometry::index::rstar<16>>;
+
+  static box box_of(const area& ar) noexcept;
+
+  void actualize() const;
+
+private:
+  forest_t&          forest_;
+  worksheet_node::it sheet_node_;
+  mutable index      index_;
+  mutable bool       dirty_ = true;
+};
+
+
+} // namespace lde::cellfy::boox
@@ -0,0 +1,62 @@
+#include <lde/cellfy/boox/src/format_transitions.h>
+
+#include <optional>
+#include <utility>
+
+#include <ed/core/assert.h>
+
+#include <lde/cellfy/boox/workbook.h>
+
+
+namespace lde::cellfy::boox {
+
+
+format_transitions::format_transitions(cell_format::changes changes) noexcept
+  : changes_(std::move(changes)) {
+}
+
+
+const cell_format::changes& format_transitions::changes() const noexcept {
+  return changes_;
+}
+
+
+cell_format_node::it format_transitions::apply(workbook& book, const cell_format::ptr& fmt) {
+  ED_EXPECTS(fmt);
+
+  if (auto i = by_format_.find(fmt.get()); i != by_format_.end()) {
+    return i->second.target;
+  }
+
+  auto target = book.ensure_format(fmt->apply(changes_));
+  ED_ENSURES(target->format);
+  if (target->format != fmt) {
+    book.release_format(*fmt);
+  }
+  by_format_.emplace(fmt.get(), transition{fmt, target});
+  return target;
+}
+
+
+cell_format_node::it format_transitions::apply(workbook& book, const cell_format* row, const cell_format* column, const cell_format* sheet) {
+  const sources key{row, column, sheet};
+
+  if (auto i = by_sources_.find(key); i != by_sources_.end()) {
+    return i->second;
+  }
+
+  std::optional<cell_format> fmt;
+  for (auto* source : {row, column, sheet}) {
+    if (source) {
+      fmt = fmt ? fmt->unite(*source) : *source;
+    }
+  }
+
+  auto target = book.ensure_format((fmt ? *fmt : cell_format()).apply(changes_));
+  ED_ENSURES(target->format);
+  by_sources_.emplace(key, target);
+  return target;
+}
+
+
+} // namespace lde::cellfy::boox
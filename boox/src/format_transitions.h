@@ -0,0 +1,46 @@
+#pragma once
+
+
+#include <map>
+#include <tuple>
+#include <unordered_map>
+
+#include <lde/cellfy/boox/fwd.h>
+#include <lde/cellfy/boox/node.h>
+
+
+namespace lde::cellfy::boox {
+
+
+/// Переходы форматов при применении одних и тех же изменений к множеству узлов.
+/// Для каждого исходного формата apply и поиск в таблице форматов книги выполняются один раз за операцию,
+/// остальные узлы с тем же форматом получают готовый узел формата.
+class format_transitions final {
+public:
+  explicit format_transitions(cell_format::changes changes) noexcept;
+
+  const cell_format::changes& changes() const noexcept;
+
+  /// Узел формата fmt после изменений. Если изменения формат не меняют, у узла тот же format, что и fmt.
+  cell_format_node::it apply(workbook& book, const cell_format::ptr& fmt);
+
+  /// Узел формата после изменений для узла без собственного формата.
+  /// Исходный формат - объединение форматов строки, столбца и листа (в порядке приоритета), nullptr пропускается.
+  cell_format_node::it apply(workbook& book, const cell_format* row, const cell_format* column, const cell_format* sheet);
+
+private:
+  struct transition final {
+    cell_format::ptr     source; ///< Держит исходный формат, чтобы его адрес не был переиспользован.
+    cell_format_node::it target;
+  };
+
+  using sources = std::tuple<const cell_format*, const cell_format*, const cell_format*>;
+
+private:
+  cell_format::changes                                changes_;
+  std::unordered_map<const cell_format*, transition> by_format_;
+  std::map<sources, cell_format_node::it>             by_sources_;
+};
+
+
+} // namespace lde::cellfy::boox
@@ -370,16 +370,28 @@ operand engine::exec(ast::greater_equal, const cell_value& lhs, const cell_value
 
 
 operand engine::exec(ast::equal, const cell_value& lhs, const cell_value& rhs) const {
+  if (lhs.is<shared_string>() && rhs.is<shared_string>()) {
+    // Одинаковые строки ячеек - одна запись пула, поэтому обычно хватает сравнения указателей и хэшей.
+    return iequals(lhs.as<shared_string>(), rhs.as<shared_string>());
+  }
   if (lhs.is<std::wstring>() && rhs.is<std::wstring>()) {
-    return ed::iequals(lhs.as<std::wstring>(), rhs.as<std::wstring>());
+    auto& lhs_s = lhs.as<std::wstring>();
+    auto& rhs_s = rhs.as<std::wstring>();
+    // Посимвольное сравнение без учёта регистра: строки разной длины не равны.
+    return lhs_s.size() == rhs_s.size() && ed::iequals(lhs_s, rhs_s);
   }
   return lhs == rhs;
 }
 
 
 operand engine::exec(ast::not_equal, const cell_value& lhs, const cell_value& rhs) const {
+  if (lhs.is<shared_string>() && rhs.is<shared_string>()) {
+    return !iequals(lhs.as<shared_string>(), rhs.as<shared_string>());
+  }
   if (lhs.is<std::wstring>() && rhs.is<std::wstring>()) {
-    return !ed::iequals(lhs.as<std::wstring>(), rhs.as<std::wstring>());
+    auto& lhs_s = lhs.as<std::wstring>();
+    auto& rhs_s = rhs.as<std::wstring>();
+    return lhs_s.size() != rhs_s.size() || !ed::iequals(lhs_s, rhs_s);
   }
   return lhs != rhs;
 }
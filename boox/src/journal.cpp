@@ -0,0 +1,812 @@
+#include <lde/cellfy/boox/journal.h>
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <ios>
+#include <iterator>
+#include <limits>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#ifdef _WIN32
+#  ifndef NOMINMAX
+#    define NOMINMAX
+#  endif
+#  ifndef WIN32_LEAN_AND_MEAN
+#    define WIN32_LEAN_AND_MEAN
+#  endif
+#  include <windows.h>
+#else
+#  include <fcntl.h>
+#  include <unistd.h>
+#endif
+
+#include <ed/core/assert.h>
+
+#include <lde/cellfy/boox/cell_addr.h>
+#include <lde/cellfy/boox/exception.h>
+#include <lde/cellfy/boox/node.h>
+#include <lde/cellfy/boox/scoped_transaction.h>
+#include <lde/cellfy/boox/snapshot.h>
+#include <lde/cellfy/boox/worksheet.h>
+#include <lde/cellfy/boox/src/blob.h>
+
+
+namespace lde::cellfy::boox {
+
+namespace _ {
+namespace {
+
+
+constexpr char          magic[8]      = {'C', 'E', 'L', 'L', 'F', 'Y', 'S', 'J'};
+constexpr std::uint32_t version       = 1;
+constexpr std::size_t   head_size     = 16;
+constexpr std::size_t   frame_size    = 8;
+constexpr std::uint32_t no_id         = ~std::uint32_t(0);
+
+/// Части ячейки, которые есть в записи.
+constexpr std::uint8_t part_data    = 1;
+constexpr std::uint8_t part_formula = 2;
+
+
+using row_intervals = std::vector<std::pair<row_index, row_index>>;
+
+
+/// FNV-1a, по нему при открытии отличается запись, недописанная при сбое.
+std::uint32_t checksum(std::string_view data) noexcept {
+  std::uint32_t hash = 2166136261u;
+  for (auto c : data) {
+    hash = (hash ^ static_cast<unsigned char>(c)) * 16777619u;
+  }
+  return hash;
+}
+
+
+/// Дождаться, пока данные файла дойдут до диска. Поток сбрасывает их только в кэш системы,
+/// и после отключения питания в журнале остались бы записи, которых на диске нет.
+void sync_file(const std::filesystem::path& path) {
+#ifdef _WIN32
+  const HANDLE file = ::CreateFileW(path.c_str(), GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+                                    nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+  const bool synced = file != INVALID_HANDLE_VALUE && ::FlushFileBuffers(file);
+  if (file != INVALID_HANDLE_VALUE) {
+    ::CloseHandle(file);
+  }
+#else
+  const int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+#  ifdef __APPLE__
+  const bool synced = fd >= 0 && ::fcntl(fd, F_FULLFSYNC) != -1;
+#  else
+  const bool synced = fd >= 0 && ::fdatasync(fd) == 0;
+#  endif
+  if (fd >= 0) {
+    ::close(fd);
+  }
+#endif
+  if (!synced) {
+    ED_THROW_EXCEPTION(std::ios_base::failure("journal sync failed"));
+  }
+}
+
+
+/// Дождаться записи каталога, в котором лежит path: созданный или переименованный файл без этого может пропасть после сбоя.
+/// В Windows каталог не синхронизируется, переименование само пишется сквозь кэш (replace_file).
+void sync_directory(const std::filesystem::path& path) {
+#ifndef _WIN32
+  const auto dir = path.has_parent_path() ? path.parent_path() : std::filesystem::path(".");
+  const int fd = ::open(dir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  const bool synced = fd >= 0 && ::fsync(fd) == 0;
+  if (fd >= 0) {
+    ::close(fd);
+  }
+  if (!synced) {
+    ED_THROW_EXCEPTION(std::ios_base::failure("journal sync failed"));
+  }
+#else
+  (void)path;
+#endif
+}
+
+
+/// Заменить файл to файлом from. Старый или новый файл остаётся целым при сбое в любой момент.
+void replace_file(const std::filesystem::path& from, const std::filesystem::path& to) {
+#ifdef _WIN32
+  if (!::MoveFileExW(from.c_str(), to.c_str(), MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH)) {
+    ED_THROW_EXCEPTION(std::ios_base::failure("journal compaction failed"));
+  }
+#else
+  std::filesystem::rename(from, to);
+  sync_directory(to);
+#endif
+}
+
+
+std::string head(std::uint32_t generation) {
+  blob::writer out;
+  out.raw(std::string_view(magic, sizeof(magic)));
+  out.pod(version);
+  out.pod(generation);
+  return out.data();
+}
+
+
+/// Отсортировать и слить пересекающиеся и соседние интервалы.
+void normalize(row_intervals& rows) {
+  std::sort(rows.begin(), rows.end());
+  auto last = rows.begin();
+  for (auto i = rows.begin(); i != rows.end(); ++i) {
+    if (last != i && i->first <= last->second + 1) {
+      last->second = std::max(last->second, i->second);
+    } else if (last != i) {
+      *++last = *i;
+    }
+  }
+  if (!rows.empty()) {
+    rows.erase(std::next(last), rows.end());
+  }
+}
+
+
+/// Первая строка листа с индексом не меньше index.
+template<typename Rows>
+auto first_row(const Rows& rows, row_index index) {
+  row_node n;
+  n.index = index;
+  return std::lower_bound(rows.begin(), rows.end(), n);
+}
+
+
+/// Запись журнала: новые форматы, удалённые листы и состояние изменённых листов.
+///
+/// Лист пишется заголовком, столбцами и областями форматов целиком, строки - интервалами:
+/// интервал заменяет при чтении все строки в своих границах. Если изменился только заголовок, интервалов нет.
+/// На форматы узлы ссылаются номерами журнала.
+class record_writer final {
+public:
+  /// Номер формата в журнале и признак того, что номер новый и формат надо записать.
+  using format_lookup = std::function<std::pair<std::uint32_t, bool>(node_key_type)>;
+
+  record_writer(const forest_t& forest, format_lookup lookup) noexcept
+    : forest_(forest)
+    , lookup_(std::move(lookup)) {
+  }
+
+  void erase_sheet(std::uint32_t id) {
+    erased_.pod(id);
+    ++erased_count_;
+  }
+
+  void sheet(worksheet_node::it sheet, std::uint32_t id, std::uint32_t position, const row_intervals& intervals) {
+    sheets_.pod(id);
+    sheets_.pod(position);
+    node(sheets_, *sheet);
+
+    auto columns = forest_.get<column_node>(sheet);
+    sheets_.pod(static_cast<std::uint32_t>(columns.size()));
+    for (auto& column : columns) {
+      node(sheets_, column);
+    }
+
+    auto runs = forest_.get<format_run_node>(sheet);
+    sheets_.pod(static_cast<std::uint32_t>(runs.size()));
+    for (auto& run : runs) {
+      node(sheets_, run);
+    }
+
+    auto rows = forest_.get<row_node>(sheet);
+    sheets_.pod(static_cast<std::uint32_t>(intervals.size()));
+    for (auto [first, last] : intervals) {
+      blob::writer interval;
+      std::uint32_t count = 0;
+      for (auto row = first_row(rows, first); row != rows.end() && row->index <= last; ++row, ++count) {
+        write_row(interval, row);
+      }
+      sheets_.pod(first);
+      sheets_.pod(last);
+      sheets_.pod(count);
+      sheets_.raw(interval.data());
+    }
+    ++sheets_count_;
+  }
+
+  bool empty() const noexcept {
+    return erased_count_ == 0 && sheets_count_ == 0;
+  }
+
+  std::string finish() {
+    blob::writer out;
+    out.pod(formats_count_);
+    out.raw(formats_.data());
+    out.pod(erased_count_);
+    out.raw(erased_.data());
+    out.pod(sheets_count_);
+    out.raw(sheets_.data());
+    return out.data();
+  }
+
+private:
+  void write_row(blob::writer& out, row_node::it row) {
+    node(out, *row);
+
+    auto cells = forest_.get<cell_node>(row);
+    out.pod(static_cast<std::uint32_t>(cells.size()));
+    for (auto cell = cells.begin(); cell != cells.end(); ++cell) {
+      node(out, *cell);
+
+      auto data = forest_.get<cell_data_node>(cell);
+      auto formulas = forest_.get<cell_formula_node>(cell);
+      out.pod(static_cast<std::uint8_t>((data.empty() ? 0 : part_data) | (formulas.empty() ? 0 : part_formula)));
+      if (!data.empty()) {
+        out.bytes(blob::pack(data.front()));
+      }
+      if (!formulas.empty()) {
+        out.bytes(blob::pack(formulas.front()));
+      }
+
+      auto runs = forest_.get<text_run_node>(cell);
+      out.pod(static_cast<std::uint32_t>(runs.size()));
+      for (auto& run : runs) {
+        out.bytes(blob::pack(run));
+      }
+    }
+  }
+
+  template<typename Node>
+  void node(blob::writer& out, const Node& n) {
+    out.bytes(blob::pack(n));
+    out.pod(format(n.format_key));
+  }
+
+  std::uint32_t format(const std::optional<node_key_type>& key) {
+    if (!key) {
+      return no_id;
+    }
+
+    auto [id, added] = lookup_(*key);
+    if (added) {
+      formats_.pod(id);
+      formats_.bytes(blob::pack(*forest_.find<cell_format_node>(*key)));
+      ++formats_count_;
+    }
+    return id;
+  }
+
+private:
+  const forest_t& forest_;
+  format_lookup   lookup_;
+  blob::writer    formats_;
+  blob::writer    erased_;
+  blob::writer    sheets_;
+  std::uint32_t   formats_count_ = 0;
+  std::uint32_t   erased_count_  = 0;
+  std::uint32_t   sheets_count_  = 0;
+};
+
+
+/// Применение записей журнала к лесу книги. Номера листов и форматов в начале - их порядок в книге.
+class replayer final {
+public:
+  using sheet_ids = std::unordered_map<std::uint32_t, worksheet_node::it>;
+
+  replayer(forest_t& forest, workbook_node::it book)
+    : forest_(forest)
+    , book_(book) {
+
+    auto formats = forest_.get<cell_format_node>(book_);
+    for (auto node = formats.begin(); node != formats.end(); ++node) {
+      formats_.push_back(forest_t::key_of(node));
+      by_format_.emplace(*node->format, forest_t::key_of(node));
+    }
+
+    auto sheets = forest_.get<worksheet_node>(book_);
+    for (auto sheet = sheets.begin(); sheet != sheets.end(); ++sheet) {
+      sheets_.emplace(next_sheet_id_++, sheet);
+    }
+  }
+
+  replayer(const replayer&) = delete;
+  replayer& operator=(const replayer&) = delete;
+
+  void operator()(std::string_view record) {
+    blob::reader in(record);
+
+    for (auto count = in.pod<std::uint32_t>(); count > 0; --count) {
+      const auto id = in.pod<std::uint32_t>();
+      cell_format_node n;
+      blob::unpack(in.bytes(), n);
+      if (!n.format) {
+        ED_THROW_EXCEPTION(file_is_broken());
+      }
+      // Номера новых форматов идут подряд.
+      if (id != formats_.size()) {
+        ED_THROW_EXCEPTION(file_is_broken());
+      }
+      formats_.push_back(ensure_format(std::move(n)));
+    }
+
+    for (auto count = in.pod<std::uint32_t>(); count > 0; --count) {
+      if (auto i = sheets_.find(in.pod<std::uint32_t>()); i != sheets_.end()) {
+        forest_.erase(i->second);
+        sheets_.erase(i);
+      }
+    }
+
+    for (auto count = in.pod<std::uint32_t>(); count > 0; --count) {
+      sheet(in);
+    }
+
+    if (!in.at_end()) {
+      ED_THROW_EXCEPTION(file_is_broken());
+    }
+  }
+
+  const std::vector<std::optional<node_key_type>>& formats() const noexcept {
+    return formats_;
+  }
+
+  const sheet_ids& sheets() const noexcept {
+    return sheets_;
+  }
+
+  std::uint32_t next_sheet_id() const noexcept {
+    return next_sheet_id_;
+  }
+
+private:
+  node_key_type ensure_format(cell_format_node&& n) {
+    if (auto i = by_format_.find(*n.format); i != by_format_.end()) {
+      return i->second;
+    }
+    const auto key = forest_t::key_of(forest_.push_back(book_, std::move(n)));
+    by_format_.emplace(*forest_.find<cell_format_node>(key)->format, key);
+    return key;
+  }
+
+  void sheet(blob::reader& in) {
+    const auto id = in.pod<std::uint32_t>();
+    const auto position = in.pod<std::uint32_t>();
+    auto n = node<worksheet_node>(in);
+
+    worksheet_node::it sheet;
+    if (auto i = sheets_.find(id); i != sheets_.end()) {
+      sheet = i->second;
+      // Содержимое листа заменяется поверх прочитанного, нетронутые записями листы остаются в снимке.
+      if (sheet->deferred) {
+        sheet->deferred->load(forest_, sheet);
+      }
+      if (sheet->name != n.name || sheet->hidden != n.hidden || sheet->tab_color != n.tab_color || sheet->format_key != n.format_key) {
+        worksheet_node m = *sheet;
+        m.name = std::move(n.name);
+        m.hidden = n.hidden;
+        m.tab_color = n.tab_color;
+        m.format_key = n.format_key;
+        forest_.modify(sheet) = std::move(m);
+      }
+    } else {
+      auto sheets = forest_.get<worksheet_node>(book_);
+      auto pos = sheets.begin();
+      std::advance(pos, std::min<std::size_t>(position, sheets.size()));
+      sheet = forest_.insert(book_, pos, std::move(n));
+      sheets_.emplace(id, sheet);
+      next_sheet_id_ = std::max(next_sheet_id_, id + 1);
+    }
+
+    replace_all<column_node>(in, sheet);
+    replace_all<format_run_node>(in, sheet);
+
+    for (auto count = in.pod<std::uint32_t>(); count > 0; --count) {
+      const auto first = in.pod<row_index>();
+      const auto last = in.pod<row_index>();
+      if (first > last) {
+        ED_THROW_EXCEPTION(file_is_broken());
+      }
+
+      auto rows = forest_.get<row_node>(sheet);
+      auto begin = first_row(rows, first);
+      auto end = begin;
+      while (end != rows.end() && end->index <= last) {
+        ++end;
+      }
+      forest_.erase(begin, end);
+
+      for (auto rows_count = in.pod<std::uint32_t>(); rows_count > 0; --rows_count) {
+        row(in, sheet);
+      }
+    }
+  }
+
+  void row(blob::reader& in, worksheet_node::it sheet) {
+    auto row = forest_.push_back(sheet, node<row_node>(in));
+
+    for (auto count = in.pod<std::uint32_t>(); count > 0; --count) {
+      auto cell = forest_.push_back(row, node<cell_node>(in));
+
+      const auto parts = in.pod<std::uint8_t>();
+      if (parts & part_data) {
+        cell_data_node child;
+        blob::unpack(in.bytes(), child);
+        forest_.push_back(cell, std::move(child));
+      }
+      if (parts & part_formula) {
+        cell_formula_node child;
+        blob::unpack(in.bytes(), child);
+        forest_.push_back(cell, std::move(child));
+      }
+
+      for (auto runs = in.pod<std::uint32_t>(); runs > 0; --runs) {
+        text_run_node run;
+        blob::unpack(in.bytes(), run);
+        forest_.push_back(cell, std::move(run));
+      }
+    }
+  }
+
+  /// Заменить все дочерние узлы типа Node на записанные.
+  template<typename Node, typename Parent>
+  void replace_all(blob::reader& in, Parent parent) {
+    auto children = forest_.get<Node>(parent);
+    forest_.erase(children.begin(), children.end());
+    for (auto count = in.pod<std::uint32_t>(); count > 0; --count) {
+      forest_.push_back(parent, node<Node>(in));
+    }
+  }
+
+  /// Узел с номером формата журнала, заменённым на ключ формата в лесу.
+  template<typename Node>
+  Node node(blob::reader& in) const {
+    Node n;
+    blob::unpack(in.bytes(), n);
+    const auto id = in.pod<std::uint32_t>();
+    if (id == no_id) {
+      n.format_key.reset();
+    } else if (id < formats_.size() && formats_[id]) {
+      n.format_key = formats_[id];
+    } else {
+      ED_THROW_EXCEPTION(file_is_broken());
+    }
+    return n;
+  }
+
+private:
+  using keys_by_format = std::unordered_map<cell_format, node_key_type, boost::hash<cell_format>>;
+
+  forest_t&                                  forest_;
+  workbook_node::it                          book_;
+  std::vector<std::optional<node_key_type>> formats_;
+  keys_by_format                             by_format_;
+  sheet_ids                                  sheets_;
+  std::uint32_t                              next_sheet_id_ = 0;
+};
+
+}} // namespace _
+
+
+journal::journal(workbook& book, std::filesystem::path path)
+  : book_(book)
+  , path_(std::move(path))
+  , journal_path_(path_) {
+
+  journal_path_ += ".journal";
+
+  book_conns_.emplace_back(book_.changes_finished += [this](forest::changes_cause) {
+    if (out_.is_open()) {
+      append();
+    }
+  });
+
+  book_conns_.emplace_back(book_.sheet_inserted += [this](worksheet& sheet) {
+    if (!out_.is_open()) {
+      return;
+    }
+    auto& changes = sheets_[&sheet];
+    changes.id = next_sheet_id_++;
+    changes.rows = {{0, cell_addr::max_row_count - 1}};
+    watch(sheet);
+  });
+
+  book_conns_.emplace_back(book_.sheet_removed += [this](worksheet& sheet) {
+    sheet_conns_.erase(&sheet);
+    if (auto i = sheets_.find(&sheet); i != sheets_.end()) {
+      erased_sheets_.push_back(i->second.id);
+      sheets_.erase(i);
+    }
+  });
+
+  // Перемещение листа записью не выражается, журнал сворачивается в снимок.
+  book_conns_.emplace_back(book_.sheet_shifted += [this](worksheet&) {
+    needs_compaction_ = out_.is_open();
+  });
+
+  book_conns_.emplace_back(book_.about_to_close += [this] {
+    close();
+  });
+}
+
+
+journal::~journal() {
+  close();
+}
+
+
+void journal::open() {
+  close();
+
+  snapshot_size_ = std::filesystem::file_size(path_);
+
+  std::ifstream is(path_, std::ios::binary);
+  std::string snapshot_head(_::head_size, '\0');
+  is.read(snapshot_head.data(), static_cast<std::streamsize>(snapshot_head.size()));
+  const auto generation = snapshot_generation(std::string_view(snapshot_head).substr(0, static_cast<std::size_t>(is.gcount())));
+  is.seekg(0);
+
+  std::string records;
+  if (std::ifstream in(journal_path_, std::ios::binary); in) {
+    records.assign(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+  }
+  // Журнала нет или он от другого снимка.
+  const bool has_records = records.size() >= _::head_size && records.compare(0, _::head_size, _::head(generation)) == 0;
+
+  std::size_t size = _::head_size;
+  sheet_nodes sheets;
+  bool replayed = has_records;
+  try {
+    book_.open(ed::mime_type::known::application_x_cellfy, is, [&](forest_t& forest) {
+      if (has_records) {
+        size += replay(std::string_view(records).substr(_::head_size), forest, sheets);
+      }
+    });
+  } catch (const file_is_broken&) {
+    if (!has_records) {
+      throw;
+    }
+    // Запись с верной суммой не применяется: документ открывается снимком, а журнал откладывается
+    // в path + ".journal.broken", чтобы правки из него не пропали бесследно.
+    is.clear();
+    is.seekg(0);
+    book_.open(ed::mime_type::known::application_x_cellfy, is);
+    auto broken_path = journal_path_;
+    broken_path += ".broken";
+    std::filesystem::copy_file(journal_path_, broken_path, std::filesystem::copy_options::overwrite_existing);
+    sheets.clear();
+    replayed = false;
+  }
+  generation_ = generation;
+
+  if (!replayed) {
+    reset();
+    start();
+    return;
+  }
+
+  std::filesystem::resize_file(journal_path_, size);
+  _::sync_file(journal_path_);
+
+  out_.open(journal_path_, std::ios::binary | std::ios::app);
+  size_ = size;
+  for (auto& [id, node] : sheets) {
+    sheets_[node->sheet].id = id;
+    watch(*node->sheet);
+  }
+}
+
+
+void journal::compact() {
+  const auto generation = generation_ + 1;
+
+  auto tmp_path = path_;
+  tmp_path += ".tmp";
+  {
+    std::ofstream os(tmp_path, std::ios::binary | std::ios::trunc);
+    os.exceptions(std::ios::failbit | std::ios::badbit);
+    book_.load_sheets();
+    write_snapshot(os, book_.forest(), generation);
+  }
+  // Снимок должен лечь на диск раньше, чем его имя и новый пустой журнал.
+  _::sync_file(tmp_path);
+  _::replace_file(tmp_path, path_);
+
+  generation_ = generation;
+  snapshot_size_ = std::filesystem::file_size(path_);
+  needs_compaction_ = false;
+
+  reset();
+  start();
+}
+
+
+void journal::flush() {
+  if (!out_.is_open()) {
+    return;
+  }
+
+  out_.flush();
+  if (!out_) {
+    ED_THROW_EXCEPTION(std::ios_base::failure("journal write failed"));
+  }
+  _::sync_file(journal_path_);
+
+  if (size_ > std::max(snapshot_size_, min_compact_size)) {
+    compact();
+  }
+}
+
+
+std::uint64_t journal::size() const noexcept {
+  return size_;
+}
+
+
+void journal::reset() {
+  sheet_conns_.clear();
+  sheets_.clear();
+  erased_sheets_.clear();
+  formats_.clear();
+
+  const auto& forest = book_.forest();
+  auto formats = forest.get<cell_format_node>(book_.node());
+  next_format_id_ = 0;
+  for (auto node = formats.begin(); node != formats.end(); ++node) {
+    formats_[forest_t::key_of(node)] = {next_format_id_++, node->format};
+  }
+
+  next_sheet_id_ = 0;
+  for (auto& sheet : book_.sheets()) {
+    sheets_[&sheet].id = next_sheet_id_++;
+    watch(sheet);
+  }
+}
+
+
+void journal::watch(worksheet& sheet) {
+  // Не changed: там столбец целиком поглощает изменённые в нём ячейки, а результаты формул меняются и вне транзакций.
+  auto& conns = sheet_conns_[&sheet];
+  conns.clear();
+  conns.emplace_back(sheet.rows_changed += [this, &sheet](const std::vector<row_index>& changed) {
+    auto& rows = sheets_[&sheet].rows;
+    for (auto row : changed) {
+      rows.emplace_back(row, row);
+    }
+  });
+  conns.emplace_back(sheet.properties_changed += [this, &sheet] {
+    sheets_[&sheet].properties = true;
+  });
+}
+
+
+void journal::close() noexcept {
+  out_.close();
+  size_ = 0;
+  sheet_conns_.clear();
+  sheets_.clear();
+  erased_sheets_.clear();
+  formats_.clear();
+  needs_compaction_ = false;
+}
+
+
+void journal::start() {
+  out_.close();
+  out_.open(journal_path_, std::ios::binary | std::ios::trunc);
+  out_.exceptions(std::ios::failbit | std::ios::badbit);
+  out_ << _::head(generation_);
+  out_.flush();
+  out_.exceptions(std::ios::goodbit);
+  _::sync_file(journal_path_);
+  _::sync_directory(journal_path_);
+  size_ = _::head_size;
+}
+
+
+void journal::append() {
+  if (needs_compaction_) {
+    compact();
+    return;
+  }
+
+  const auto& forest = book_.forest();
+  _::record_writer record(forest, [&](node_key_type key) {
+    const auto& format = forest.find<cell_format_node>(key)->format;
+    auto& known = formats_[key];
+    if (known.format.lock() == format) {
+      return std::pair(known.id, false);
+    }
+    known = {next_format_id_++, format};
+    return std::pair(known.id, true);
+  });
+
+  for (auto id : erased_sheets_) {
+    record.erase_sheet(id);
+  }
+  erased_sheets_.clear();
+
+  std::uint32_t position = 0;
+  for (auto& sheet : book_.sheets()) {
+    // Без изменённых строк пишется только заголовок листа.
+    if (auto i = sheets_.find(&sheet); i != sheets_.end() && (!i->second.rows.empty() || i->second.properties)) {
+      _::normalize(i->second.rows);
+      record.sheet(sheet.node(), i->second.id, position, i->second.rows);
+      i->second.rows.clear();
+      i->second.properties = false;
+    }
+    ++position;
+  }
+
+  if (record.empty()) {
+    return;
+  }
+
+  const auto payload = record.finish();
+  ED_EXPECTS(payload.size() <= std::numeric_limits<std::uint32_t>::max());
+
+  blob::writer frame;
+  frame.pod(static_cast<std::uint32_t>(payload.size()));
+  frame.pod(_::checksum(payload));
+  out_.write(frame.data().data(), static_cast<std::streamsize>(frame.size()));
+  out_.write(payload.data(), static_cast<std::streamsize>(payload.size()));
+  size_ += frame.size() + payload.size();
+}
+
+
+std::size_t journal::replay(std::string_view records, forest_t& forest, sheet_nodes& sheets) {
+  ED_EXPECTS(!forest.get<workbook_node>().empty());
+  const auto book = forest.get<workbook_node>().begin();
+  _::replayer apply(forest, book);
+
+  std::vector<std::string_view> valid;
+  blob::reader in(records);
+  std::size_t size = 0;
+  while (records.size() - size >= _::frame_size) {
+    const auto payload_size = in.pod<std::uint32_t>();
+    const auto sum = in.pod<std::uint32_t>();
+    if (payload_size > records.size() - in.position()) {
+      break;
+    }
+    const auto payload = in.take(payload_size);
+    if (_::checksum(payload) != sum) {
+      break;
+    }
+    valid.push_back(payload);
+    size = in.position();
+  }
+
+  if (!valid.empty()) {
+    // Листов книги ещё нет, поэтому транзакция леса: отложенные листы читаются, только если запись их затрагивает.
+    scoped_transaction tr(forest);
+    for (auto record : valid) {
+      apply(record);
+    }
+    tr.commit();
+  }
+
+  // Формат мог удалиться вместе с последней ячейкой, которая на него ссылалась.
+  std::unordered_map<node_key_type, std::uint32_t, boost::hash<node_key_type>> ids;
+  const auto& keys = apply.formats();
+  for (std::uint32_t id = 0; id < keys.size(); ++id) {
+    if (keys[id]) {
+      ids[*keys[id]] = id;
+    }
+  }
+
+  formats_.clear();
+  auto formats = forest.get<cell_format_node>(book);
+  for (auto node = formats.begin(); node != formats.end(); ++node) {
+    if (auto i = ids.find(forest_t::key_of(node)); i != ids.end()) {
+      formats_[i->first] = {i->second, node->format};
+    }
+  }
+  next_format_id_ = static_cast<std::uint32_t>(keys.size());
+
+  sheets.assign(apply.sheets().begin(), apply.sheets().end());
+  next_sheet_id_ = apply.next_sheet_id();
+
+  return size;
+}
+
+
+} // namespace lde::cellfy::boox
@@ -0,0 +1,69 @@
+#include <lde/cellfy/boox/src/layout_cache.h>
+
+#include <ed/core/assert.h>
+
+
+namespace lde::cellfy::boox {
+
+
+layout_cache::layout_cache(std::size_t capacity) noexcept
+  : capacity_(capacity) {
+  ED_EXPECTS(capacity_ > 0);
+}
+
+
+void layout_cache::touch(const cell_node& node) {
+  if (auto i = index_.find(&node); i != index_.end()) {
+    lru_.splice(lru_.begin(), lru_, i->second);
+    return;
+  }
+
+  lru_.push_front(&node);
+  index_.emplace(&node, lru_.begin());
+  shrink();
+}
+
+
+void layout_cache::attached(const cell_node& node) {
+  ++revision_;
+  touch(node);
+}
+
+
+void layout_cache::erase(const cell_node& node) noexcept {
+  if (auto i = index_.find(&node); i != index_.end()) {
+    lru_.erase(i->second);
+    index_.erase(i);
+    ++revision_;
+  }
+}
+
+
+std::size_t layout_cache::size() const noexcept {
+  return lru_.size();
+}
+
+
+std::size_t layout_cache::capacity() const noexcept {
+  return capacity_;
+}
+
+
+std::uint64_t layout_cache::revision() const noexcept {
+  return revision_;
+}
+
+
+void layout_cache::shrink() noexcept {
+  while (lru_.size() > capacity_) {
+    const cell_node* node = lru_.back();
+    node->layout = nullptr;
+    node->is_layout_dirty = true;
+    index_.erase(node);
+    lru_.pop_back();
+    ++revision_;
+  }
+}
+
+
+} // namespace lde::cellfy::boox
@@ -0,0 +1,56 @@
+#pragma once
+
+
+#include <cstddef>
+#include <cstdint>
+#include <list>
+#include <unordered_map>
+
+#include <lde/cellfy/boox/node.h>
+
+
+namespace lde::cellfy::boox {
+
+
+/// Ограниченный по размеру LRU-список ячеек листа, у которых посчитан layout.
+/// При переполнении у самых давно использованных ячеек layout освобождается и помечается устаревшим,
+/// при следующем обращении он будет посчитан заново.
+class layout_cache final {
+public:
+  static constexpr std::size_t default_capacity = 65536;
+
+public:
+  explicit layout_cache(std::size_t capacity = default_capacity) noexcept;
+
+  layout_cache(const layout_cache&) = delete;
+  layout_cache& operator=(const layout_cache&) = delete;
+
+  /// Отметить использование layout ячейки.
+  void touch(const cell_node& node);
+
+  /// У ячейки посчитан новый layout.
+  void attached(const cell_node& node);
+
+  /// Ячейка удалена или у неё больше нет layout.
+  void erase(const cell_node& node) noexcept;
+
+  std::size_t size() const noexcept;
+  std::size_t capacity() const noexcept;
+
+  /// Растёт при каждом новом, удалённом или вытесненном layout.
+  std::uint64_t revision() const noexcept;
+
+private:
+  using lru_list = std::list<const cell_node*>;
+
+  void shrink() noexcept;
+
+private:
+  std::size_t                                              capacity_;
+  std::uint64_t                                            revision_ = 0;
+  lru_list                                                 lru_;
+  std::unordered_map<const cell_node*, lru_list::iterator> index_;
+};
+
+
+} // namespace lde::cellfy::boox
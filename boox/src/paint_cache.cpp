@@ -0,0 +1,126 @@
+#include <lde/cellfy/boox/src/paint_cache.h>
+
+#include <algorithm>
+#include <tuple>
+
+
+namespace lde::cellfy::boox {
+
+
+bool paint_cache::tile_key::operator<(const tile_key& rhs) const noexcept {
+  return std::tie(origin, zoom) < std::tie(rhs.origin, rhs.zoom);
+}
+
+
+area paint_cache::tile_area(cell_addr addr) noexcept {
+  const column_index left = addr.column() / tile_columns * tile_columns;
+  const row_index top = addr.row() / tile_rows * tile_rows;
+  return area(
+    {left, top},
+    {std::min<column_index>(left + tile_columns, cell_addr::max_column_count) - 1,
+     std::min<row_index>(top + tile_rows, cell_addr::max_row_count) - 1});
+}
+
+
+const paint_cache::tile* paint_cache::find(cell_addr origin, double zoom) noexcept {
+  auto i = tiles_.find(tile_key{origin.index(), zoom});
+  if (i == tiles_.end() || i->second.generation != generation_) {
+    return nullptr;
+  }
+
+  for (auto& info : i->second.data.model) {
+    if (info.node && info.node.value()->layout.get() != info.layout) {
+      return nullptr;
+    }
+  }
+
+  i->second.used = ++clock_;
+  return &i->second.data;
+}
+
+
+paint_cache::tile& paint_cache::reset(cell_addr origin, double zoom) {
+  auto& entry = tiles_[tile_key{origin.index(), zoom}];
+  const auto ar = tile_area(origin);
+  entry.data.model.clear();
+  entry.data.model.resize(ar.rows_count(), ar.columns_count());
+  entry.data.reach = ar;
+  entry.generation = generation_;
+  entry.used = ++clock_;
+
+  auto& result = entry.data;
+  shrink();
+  return result;
+}
+
+
+const paint_cache::matrix* paint_cache::find_view(const area& ar, double zoom, std::uint64_t layouts_revision) const noexcept {
+  if (view_key_ &&
+      view_key_->ar == ar &&
+      view_key_->zoom == zoom &&
+      view_key_->layouts_revision == layouts_revision &&
+      view_key_->tiles_revision == tiles_revision_) {
+    return &view_;
+  }
+  return nullptr;
+}
+
+
+paint_cache::matrix& paint_cache::reset_view(const area& ar, double zoom, std::uint64_t layouts_revision) {
+  view_key_.reset();
+  view_.clear();
+  view_.resize(ar.rows_count(), ar.columns_count());
+  view_key_ = view_key{ar, zoom, layouts_revision, tiles_revision_};
+  return view_;
+}
+
+
+void paint_cache::erase(const range& rng) {
+  if (rng.empty()) {
+    return;
+  }
+
+  rng.for_each_area([this](const range& r) {
+    erase(area(r.addr(), r.bottom_right().addr()));
+  });
+}
+
+
+void paint_cache::clear() noexcept {
+  ++generation_;
+  ++tiles_revision_;
+  view_key_.reset();
+}
+
+
+void paint_cache::erase(const area& ar) noexcept {
+  // Плитки собранной области могли быть вытеснены, пока она собиралась.
+  if (view_key_ && view_key_->ar.intersects(ar)) {
+    view_key_.reset();
+  }
+
+  for (auto i = tiles_.begin(); i != tiles_.end();) {
+    if (i->second.data.reach.intersects(ar)) {
+      i = tiles_.erase(i);
+      ++tiles_revision_;
+    } else {
+      ++i;
+    }
+  }
+}
+
+
+void paint_cache::shrink() {
+  // Сначала уходят плитки прошлых поколений, затем давно не использованные.
+  // Плитка, построенная последней, используется самой последней и остаётся.
+  while (tiles_.size() > max_tiles) {
+    auto victim = std::min_element(tiles_.begin(), tiles_.end(), [this](const auto& lhs, const auto& rhs) {
+      return std::make_pair(lhs.second.generation == generation_, lhs.second.used) <
+             std::make_pair(rhs.second.generation == generation_, rhs.second.used);
+    });
+    tiles_.erase(victim);
+  }
+}
+
+
+} // namespace lde::cellfy::boox
@@ -0,0 +1,136 @@
+#pragma once
+
+
+#include <cstddef>
+#include <cstdint>
+#include <map>
+#include <optional>
+
+#include <ed/core/rect.h>
+
+#include <ed/rasta/matrix.h>
+
+#include <lde/cellfy/boox/area.h>
+#include <lde/cellfy/boox/node.h>
+#include <lde/cellfy/boox/range.h>
+#include <lde/cellfy/boox/vector_2d.h>
+
+
+namespace lde::cellfy::boox {
+namespace _ {
+
+
+/// Всё, что нужно для отрисовки одной ячейки области.
+struct cell_info {
+  using matrix = vector_2d<cell_info>;
+
+  std::size_t                              matrix_row            = 0;
+  std::size_t                              matrix_col            = 0;
+  cell_node::opt_it                        node;
+  const cell_node*                         merged_with           = nullptr;
+  const cell_format*                       format                = nullptr; ///< Формат узла листа. Плитка сбрасывается при изменении формата любого узла в её области.
+  std::optional<cell_value_type>           formula_type; ///< Тип значения формулы. Если формула была посчитана.
+  const cell_info*                         left_non_overlapping  = nullptr;
+  const cell_info*                         right_non_overlapping = nullptr;
+  ed::rect_px<long long>                   rect;
+  ed::rect_px<long long>                   merged_rect;
+  ed::rect_px<long long>                   layout_rect;
+  const ed::rasta::text_layout*            layout                = nullptr; ///< Layout ячейки, по которому посчитан layout_rect.
+  bool                                     draw_top_border       = true;
+  bool                                     draw_bottom_border    = true;
+  bool                                     draw_left_border      = true;
+  bool                                     draw_right_border     = true;
+  bool                                     fill_sharp            = false;
+  std::optional<text_rotation::value_type> rotation; ///< Поворот текста вокруг rotation_origin.
+  ed::point_px<long long>                  rotation_origin;
+  ed::rasta::matrix                        rotate_matrix; ///< Строится при сборке области из плиток.
+};
+
+} // namespace _
+
+
+/// Модели отрисовки ячеек листа: форматы, прямоугольники, положение текста и видимость границ ячеек.
+/// Модели строятся плитками фиксированного размера в координатах от угла плитки, изменение листа сбрасывает
+/// только задетые плитки. Область рисования собирается из плиток, пока ни одна плитка и ни один layout не менялись,
+/// range::paint() только выдаёт команды рисования по готовой модели области.
+class paint_cache final {
+public:
+  using matrix = _::cell_info::matrix;
+
+  static constexpr row_index    tile_rows    = 32;
+  static constexpr column_index tile_columns = 16;
+  static constexpr std::size_t  max_tiles    = 256;
+
+  /// Модели ячеек одной плитки.
+  struct tile final {
+    matrix model;
+    area   reach; ///< Ячейки, изменение которых меняет модель: сама плитка и задевающие её объединения.
+  };
+
+public:
+  paint_cache() = default;
+
+  paint_cache(const paint_cache&) = delete;
+  paint_cache& operator=(const paint_cache&) = delete;
+
+  /// Плитка, в которую попадает ячейка addr.
+  static area tile_area(cell_addr addr) noexcept;
+
+  /// Готовая плитка с левым верхним углом origin или nullptr.
+  /// Плитка устарела, если у её ячейки сменился layout: он перестраивается и без изменения листа.
+  const tile* find(cell_addr origin, double zoom) noexcept;
+
+  /// Пустая плитка с левым верхним углом origin для заполнения.
+  tile& reset(cell_addr origin, double zoom);
+
+  /// Готовая модель области ar или nullptr.
+  /// layouts_revision - layout_cache::revision() после актуализации layout видимых ячеек.
+  const matrix* find_view(const area& ar, double zoom, std::uint64_t layouts_revision) const noexcept;
+
+  /// Пустая модель области ar для сборки из плиток.
+  matrix& reset_view(const area& ar, double zoom, std::uint64_t layouts_revision);
+
+  /// Сбросить плитки, модели которых зависят от ячеек rng.
+  void erase(const range& rng);
+
+  /// Сбросить плитки, модели которых зависят от ячеек ar.
+  void erase(const area& ar) noexcept;
+
+  /// Сбросить все плитки.
+  void clear() noexcept;
+
+private:
+  struct tile_key final {
+    cell_index origin = 0;
+    double     zoom   = 1.;
+
+    bool operator<(const tile_key& rhs) const noexcept;
+  };
+
+  struct tile_entry final {
+    tile          data;
+    std::uint64_t generation = 0;
+    std::uint64_t used       = 0;
+  };
+
+  struct view_key final {
+    area          ar;
+    double        zoom             = 1.;
+    std::uint64_t layouts_revision = 0;
+    std::uint64_t tiles_revision   = 0;
+  };
+
+private:
+  void shrink();
+
+private:
+  std::map<tile_key, tile_entry> tiles_;
+  std::uint64_t                  generation_     = 0; ///< Плитки прошлых поколений сброшены clear().
+  std::uint64_t                  tiles_revision_ = 0; ///< Меняется при каждом сбросе плиток. Собранная область - копия, вытеснение плиток её не портит.
+  std::uint64_t                  clock_          = 0;
+  std::optional<view_key>        view_key_;
+  matrix                         view_;
+};
+
+
+} // namespace lde::cellfy::boox
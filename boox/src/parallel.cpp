@@ -0,0 +1,160 @@
+#include <lde/cellfy/boox/src/parallel.h>
+
+#include <algorithm>
+#include <atomic>
+#include <exception>
+#include <memory>
+
+
+namespace lde::cellfy::boox {
+namespace _ {
+namespace {
+
+
+/// Блоки одного вызова parallel_blocks. Задачи пула, запущенные после разбора всех блоков,
+/// сразу завершаются и fn не трогают, поэтому состояние живёт в shared_ptr, а fn - по ссылке.
+class block_group final {
+public:
+  block_group(const block_fn& fn, std::size_t count, std::size_t block) noexcept
+    : fn_(fn)
+    , count_(count)
+    , block_(block)
+    , blocks_((count + block - 1) / block) {
+  }
+
+  std::size_t blocks() const noexcept {
+    return blocks_;
+  }
+
+  /// Разбирать свободные блоки, пока они есть.
+  void run() noexcept {
+    for (auto i = next_.fetch_add(1); i < blocks_; i = next_.fetch_add(1)) {
+      std::exception_ptr error;
+      try {
+        const auto first = i * block_;
+        fn_(first, std::min(count_, first + block_));
+      } catch (...) {
+        error = std::current_exception();
+      }
+
+      std::lock_guard lock(mutex_);
+      if (error && !error_) {
+        error_ = error;
+      }
+      if (++done_ == blocks_) {
+        finished_.notify_all();
+      }
+    }
+  }
+
+  /// Дождаться завершения всех блоков и пробросить первое исключение.
+  void wait() {
+    std::unique_lock lock(mutex_);
+    finished_.wait(lock, [this] {
+      return done_ == blocks_;
+    });
+    if (error_) {
+      std::rethrow_exception(error_);
+    }
+  }
+
+private:
+  const block_fn&          fn_;
+  const std::size_t        count_;
+  const std::size_t        block_;
+  const std::size_t        blocks_;
+  std::atomic<std::size_t> next_ = 0;
+  std::mutex               mutex_;
+  std::condition_variable  finished_;
+  std::size_t              done_ = 0;
+  std::exception_ptr       error_;
+};
+
+} // namespace
+
+
+worker_pool& worker_pool::instance() {
+  static worker_pool pool;
+  return pool;
+}
+
+
+worker_pool::worker_pool() {
+  const std::size_t threads = std::max(1u, std::thread::hardware_concurrency());
+  threads_.reserve(threads - 1);
+  for (std::size_t i = 1; i < threads; ++i) {
+    threads_.emplace_back([this] {
+      run();
+    });
+  }
+}
+
+
+worker_pool::~worker_pool() {
+  {
+    std::lock_guard lock(mutex_);
+    stop_ = true;
+  }
+  ready_.notify_all();
+  for (auto& t : threads_) {
+    t.join();
+  }
+}
+
+
+std::size_t worker_pool::size() const noexcept {
+  return threads_.size();
+}
+
+
+void worker_pool::post(std::function<void()> task) {
+  {
+    std::lock_guard lock(mutex_);
+    tasks_.push_back(std::move(task));
+  }
+  ready_.notify_one();
+}
+
+
+void worker_pool::run() {
+  for (;;) {
+    std::function<void()> task;
+    {
+      std::unique_lock lock(mutex_);
+      ready_.wait(lock, [this] {
+        return stop_ || !tasks_.empty();
+      });
+      if (tasks_.empty()) {
+        return;
+      }
+      task = std::move(tasks_.front());
+      tasks_.pop_front();
+    }
+    task();
+  }
+}
+
+
+void parallel_blocks(std::size_t count, std::size_t min_block, const block_fn& fn) {
+  auto& pool = worker_pool::instance();
+  const std::size_t blocks = std::min(pool.size() + 1, count / std::max<std::size_t>(min_block, 1));
+
+  if (blocks <= 1) {
+    fn(std::size_t(0), count);
+    return;
+  }
+
+  auto group = std::make_shared<block_group>(fn, count, (count + blocks - 1) / blocks);
+  for (std::size_t i = 1; i < group->blocks(); ++i) {
+    pool.post([group] {
+      group->run();
+    });
+  }
+
+  group->run();
+  group->wait();
+}
+
+
+} // namespace _
+} // namespace lde::cellfy::boox
@@ -0,0 +1,67 @@
+#pragma once
+
+
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+
+namespace lde::cellfy::boox {
+namespace _ {
+
+
+/// Общий пул потоков для parallel_blocks. Потоки создаются при первом обращении и живут до завершения программы.
+/// Вместе с вызывающим потоком работает столько потоков, сколько ядер.
+class worker_pool final {
+public:
+  static worker_pool& instance();
+
+  worker_pool(const worker_pool&) = delete;
+  worker_pool& operator=(const worker_pool&) = delete;
+
+  ~worker_pool();
+
+  /// Число потоков пула, без вызывающего.
+  std::size_t size() const noexcept;
+
+  /// Поставить задачу в очередь. Задача не должна бросать исключения.
+  void post(std::function<void()> task);
+
+private:
+  worker_pool();
+
+  void run();
+
+private:
+  std::mutex                        mutex_;
+  std::condition_variable           ready_;
+  std::deque<std::function<void()>> tasks_;
+  std::vector<std::thread>          threads_;
+  bool                              stop_ = false;
+};
+
+
+using block_fn = std::function<void(std::size_t, std::size_t)>;
+
+void parallel_blocks(std::size_t count, std::size_t min_block, const block_fn& fn);
+
+
+} // namespace _
+
+
+/// Разбить [0, count) на непрерывные блоки и выполнить fn(first, last) для каждого блока в потоках общего пула.
+/// Вызывающий поток тоже разбирает блоки, поэтому вложенный вызов из блока не ждёт занятых потоков пула.
+/// Блоков не больше числа ядер, и в каждом не меньше min_block элементов, иначе всё выполняется в вызывающем потоке.
+/// Возврат - только после завершения всех блоков. Первое исключение из fn пробрасывается дальше.
+/// fn вызывается одновременно из разных потоков: общие данные она только читает, пишет - в свои элементы.
+template<typename Fn>
+void parallel_blocks(std::size_t count, std::size_t min_block, Fn&& fn) {
+  _::parallel_blocks(count, min_block, _::block_fn(std::ref(fn)));
+}
+
+
+} // namespace lde::cellfy::boox
@@ -5,6 +5,8 @@
 #include <functional>
 #include <optional>
 #include <tuple>
+#include <unordered_map>
+#include <vector>
 
 #include <boost/iostreams/device/back_inserter.hpp>
 #include <boost/iostreams/stream.hpp>
@@ -28,6 +30,8 @@
 #include <lde/cellfy/boox/worksheet.h>
 #include <lde/cellfy/boox/src/cell_op.h>
 #include <lde/cellfy/boox/src/column_op.h>
+#include <lde/cellfy/boox/src/format_runs.h>
+#include <lde/cellfy/boox/src/paint_cache.h>
 #include <lde/cellfy/boox/src/row_op.h>
 #include <lde/cellfy/boox/src/value_parser.h>
 
@@ -37,27 +41,9 @@ namespace _ {
 namespace {
 
 
-struct cell_info {
-  using matrix = vector_2d<cell_info>;
-
-  std::size_t                    matrix_row            = 0;
-  std::size_t                    matrix_col            = 0;
-  cell_node::opt_it              node;
-  const cell_node*               merged_with           = nullptr;
-  cell_format::ptr               format;
-  std::optional<cell_value_type> formula_type; ///< Тип значения формулы. Если формула была посчитана.
-  const cell_info*               left_non_overlapping  = nullptr;
-  const cell_info*               right_non_overlapping = nullptr;
-  ed::rect_px<long long>         rect;
-  ed::rect_px<long long>         merged_rect;
-  ed::rect_px<long long>         layout_rect;
-  bool                           draw_top_border       = true;
-  bool                           draw_bottom_border    = true;
-  bool                           draw_left_border      = true;
-  bool                           draw_right_border     = true;
-  bool                           fill_sharp            = false;
-  ed::rasta::matrix              rotate_matrix;
-};
+/// Начиная с этого числа ячеек формат пустых ячеек области хранится в format_run_node,
+/// а не в отдельной ячейке на каждый адрес.
+constexpr std::uint64_t format_run_min_cells = 4096;
 
 
 int border_power(border_style style) noexcept {
@@ -73,7 +59,7 @@ int border_power(border_style style) noexcept {
 
 
 template<typename Border1, typename Border2>
-bool is_more_power(const cell_format::ptr& fmt1, const cell_format::ptr& fmt2) noexcept {
+bool is_more_power(const cell_format* fmt1, const cell_format* fmt2) noexcept {
   auto border1 = fmt1 ? fmt1->get_optional<Border1>() : std::nullopt;
   auto border2 = fmt2 ? fmt2->get_optional<Border2>() : std::nullopt;
 
@@ -85,7 +71,7 @@ bool is_more_power(const cell_format::ptr& fmt1, const cell_format::ptr& fmt2) n
 
 
 template<typename Border1, typename Border2>
-bool is_more_power_eq(const cell_format::ptr& fmt1, const cell_format::ptr& fmt2) noexcept {
+bool is_more_power_eq(const cell_format* fmt1, const cell_format* fmt2) noexcept {
   auto border1 = fmt1 ? fmt1->get_optional<Border1>() : std::nullopt;
   auto border2 = fmt2 ? fmt2->get_optional<Border2>() : std::nullopt;
 
@@ -108,18 +94,96 @@ ed::pixels<double> border_width(border_style style) noexcept {
 }
 
 
-void draw_border_side(
-  ed::rasta::painter& pnt,
-  const ed::point_px<double>& p1,
-  const ed::point_px<double>& p2,
-  const border& fmt) noexcept {
+/// Отрезки линий сетки и границ одного прохода отрисовки.
+/// Отрезки группируются по стилю и цвету, соседние отрезки одной линии сливаются в один,
+/// каждая группа рисуется одним путём и одним stroke.
+class stroke_batch final {
+public:
+  void add(const ed::point_px<double>& p1, const ed::point_px<double>& p2, const border& fmt) {
+    auto& group = group_of(fmt);
+    if (p1.y == p2.y) {
+      group.horizontal.push_back({p1.y, std::min(p1.x, p2.x), std::max(p1.x, p2.x)});
+    } else {
+      ED_ASSERT(p1.x == p2.x);
+      group.vertical.push_back({p1.x, std::min(p1.y, p2.y), std::max(p1.y, p2.y)});
+    }
+  }
 
-  pnt.move_to(p1);
-  pnt.line_to(p2);
-  pnt.line_width(border_width(fmt.style));
-  pnt.source(fmt.line_color);
-  pnt.stroke();
-}
+  /// Нарисовать собранные отрезки и очистить их. Более толстые линии рисуются поверх тонких.
+  void stroke(ed::rasta::painter& pnt) {
+    std::stable_sort(groups_.begin(), groups_.end(), [](const group& lhs, const group& rhs) {
+      return border_power(lhs.fmt.style) < border_power(rhs.fmt.style);
+    });
+
+    for (auto& group : groups_) {
+      merge(group.horizontal);
+      merge(group.vertical);
+
+      for (const auto& s : group.horizontal) {
+        pnt.move_to(ed::point_px<double>{s.from, s.line});
+        pnt.line_to(ed::point_px<double>{s.to, s.line});
+      }
+      for (const auto& s : group.vertical) {
+        pnt.move_to(ed::point_px<double>{s.line, s.from});
+        pnt.line_to(ed::point_px<double>{s.line, s.to});
+      }
+      pnt.line_width(border_width(group.fmt.style));
+      pnt.source(group.fmt.line_color);
+      pnt.stroke();
+    }
+
+    groups_.clear();
+  }
+
+private:
+  /// Отрезок на линии line от from до to.
+  struct segment final {
+    ed::pixels<double> line;
+    ed::pixels<double> from;
+    ed::pixels<double> to;
+  };
+
+  struct group final {
+    border               fmt;
+    std::vector<segment> horizontal;
+    std::vector<segment> vertical;
+  };
+
+  group& group_of(const border& fmt) {
+    auto i = std::find_if(groups_.begin(), groups_.end(), [&fmt](const group& g) {
+      return g.fmt == fmt;
+    });
+    if (i == groups_.end()) {
+      groups_.push_back({fmt, {}, {}});
+      return groups_.back();
+    }
+    return *i;
+  }
+
+  /// Слить касающиеся и перекрывающиеся отрезки одной линии.
+  static void merge(std::vector<segment>& segments) {
+    if (segments.empty()) {
+      return;
+    }
+
+    std::sort(segments.begin(), segments.end(), [](const segment& lhs, const segment& rhs) {
+      return std::tie(lhs.line, lhs.from) < std::tie(rhs.line, rhs.from);
+    });
+
+    auto out = segments.begin();
+    for (auto i = std::next(segments.begin()); i != segments.end(); ++i) {
+      if (i->line == out->line && i->from <= out->to) {
+        out->to = std::max(out->to, i->to);
+      } else {
+        *++out = *i;
+      }
+    }
+    segments.erase(std::next(out), segments.end());
+  }
+
+private:
+  std::vector<group> groups_;
+};
 
 
 void draw_border_sides(
@@ -128,32 +192,28 @@ void draw_border_sides(
   const std::optional<border>& bottom_side,
   const std::optional<border>& left_side,
   const std::optional<border>& right_side,
-  ed::rasta::painter& pnt) noexcept {
+  stroke_batch& batch) {
 
   if (top_side) {
-    draw_border_side(
-      pnt,
+    batch.add(
       rect.top_left().x_added(-border_width(top_side->style) / 2.),
       rect.top_right().x_added(border_width(top_side->style) / 2.),
       *top_side);
   }
   if (bottom_side) {
-    draw_border_side(
-      pnt,
+    batch.add(
       rect.bottom_left().x_added(-border_width(bottom_side->style) / 2.),
       rect.bottom_right().x_added(border_width(bottom_side->style) / 2.),
       *bottom_side);
   }
   if (left_side) {
-    draw_border_side(
-      pnt,
+    batch.add(
       rect.top_left().y_added(-border_width(left_side->style) / 2.),
       rect.bottom_left().y_added(border_width(left_side->style) / 2.),
       *left_side);
   }
   if (right_side) {
-    draw_border_side(
-      pnt,
+    batch.add(
       rect.top_right().y_added(-border_width(right_side->style) / 2.),
       rect.bottom_right().y_added(border_width(right_side->style) / 2.),
       *right_side);
@@ -161,7 +221,7 @@ void draw_border_sides(
 }
 
 
-void draw_grid_lines(const cell_info& info, const range::paint_options& opts, ed::rasta::painter& pnt) {
+void draw_grid_lines(const cell_info& info, const range::paint_options& opts, stroke_batch& batch) {
   std::optional<border> top_side;
   std::optional<border> bottom_side;
   std::optional<border> left_side;
@@ -192,11 +252,11 @@ void draw_grid_lines(const cell_info& info, const range::paint_options& opts, ed
   cell_border.x -= 0.5_px;
   cell_border.y -= 0.5_px;
 
-  draw_border_sides(cell_border, top_side, bottom_side, left_side, right_side, pnt);
+  draw_border_sides(cell_border, top_side, bottom_side, left_side, right_side, batch);
 }
 
 
-void draw_border(const cell_info& info, ed::rasta::painter& pnt) {
+void draw_border(const cell_info& info, stroke_batch& batch) {
   std::optional<border> top_side;
   std::optional<border> bottom_side;
   std::optional<border> left_side;
@@ -227,11 +287,11 @@ void draw_border(const cell_info& info, ed::rasta::painter& pnt) {
   cell_border.x -= 0.5_px;
   cell_border.y -= 0.5_px;
 
-  draw_border_sides(cell_border, top_side, bottom_side, left_side, right_side, pnt);
+  draw_border_sides(cell_border, top_side, bottom_side, left_side, right_side, batch);
 }
 
 
-void draw_cell_content(const cell_info& info, ed::rasta::painter& pnt) {
+void draw_cell_fill(const cell_info& info, ed::rasta::painter& pnt) {
   if (info.node && info.node.value()->merged_with) {
     return;
   }
@@ -245,72 +305,101 @@ void draw_cell_content(const cell_info& info, ed::rasta::painter& pnt) {
     pnt.rectangle(fill_area);
     pnt.fill();
   }
+}
+
+
+bool has_text(const cell_info& info) noexcept {
+  return info.node && !info.node.value()->merged_with && info.node.value()->layout;
+}
+
+
+/// Шрифт и ширина символа # для заполнения ячеек, в которые не помещается значение. По одному на формат.
+class sharp_fill_cache final {
+public:
+  static constexpr wchar_t sharp = L'#';
+
+  struct entry final {
+    ed::rasta::text_layout::text_format fmt;
+    ed::pixels<double>                  glyph_width;
+  };
+
+  const entry& get(const cell_format& format) {
+    auto i = entries_.find(&format);
+    if (i == entries_.end()) {
+      auto fmt = make_text_format(format);
+      const auto glyph_width = fmt.fnt.text_extents(std::wstring{sharp}).width;
+      i = entries_.emplace(&format, entry{std::move(fmt), glyph_width}).first;
+    }
+    return i->second;
+  }
 
-  if (info.node) {
-    auto& cell = *info.node.value();
+private:
+  std::unordered_map<const cell_format*, entry> entries_;
+};
 
-    if (cell.layout) {
-      ED_ASSERT(!cell.is_layout_dirty);
-      ed::rasta::painter::scoped_save _(pnt);
 
-      auto clip_rect = info.layout_rect;
-      bool clip = false;
-      const bool format_holds_text_rotation = cell.format && cell.format->holds<text_rotation>();
+void draw_cell_text(const cell_info& info, sharp_fill_cache& sharps, ed::rasta::painter& pnt) {
+  ED_ASSERT(has_text(info));
+  auto& cell = *info.node.value();
+  ED_ASSERT(!cell.is_layout_dirty);
 
-      if (cell.row_span > 1 || cell.column_span > 1) { // Объединенные ячейки всегда надо обрезать
-        if (info.layout_rect.left() < info.merged_rect.left()) {
-          clip_rect.left(info.merged_rect.left());
-          clip = true;
-        }
-        if (info.layout_rect.right() > info.merged_rect.right()) {
-          clip_rect.right(info.merged_rect.right());
-          clip = true;
-        }
-      } else {
-        if (info.left_non_overlapping) {
-          if (info.left_non_overlapping->merged_rect.right() > info.layout_rect.left()) {
-            clip_rect.left(info.left_non_overlapping->merged_rect.right());
-            clip = true;
-          }
-        }
-        if (info.right_non_overlapping) {
-          if (info.right_non_overlapping->merged_rect.left() < info.layout_rect.right()) {
-            clip_rect.right(info.right_non_overlapping->merged_rect.left());
-            clip = true;
-          }
-        }
-      }
+  auto clip_rect = info.layout_rect;
+  bool clip = false;
+  const bool format_holds_text_rotation = cell.format && cell.format->holds<text_rotation>();
 
-      // Дополнтительно обрезаем текст сверху/снизу. Если он не влазит в ячейку по высоте.
-      if (format_holds_text_rotation) {
-        const auto rot = cell.format->get<text_rotation>();
-        if (rot > 0._deg) {
-          clip_rect.bottom(info.merged_rect.bottom());
-        } else {
-          clip_rect.top(info.merged_rect.top());
-        }
+  if (cell.row_span > 1 || cell.column_span > 1) { // Объединенные ячейки всегда надо обрезать
+    if (info.layout_rect.left() < info.merged_rect.left()) {
+      clip_rect.left(info.merged_rect.left());
+      clip = true;
+    }
+    if (info.layout_rect.right() > info.merged_rect.right()) {
+      clip_rect.right(info.merged_rect.right());
+      clip = true;
+    }
+  } else {
+    if (info.left_non_overlapping) {
+      if (info.left_non_overlapping->merged_rect.right() > info.layout_rect.left()) {
+        clip_rect.left(info.left_non_overlapping->merged_rect.right());
         clip = true;
       }
-
-      if (clip) {
-        pnt.rectangle(clip_rect);
-        pnt.clip();
+    }
+    if (info.right_non_overlapping) {
+      if (info.right_non_overlapping->merged_rect.left() < info.layout_rect.right()) {
+        clip_rect.right(info.right_non_overlapping->merged_rect.left());
+        clip = true;
       }
+    }
+  }
 
-      // Если выбран поворот, то ячейки не заполняются #, если значение ячейки не помещается в ячейку.
-      if (format_holds_text_rotation) {
-        pnt.transform(info.rotate_matrix);
-        cell.layout->paint(pnt);
-      } else if (cell.format && info.fill_sharp) {
-        const auto sharp       = L'#';
-        const auto fmt         = make_text_format(*cell.format);
-        const auto glyph_width = fmt.fnt.text_extents(std::wstring{sharp}).width;
-        const auto fill_count  = static_cast<std::wstring::size_type>(std::max(info.merged_rect.width / glyph_width, {}));
-        ed::rasta::text_layout{}.add(std::wstring(fill_count, sharp), fmt).paint(info.merged_rect.top_left(), pnt);
-      } else {
-        cell.layout->paint(info.layout_rect.top_left(), pnt);
-      }
+  // Дополнтительно обрезаем текст сверху/снизу. Если он не влазит в ячейку по высоте.
+  if (format_holds_text_rotation) {
+    const auto rot = cell.format->get<text_rotation>();
+    if (rot > 0._deg) {
+      clip_rect.bottom(info.merged_rect.bottom());
+    } else {
+      clip_rect.top(info.merged_rect.top());
     }
+    clip = true;
+  }
+
+  // Состояние painter сохраняется, только если его меняет обрезка или поворот.
+  std::optional<ed::rasta::painter::scoped_save> save;
+  if (clip) {
+    save.emplace(pnt);
+    pnt.rectangle(clip_rect);
+    pnt.clip();
+  }
+
+  // Если выбран поворот, то ячейки не заполняются #, если значение ячейки не помещается в ячейку.
+  if (format_holds_text_rotation) {
+    pnt.transform(info.rotate_matrix);
+    cell.layout->paint(pnt);
+  } else if (cell.format && info.fill_sharp) {
+    const auto& fill = sharps.get(*cell.format);
+    const auto fill_count = static_cast<std::wstring::size_type>(std::max(info.merged_rect.width / fill.glyph_width, {}));
+    ed::rasta::text_layout{}.add(std::wstring(fill_count, sharp_fill_cache::sharp), fill.fmt).paint(info.merged_rect.top_left(), pnt);
+  } else {
+    cell.layout->paint(info.layout_rect.top_left(), pnt);
   }
 }
 
@@ -1169,36 +1258,8 @@ void range::for_each_area(const area_fn& fn) const {
 void range::for_each_column(const column_fn& fn) const {
   ED_ASSERT(fn);
 
-  if (!sheet_) {
-    ED_THROW_EXCEPTION(range_is_empty());
-  }
-
-  if (!single_area()) {
-    ED_THROW_EXCEPTION(too_many_areas_in_range());
-  }
-
-  auto columns = sheet_->book().forest().get<column_node>(sheet_->sheet_node_);
-  auto i = std::lower_bound(columns.begin(), columns.end(), column_node{united_.left_column()});
-  column_info info;
-
-  for (auto index = united_.left_column(); index <= united_.right_column(); ++index) {
-    info.index = index;
-
-    if (i != columns.end() && i->index < index) {
-      ++i;
-    }
-
-    if (i != columns.end() && i->index == index) {
-      info.width = ed::pixels<long long>(i->width);
-      info.node = i;
-    } else {
-      info.width = ed::pixels<long long>(sheet_->default_column_width());
-      info.node = std::nullopt;
-    }
-
+  for (auto&& info : columns()) {
     fn(info);
-
-    info.left += info.width;
   }
 }
 
@@ -1206,36 +1267,8 @@ void range::for_each_column(const column_fn& fn) const {
 void range::for_each_row(const row_fn& fn) const {
   ED_ASSERT(fn);
 
-  if (!sheet_) {
-    ED_THROW_EXCEPTION(range_is_empty());
-  }
-
-  if (!single_area()) {
-    ED_THROW_EXCEPTION(too_many_areas_in_range());
-  }
-
-  auto rows = sheet_->book().forest().get<row_node>(sheet_->sheet_node_);
-  auto i = std::lower_bound(rows.begin(), rows.end(), row_node{united_.top_row()});
-  row_info info;
-
-  for (auto index = united_.top_row(); index <= united_.bottom_row(); ++index) {
-    info.index = index;
-
-    if (i != rows.end() && i->index < index) {
-      ++i;
-    }
-
-    if (i != rows.end() && i->index == index) {
-      info.height = ed::pixels<long long>(i->height);
-      info.node = i;
-    } else {
-      info.height = ed::pixels<long long>(sheet_->default_row_height());
-      info.node = std::nullopt;
-    }
-
+  for (auto&& info : rows()) {
     fn(info);
-
-    info.top += info.height;
   }
 }
 
@@ -1260,14 +1293,44 @@ void range::for_each_cell(const cell_fn& fn) const {
 void range::for_existing_cells(const cell_fn& fn) const {
   ED_ASSERT(fn);
 
+  for (auto&& cell : existing()) {
+    fn(range{*sheet_, area{cell.index()}});
+  }
+}
+
+
+existing_cells range::existing() const {
   if (!sheet_) {
     ED_THROW_EXCEPTION(range_is_empty());
   }
 
-  apply(cell_nodes_visitor_op([&fn, this](cell_node::it node) {
-    fn(range{*sheet_, area{node->index}});
-    return true;
-  }));
+  return {*sheet_, areas_};
+}
+
+
+column_cursor range::columns() const {
+  if (!sheet_) {
+    ED_THROW_EXCEPTION(range_is_empty());
+  }
+
+  if (!single_area()) {
+    ED_THROW_EXCEPTION(too_many_areas_in_range());
+  }
+
+  return {*sheet_, united_};
+}
+
+
+row_cursor range::rows() const {
+  if (!sheet_) {
+    ED_THROW_EXCEPTION(range_is_empty());
+  }
+
+  if (!single_area()) {
+    ED_THROW_EXCEPTION(too_many_areas_in_range());
+  }
+
+  return {*sheet_, united_};
 }
 
 
@@ -1419,27 +1482,27 @@ std::wstring range::text_for_edit() const {
     return result.fill_positions.has_value() && result.text == L"#";
   };
 
-  value_format v_fmt(fmt.get_or_default<number_format>(), loc);
-  const auto result = v_fmt(cell_val);
+  const auto v_fmt = value_format::compiled(fmt.get_or_default<number_format>(), loc);
+  const auto result = (*v_fmt)(cell_val);
 
   if (cell_val.type() == cell_value_type::number && !format_error(result)) {
     const auto value = cell_val.to<double>();
-    if (v_fmt.has_date_time_section(value)) {
-      if (v_fmt.has_date_section(value)) {
-        text = value_format(static_cast<int>(value) == value ? L"dd.mm.yyyy" : L"dd.mm.yyyy h:mm:ss")(cell_val).text;
-      } else if (v_fmt.has_time_section(value)) {
+    if (v_fmt->has_date_time_section(value)) {
+      if (v_fmt->has_date_section(value)) {
+        text = (*value_format::compiled(static_cast<int>(value) == value ? L"dd.mm.yyyy" : L"dd.mm.yyyy h:mm:ss"))(cell_val).text;
+      } else if (v_fmt->has_time_section(value)) {
         double int_part = 0.;
         std::modf(value, &int_part);
-        text = value_format(int_part ? L"dd.mm.yyyy h:mm:ss" : L"h:mm:ss")(cell_val).text;
+        text = (*value_format::compiled(int_part ? L"dd.mm.yyyy h:mm:ss" : L"h:mm:ss"))(cell_val).text;
       } else {
-        text = value_format(L"dd.mm.yyyy h:mm:ss")(cell_val).text;
+        text = (*value_format::compiled(L"dd.mm.yyyy h:mm:ss"))(cell_val).text;
       }
-    } else if (v_fmt.has_percent_section(value)) {
-      text = value_format(number_format::default_value, loc)(value * 100.).text + L"%";
-    } else if (v_fmt.has_duration_section(value)) { // Для продолжительности всегда выводятся миллисекунды.
-      text = value_format(L"[h]:mm:ss.000")(cell_val).text;
+    } else if (v_fmt->has_percent_section(value)) {
+      text = (*value_format::compiled(number_format::default_value, loc))(value * 100.).text + L"%";
+    } else if (v_fmt->has_duration_section(value)) { // Для продолжительности всегда выводятся миллисекунды.
+      text = (*value_format::compiled(L"[h]:mm:ss.000"))(cell_val).text;
     } else {
-      text = value_format(number_format::default_value, loc)(cell_val).text;
+      text = (*value_format::compiled(number_format::default_value, loc))(cell_val).text;
     }
   } else {
     text = cell_val.to<std::wstring>();
@@ -1453,7 +1516,7 @@ range& range::merge() {
     ED_THROW_EXCEPTION(range_is_empty());
   }
 
-  scoped_transaction tr(sheet_->book().forest());
+  scoped_transaction tr(sheet_->book());
   {
     auto area_f = [](const auto& r) {
       const auto merge_with = r.addr().index();
@@ -1476,7 +1539,7 @@ range& range::unmerge() {
     ED_THROW_EXCEPTION(range_is_empty());
   }
 
-  scoped_transaction tr(sheet_->book().forest());
+  scoped_transaction tr(sheet_->book());
   {
     for_each_area([](const auto& r) {
       r.apply(unmerge_cells_op());
@@ -1493,7 +1556,7 @@ range& range::set_format(cell_format::changes&& changes) {
     ED_THROW_EXCEPTION(range_is_empty());
   }
 
-  scoped_transaction tr(sheet_->book().forest());
+  scoped_transaction tr(sheet_->book());
   {
     if (contains_entire_sheet()) {
       if (sheet_->node()->format_key) {
@@ -1502,6 +1565,7 @@ range& range::set_format(cell_format::changes&& changes) {
         if (new_fmt != *sheet_->node()->format) {
           auto format_node = sheet_->book().ensure_format(std::move(new_fmt));
           ED_ENSURES(format_node->format);
+          sheet_->book().release_format(sheet_->node()->format_key);
 
           worksheet_node n = *sheet_->node();
           n.format_key = forest_t::key_of(format_node);
@@ -1521,10 +1585,16 @@ range& range::set_format(cell_format::changes&& changes) {
 
       apply(change_existing_column_format_op(changes));
       apply(change_existing_row_format_op(changes));
-      apply(change_existing_cell_format_op(std::move(changes)));
+      apply(change_existing_cell_format_op(changes));
+      for (auto& ar : areas_) {
+        sheet_->change_format_runs(ar, changes, false);
+      }
     } else if (contains_entire_columns()) {
       apply(change_column_format_op(changes));
       apply(change_existing_cell_format_op(changes));
+      for (auto& ar : areas_) {
+        sheet_->change_format_runs(ar, changes, false);
+      }
 
       // Надо создать ячейки при пересечении со строками, имеющими формат
       for (auto& row : sheet_->book().forest().get<row_node>(sheet_->node())) {
@@ -1539,6 +1609,9 @@ range& range::set_format(cell_format::changes&& changes) {
     } else if (contains_entire_rows()) {
       apply(change_row_format_op(changes));
       apply(change_existing_cell_format_op(changes));
+      for (auto& ar : areas_) {
+        sheet_->change_format_runs(ar, changes, false);
+      }
 
       // Надо создать ячейки при пересечении c колонками, имеющими формат
       for (auto& column : sheet_->book().forest().get<column_node>(sheet_->node())) {
@@ -1551,7 +1624,35 @@ range& range::set_format(cell_format::changes&& changes) {
         }
       }
     } else {
-      apply(change_cell_format_op(std::move(changes)));
+      auto& forest = sheet_->book().forest();
+
+      for (auto& ar : areas_) {
+        range ar_range(*sheet_, ar);
+
+        if (ar.cells_count() < _::format_run_min_cells) {
+          ar_range.apply(change_cell_format_op(changes));
+          continue;
+        }
+
+        // Формат строк и колонок важнее формата листа, поэтому на их пересечениях с областью
+        // ячейки создаются как раньше. Остальная часть области описывается format_run_node.
+        auto rows = forest.get<row_node>(sheet_->node());
+        for (auto row_i = std::lower_bound(rows.begin(), rows.end(), row_node{ar.top_row()}); row_i != rows.end() && row_i->index <= ar.bottom_row(); ++row_i) {
+          if (row_i->format_key) {
+            range(*sheet_, area({ar.left_column(), row_i->index}, {ar.right_column(), row_i->index})).apply(change_cell_format_op(changes));
+          }
+        }
+
+        auto columns = forest.get<column_node>(sheet_->node());
+        for (auto col_i = std::lower_bound(columns.begin(), columns.end(), column_node{ar.left_column()}); col_i != columns.end() && col_i->index <= ar.right_column(); ++col_i) {
+          if (col_i->format_key) {
+            range(*sheet_, area({col_i->index, ar.top_row()}, {col_i->index, ar.bottom_row()})).apply(change_cell_format_op(changes));
+          }
+        }
+
+        ar_range.apply(change_existing_cell_format_op(changes));
+        sheet_->change_format_runs(ar, changes, true);
+      }
     }
   }
   tr.commit();
@@ -1565,11 +1666,12 @@ range& range::clear_format() {
     ED_THROW_EXCEPTION(range_is_empty());
   }
 
-  scoped_transaction tr(sheet_->book().forest());
+  scoped_transaction tr(sheet_->book());
   {
     if (contains_entire_sheet()) {
       if (sheet_->node()->format_key) {
         ED_ASSERT(sheet_->node()->format);
+        sheet_->book().release_format(sheet_->node()->format_key);
         worksheet_node n = *sheet_->node();
         n.format_key = std::nullopt;
         n.format = nullptr;
@@ -1586,6 +1688,9 @@ range& range::clear_format() {
     }
 
     apply(clear_cell_format_op());
+    for (auto& ar : areas_) {
+      sheet_->clear_format_runs(ar);
+    }
   }
   tr.commit();
 
@@ -1620,7 +1725,7 @@ void range::prepare_and_apply_number_format(const number_format::value_type& for
     fn = [&loc](range range) {
       const auto& v = range.value();
       if (v.type() == cell_value_type::number) {
-        auto result = value_format(number_format::default_value, loc)(v.as<double>());
+        auto result = (*value_format::compiled(number_format::default_value, loc))(v.as<double>());
         range.set_value(std::move(result.text));
         range.set_format<text_horizontal_alignment>(horizontal_alignment::left);
       }
@@ -1640,7 +1745,7 @@ void range::prepare_and_apply_number_format(const number_format::value_type& for
     changes.set<number_format>(format);
   }
 
-  scoped_transaction tr(sheet_->book().forest());
+  scoped_transaction tr(sheet_->book());
   {
     for_existing_cells(fn);
     set_format(std::move(changes));
@@ -1924,7 +2029,7 @@ void range::fill(range& out) const {
     dest_ranges    = split_by_rows(*sheet_, out.united_);
   }
 
-  scoped_transaction tr(sheet_->book().forest());
+  scoped_transaction tr(sheet_->book());
   {
     for(auto&& p_ranges : _::zip_range(current_ranges, dest_ranges)) {
       value_ranges value_ranges;
@@ -1962,7 +2067,7 @@ range& range::update_column_width() {
     ED_THROW_EXCEPTION(range_is_empty());
   }
 
-  scoped_transaction tr(sheet_->book().forest());
+  scoped_transaction tr(sheet_->book());
   {
     apply(change_column_width{});
   }
@@ -1977,7 +2082,7 @@ range& range::set_default_row_height() {
     ED_THROW_EXCEPTION(range_is_empty());
   }
 
-  scoped_transaction tr(sheet_->book().forest());
+  scoped_transaction tr(sheet_->book());
   {
     apply(set_up_default_row_height());
   }
@@ -1992,7 +2097,7 @@ range& range::set_all_borders(const border& br) {
     ED_THROW_EXCEPTION(range_is_empty());
   }
 
-  scoped_transaction tr(sheet_->book().forest());
+  scoped_transaction tr(sheet_->book());
   {
     for (auto& ar : areas_) {
       range rng(*sheet_, ar);
@@ -2023,7 +2128,7 @@ range& range::set_inner_borders(const border& br) {
     ED_THROW_EXCEPTION(range_is_empty());
   }
 
-  scoped_transaction tr(sheet_->book().forest());
+  scoped_transaction tr(sheet_->book());
   {
     set_horizontal_borders(br);
     set_vertical_borders(br);
@@ -2039,7 +2144,7 @@ range& range::set_horizontal_borders(const border& br) {
     ED_THROW_EXCEPTION(range_is_empty());
   }
 
-  scoped_transaction tr(sheet_->book().forest());
+  scoped_transaction tr(sheet_->book());
   {
     if (!single_merged_cell()) {
       for (auto& ar : areas_) {
@@ -2062,7 +2167,7 @@ range& range::set_vertical_borders(const border& br) {
     ED_THROW_EXCEPTION(range_is_empty());
   }
 
-  scoped_transaction tr(sheet_->book().forest());
+  scoped_transaction tr(sheet_->book());
   {
     if (!single_merged_cell()) {
       for (auto& ar : areas_) {
@@ -2085,7 +2190,7 @@ range& range::set_outer_borders(const border& br) {
     ED_THROW_EXCEPTION(range_is_empty());
   }
 
-  scoped_transaction tr(sheet_->book().forest());
+  scoped_transaction tr(sheet_->book());
   {
     if (single_merged_cell()) {
       set_all_borders(br);
@@ -2123,7 +2228,7 @@ range& range::set_top_borders(const border& br) {
     ED_THROW_EXCEPTION(range_is_empty());
   }
 
-  scoped_transaction tr(sheet_->book().forest());
+  scoped_transaction tr(sheet_->book());
   {
     for (auto& ar : areas_) {
       range rng(*sheet_, ar);
@@ -2145,7 +2250,7 @@ range& range::set_bottom_borders(const border& br) {
     ED_THROW_EXCEPTION(range_is_empty());
   }
 
-  scoped_transaction tr(sheet_->book().forest());
+  scoped_transaction tr(sheet_->book());
   {
     for (auto& ar : areas_) {
       range rng(*sheet_, ar);
@@ -2172,7 +2277,7 @@ range& range::set_left_borders(const border& br) {
     ED_THROW_EXCEPTION(range_is_empty());
   }
 
-  scoped_transaction tr(sheet_->book().forest());
+  scoped_transaction tr(sheet_->book());
   {
     for (auto& ar : areas_) {
       range rng(*sheet_, ar);
@@ -2194,7 +2299,7 @@ range& range::set_right_borders(const border& br) {
     ED_THROW_EXCEPTION(range_is_empty());
   }
 
-  scoped_transaction tr(sheet_->book().forest());
+  scoped_transaction tr(sheet_->book());
   {
       for (auto& ar : areas_) {
         range rng(*sheet_, ar);
@@ -2221,7 +2326,7 @@ range& range::clear_all_borders() {
     ED_THROW_EXCEPTION(range_is_empty());
   }
 
-  scoped_transaction tr(sheet_->book().forest());
+  scoped_transaction tr(sheet_->book());
   {
     for (auto& ar : areas_) {
       range rng(*sheet_, ar);
@@ -2253,7 +2358,7 @@ range& range::set_column_width(ed::twips<double> val) {
     ED_THROW_EXCEPTION(range_is_empty());
   }
 
-  scoped_transaction tr(sheet_->book().forest());
+  scoped_transaction tr(sheet_->book());
   {
     apply(set_column_width_op(val));
   }
@@ -2268,7 +2373,7 @@ range& range::set_row_height(ed::twips<double> val) {
     ED_THROW_EXCEPTION(range_is_empty());
   }
 
-  scoped_transaction tr(sheet_->book().forest());
+  scoped_transaction tr(sheet_->book());
   {
     apply(set_row_height_op(val));
   }
@@ -2283,7 +2388,7 @@ range& range::set_value(const cell_value& val) {
     ED_THROW_EXCEPTION(range_is_empty());
   }
 
-  scoped_transaction tr(sheet_->book().forest());
+  scoped_transaction tr(sheet_->book());
   {
     if (val.is_none()) {
       apply(clear_cell_value_op() | clear_cell_formula_op());
@@ -2302,7 +2407,7 @@ range& range::set_text(const std::wstring& val) {
     ED_THROW_EXCEPTION(range_is_empty());
   }
 
-  scoped_transaction tr(sheet_->book().forest());
+  scoped_transaction tr(sheet_->book());
   {
     if (val.empty()) {
       apply(clear_cell_value_op() | clear_cell_formula_op());
@@ -2311,21 +2416,21 @@ range& range::set_text(const std::wstring& val) {
     } else if (cell_format::changes changes; val.size() > 1 && val.front() == L'=') {
       apply(clear_cell_value_op() | set_cell_formula_op(val));
       if (fx::ast::tokens tokens; sheet_->book().formula_parser().parse_no_throw(val, tokens)) {
-        value_format formatter(v_format.get_or_default<number_format>(), sheet_->book_.get_locale());
+        const auto formatter = value_format::compiled(v_format.get_or_default<number_format>(), sheet_->book_.get_locale());
         // Если выставлен формат "Число", то не применяется формат от функций.
-        if (auto format = fx::get_func_format(tokens); !format.empty() && !formatter.has_number_section(0.)) {
+        if (auto format = fx::get_func_format(tokens); !format.empty() && !formatter->has_number_section(0.)) {
           apply(change_cell_format_op(changes.set<number_format>(std::move(format))));
         }
       }
     } else {
       const auto& loc = sheet_->book().get_locale();
       value_parser parser(loc);
-      value_format formatter(v_format.get_or_default<number_format>(), loc);
+      const auto formatter = value_format::compiled(v_format.get_or_default<number_format>(), loc);
 
       // Если был выставлен формат дробный, то с приоритетом ищется дробь, а не дата.
-      auto value_with_format = parser(val, formatter.has_fraction_section(0.));
+      auto value_with_format = parser(val, formatter->has_fraction_section(0.));
       // Если выставлен формат "Число", "Дата/время", то формат меняется только вручную.
-      if (!value_with_format.second.empty() && !formatter.has_number_section(0.) && !formatter.has_date_time_section(0.)) {
+      if (!value_with_format.second.empty() && !formatter->has_number_section(0.) && !formatter->has_date_time_section(0.)) {
         changes.set<number_format>(std::move(value_with_format.second));
       }
       apply(set_cell_value_op(std::move(value_with_format.first)) | change_cell_format_op(std::move(changes)) | clear_cell_formula_op());
@@ -2367,380 +2472,504 @@ void range::paint(ed::rasta::painter& pnt, const paint_options& opts) const {
     ED_THROW_EXCEPTION(too_many_areas_in_range());
   }
 
-  thread_local _::cell_info::matrix matrix;
-  matrix.clear();
-  matrix.resize(united_.rows_count(), united_.columns_count());
-
-  auto rows = sheet_->book().forest().get<row_node>(sheet_->sheet_node_);
-  auto columns = sheet_->book().forest().get<column_node>(sheet_->sheet_node_);
-  auto row_it = std::lower_bound(rows.begin(), rows.end(), row_node{united_.top_row()});
-  auto first_col_it = std::lower_bound(columns.begin(), columns.end(), column_node{united_.left_column()});
-
-  ed::rect_px<long long> rect;
-  std::size_t matrix_row = 0;
-  std::size_t matrix_col = 0;
-
-  for (auto row = united_.top_row(); row <= united_.bottom_row(); ++row) {
-    if (row_it != rows.end() && row_it->index == row) { // Не пустая строка
-      rect.height = row_it->height;
-      matrix_col = 0;
-      const _::cell_info* left_non_overlapping = nullptr;
-
-      auto col_it = first_col_it;
-      auto cells = sheet_->book().forest().get<cell_node>(row_it);
-      auto cell_it = std::lower_bound(cells.begin(), cells.end(), cell_node{cell_addr(united_.left_column(), row).index()});
-
-      for (auto col = united_.left_column(); col <= united_.right_column(); ++col) {
-        cell_addr addr(col, row);
-        auto& info = matrix[matrix_row][matrix_col];
-        info.matrix_row = matrix_row;
-        info.matrix_col = matrix_col;
-        info.format = sheet_->node()->format;
-
-        if (col_it != columns.end() && col_it->index == col) {
-          rect.width = col_it->width;
-          if (col_it->format) {
-            info.format = col_it->format;
-          }
-          ++col_it;
-        } else {
-          rect.width = sheet_->default_column_width();
-        }
-
-        if (row_it->format) {
-          info.format = row_it->format;
-        }
-
-        if (cell_it != cells.end() && cell_it->index == addr.index()) { // Не пустая ячейка
-          // Для типа горизонтального выравнивания general нужно получить тип результата формулы. Поскольку результат формулы тоже должен быть выровнен.
-          // Например: Если результат формулы bool. То он должен, по аналогии с Ms Excel, рисоваться по центру.
-          const auto formula_node = sheet_->book().forest().get<cell_formula_node>(cell_it);
-          if (!formula_node.empty()) {
-            ED_ASSERT(formula_node.size() == 1);
-            info.formula_type = formula_node.front().result.type();
-          }
-
-          const cell_node& cell = *cell_it;
-          info.node = cell_it;
-          info.rect = rect;
-          info.merged_rect = rect;
-          info.left_non_overlapping = left_non_overlapping;
-
-          if (cell.merged_with) {
-            if (!cell.merged_with_node) {
-              cell_addr merged_addr(*cell.merged_with);
-              if (united_.contains(merged_addr)) {
-                cell.merged_with_node = &*matrix
-                  [merged_addr.row() - united_.top_row()]
-                  [merged_addr.column() - united_.left_column()].node.value();
-              } else { // Объединяющая ячейка может находиться за пределами области
-                cell.merged_with_node = &*sheet_->find_cell(merged_addr).value();
+  auto& cache = *sheet_->paint_cache_;
+
+  // Плитки, которые задевает область.
+  const area tiles(
+    paint_cache::tile_area(united_.top_left()).top_left(),
+    paint_cache::tile_area(united_.bottom_right()).bottom_right());
+
+  // Layout считается только для ячеек видимых плиток и только если устарел.
+  sheet_->cells(tiles.top_left(), tiles.bottom_right()).apply(actualize_layout_op());
+
+  // Модель области собирается заново, только если изменилась область, плитки в её пределах или layout ячеек.
+  // Повторная отрисовка без изменений (курсор, выделение, перерисовка окна) только выдаёт команды рисования.
+  const auto layouts_revision = sheet_->layouts_->revision();
+  const _::cell_info::matrix* model = cache.find_view(united_, opts.zoom, layouts_revision);
+
+  if (!model) {
+    // Модели ячеек плитки в координатах от её угла. Соседство ячеек (перекрытие текстом и границы)
+    // выходит за плитку, поэтому считается при сборке области.
+    const auto build_tile = [this](const area& ar, paint_cache::tile& tile) {
+      auto& matrix = tile.model;
+
+      auto rows = sheet_->book().forest().get<row_node>(sheet_->sheet_node_);
+      auto columns = sheet_->book().forest().get<column_node>(sheet_->sheet_node_);
+      auto row_it = std::lower_bound(rows.begin(), rows.end(), row_node{ar.top_row()});
+      auto first_col_it = std::lower_bound(columns.begin(), columns.end(), column_node{ar.left_column()});
+
+      ed::rect_px<long long> rect;
+      std::size_t matrix_row = 0;
+      std::size_t matrix_col = 0;
+
+      for (auto row = ar.top_row(); row <= ar.bottom_row(); ++row) {
+        if (row_it != rows.end() && row_it->index == row) { // Не пустая строка
+          rect.height = row_it->height;
+          matrix_col = 0;
+
+          auto col_it = first_col_it;
+          auto cells = sheet_->book().forest().get<cell_node>(row_it);
+          auto cell_it = std::lower_bound(cells.begin(), cells.end(), cell_node{cell_addr(ar.left_column(), row).index()});
+
+          for (auto col = ar.left_column(); col <= ar.right_column(); ++col) {
+            cell_addr addr(col, row);
+            auto& info = matrix[matrix_row][matrix_col];
+            info.matrix_row = matrix_row;
+            info.matrix_col = matrix_col;
+            info.format = sheet_->node()->format.get();
+
+            if (col_it != columns.end() && col_it->index == col) {
+              rect.width = col_it->width;
+              if (col_it->format) {
+                info.format = col_it->format.get();
               }
-            }
-            info.merged_with = cell.merged_with_node;
-            if (info.merged_with->format) {
-              info.format = info.merged_with->format;
-            }
-          } else {
-            if (cell.format) {
-              info.format = cell.format;
+              ++col_it;
+            } else {
+              rect.width = sheet_->default_column_width();
             }
 
-            if (cell.column_span > 1 || cell.row_span > 1) {
-              info.merged_with = &cell;
+            if (row_it->format) {
+              info.format = row_it->format.get();
             }
 
-            if (cell.column_span > 1) {
-              auto sp_col_it = col_it;
-              for (column_index sp_col = col + 1; sp_col < col + cell.column_span; ++sp_col) {
-                if (sp_col_it != columns.end() && sp_col_it->index == sp_col) {
-                  info.merged_rect.width += sp_col_it->width;
-                  ++sp_col_it;
-                } else {
-                  info.merged_rect.width += sheet_->default_column_width();
-                }
+            if (cell_it != cells.end() && cell_it->index == addr.index()) { // Не пустая ячейка
+              // Для типа горизонтального выравнивания general нужно получить тип результата формулы. Поскольку результат формулы тоже должен быть выровнен.
+              // Например: Если результат формулы bool. То он должен, по аналогии с Ms Excel, рисоваться по центру.
+              const auto formula_node = sheet_->book().forest().get<cell_formula_node>(cell_it);
+              if (!formula_node.empty()) {
+                ED_ASSERT(formula_node.size() == 1);
+                info.formula_type = formula_node.front().result.type();
               }
-            }
 
-            if (cell.row_span > 1) {
-              auto sp_row_it = row_it + 1;
-              for (row_index sp_row = row + 1; sp_row < row + cell.row_span; ++sp_row) {
-                if (sp_row_it != rows.end() && sp_row_it->index == sp_row) {
-                  info.merged_rect.height += sp_row_it->height;
-                  ++sp_row_it;
-                } else {
-                  info.merged_rect.height += sheet_->default_row_height();
+              const cell_node& cell = *cell_it;
+              info.node = cell_it;
+              info.rect = rect;
+              info.merged_rect = rect;
+
+              if (cell.merged_with) {
+                if (!cell.merged_with_node) {
+                  cell_addr merged_addr(*cell.merged_with);
+                  if (ar.contains(merged_addr)) {
+                    cell.merged_with_node = &*matrix
+                      [merged_addr.row() - ar.top_row()]
+                      [merged_addr.column() - ar.left_column()].node.value();
+                  } else { // Объединяющая ячейка может находиться за пределами плитки
+                    cell.merged_with_node = &*sheet_->find_cell(merged_addr).value();
+                  }
+                }
+                info.merged_with = cell.merged_with_node;
+                tile.reach = tile.reach.unite(area(cell_addr(info.merged_with->index)));
+                if (info.merged_with->format) {
+                  info.format = info.merged_with->format.get();
+                }
+              } else {
+                if (cell.format) {
+                  info.format = cell.format.get();
                 }
-              }
-            }
-          }
-
-          if (cell.layout) {
-            ED_ASSERT(!cell.merged_with);
-
-            auto h_alignment = text_horizontal_alignment::default_value;
-            auto v_alignment = text_vertical_alignment::default_value;
-            auto t_rotation  = text_rotation::default_value;
 
-            if (cell.format) {
-              h_alignment = cell.format->get_or_default<text_horizontal_alignment>();
-              v_alignment = cell.format->get_or_default<text_vertical_alignment>();
-              t_rotation  = cell.format->get_or_default<text_rotation>();
-            }
+                if (cell.column_span > 1 || cell.row_span > 1) {
+                  info.merged_with = &cell;
+                  tile.reach = tile.reach.unite(area(addr, cell_addr(col + cell.column_span - 1, row + cell.row_span - 1)));
+                }
 
-            if (t_rotation != text_rotation::default_value) { // Если задана ориентация.
-              if (t_rotation > 0._deg) { // Поворот по часовой стрелке.
-                const auto rect = _::map_rect(info.merged_rect.bottom_right(), t_rotation,
-                  ed::rect_px<long long>{ed::point_px<long long>{}, ed::size_px<long long>{cell.layout->width(), cell.layout->height()}});
-                info.layout_rect.x = info.merged_rect.right();
-                info.layout_rect.y = info.merged_rect.top();
-                info.layout_rect.width  = rect.width;
-                info.layout_rect.height = rect.height;
-
-                info.layout_rect.x -= rect.width;
-                if (h_alignment == horizontal_alignment::left && rect.width < info.merged_rect.width) {
-                  info.layout_rect.x = info.merged_rect.left();
-                } else if (h_alignment == horizontal_alignment::center && rect.width < info.merged_rect.width) {
-                  info.layout_rect.x -= (info.merged_rect.width - rect.width) / 2;
+                if (cell.column_span > 1) {
+                  auto sp_col_it = col_it;
+                  for (column_index sp_col = col + 1; sp_col < col + cell.column_span; ++sp_col) {
+                    if (sp_col_it != columns.end() && sp_col_it->index == sp_col) {
+                      info.merged_rect.width += sp_col_it->width;
+                      ++sp_col_it;
+                    } else {
+                      info.merged_rect.width += sheet_->default_column_width();
+                    }
+                  }
                 }
 
-                if (v_alignment == vertical_alignment::bottom && rect.height < info.merged_rect.height) {
-                  info.layout_rect.y = info.merged_rect.bottom() - rect.height;
-                } else if (v_alignment == vertical_alignment::center && rect.height < info.merged_rect.height) {
-                  info.layout_rect.y += (info.merged_rect.height - rect.height) / 2;
+                if (cell.row_span > 1) {
+                  auto sp_row_it = row_it + 1;
+                  for (row_index sp_row = row + 1; sp_row < row + cell.row_span; ++sp_row) {
+                    if (sp_row_it != rows.end() && sp_row_it->index == sp_row) {
+                      info.merged_rect.height += sp_row_it->height;
+                      ++sp_row_it;
+                    } else {
+                      info.merged_rect.height += sheet_->default_row_height();
+                    }
+                  }
                 }
+              }
+
+              if (cell.layout) {
+                ED_ASSERT(!cell.merged_with);
+                info.layout = cell.layout.get();
 
-                info.rotate_matrix.translate(info.layout_rect.x + (info.merged_rect.right() - rect.left()), info.layout_rect.y);
-                info.rotate_matrix.rotate(t_rotation);
-              } else { // Против часовой стрелки.
-                const auto rect = _::map_rect(info.merged_rect.bottom_left(), t_rotation,
-                  ed::rect_px<long long>{ed::point_px<long long>{}, ed::size_px<long long>{cell.layout->width(), cell.layout->height()}});
-                info.layout_rect.x      = info.merged_rect.left();
-                info.layout_rect.y      = info.merged_rect.bottom();
-                info.layout_rect.width  = rect.width;
-                info.layout_rect.height = rect.height;
-
-                info.layout_rect.y -= rect.bottom() - info.merged_rect.bottom();
-                if (v_alignment == vertical_alignment::center && rect.height < info.merged_rect.height) {
-                  info.layout_rect.y -= (info.merged_rect.height - rect.height) / 2;
-                } else if (v_alignment == vertical_alignment::top && rect.height < info.merged_rect.height) {
-                  info.layout_rect.y = info.merged_rect.top() + rect.height - (rect.bottom() - info.merged_rect.bottom());
+                auto h_alignment = text_horizontal_alignment::default_value;
+                auto v_alignment = text_vertical_alignment::default_value;
+                auto t_rotation  = text_rotation::default_value;
+
+                if (cell.format) {
+                  h_alignment = cell.format->get_or_default<text_horizontal_alignment>();
+                  v_alignment = cell.format->get_or_default<text_vertical_alignment>();
+                  t_rotation  = cell.format->get_or_default<text_rotation>();
                 }
 
-                // При повороте нужно дополнительно учесть, что размер квадрата может быть меньше, чем размер повёрнутого текста.
-                if (h_alignment == horizontal_alignment::center && rect.width < info.merged_rect.width) { // По умолчанию слева.
-                  info.layout_rect.x += (info.merged_rect.width - rect.width) / 2;
-                } else if (h_alignment == horizontal_alignment::right && rect.width < info.merged_rect.width) {
-                  info.layout_rect.x = info.merged_rect.right() - rect.width;
+                if (t_rotation != text_rotation::default_value) { // Если задана ориентация.
+                  if (t_rotation > 0._deg) { // Поворот по часовой стрелке.
+                    const auto rect = _::map_rect(info.merged_rect.bottom_right(), t_rotation,
+                      ed::rect_px<long long>{ed::point_px<long long>{}, ed::size_px<long long>{cell.layout->width(), cell.layout->height()}});
+                    info.layout_rect.x = info.merged_rect.right();
+                    info.layout_rect.y = info.merged_rect.top();
+                    info.layout_rect.width  = rect.width;
+                    info.layout_rect.height = rect.height;
+
+                    info.layout_rect.x -= rect.width;
+                    if (h_alignment == horizontal_alignment::left && rect.width < info.merged_rect.width) {
+                      info.layout_rect.x = info.merged_rect.left();
+                    } else if (h_alignment == horizontal_alignment::center && rect.width < info.merged_rect.width) {
+                      info.layout_rect.x -= (info.merged_rect.width - rect.width) / 2;
+                    }
+
+                    if (v_alignment == vertical_alignment::bottom && rect.height < info.merged_rect.height) {
+                      info.layout_rect.y = info.merged_rect.bottom() - rect.height;
+                    } else if (v_alignment == vertical_alignment::center && rect.height < info.merged_rect.height) {
+                      info.layout_rect.y += (info.merged_rect.height - rect.height) / 2;
+                    }
+
+                    info.rotation = t_rotation;
+                    info.rotation_origin.x = info.layout_rect.x + (info.merged_rect.right() - rect.left());
+                    info.rotation_origin.y = info.layout_rect.y;
+                  } else { // Против часовой стрелки.
+                    const auto rect = _::map_rect(info.merged_rect.bottom_left(), t_rotation,
+                      ed::rect_px<long long>{ed::point_px<long long>{}, ed::size_px<long long>{cell.layout->width(), cell.layout->height()}});
+                    info.layout_rect.x      = info.merged_rect.left();
+                    info.layout_rect.y      = info.merged_rect.bottom();
+                    info.layout_rect.width  = rect.width;
+                    info.layout_rect.height = rect.height;
+
+                    info.layout_rect.y -= rect.bottom() - info.merged_rect.bottom();
+                    if (v_alignment == vertical_alignment::center && rect.height < info.merged_rect.height) {
+                      info.layout_rect.y -= (info.merged_rect.height - rect.height) / 2;
+                    } else if (v_alignment == vertical_alignment::top && rect.height < info.merged_rect.height) {
+                      info.layout_rect.y = info.merged_rect.top() + rect.height - (rect.bottom() - info.merged_rect.bottom());
+                    }
+
+                    // При повороте нужно дополнительно учесть, что размер квадрата может быть меньше, чем размер повёрнутого текста.
+                    if (h_alignment == horizontal_alignment::center && rect.width < info.merged_rect.width) { // По умолчанию слева.
+                      info.layout_rect.x += (info.merged_rect.width - rect.width) / 2;
+                    } else if (h_alignment == horizontal_alignment::right && rect.width < info.merged_rect.width) {
+                      info.layout_rect.x = info.merged_rect.right() - rect.width;
+                    }
+                    info.rotation = t_rotation;
+                    info.rotation_origin = info.layout_rect.top_left();
+                  }
+                } else { // Если нет ориентации, то используется general_horizontal_alignment.
+                  info.layout_rect.top_left(info.merged_rect.top_left());
+                  info.layout_rect.width = cell.layout->width();
+                  info.layout_rect.height = cell.layout->height();
+
+                  const auto general_hor_alignment_right = h_alignment == horizontal_alignment::general && info.formula_type.value_or(cell.value_type) == cell_value_type::number;
+                  const auto general_hor_alignment_center = h_alignment == horizontal_alignment::general &&
+                    (info.formula_type.value_or(cell.value_type) == cell_value_type::error || info.formula_type.value_or(cell.value_type) == cell_value_type::boolean);
+
+                  // Выравнивание по правому краю:
+                  // - Если задано вручную.
+                  // - Выставлен тип general и тип данных double.
+                  // Выравнивание по левому краю:
+                  // - Если задано вручную.
+                  // - Выставлен тип general и тип данных string/rich_text.
+                  // Выравнивание по центру:
+                  // - Если задано вручную.
+                  // - Выставлен тип general и тип данных bool, ошибка.
+                  // По умолчанию стоит выравнивание по левому краю.
+                  // todo: Осталось 3 типа: distibuted, fill, justify.
+                  if (general_hor_alignment_right || h_alignment == horizontal_alignment::right) {
+                    info.layout_rect.x = info.merged_rect.right() - cell.layout->width() - 2_px;
+                  } else if (general_hor_alignment_center || h_alignment == horizontal_alignment::center) {
+                    info.layout_rect.x += (info.merged_rect.width - cell.layout->width()) / 2;
+                  }
+                  if (v_alignment == vertical_alignment::bottom) {
+                    info.layout_rect.y = info.merged_rect.bottom() - cell.layout->height() - 2_px;
+                  } else if (v_alignment == vertical_alignment::center) {
+                    info.layout_rect.y += (info.merged_rect.height - cell.layout->height()) / 2;
+                  }
                 }
-                info.rotate_matrix.translate(info.layout_rect.top_left());
-                info.rotate_matrix.rotate(t_rotation);
-              }
-            } else { // Если нет ориентации, то используется general_horizontal_alignment.
-              info.layout_rect.top_left(info.merged_rect.top_left());
-              info.layout_rect.width = cell.layout->width();
-              info.layout_rect.height = cell.layout->height();
-
-              const auto general_hor_alignment_right = h_alignment == horizontal_alignment::general && info.formula_type.value_or(cell.value_type) == cell_value_type::number;
-              const auto general_hor_alignment_center = h_alignment == horizontal_alignment::general &&
-                (info.formula_type.value_or(cell.value_type) == cell_value_type::error || info.formula_type.value_or(cell.value_type) == cell_value_type::boolean);
-
-              // Выравнивание по правому краю:
-              // - Если задано вручную.
-              // - Выставлен тип general и тип данных double.
-              // Выравнивание по левому краю:
-              // - Если задано вручную.
-              // - Выставлен тип general и тип данных string/rich_text.
-              // Выравнивание по центру:
-              // - Если задано вручную.
-              // - Выставлен тип general и тип данных bool, ошибка.
-              // По умолчанию стоит выравнивание по левому краю.
-              // todo: Осталось 3 типа: distibuted, fill, justify.
-              if (general_hor_alignment_right || h_alignment == horizontal_alignment::right) {
-                info.layout_rect.x = info.merged_rect.right() - cell.layout->width() - 2_px;
-              } else if (general_hor_alignment_center || h_alignment == horizontal_alignment::center) {
-                info.layout_rect.x += (info.merged_rect.width - cell.layout->width()) / 2;
-              }
-              if (v_alignment == vertical_alignment::bottom) {
-                info.layout_rect.y = info.merged_rect.bottom() - cell.layout->height() - 2_px;
-              } else if (v_alignment == vertical_alignment::center) {
-                info.layout_rect.y += (info.merged_rect.height - cell.layout->height()) / 2;
+
+                // Заполняем #, если тип значения не std::wstring/rich_text и layout не помещается в ячейку.
+                info.fill_sharp = info.layout_rect.width > info.merged_rect.width &&
+                  cell.value_type != cell_value_type::string                      &&
+                  cell.value_type != cell_value_type::rich_text;
               }
+              ++cell_it;
+            } else { // Пустая ячейка
+              info.rect = rect;
+              info.merged_rect = rect;
             }
 
-            // Заполняем #, если тип значения не std::wstring/rich_text и layout не помещается в ячейку.
-            info.fill_sharp = info.layout_rect.width > info.merged_rect.width &&
-              cell.value_type != cell_value_type::string                      &&
-              cell.value_type != cell_value_type::rich_text;
+            rect.x += rect.width;
+            ++matrix_col;
           }
-          if (cell.layout || cell.merged_with) {
-            if (matrix_col > 0) {
-              auto row_ref = matrix[matrix_row];
-              for (int c = matrix_col - 1; c >= 0; --c) {
-                if (!row_ref[c].right_non_overlapping) {
-                  row_ref[c].right_non_overlapping = &info;
-                } else {
-                  break;
-                }
-              }
+
+          ++row_it;
+        } else { // Пустая строка
+          rect.height = sheet_->default_row_height();
+          auto col_it = first_col_it;
+          matrix_col = 0;
+
+          for (auto col = ar.left_column(); col <= ar.right_column(); ++col) {
+            auto& info = matrix[matrix_row][matrix_col];
+            info.matrix_row = matrix_row;
+            info.matrix_col = matrix_col;
+
+            if (col_it != columns.end() && col_it->index == col) {
+              rect.width = col_it->width;
+              info.format = col_it->format.get();
+              ++col_it;
+            } else {
+              info.format = sheet_->node()->format.get();
+              rect.width = sheet_->default_column_width();
             }
-            left_non_overlapping = &info;
-          }
 
-          ++cell_it;
-        } else { // Пустая ячейка
-          info.left_non_overlapping = left_non_overlapping;
-          info.rect = rect;
-          info.merged_rect = rect;
+            info.rect = rect;
+            info.merged_rect = rect;
+
+            rect.x += rect.width;
+            ++matrix_col;
+          }
         }
 
-        rect.x += rect.width;
-        ++matrix_col;
+        rect.x = 0._tw;
+        rect.y += rect.height;
+        ++matrix_row;
+      }
+
+      // Пустые ячейки внутри областей формата берут формат области.
+      for (auto run : sheet_->find_format_runs(ar)) {
+        ED_ASSERT(run->format);
+        auto common = format_runs::area_of(*run).intersect(ar);
+        ED_ASSERT(common);
+
+        for (auto row = common->top_row(); row <= common->bottom_row(); ++row) {
+          for (auto col = common->left_column(); col <= common->right_column(); ++col) {
+            auto& info = matrix[row - ar.top_row()][col - ar.left_column()];
+            if (!info.node) {
+              info.format = run->format.get();
+            }
+          }
+        }
       }
+    };
 
-      ++row_it;
-    } else { // Пустая строка
-      rect.height = sheet_->default_row_height();
-      auto col_it = first_col_it;
-      matrix_col = 0;
+    auto& view = cache.reset_view(united_, opts.zoom, layouts_revision);
 
-      for (auto col = united_.left_column(); col <= united_.right_column(); ++col) {
-        auto& info = matrix[matrix_row][matrix_col];
-        info.matrix_row = matrix_row;
-        info.matrix_col = matrix_col;
+    for (auto tile_row = tiles.top_row(); tile_row <= tiles.bottom_row(); tile_row += paint_cache::tile_rows) {
+      for (auto tile_col = tiles.left_column(); tile_col <= tiles.right_column(); tile_col += paint_cache::tile_columns) {
+        const cell_addr origin(tile_col, tile_row);
+        const auto ar = paint_cache::tile_area(origin);
 
-        if (col_it != columns.end() && col_it->index == col) {
-          rect.width = col_it->width;
-          info.format = col_it->format;
-          ++col_it;
-        } else {
-          info.format = sheet_->node()->format;
-          rect.width = sheet_->default_column_width();
+        const auto* tile = cache.find(origin, opts.zoom);
+        if (!tile) {
+          auto& fresh = cache.reset(origin, opts.zoom);
+          build_tile(ar, fresh);
+          tile = &fresh;
         }
 
-        info.rect = rect;
-        info.merged_rect = rect;
-
-        rect.x += rect.width;
-        ++matrix_col;
+        const auto common = ar.intersect(united_);
+        ED_ASSERT(common);
+        for (auto row = common->top_row(); row <= common->bottom_row(); ++row) {
+          for (auto col = common->left_column(); col <= common->right_column(); ++col) {
+            view[row - united_.top_row()][col - united_.left_column()] = tile->model[row - ar.top_row()][col - ar.left_column()];
+          }
+        }
       }
     }
 
-    rect.x = 0._tw;
-    rect.y += rect.height;
-    ++matrix_row;
-  }
-
-  for (auto& info : matrix) {
-    if (info.merged_with) {
-      ED_ASSERT(info.node);
+    // Перевод координат ячеек из плиток в координаты области.
+    std::vector<decltype(ed::rect_px<long long>{}.x)> xs(view.columns_count());
+    std::vector<decltype(ed::rect_px<long long>{}.y)> ys(view.rows_count());
+    for (std::size_t col = 1; col < xs.size(); ++col) {
+      xs[col] = xs[col - 1];
+      xs[col] += view[0][col - 1].rect.width;
+    }
+    for (std::size_t row = 1; row < ys.size(); ++row) {
+      ys[row] = ys[row - 1];
+      ys[row] += view[row - 1][0].rect.height;
+    }
 
-      cell_addr addr(info.node.value()->index);
-      cell_addr merged_addr(info.merged_with->index);
+    for (std::size_t row = 0; row < view.rows_count(); ++row) {
+      auto row_ref = view[row];
+      for (std::size_t col = 0; col < view.columns_count(); ++col) {
+        auto& info = row_ref[col];
+        const auto dx = xs[col] - info.rect.x;
+        const auto dy = ys[row] - info.rect.y;
+        for (auto* r : {&info.rect, &info.merged_rect, &info.layout_rect}) {
+          r->x += dx;
+          r->y += dy;
+        }
+        info.matrix_row = row;
+        info.matrix_col = col;
 
-      if (addr.row() != merged_addr.row()) {
-        info.draw_top_border = false;
-      }
-      if (addr.row() != merged_addr.row() + info.merged_with->row_span - 1) {
-        info.draw_bottom_border = false;
+        if (info.rotation) {
+          info.rotation_origin.x += dx;
+          info.rotation_origin.y += dy;
+          info.rotate_matrix = ed::rasta::matrix{}.translate(info.rotation_origin).rotate(*info.rotation);
+        }
       }
-      if (addr.column() != merged_addr.column()) {
-        info.draw_left_border = false;
+
+      // Текст может перекрывать соседние ячейки до ближайших непустых слева и справа.
+      const _::cell_info* left_non_overlapping = nullptr;
+      for (std::size_t col = 0; col < view.columns_count(); ++col) {
+        auto& info = row_ref[col];
+        info.left_non_overlapping = left_non_overlapping;
+        if (info.node && (info.node.value()->layout || info.node.value()->merged_with)) {
+          left_non_overlapping = &info;
+        }
       }
-      if (addr.column() != merged_addr.column() + info.merged_with->column_span - 1) {
-        info.draw_right_border = false;
+
+      const _::cell_info* right_non_overlapping = nullptr;
+      for (std::size_t col = view.columns_count(); col-- > 0;) {
+        auto& info = row_ref[col];
+        info.right_non_overlapping = right_non_overlapping;
+        if (info.node && (info.node.value()->layout || info.node.value()->merged_with)) {
+          right_non_overlapping = &info;
+        }
       }
-    } else {
-      if (info.node && info.node.value()->layout) { // Не пустая ячейка
-        if (info.node.value()->row_span == 1 && info.node.value()->column_span == 1) {
-          if (info.layout_rect.left() < info.rect.left()) { // Слева не помещается в ячейку
-            if (!info.left_non_overlapping || info.left_non_overlapping->matrix_col < info.matrix_col - 1) { // Ячейка слева может перекрываться
-              info.draw_left_border = false;
-            }
-          }
-          if (info.layout_rect.right() > info.rect.right()) { // Справа не помещается в ячейку
-            if (!info.right_non_overlapping || info.right_non_overlapping->matrix_col > info.matrix_col + 1) { // Ячейка справа может перекрываться
-              info.draw_right_border = false;
-            }
-          }
+    }
+
+    for (auto& info : view) {
+      if (info.merged_with) {
+        ED_ASSERT(info.node);
+
+        cell_addr addr(info.node.value()->index);
+        cell_addr merged_addr(info.merged_with->index);
+
+        if (addr.row() != merged_addr.row()) {
+          info.draw_top_border = false;
+        }
+        if (addr.row() != merged_addr.row() + info.merged_with->row_span - 1) {
+          info.draw_bottom_border = false;
+        }
+        if (addr.column() != merged_addr.column()) {
+          info.draw_left_border = false;
+        }
+        if (addr.column() != merged_addr.column() + info.merged_with->column_span - 1) {
+          info.draw_right_border = false;
         }
-      } else { // Пустая ячейка
-        if (info.left_non_overlapping && !info.left_non_overlapping->merged_with) {
-          if (info.left_non_overlapping->node.value()->layout) {
-            if (info.left_non_overlapping->layout_rect.right() > info.rect.left()) {
-              info.draw_left_border = false;
+      } else {
+        if (info.node && info.node.value()->layout) { // Не пустая ячейка
+          if (info.node.value()->row_span == 1 && info.node.value()->column_span == 1) {
+            if (info.layout_rect.left() < info.rect.left()) { // Слева не помещается в ячейку
+              if (!info.left_non_overlapping || info.left_non_overlapping->matrix_col < info.matrix_col - 1) { // Ячейка слева может перекрываться
+                info.draw_left_border = false;
+              }
             }
-            if (info.left_non_overlapping->layout_rect.right() > info.rect.right()) {
-              info.draw_right_border = false;
+            if (info.layout_rect.right() > info.rect.right()) { // Справа не помещается в ячейку
+              if (!info.right_non_overlapping || info.right_non_overlapping->matrix_col > info.matrix_col + 1) { // Ячейка справа может перекрываться
+                info.draw_right_border = false;
+              }
             }
           }
-        }
-        if (info.right_non_overlapping && !info.right_non_overlapping->merged_with) {
-          if (info.right_non_overlapping->node.value()->layout) {
-            if (info.right_non_overlapping->layout_rect.left() < info.rect.left()) {
-              info.draw_left_border = false;
+        } else { // Пустая ячейка
+          if (info.left_non_overlapping && !info.left_non_overlapping->merged_with) {
+            if (info.left_non_overlapping->node.value()->layout) {
+              if (info.left_non_overlapping->layout_rect.right() > info.rect.left()) {
+                info.draw_left_border = false;
+              }
+              if (info.left_non_overlapping->layout_rect.right() > info.rect.right()) {
+                info.draw_right_border = false;
+              }
             }
-            if (info.right_non_overlapping->layout_rect.left() < info.rect.right()) {
-              info.draw_right_border = false;
+          }
+          if (info.right_non_overlapping && !info.right_non_overlapping->merged_with) {
+            if (info.right_non_overlapping->node.value()->layout) {
+              if (info.right_non_overlapping->layout_rect.left() < info.rect.left()) {
+                info.draw_left_border = false;
+              }
+              if (info.right_non_overlapping->layout_rect.left() < info.rect.right()) {
+                info.draw_right_border = false;
+              }
             }
           }
         }
       }
-    }
 
-    if (info.draw_top_border) {
-      if (const _::cell_info* above = info.matrix_row > 0 ? &matrix[info.matrix_row - 1][info.matrix_col] : nullptr) {
-        if (!_::is_more_power<top_border, bottom_border>(info.format, above->format)) {
-          info.draw_top_border = false;
+      if (info.draw_top_border) {
+        if (const _::cell_info* above = info.matrix_row > 0 ? &view[info.matrix_row - 1][info.matrix_col] : nullptr) {
+          if (!_::is_more_power<top_border, bottom_border>(info.format, above->format)) {
+            info.draw_top_border = false;
+          }
         }
       }
-    }
-    if (info.draw_bottom_border) {
-      if (const _::cell_info* below = info.matrix_row < matrix.rows_count() - 1 ? &matrix[info.matrix_row + 1][info.matrix_col] : nullptr) {
-        if (!_::is_more_power_eq<bottom_border, top_border>(info.format, below->format)) {
-          info.draw_bottom_border = false;
+      if (info.draw_bottom_border) {
+        if (const _::cell_info* below = info.matrix_row < view.rows_count() - 1 ? &view[info.matrix_row + 1][info.matrix_col] : nullptr) {
+          if (!_::is_more_power_eq<bottom_border, top_border>(info.format, below->format)) {
+            info.draw_bottom_border = false;
+          }
         }
       }
-    }
-    if (info.draw_left_border) {
-      if (const _::cell_info* left = info.matrix_col > 0 ? &matrix[info.matrix_row][info.matrix_col - 1] : nullptr) {
-        if (!_::is_more_power<left_border, right_border>(info.format, left->format)) {
-          info.draw_left_border = false;
+      if (info.draw_left_border) {
+        if (const _::cell_info* left = info.matrix_col > 0 ? &view[info.matrix_row][info.matrix_col - 1] : nullptr) {
+          if (!_::is_more_power<left_border, right_border>(info.format, left->format)) {
+            info.draw_left_border = false;
+          }
         }
       }
-    }
-    if (info.draw_right_border) {
-      if (const _::cell_info* right = info.matrix_col < matrix.columns_count() - 1 ? &matrix[info.matrix_row][info.matrix_col + 1] : nullptr) {
-        if (!_::is_more_power_eq<right_border, left_border>(info.format, right->format)) {
-          info.draw_right_border = false;
+      if (info.draw_right_border) {
+        if (const _::cell_info* right = info.matrix_col < view.columns_count() - 1 ? &view[info.matrix_row][info.matrix_col + 1] : nullptr) {
+          if (!_::is_more_power_eq<right_border, left_border>(info.format, right->format)) {
+            info.draw_right_border = false;
+          }
         }
       }
     }
+
+    model = &view;
   }
 
+  const auto& matrix = *model;
+
+  // Линии сетки и границы собираются по всей области и рисуются несколькими stroke, по одному на стиль.
+  _::stroke_batch lines;
+
   for (auto& info : matrix) {
     if (!info.rect.empty()) {
-      _::draw_grid_lines(info, opts, pnt);
+      _::draw_grid_lines(info, opts, lines);
     }
   }
+  lines.stroke(pnt);
+
+  // Сначала все заливки, затем весь текст: текст, выходящий за ячейку, не перекрывается заливкой соседей.
+  // Текст рисуется подряд по форматам ячеек, чтобы одинаковый шрифт и цвет шли одной серией.
+  thread_local std::vector<const _::cell_info*> texts;
+  texts.clear();
 
   for (auto& info : matrix) {
     if (info.node && opts.hidden_cell == info.node.value()->index) {
       continue;
     }
     if (!info.rect.empty()) {
-      _::draw_cell_content(info, pnt);
+      _::draw_cell_fill(info, pnt);
+      if (_::has_text(info)) {
+        texts.push_back(&info);
+      }
     }
   }
 
+  std::stable_sort(texts.begin(), texts.end(), [](const _::cell_info* lhs, const _::cell_info* rhs) {
+    return std::less<>()(lhs->node.value()->format.get(), rhs->node.value()->format.get());
+  });
+
+  _::sharp_fill_cache sharps;
+  for (auto* info : texts) {
+    _::draw_cell_text(*info, sharps, pnt);
+  }
+
   for (auto& info : matrix) {
     if (info.node && opts.hidden_cell == info.node.value()->index) {
       continue;
     }
     if (!info.rect.empty()) {
-      _::draw_border(info, pnt);
+      _::draw_border(info, lines);
     }
   }
+  lines.stroke(pnt);
 }
 
 
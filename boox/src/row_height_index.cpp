@@ -0,0 +1,96 @@
+#include <lde/cellfy/boox/src/row_height_index.h>
+
+#include <algorithm>
+
+#include <ed/core/assert.h>
+#include <ed/core/rect.h>
+
+#include <ed/rasta/dpi.h>
+#include <ed/rasta/matrix.h>
+#include <ed/rasta/text_layout.h>
+
+#include <lde/cellfy/boox/cell_addr.h>
+
+
+namespace lde::cellfy::boox {
+
+
+std::optional<row_height_index::height> row_height_index::content_height(const cell_node& node) {
+  if (!node.layout) {
+    return std::nullopt;
+  }
+
+  height h = node.layout->height();
+  if (node.format && node.format->holds<text_rotation>()) {
+    const auto rect = ed::rasta::matrix{}.
+                      rotate(node.format->get<text_rotation>()).
+                      map(ed::rect_px<double>{ed::point_px<double>{}, ed::size_px<double>{node.layout->width(), node.layout->height()}});
+
+    h = std::max(h, height{rect.height});
+  }
+  return h;
+}
+
+
+void row_height_index::update(const cell_node& node) {
+  auto h = content_height(node);
+  if (!h) {
+    erase(node);
+    return;
+  }
+
+  const row_index row = cell_addr(node.index).row();
+
+  if (auto i = cells_.find(&node); i != cells_.end()) {
+    ED_ASSERT(i->second.first == row);
+    if (i->second.second == *h) {
+      return;
+    }
+    auto& heights = rows_[row].heights;
+    heights.erase(heights.find(i->second.second));
+    heights.insert(*h);
+    i->second.second = *h;
+    return;
+  }
+
+  rows_[row].heights.insert(*h);
+  cells_.emplace(&node, std::make_pair(row, *h));
+}
+
+
+void row_height_index::erase(const cell_node& node) noexcept {
+  auto i = cells_.find(&node);
+  if (i == cells_.end()) {
+    return;
+  }
+
+  if (auto r = rows_.find(i->second.first); r != rows_.end()) {
+    if (auto h = r->second.heights.find(i->second.second); h != r->second.heights.end()) {
+      r->second.heights.erase(h);
+    }
+  }
+  cells_.erase(i);
+}
+
+
+bool row_height_index::complete(row_index row) const noexcept {
+  auto i = rows_.find(row);
+  return i != rows_.end() && i->second.complete;
+}
+
+
+void row_height_index::mark_complete(row_index row) {
+  rows_[row].complete = true;
+}
+
+
+std::optional<row_height_index::height> row_height_index::max_height(row_index row) const noexcept {
+  auto i = rows_.find(row);
+  if (i == rows_.end() || i->second.heights.empty()) {
+    return std::nullopt;
+  }
+  return *i->second.heights.rbegin();
+}
+
+
+} // namespace lde::cellfy::boox
@@ -0,0 +1,60 @@
+#pragma once
+
+
+#include <optional>
+#include <set>
+#include <unordered_map>
+#include <utility>
+
+#include <ed/core/quantity.h>
+
+#include <lde/cellfy/boox/node.h>
+
+
+namespace lde::cellfy::boox {
+
+
+/// Высоты содержимого ячеек по строкам листа для автоподбора высоты строк.
+/// Для строки хранится мультимножество высот её ячеек, поэтому изменение layout одной ячейки
+/// обновляет максимум строки за O(log n), без обхода всех ячеек строки.
+/// Строка считается полной, когда все её ячейки один раз получили layout. Дальше индекс пополняется
+/// при каждом новом layout, а вытеснение layout из кэша высоту ячейки не забывает.
+class row_height_index final {
+public:
+  using height = ed::twips<double>;
+
+public:
+  row_height_index() = default;
+
+  row_height_index(const row_height_index&) = delete;
+  row_height_index& operator=(const row_height_index&) = delete;
+
+  /// Высота, которую содержимое ячейки требует от строки. Пусто, если у ячейки нет layout.
+  static std::optional<height> content_height(const cell_node& node);
+
+  /// Запомнить высоту содержимого ячейки по её текущему layout.
+  void update(const cell_node& node);
+
+  /// Ячейка удалена или больше не влияет на высоту строки.
+  void erase(const cell_node& node) noexcept;
+
+  /// Все ячейки строки учтены.
+  bool complete(row_index row) const noexcept;
+  void mark_complete(row_index row);
+
+  /// Наибольшая высота содержимого ячеек строки.
+  std::optional<height> max_height(row_index row) const noexcept;
+
+private:
+  struct row_entry final {
+    std::multiset<height> heights;
+    bool                  complete = false;
+  };
+
+private:
+  std::unordered_map<row_index, row_entry>                            rows_;
+  std::unordered_map<const cell_node*, std::pair<row_index, height>> cells_;
+};
+
+
+} // namespace lde::cellfy::boox
@@ -2,14 +2,13 @@
 
 #include <algorithm>
 
-#include <ed/core/rect.h>
-
 #include <ed/rasta/dpi.h>
-#include <ed/rasta/matrix.h>
 #include <ed/rasta/text_layout.h>
 
 #include <lde/cellfy/boox/workbook.h>
 #include <lde/cellfy/boox/worksheet.h>
+#include <lde/cellfy/boox/src/cell_op.h>
+#include <lde/cellfy/boox/src/row_height_index.h>
 
 
 namespace lde::cellfy::boox {
@@ -41,22 +40,32 @@ bool set_row_height_op::on_existing_node(range_op_ctx& ctx, row_node::it node) {
 bool actualize_row_height_op::on_existing_node(range_op_ctx& ctx, row_node::it node) {
   // TODO: Доработать для объединенных ячеек
   if (!node->custom_height) {
-    ed::twips<double> h = ctx.sheet().default_row_height();
-
-    for (auto& cell_n : ctx.forest().get<cell_node>(node)) {
-      if (cell_n.layout) {
-        ed::twips<double> cell_h = cell_n.layout->height();
-        if (cell_n.format && cell_n.format->holds<text_rotation>()) {
-          const auto rect = ed::rasta::matrix{}.
-                            rotate(cell_n.format->get<text_rotation>()).
-                            map(ed::rect_px<double>{ed::point_px<double>{}, ed::size_px<double>{cell_n.layout->width(), cell_n.layout->height()}});
-
-          cell_h = std::max(cell_h, ed::twips<double>{rect.height});
+    auto& heights = ctx.row_heights();
+    const row_index row = node->index;
+    auto cells = ctx.forest().get<cell_node>(node);
+
+    if (heights.complete(row)) {
+      // Высоты остальных ячеек строки уже в индексе, достаточно досчитать layout ячеек из областей.
+      for (auto&& ar : ctx.areas()) {
+        if (!ar.contains_row(row)) {
+          continue;
+        }
+        auto cell_i = std::lower_bound(cells.begin(), cells.end(), cell_node{cell_addr(ar.left_column(), row).index()});
+        for (; cell_i != cells.end() && cell_addr(cell_i->index).column() <= ar.right_column(); ++cell_i) {
+          actualize_cell_layout(ctx, cell_i);
         }
-        h = std::max(h, cell_h);
       }
+    } else {
+      for (auto cell_i = cells.begin(); cell_i != cells.end(); ++cell_i) {
+        actualize_cell_layout(ctx, cell_i);
+        heights.update(*cell_i);
+      }
+      heights.mark_complete(row);
     }
 
+    const ed::twips<double> default_height = ctx.default_row_height();
+    const ed::twips<double> h = std::max(default_height, heights.max_height(row).value_or(default_height));
+
     if (h != node->height) {
       row_node n = *node;
       n.height = h;
@@ -87,6 +96,7 @@ void get_row_format_op::on_start(range_op_ctx& ctx) {
   ED_ASSERT(format_);
   *format_ = {};
   processed_count_ = 0;
+  last_format_ = nullptr;
 }
 
 
@@ -96,9 +106,10 @@ bool get_row_format_op::on_existing_node(range_op_ctx& ctx, row_node::it node) {
     ED_ASSERT(node->format);
     if (processed_count_ == 0) {
       *format_ = *node->format;
-    } else {
+    } else if (node->format.get() != last_format_) { // Пересечение с тем же форматом ничего не меняет
       *format_ = format_->intersect(*node->format);
     }
+    last_format_ = node->format.get();
     ++processed_count_;
   }
   return true;
@@ -108,6 +119,7 @@ bool get_row_format_op::on_existing_node(range_op_ctx& ctx, row_node::it node) {
 bool clear_row_format_op::on_existing_node(range_op_ctx& ctx, row_node::it node) {
   if (node->format_key) {
     ED_ASSERT(node->format);
+    ctx.release_format(node->format_key);
     row_node n = *node;
     n.format_key = std::nullopt;
     n.format = nullptr;
@@ -118,27 +130,22 @@ bool clear_row_format_op::on_existing_node(range_op_ctx& ctx, row_node::it node)
 
 
 change_existing_row_format_op::change_existing_row_format_op(cell_format::changes changes) noexcept
-  : changes_(std::move(changes)) {
+  : transitions_(std::move(changes)) {
 }
 
 
 bool change_existing_row_format_op::on_existing_node(range_op_ctx& ctx, row_node::it node) {
   if (node->format_key) {
     ED_ASSERT(node->format);
-    auto new_fmt = node->format->apply(changes_);
-    if (new_fmt != *node->format) {
-      auto format_node = ctx.sheet().book().ensure_format(std::move(new_fmt));
-      ED_ENSURES(format_node->format);
-
+    auto format_node = transitions_.apply(ctx.sheet().book(), node->format);
+    if (format_node->format != node->format) {
       row_node n = *node;
       n.format_key = forest_t::key_of(format_node);
       n.format = format_node->format;
       ctx.forest().modify(node) = n;
     }
   } else {
-    cell_format fmt = ctx.sheet().node()->format ? ctx.sheet().node()->format->apply(changes_) : cell_format().apply(changes_);
-    auto format_node = ctx.sheet().book().ensure_format(std::move(fmt));
-    ED_ENSURES(format_node->format);
+    auto format_node = transitions_.apply(ctx.sheet().book(), nullptr, nullptr, ctx.sheet().node()->format.get());
 
     row_node n = *node;
     n.format_key = forest_t::key_of(format_node);
@@ -155,9 +162,7 @@ change_row_format_op::change_row_format_op(cell_format::changes changes) noexcep
 
 
 bool change_row_format_op::on_new_node(range_op_ctx& ctx, row_node& node) {
-  cell_format fmt = ctx.sheet().node()->format ? ctx.sheet().node()->format->apply(changes_) : cell_format().apply(changes_);
-  auto format_node = ctx.sheet().book().ensure_format(std::move(fmt));
-  ED_ENSURES(format_node->format);
+  auto format_node = transitions_.apply(ctx.sheet().book(), nullptr, nullptr, ctx.sheet().node()->format.get());
 
   node.height = ctx.sheet().default_row_height();
   node.format_key = forest_t::key_of(format_node);
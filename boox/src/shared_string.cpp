@@ -0,0 +1,192 @@
+#include <lde/cellfy/boox/shared_string.h>
+
+#include <array>
+#include <functional>
+#include <mutex>
+#include <unordered_map>
+#include <utility>
+
+#include <ed/core/assert.h>
+#include <ed/core/unicode.h>
+
+
+namespace lde::cellfy::boox {
+
+
+struct shared_string::entry final {
+  std::wstring text;
+  std::wstring folded;
+  std::size_t  hash        = 0;
+  std::size_t  folded_hash = 0;
+};
+
+
+namespace _ {
+namespace {
+
+
+/// Пул строк. Хранит слабые ссылки, записи живут, пока на них ссылается хотя бы одна shared_string.
+/// Строки разложены по частям по хэшу, у каждой части свой мьютекс: потоки чтения и записи книг
+/// почти не ждут друг друга.
+class string_pool final {
+public:
+  using entry     = shared_string::entry;
+  using entry_ptr = std::shared_ptr<const entry>;
+
+public:
+  static string_pool& instance() {
+    static string_pool pool;
+    return pool;
+  }
+
+  entry_ptr intern(std::wstring_view text) {
+    const auto hash = std::hash<std::wstring_view>()(text);
+    auto& shard = shard_of(hash);
+
+    std::lock_guard lock(shard.mutex);
+
+    if (auto i = shard.entries.find(text); i != shard.entries.end()) {
+      if (auto result = i->second.ptr.lock()) {
+        return result;
+      }
+      // Последняя ссылка уже ушла, но запись ещё не удалена. Ключ смотрит на её текст,
+      // поэтому убираем запись целиком и добавляем новую.
+      shard.entries.erase(i);
+    }
+
+    auto* e = new entry();
+    e->text = text;
+    e->folded = e->text;
+    for (auto& c : e->folded) {
+      c = ed::to_lower_copy(c);
+    }
+    e->hash = hash;
+    e->folded_hash = std::hash<std::wstring_view>()(e->folded);
+
+    entry_ptr result(e, [this](const entry* e) {
+      release(e);
+    });
+    shard.entries.emplace(e->text, slot{e, result});
+    return result;
+  }
+
+private:
+  struct slot final {
+    const entry*               raw = nullptr;
+    std::weak_ptr<const entry> ptr;
+  };
+
+  struct shard final {
+    std::mutex                                  mutex;
+    std::unordered_map<std::wstring_view, slot> entries;
+  };
+
+  static constexpr std::size_t shard_count = 16;
+
+  string_pool() = default;
+
+  shard& shard_of(std::size_t hash) noexcept {
+    return shards_[hash % shard_count];
+  }
+
+  void release(const entry* e) noexcept {
+    {
+      auto& shard = shard_of(e->hash);
+      std::lock_guard lock(shard.mutex);
+      if (auto i = shard.entries.find(e->text); i != shard.entries.end() && i->second.raw == e) {
+        shard.entries.erase(i);
+      }
+    }
+    delete e;
+  }
+
+private:
+  std::array<shard, shard_count> shards_;
+};
+
+
+const std::shared_ptr<const shared_string::entry>& empty_entry() {
+  // Пустая строка нужна очень часто, держим её в пуле постоянно.
+  static const auto entry = string_pool::instance().intern({});
+  return entry;
+}
+
+}} // namespace _
+
+
+shared_string::shared_string()
+  : entry_(_::empty_entry()) {
+}
+
+
+shared_string::shared_string(std::wstring_view text)
+  : entry_(text.empty() ? _::empty_entry() : _::string_pool::instance().intern(text)) {
+}
+
+
+shared_string::shared_string(const std::wstring& text)
+  : shared_string(std::wstring_view(text)) {
+}
+
+
+shared_string::shared_string(const wchar_t* text)
+  : shared_string(std::wstring_view(text)) {
+}
+
+
+bool shared_string::operator==(const shared_string& rhs) const noexcept {
+  return entry_ == rhs.entry_;
+}
+
+
+const std::wstring& shared_string::str() const noexcept {
+  ED_ASSERT(entry_);
+  return entry_->text;
+}
+
+
+shared_string::operator const std::wstring&() const noexcept {
+  return str();
+}
+
+
+bool shared_string::empty() const noexcept {
+  return str().empty();
+}
+
+
+std::size_t shared_string::size() const noexcept {
+  return str().size();
+}
+
+
+std::size_t shared_string::hash() const noexcept {
+  ED_ASSERT(entry_);
+  return entry_->hash;
+}
+
+
+const std::wstring& shared_string::folded() const noexcept {
+  ED_ASSERT(entry_);
+  return entry_->folded;
+}
+
+
+std::size_t shared_string::folded_hash() const noexcept {
+  ED_ASSERT(entry_);
+  return entry_->folded_hash;
+}
+
+
+bool iequals(const shared_string& lhs, const shared_string& rhs) noexcept {
+  if (lhs.entry_ == rhs.entry_) {
+    return true;
+  }
+  if (lhs.entry_->folded_hash != rhs.entry_->folded_hash) {
+    return false;
+  }
+  return lhs.entry_->folded == rhs.entry_->folded;
+}
+
+
+} // namespace lde::cellfy::boox
@@ -0,0 +1,1022 @@
+#include <lde/cellfy/boox/snapshot.h>
+
+#include <algorithm>
+#include <bit>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <functional>
+#include <istream>
+#include <memory>
+#include <optional>
+#include <ostream>
+#include <queue>
+#include <span>
+#include <sstream>
+#include <string>
+#include <string_view>
+#include <type_traits>
+#include <unordered_map>
+#include <utility>
+#include <variant>
+#include <vector>
+
+#include <boost/functional/hash.hpp>
+#include <boost/interprocess/file_mapping.hpp>
+#include <boost/interprocess/mapped_region.hpp>
+
+#include <ed/core/assert.h>
+#include <ed/core/unicode.h>
+
+#include <lde/cellfy/boox/cell_addr.h>
+#include <lde/cellfy/boox/exception.h>
+#include <lde/cellfy/boox/node.h>
+#include <lde/cellfy/boox/scoped_transaction.h>
+#include <lde/cellfy/boox/src/blob.h>
+#include <lde/cellfy/boox/src/column_codec.h>
+
+
+namespace lde::cellfy::boox {
+
+namespace _ {
+namespace {
+
+
+static_assert(std::endian::native == std::endian::little);
+
+
+constexpr char          magic[8]    = {'C', 'E', 'L', 'L', 'F', 'Y', 'S', 'S'};
+constexpr std::size_t   head_size   = 16;
+constexpr std::size_t   footer_size = 48;
+constexpr std::uint32_t no_id       = ~std::uint32_t(0);
+
+/// Индексы ячеек листа. Индексы из файла сверяются с ним до cell_addr, который выход за лист не допускает.
+constexpr cell_index cells_count = cell_index(cell_addr::max_row_count) * cell_addr::max_column_count;
+
+/// Флаг ячейки: у ячейки есть формула.
+constexpr std::uint8_t flag_formula = 1;
+/// Биты 1-2 флагов: вид cell_node::value. 0 - значения нет, иначе номер альтернативы scalar плюс 1.
+constexpr unsigned value_kind_shift = 1;
+constexpr unsigned value_kind_mask  = 3;
+
+
+using format_ids  = std::unordered_map<node_key_type, std::uint32_t, boost::hash<node_key_type>>;
+using format_keys = std::unordered_map<node_key_type, node_key_type, boost::hash<node_key_type>>;
+
+
+/// Порядок ячеек блока в файле: по колонкам листа, внутри колонки - по строкам.
+/// Тогда соседние значения колонок блока - соседние ячейки одной колонки листа: шаг индекса постоянен,
+/// типы и форматы повторяются, а числа мало отличаются друг от друга.
+void transposed_order(const std::vector<cell_index>& index, std::vector<std::uint32_t>& order) {
+  order.resize(index.size());
+  for (std::uint32_t i = 0; i < order.size(); ++i) {
+    order[i] = i;
+  }
+  std::stable_sort(order.begin(), order.end(), [&](std::uint32_t lhs, std::uint32_t rhs) {
+    return cell_addr(index[lhs]).column() < cell_addr(index[rhs]).column();
+  });
+}
+
+
+/// Ячейки со значением в порядке order. Числа записываются только для них.
+void valued_cells(const std::vector<std::uint8_t>& flags, const std::vector<std::uint32_t>& order, std::vector<std::uint32_t>& cells) {
+  cells.clear();
+  for (auto i : order) {
+    if (((flags[i] >> value_kind_shift) & value_kind_mask) != 0) {
+      cells.push_back(i);
+    }
+  }
+}
+
+
+/// Вызвать fn(first, count) для каждой колонки листа среди cells.
+template<typename Fn>
+void for_each_column(const std::vector<cell_index>& index, const std::vector<std::uint32_t>& cells, Fn&& fn) {
+  std::size_t first = 0;
+  column_index column = 0;
+  for (std::size_t i = 0; i < cells.size(); ++i) {
+    const auto c = cell_addr(index[cells[i]]).column();
+    if (i > first && c != column) {
+      fn(first, i - first);
+      first = i;
+    }
+    column = c;
+  }
+  if (first < cells.size()) {
+    fn(first, cells.size() - first);
+  }
+}
+
+
+std::string to_utf8(const std::wstring& text) {
+  if (std::all_of(text.begin(), text.end(), [](wchar_t c) { return c < 0x80; })) {
+    return std::string(text.begin(), text.end());
+  }
+  return ed::to_utf8<std::string>(text);
+}
+
+
+std::wstring to_wstring(std::string_view raw) {
+  if (std::all_of(raw.begin(), raw.end(), [](char c) { return static_cast<unsigned char>(c) < 0x80; })) {
+    return std::wstring(raw.begin(), raw.end());
+  }
+  return ed::from_utf8(std::string(raw));
+}
+
+
+/// Запись разделов в поток с выравниванием.
+class section_stream final {
+public:
+  explicit section_stream(std::ostream& os) noexcept
+    : os_(os) {
+  }
+
+  /// Записать раздел и дополнить нулями до 8 байт. Возвращает смещение раздела.
+  std::uint64_t write(std::string_view data) {
+    constexpr char zeros[8] = {};
+
+    const auto offset = offset_;
+    const auto end = blob::align(offset_ + data.size());
+    os_.write(data.data(), static_cast<std::streamsize>(data.size()));
+    os_.write(zeros, static_cast<std::streamsize>(end - offset_ - data.size()));
+    offset_ = end;
+    return offset;
+  }
+
+private:
+  std::ostream& os_;
+  std::uint64_t offset_ = 0;
+};
+
+
+/// Таблица строк при записи. Одинаковые строки записываются один раз.
+class string_table_writer final {
+public:
+  std::uint32_t id(const std::wstring& text) {
+    auto [i, inserted] = ids_.try_emplace(text, static_cast<std::uint32_t>(ids_.size()));
+    if (inserted) {
+      data_.bytes(to_utf8(text));
+    }
+    return i->second;
+  }
+
+  std::string finish() const {
+    blob::writer out;
+    out.pod(static_cast<std::uint32_t>(ids_.size()));
+    out.raw(data_.data());
+    return out.data();
+  }
+
+private:
+  std::unordered_map<std::wstring, std::uint32_t> ids_;
+  blob::writer                                    data_;
+};
+
+
+/// Таблица строк при чтении. Строка декодируется при первом обращении.
+class string_table_reader final {
+public:
+  explicit string_table_reader(std::string_view data) {
+    blob::reader in(data);
+    const auto count = in.pod<std::uint32_t>();
+    if (count > data.size() / sizeof(std::uint32_t)) {
+      ED_THROW_EXCEPTION(file_is_broken());
+    }
+
+    raw_.reserve(count);
+    for (std::uint32_t i = 0; i < count; ++i) {
+      raw_.push_back(in.bytes());
+    }
+    decoded_.resize(count);
+  }
+
+  const shared_string& operator[](std::uint32_t id) {
+    if (id >= raw_.size()) {
+      ED_THROW_EXCEPTION(file_is_broken());
+    }
+    auto& text = decoded_[id];
+    if (!text) {
+      text = shared_string(to_wstring(raw_[id]));
+    }
+    return *text;
+  }
+
+private:
+  std::vector<std::string_view>             raw_;
+  std::vector<std::optional<shared_string>> decoded_;
+};
+
+
+/// Запись раздела листа.
+class sheet_writer final {
+public:
+  sheet_writer(const forest_t& forest, const format_ids& formats, string_table_writer& strings) noexcept
+    : forest_(forest)
+    , formats_(formats)
+    , strings_(strings) {
+  }
+
+  std::string operator()(worksheet_node::it sheet) {
+    blob::writer head;
+    head.bytes(pack(*sheet));
+
+    auto columns = forest_.get<column_node>(sheet);
+    head.pod(static_cast<std::uint32_t>(columns.size()));
+    for (auto& column : columns) {
+      head.bytes(pack(column));
+    }
+
+    auto rows = forest_.get<row_node>(sheet);
+    head.pod(static_cast<std::uint32_t>(rows.size()));
+    for (auto& row : rows) {
+      head.bytes(pack(row));
+    }
+
+    auto runs = forest_.get<format_run_node>(sheet);
+    head.pod(static_cast<std::uint32_t>(runs.size()));
+    for (auto& run : runs) {
+      head.bytes(pack(run));
+    }
+
+    blocks_.clear();
+    directory_.clear();
+    for (auto row = rows.begin(); row != rows.end(); ++row) {
+      auto cells = forest_.get<cell_node>(row);
+      for (auto cell = cells.begin(); cell != cells.end(); ++cell) {
+        add(cell);
+      }
+    }
+    flush_block();
+
+    head.pod(static_cast<std::uint32_t>(directory_.size()));
+    for (auto [offset, count] : directory_) {
+      head.pod(offset);
+      head.pod(count);
+    }
+    head.align();
+    head.raw(blocks_.data());
+    return head.data();
+  }
+
+private:
+  /// Узел с номером формата вместо ключа.
+  template<typename Node>
+  std::string pack(Node n) const {
+    if (n.format_key) {
+      auto i = formats_.find(*n.format_key);
+      n.format_key = i != formats_.end() ? std::optional<node_key_type>(i->second) : std::nullopt;
+    }
+    return blob::pack(n);
+  }
+
+  void add(cell_node::it node) {
+    const auto ordinal = static_cast<std::uint32_t>(index_.size());
+
+    std::uint8_t flags = node->has_formula ? flag_formula : 0;
+    std::uint32_t string = no_id;
+    auto value = node->value;
+
+    // Строка лежит в cell_data_node. В узлах версии 1 там же лежат скаляры, в снимке они переносятся в value.
+    if (auto children = forest_.get<cell_data_node>(node); !children.empty()) {
+      std::visit([&](auto&& v) {
+        if constexpr (std::is_same_v<std::decay_t<decltype(v)>, shared_string>) {
+          string = strings_.id(v.str());
+        } else if (!value) {
+          value = cell_node::scalar(v);
+        }
+      }, children.begin()->data);
+    }
+
+    double number = 0;
+    if (value) {
+      flags |= static_cast<std::uint8_t>((value->index() + 1) << value_kind_shift);
+      number = std::visit([](auto&& v) {
+        if constexpr (std::is_same_v<std::decay_t<decltype(v)>, cell_value_error>) {
+          return static_cast<double>(static_cast<unsigned char>(v));
+        } else {
+          return static_cast<double>(v);
+        }
+      }, *value);
+    }
+
+    std::uint32_t format = no_id;
+    if (node->format_key) {
+      if (auto i = formats_.find(*node->format_key); i != formats_.end()) {
+        format = i->second;
+      }
+    }
+
+    index_.push_back(node->index);
+    number_.push_back(number);
+    string_.push_back(string);
+    format_.push_back(format);
+    type_.push_back(static_cast<std::uint8_t>(node->value_type));
+    flags_.push_back(flags);
+
+    if (node->column_span != 1 || node->row_span != 1 || node->merged_with) {
+      extras_.pod(ordinal);
+      extras_.pod(node->column_span);
+      extras_.pod(node->row_span);
+      extras_.pod(static_cast<std::uint8_t>(node->merged_with ? 1 : 0));
+      extras_.pod(node->merged_with.value_or(0));
+      ++extras_count_;
+    }
+
+    if (node->has_formula) {
+      if (auto formulas = forest_.get<cell_formula_node>(node); !formulas.empty()) {
+        auto& formula = formulas.front();
+        formulas_.pod(ordinal);
+        formulas_.pod(strings_.id(formula.formula));
+        // Устаревший результат не пишется, такая формула посчитается после открытия.
+        formulas_.bytes(formula.is_result_dirty ? std::string() : blob::pack(formula.result));
+        ++formulas_count_;
+      }
+    }
+
+    if (node->value_type == cell_value_type::rich_text) {
+      auto runs = forest_.get<text_run_node>(node);
+      rich_.pod(ordinal);
+      rich_.pod(static_cast<std::uint32_t>(runs.size()));
+      for (auto& run : runs) {
+        rich_.bytes(blob::pack(run));
+      }
+      ++rich_count_;
+    }
+
+    if (index_.size() == snapshot_block_size) {
+      flush_block();
+    }
+  }
+
+  template<typename T>
+  void write_column(const std::vector<T>& values) {
+    codec::integer_writer out(blocks_);
+    for (auto i : order_) {
+      out.push(static_cast<std::uint64_t>(values[i]));
+    }
+    out.finish();
+  }
+
+  /// Числа пишутся отдельно по каждой колонке листа: у колонки свой способ сжатия.
+  void write_numbers() {
+    valued_cells(flags_, order_, valued_);
+    ordered_.clear();
+    for (auto i : valued_) {
+      ordered_.push_back(number_[i]);
+    }
+    for_each_column(index_, valued_, [&](std::size_t first, std::size_t count) {
+      codec::write_numbers(blocks_, std::span<const double>(ordered_).subspan(first, count));
+    });
+  }
+
+  void flush_block() {
+    if (index_.empty()) {
+      return;
+    }
+
+    blocks_.align();
+    directory_.emplace_back(static_cast<std::uint64_t>(blocks_.size()), static_cast<std::uint32_t>(index_.size()));
+
+    transposed_order(index_, order_);
+    write_column(index_);
+    write_column(string_);
+    write_column(format_);
+    write_column(type_);
+    write_column(flags_);
+    write_numbers();
+    blocks_.pod(extras_count_);
+    blocks_.raw(extras_.data());
+    blocks_.pod(formulas_count_);
+    blocks_.raw(formulas_.data());
+    blocks_.pod(rich_count_);
+    blocks_.raw(rich_.data());
+
+    index_.clear();
+    number_.clear();
+    string_.clear();
+    format_.clear();
+    type_.clear();
+    flags_.clear();
+    extras_.clear();
+    formulas_.clear();
+    rich_.clear();
+    extras_count_ = 0;
+    formulas_count_ = 0;
+    rich_count_ = 0;
+  }
+
+private:
+  using block_directory = std::vector<std::pair<std::uint64_t, std::uint32_t>>;
+
+  const forest_t&            forest_;
+  const format_ids&          formats_;
+  string_table_writer&       strings_;
+  blob::writer               blocks_;
+  block_directory            directory_;
+  std::vector<cell_index>    index_;
+  std::vector<double>        number_;
+  std::vector<std::uint32_t> string_;
+  std::vector<std::uint32_t> format_;
+  std::vector<std::uint8_t>  type_;
+  std::vector<std::uint8_t>  flags_;
+  std::vector<std::uint32_t> order_;
+  std::vector<std::uint32_t> valued_;
+  std::vector<double>        ordered_;
+  blob::writer               extras_;
+  blob::writer               formulas_;
+  blob::writer               rich_;
+  std::uint32_t              extras_count_   = 0;
+  std::uint32_t              formulas_count_ = 0;
+  std::uint32_t              rich_count_     = 0;
+};
+
+
+/// Чтение раздела листа. Строки и ячейки идут по возрастанию индексов,
+/// поэтому каждый узел добавляется в конец своего родителя.
+class sheet_reader final {
+public:
+  sheet_reader(forest_t& forest,
+               const format_keys& keys,
+               const std::vector<node_key_type>& formats,
+               string_table_reader& strings) noexcept
+    : forest_(forest)
+    , keys_(keys)
+    , formats_(formats)
+    , strings_(strings) {
+  }
+
+  /// Узел листа. Столбцы, строки и ячейки читает content.
+  worksheet_node::it sheet(std::string_view section, workbook_node::it book, std::shared_ptr<deferred_sheet> deferred) {
+    blob::reader in(section);
+    auto n = node<worksheet_node>(in.bytes());
+    n.deferred = std::move(deferred);
+    return forest_.push_back(book, std::move(n));
+  }
+
+  /// Содержимое листа, узел которого уже в лесу.
+  void content(std::string_view section, worksheet_node::it sheet) {
+    blob::reader in(section);
+    in.bytes();
+
+    std::optional<column_index> last_column;
+    for (auto count = in.pod<std::uint32_t>(); count > 0; --count) {
+      auto n = node<column_node>(in.bytes());
+      if (n.index >= cell_addr::max_column_count || (last_column && n.index <= *last_column)) {
+        ED_THROW_EXCEPTION(file_is_broken());
+      }
+      last_column = n.index;
+      forest_.push_back(sheet, std::move(n));
+    }
+
+    rows_.clear();
+    for (auto count = in.pod<std::uint32_t>(); count > 0; --count) {
+      auto n = node<row_node>(in.bytes());
+      if (n.index >= cell_addr::max_row_count || (!rows_.empty() && n.index <= rows_.back()->index)) {
+        ED_THROW_EXCEPTION(file_is_broken());
+      }
+      rows_.push_back(forest_.push_back(sheet, std::move(n)));
+    }
+
+    for (auto count = in.pod<std::uint32_t>(); count > 0; --count) {
+      auto n = node<format_run_node>(in.bytes());
+      if (n.first > n.last || n.last >= cells_count) {
+        ED_THROW_EXCEPTION(file_is_broken());
+      }
+      forest_.push_back(sheet, std::move(n));
+    }
+
+    std::vector<std::pair<std::uint64_t, std::uint32_t>> directory;
+    for (auto blocks = in.pod<std::uint32_t>(); blocks > 0; --blocks) {
+      const auto offset = in.pod<std::uint64_t>();
+      const auto count = in.pod<std::uint32_t>();
+      if (count > snapshot_block_size) {
+        ED_THROW_EXCEPTION(file_is_broken());
+      }
+      directory.emplace_back(offset, count);
+    }
+    in.align();
+
+    row_ = 0;
+    last_cell_.reset();
+    for (auto [offset, count] : directory) {
+      blob::reader block(in.tail(offset));
+      read_block(block, count);
+    }
+  }
+
+private:
+  struct extra final {
+    std::uint32_t             ordinal     = 0;
+    std::uint32_t             column_span = 1;
+    std::uint32_t             row_span    = 1;
+    std::optional<cell_index> merged_with;
+  };
+
+  /// Возрастающие серии индексов: начало и конец.
+  using index_runs = std::vector<std::pair<std::uint32_t, std::uint32_t>>;
+
+  struct formula final {
+    std::uint32_t    ordinal = 0;
+    std::uint32_t    id      = 0;
+    std::string_view result; ///< Упакованный cell_value, пусто - результат не сохранён.
+  };
+
+  /// Узел с ключом формата, пересчитанным на ключи нового леса.
+  template<typename Node>
+  Node node(std::string_view bytes) const {
+    Node n;
+    blob::unpack(bytes, n);
+    if (n.format_key) {
+      auto i = keys_.find(*n.format_key);
+      n.format_key = i != keys_.end() ? std::optional(i->second) : std::nullopt;
+    }
+    return n;
+  }
+
+  /// Колонки блока сжаты и записаны в порядке transposed_order.
+  void decode_columns(blob::reader& in, std::uint32_t count) {
+    codec::integer_reader index_in(in);
+    transposed_.resize(count);
+    for (auto& index : transposed_) {
+      index = codec::next_integer<cell_index>(index_in);
+      if (index >= cells_count) {
+        ED_THROW_EXCEPTION(file_is_broken());
+      }
+    }
+    index_in.finish();
+
+    untranspose();
+
+    read_column(in, string_);
+    read_column(in, format_);
+    read_column(in, type_);
+    read_column(in, flags_);
+
+    valued_cells(flags_, order_, valued_);
+    number_.assign(count, 0);
+    for_each_column(index_, valued_, [&](std::size_t first, std::size_t n) {
+      ordered_.clear();
+      codec::read_numbers(in, n, ordered_);
+      for (std::size_t j = 0; j < n; ++j) {
+        number_[valued_[first + j]] = ordered_[j];
+      }
+    });
+  }
+
+  /// Ячейки блока идут по возрастанию индексов, а в файле каждая колонка листа - возрастающая серия.
+  /// Порядок блока восстанавливается слиянием серий: O(n log k) для k колонок.
+  void untranspose() {
+    const auto count = static_cast<std::uint32_t>(transposed_.size());
+
+    runs_.clear();
+    for (std::uint32_t k = 0; k < count; ++k) {
+      if (k == 0 || transposed_[k] < transposed_[k - 1]) {
+        runs_.emplace_back(k, k);
+      }
+      ++runs_.back().second;
+    }
+
+    using head = std::pair<cell_index, std::uint32_t>;
+    std::priority_queue<head, std::vector<head>, std::greater<head>> heads;
+    for (std::uint32_t r = 0; r < runs_.size(); ++r) {
+      heads.emplace(transposed_[runs_[r].first], r);
+    }
+
+    index_.resize(count);
+    order_.resize(count);
+    for (std::uint32_t i = 0; i < count; ++i) {
+      const auto [index, r] = heads.top();
+      heads.pop();
+      auto& [next, end] = runs_[r];
+      index_[i] = index;
+      order_[next] = i;
+      if (++next != end) {
+        heads.emplace(transposed_[next], r);
+      }
+    }
+  }
+
+  template<typename T>
+  void read_column(blob::reader& in, std::vector<T>& values) {
+    codec::integer_reader column_in(in);
+    values.resize(order_.size());
+    for (auto i : order_) {
+      values[i] = codec::next_integer<T>(column_in);
+    }
+    column_in.finish();
+  }
+
+  void read_block(blob::reader& in, std::uint32_t count) {
+    decode_columns(in, count);
+
+    std::vector<extra> extras;
+    for (auto n = checked_count(in, count); n > 0; --n) {
+      auto& e = extras.emplace_back();
+      e.ordinal = in.pod<std::uint32_t>();
+      e.column_span = in.pod<std::uint32_t>();
+      e.row_span = in.pod<std::uint32_t>();
+      const auto has_merged = in.pod<std::uint8_t>();
+      const auto merged_with = in.pod<cell_index>();
+      if (has_merged) {
+        if (merged_with >= cells_count) {
+          ED_THROW_EXCEPTION(file_is_broken());
+        }
+        e.merged_with = merged_with;
+      }
+    }
+
+    std::vector<formula> formulas;
+    for (auto n = checked_count(in, count); n > 0; --n) {
+      auto& e = formulas.emplace_back();
+      e.ordinal = in.pod<std::uint32_t>();
+      e.id = in.pod<std::uint32_t>();
+      e.result = in.bytes();
+    }
+
+    std::vector<std::pair<std::uint32_t, std::vector<text_run_node>>> rich;
+    for (auto n = checked_count(in, count); n > 0; --n) {
+      auto& [ordinal, runs] = rich.emplace_back();
+      ordinal = in.pod<std::uint32_t>();
+      for (auto runs_count = in.pod<std::uint32_t>(); runs_count > 0; --runs_count) {
+        blob::unpack(in.bytes(), runs.emplace_back());
+      }
+    }
+
+    auto next_extra = extras.begin();
+    auto next_formula = formulas.begin();
+    auto next_rich = rich.begin();
+
+    for (std::uint32_t i = 0; i < count; ++i) {
+      // Ячейки добавляются в конец строки, повторный или меньший индекс нарушил бы их порядок.
+      if (last_cell_ && index_[i] <= *last_cell_) {
+        ED_THROW_EXCEPTION(file_is_broken());
+      }
+      last_cell_ = index_[i];
+
+      cell_node n;
+      n.index = index_[i];
+      n.has_formula = (flags_[i] & flag_formula) != 0;
+
+      if (type_[i] > static_cast<std::uint8_t>(cell_value_type::error)) {
+        ED_THROW_EXCEPTION(file_is_broken());
+      }
+      n.value_type = static_cast<cell_value_type>(type_[i]);
+
+      switch ((flags_[i] >> value_kind_shift) & value_kind_mask) {
+        case 1: n.value = number_[i] != 0; break;
+        case 2: n.value = number_[i]; break;
+        case 3: n.value = error_of(number_[i]); break;
+      }
+
+      if (const auto f = format_[i]; f != no_id) {
+        if (f >= formats_.size()) {
+          ED_THROW_EXCEPTION(file_is_broken());
+        }
+        n.format_key = formats_[f];
+      }
+
+      if (next_extra != extras.end() && next_extra->ordinal == i) {
+        n.column_span = next_extra->column_span;
+        n.row_span = next_extra->row_span;
+        n.merged_with = next_extra->merged_with;
+        ++next_extra;
+      }
+
+      auto cell = forest_.push_back(row_of(n.index), std::move(n));
+
+      if (string_[i] != no_id) {
+        cell_data_node child;
+        child.data = strings_[string_[i]];
+        forest_.push_back(cell, std::move(child));
+      }
+
+      if (next_formula != formulas.end() && next_formula->ordinal == i) {
+        cell_formula_node child;
+        child.formula = strings_[next_formula->id].str();
+        if (!next_formula->result.empty()) {
+          blob::unpack(next_formula->result, child.result);
+          child.is_result_dirty = false;
+        }
+        forest_.push_back(cell, std::move(child));
+        ++next_formula;
+      }
+
+      if (next_rich != rich.end() && next_rich->first == i) {
+        for (auto& run : next_rich->second) {
+          forest_.push_back(cell, std::move(run));
+        }
+        ++next_rich;
+      }
+    }
+  }
+
+  /// Число записей редкого списка не больше числа ячеек блока.
+  static std::uint32_t checked_count(blob::reader& in, std::uint32_t count) {
+    const auto n = in.pod<std::uint32_t>();
+    if (n > count) {
+      ED_THROW_EXCEPTION(file_is_broken());
+    }
+    return n;
+  }
+
+  static cell_value_error error_of(double number) {
+    if (!(number >= 0 && number <= static_cast<double>(cell_value_error::value))) {
+      ED_THROW_EXCEPTION(file_is_broken());
+    }
+    return static_cast<cell_value_error>(static_cast<unsigned char>(number));
+  }
+
+  /// Строка ячейки. Ячейки идут по возрастанию строк, поэтому поиск продолжается с прошлой строки.
+  row_node::it row_of(cell_index index) {
+    const auto row = cell_addr(index).row();
+    while (row_ < rows_.size() && rows_[row_]->index < row) {
+      ++row_;
+    }
+    if (row_ == rows_.size() || rows_[row_]->index != row) {
+      ED_THROW_EXCEPTION(file_is_broken());
+    }
+    return rows_[row_];
+  }
+
+private:
+  forest_t&                         forest_;
+  const format_keys&                keys_;
+  const std::vector<node_key_type>& formats_;
+  string_table_reader&              strings_;
+  std::vector<cell_index>           index_;
+  std::vector<double>               number_;
+  std::vector<std::uint32_t>        string_;
+  std::vector<std::uint32_t>        format_;
+  std::vector<std::uint8_t>         type_;
+  std::vector<std::uint8_t>         flags_;
+  std::vector<cell_index>           transposed_;
+  index_runs                        runs_;
+  std::vector<std::uint32_t>        order_;
+  std::vector<std::uint32_t>        valued_;
+  std::vector<double>               ordered_;
+  std::vector<row_node::it>         rows_;
+  std::size_t                       row_ = 0;
+  std::optional<cell_index>         last_cell_;
+};
+
+} // namespace
+
+
+/// Прочитанные раздел форматов, таблица строк и каталог снимка.
+/// Пока есть отложенные листы, держит данные файла и форматы книги: ячейки таких листов ссылаются на форматы,
+/// а сборка неиспользуемых форматов (workbook::collect_formats) этих ссылок не видит.
+class snapshot_source final : public std::enable_shared_from_this<snapshot_source> {
+public:
+  /// Данные живут, пока жив owner.
+  snapshot_source(std::string_view data, std::shared_ptr<const void> owner)
+    : owner_(std::move(owner)) {
+
+    if (!is_snapshot(data)) {
+      ED_THROW_EXCEPTION(unsupported_file_format());
+    }
+
+    blob::reader head(data);
+    head.take(sizeof(magic));
+    if (head.pod<std::uint32_t>() != snapshot_version) {
+      ED_THROW_EXCEPTION(unsupported_file_format());
+    }
+
+    blob::reader footer(data.substr(data.size() - footer_size));
+    const auto formats_offset   = footer.pod<std::uint64_t>();
+    const auto formats_size     = footer.pod<std::uint64_t>();
+    const auto strings_offset   = footer.pod<std::uint64_t>();
+    const auto strings_size     = footer.pod<std::uint64_t>();
+    const auto directory_offset = footer.pod<std::uint64_t>();
+
+    const std::uint64_t body_size = data.size() - footer_size;
+    if (directory_offset > body_size) {
+      ED_THROW_EXCEPTION(file_is_broken());
+    }
+    blob::reader directory(blob::slice(data, directory_offset, body_size - directory_offset));
+    const auto sheets_count = directory.pod<std::uint32_t>();
+    directory.pod<std::uint32_t>();
+    if (sheets_count == 0) {
+      ED_THROW_EXCEPTION(file_is_broken());
+    }
+
+    for (std::uint32_t i = 0; i < sheets_count; ++i) {
+      const auto offset = directory.pod<std::uint64_t>();
+      sections_.push_back(blob::slice(data, offset, directory.pod<std::uint64_t>()));
+    }
+
+    formats_data_ = blob::slice(data, formats_offset, formats_size);
+    strings_.emplace(blob::slice(data, strings_offset, strings_size));
+  }
+
+  /// Прочитать книгу, форматы и узлы листов. Содержимое листов читается сразу или откладывается (deferred_sheet).
+  void read(forest_t& forest, bool deferred) {
+    scoped_transaction tr(forest);
+
+    auto book = forest.push_back(workbook_node{});
+
+    blob::reader formats_in(formats_data_);
+    for (auto count = formats_in.pod<std::uint32_t>(); count > 0; --count) {
+      node_key_type key;
+      cell_format_node n;
+      blob::unpack(formats_in.bytes(), key, n);
+      auto node = forest.push_back(book, std::move(n));
+      formats_.push_back(forest_t::key_of(node));
+      keys_.emplace(key, formats_.back());
+      if (deferred) {
+        pinned_.push_back(node->format);
+      }
+    }
+
+    sheet_reader reader(forest, keys_, formats_, *strings_);
+    for (auto section : sections_) {
+      if (deferred) {
+        reader.sheet(section, book, std::make_shared<deferred_sheet>(shared_from_this(), section));
+      } else {
+        reader.content(section, reader.sheet(section, book, nullptr));
+      }
+    }
+
+    tr.commit();
+  }
+
+  /// Прочитать отложенное содержимое листа и снять с узла отметку в той же транзакции.
+  void read_sheet(std::string_view section, forest_t& forest, worksheet_node::it sheet) {
+    scoped_transaction tr(forest);
+    sheet_reader(forest, keys_, formats_, *strings_).content(section, sheet);
+    worksheet_node n = *sheet;
+    n.deferred = nullptr;
+    forest.modify(sheet) = std::move(n);
+    tr.commit();
+  }
+
+private:
+  std::shared_ptr<const void>         owner_;
+  std::string_view                    formats_data_;
+  std::vector<std::string_view>       sections_;
+  std::optional<string_table_reader>  strings_;
+  format_keys                         keys_;
+  std::vector<node_key_type>          formats_;
+  std::vector<cell_format::ptr>       pinned_;
+};
+
+} // namespace _
+
+
+bool starts_as_snapshot(std::string_view head) noexcept {
+  return head.size() >= sizeof(_::magic) && std::memcmp(head.data(), _::magic, sizeof(_::magic)) == 0;
+}
+
+
+bool is_snapshot_file(const std::filesystem::path& path) {
+  std::ifstream is(path, std::ios::binary);
+  char head[sizeof(_::magic)] = {};
+  is.read(head, sizeof(head));
+  return starts_as_snapshot(std::string_view(head, static_cast<std::size_t>(is.gcount())));
+}
+
+
+bool is_snapshot(std::string_view data) noexcept {
+  return data.size() >= _::head_size + _::footer_size &&
+         std::memcmp(data.data(), _::magic, sizeof(_::magic)) == 0 &&
+         std::memcmp(data.data() + data.size() - sizeof(_::magic), _::magic, sizeof(_::magic)) == 0;
+}
+
+
+std::uint32_t snapshot_generation(std::string_view head) {
+  if (head.size() < _::head_size || std::memcmp(head.data(), _::magic, sizeof(_::magic)) != 0) {
+    ED_THROW_EXCEPTION(unsupported_file_format());
+  }
+
+  blob::reader in(head.substr(sizeof(_::magic)));
+  in.pod<std::uint32_t>();
+  return in.pod<std::uint32_t>();
+}
+
+
+void write_snapshot(std::ostream& os, const forest_t& forest, std::uint32_t generation) {
+  auto books = forest.get<workbook_node>();
+  ED_EXPECTS(!books.empty());
+  auto book = books.begin();
+
+  _::format_ids format_ids;
+  blob::writer formats;
+  auto format_nodes = forest.get<cell_format_node>(book);
+  formats.pod(static_cast<std::uint32_t>(format_nodes.size()));
+  for (auto node = format_nodes.begin(); node != format_nodes.end(); ++node) {
+    const auto id = static_cast<std::uint32_t>(format_ids.size());
+    format_ids.emplace(forest_t::key_of(node), id);
+    // Вместо ключа пишется номер формата: снимок не зависит от того, какие ключи выдал лес.
+    formats.bytes(blob::pack(node_key_type(id), *node));
+  }
+
+  _::section_stream out(os);
+
+  blob::writer head;
+  head.raw(std::string_view(_::magic, sizeof(_::magic)));
+  head.pod(snapshot_version);
+  head.pod(generation);
+  out.write(head.data());
+
+  _::string_table_writer strings;
+  _::sheet_writer write_sheet(forest, format_ids, strings);
+
+  blob::writer directory;
+  auto sheets = forest.get<worksheet_node>(book);
+  directory.pod(static_cast<std::uint32_t>(sheets.size()));
+  directory.pod(std::uint32_t(0));
+  for (auto sheet = sheets.begin(); sheet != sheets.end(); ++sheet) {
+    const auto section = write_sheet(sheet);
+    directory.pod(out.write(section));
+    directory.pod(static_cast<std::uint64_t>(section.size()));
+  }
+
+  const auto strings_data = strings.finish();
+
+  blob::writer footer;
+  footer.pod(out.write(formats.data()));
+  footer.pod(static_cast<std::uint64_t>(formats.size()));
+  footer.pod(out.write(strings_data));
+  footer.pod(static_cast<std::uint64_t>(strings_data.size()));
+  footer.pod(out.write(directory.data()));
+  footer.raw(std::string_view(_::magic, sizeof(_::magic)));
+  ED_ASSERT(footer.size() == _::footer_size);
+  out.write(footer.data());
+}
+
+
+void read_snapshot(std::string_view data, forest_t& forest) {
+  _::snapshot_source(data, nullptr).read(forest, false);
+}
+
+
+void read_snapshot(const std::filesystem::path& path, forest_t& forest) {
+  namespace bip = boost::interprocess;
+
+  // Пустой файл нельзя отобразить в память.
+  if (std::filesystem::file_size(path) == 0) {
+    ED_THROW_EXCEPTION(unsupported_file_format());
+  }
+
+  // Отображение остаётся и после закрытия file, его держат отложенные листы.
+  bip::file_mapping file(path.string().c_str(), bip::read_only);
+  auto region = std::make_shared<bip::mapped_region>(file, bip::read_only);
+
+  const std::string_view data(static_cast<const char*>(region->get_address()), region->get_size());
+  std::make_shared<_::snapshot_source>(data, std::move(region))->read(forest, true);
+}
+
+
+workbook::file_reader make_snapshot_reader(workbook::file_reader legacy) {
+  return [legacy = std::move(legacy)](std::istream& is, forest_t& forest) {
+    constexpr std::size_t block_size = 1 << 20;
+
+    auto data = std::make_shared<std::string>();
+    for (;;) {
+      const auto size = data->size();
+      data->resize(size + block_size);
+      is.read(data->data() + size, block_size);
+      data->resize(size + static_cast<std::size_t>(is.gcount()));
+      if (!is) {
+        break;
+      }
+    }
+
+    if (legacy && !starts_as_snapshot(*data)) {
+      std::istringstream legacy_is(std::move(*data));
+      legacy(legacy_is, forest);
+      return;
+    }
+
+    const std::string_view view(*data);
+    std::make_shared<_::snapshot_source>(view, std::move(data))->read(forest, true);
+  };
+}
+
+
+workbook::file_writer make_snapshot_writer() {
+  return [](std::ostream& os, const forest_t& forest) {
+    write_snapshot(os, forest);
+  };
+}
+
+
+deferred_sheet::deferred_sheet(std::shared_ptr<_::snapshot_source> source, std::string_view section) noexcept
+  : source_(std::move(source))
+  , section_(section) {
+}
+
+
+deferred_sheet::~deferred_sheet() = default;
+
+
+void deferred_sheet::load(forest_t& forest, worksheet_node::it sheet) {
+  ED_EXPECTS(sheet->deferred.get() == this);
+  ED_EXPECTS(forest.get<row_node>(sheet).empty());
+  // Чтение снимает отметку с узла, без этой ссылки объект удалился бы посреди чтения.
+  const auto self = sheet->deferred;
+  source_->read_sheet(section_, forest, sheet);
+}
+
+
+} // namespace lde::cellfy::boox
@@ -1,15 +1,24 @@
 #include <lde/cellfy/boox/value_format.h>
 
 #include <algorithm>
+#include <array>
+#include <charconv>
 #include <cmath>
+#include <cstdint>
+#include <ctime>
 #include <iomanip>
 #include <iterator>
+#include <mutex>
+#include <optional>
+#include <shared_mutex>
 #include <sstream>
+#include <string>
 #include <type_traits>
+#include <unordered_map>
+#include <utility>
 
 #include <boost/algorithm/find_backward.hpp>
 #include <boost/container/small_vector.hpp>
-#include <boost/date_time/posix_time/posix_time.hpp>
 #include <boost/range/iterator_range.hpp>
 #include <boost/spirit/home/x3.hpp>
 
@@ -18,6 +27,7 @@
 #include <ed/core/unicode.h>
 
 #include <lde/cellfy/boox/cell_value.h>
+#include <lde/cellfy/boox/src/civil_date.h>
 
 
 using namespace boost::spirit;
@@ -524,19 +534,37 @@ const section* section_for_string(const section_vector& sections) noexcept {
 
 template<typename T>
 std::wstring to_string(T value, std::optional<int> width, std::optional<int> precision) {
-  static_assert(std::is_arithmetic_v<T>);
-
-  std::wstringstream stream;
-  stream << std::fixed;
-  if (width) {
-    stream << std::setw(*width) << std::setfill(L'0');
-  }
-  if (precision) {
-    stream << std::setprecision(*precision);
+  static_assert(std::is_arithmetic_v<T> && !std::is_same_v<T, bool>);
+
+  // Тот же результат, что у потока с std::fixed в классической локали (по умолчанию 6 знаков после точки),
+  // но без потока и фасетов локали.
+  std::array<char, 128> buffer;
+  std::string large;
+  char* first = buffer.data();
+  char* last = first + buffer.size();
+
+  for (;;) {
+    std::to_chars_result converted;
+    if constexpr (std::is_floating_point_v<T>) {
+      converted = std::to_chars(first, last, value, std::chars_format::fixed, precision.value_or(6));
+    } else {
+      converted = std::to_chars(first, last, value);
+    }
+    if (converted.ec == std::errc()) {
+      last = converted.ptr;
+      break;
+    }
+    large.resize(std::max<std::size_t>(large.size() * 2, 1024));
+    first = large.data();
+    last = first + large.size();
   }
-  stream << value;
 
-  std::wstring symbols = stream.str();
+  const auto length = static_cast<std::size_t>(last - first);
+  const auto fill = width && *width > 0 && static_cast<std::size_t>(*width) > length ? *width - length : 0;
+
+  std::wstring symbols(fill, L'0');
+  symbols.append(first, last);
+
   if (symbols.find(L'.') != std::wstring::npos) {
     while (!symbols.empty()) {
       if (symbols.back() == L'0') {
@@ -553,6 +581,82 @@ std::wstring to_string(T value, std::optional<int> width, std::optional<int> pre
 }
 
 
+/// Разделители чисел локали. Последняя использованная локаль запоминается для потока.
+struct number_punct final {
+  wchar_t decimal_point = L'.';
+  wchar_t thousands_sep = L',';
+};
+
+
+const number_punct& punct_of(const std::locale& loc) {
+  struct cache final {
+    std::optional<std::locale> loc;
+    number_punct               punct;
+  };
+  thread_local cache last;
+
+  if (!last.loc || *last.loc != loc) {
+    const auto& facet = std::use_facet<std::numpunct<wchar_t>>(loc);
+    last.punct.decimal_point = facet.decimal_point();
+    last.punct.thousands_sep = facet.thousands_sep();
+    last.loc = loc;
+  }
+  return last.punct;
+}
+
+
+/// Названия месяцев и дней недели локали в том виде, в котором их выводит std::put_time.
+struct date_names final {
+  std::array<std::wstring, 12> short_months;
+  std::array<std::wstring, 12> full_months;
+  std::array<std::wstring, 7>  short_days;
+  std::array<std::wstring, 7>  full_days;
+};
+
+
+/// Таблицы названий считаются один раз на локаль, последняя использованная локаль запоминается для потока.
+const date_names& date_names_of(const std::locale& loc) {
+  struct cache final {
+    std::optional<std::locale> loc;
+    date_names                 names;
+  };
+  thread_local cache last;
+
+  if (!last.loc || *last.loc != loc) {
+    std::tm tm = {};
+    auto stringify = [&tm, &loc](const wchar_t* fmt) {
+      std::wstringstream stream;
+      stream.imbue(loc);
+      stream << std::put_time(&tm, fmt);
+      return stream.str();
+    };
+
+    for (int i = 0; i < 12; ++i) {
+      tm.tm_mon = i;
+      last.names.short_months[i] = stringify(L"%b");
+      last.names.full_months[i] = stringify(L"%B");
+    }
+    for (int i = 0; i < 7; ++i) {
+      tm.tm_wday = i;
+      last.names.short_days[i] = stringify(L"%a");
+      last.names.full_days[i] = stringify(L"%A");
+    }
+    last.loc = loc;
+  }
+  return last.names;
+}
+
+
+/// Дописать число меньше 100. Ведущий ноль пишется только при pad.
+void append_two_digits(unsigned value, bool pad, std::wstring& text) {
+  ED_ASSERT(value < 100);
+  if (pad || value >= 10) {
+    text += static_cast<wchar_t>(L'0' + value / 10);
+  }
+  text += static_cast<wchar_t>(L'0' + value % 10);
+}
+
+
 std::pair<token_range, token_range> split_tokens(token_range tokens, token_type by_type) noexcept {
   auto i = std::find_if(tokens.begin(), tokens.end(), [by_type](const token& tok) {
     return tok.type == by_type;
@@ -753,7 +857,7 @@ void format_number_by_default(double value, const std::locale& loc, value_format
   // Поэтому в поток не задаётся локаль, а только заменяется разделитель.
   result.text = to_string(value, std::nullopt, std::nullopt);
   if (auto pos = result.text.find(L'.'); pos != std::wstring::npos) {
-    result.text[pos] = std::use_facet<std::numpunct<wchar_t>>(loc).decimal_point();
+    result.text[pos] = punct_of(loc).decimal_point;
   }
 }
 
@@ -788,13 +892,13 @@ void format_number(double value, token_range tokens, section_number s_number, co
   if (!integer_tokens.empty()) {
     std::optional<wchar_t> thousand_sep;
     if (std::any_of(tokens.begin(), last_placeholder_it, is_thousand_separator)) {
-      thousand_sep = std::use_facet<std::numpunct<wchar_t>>(loc).thousands_sep();
+      thousand_sep = punct_of(loc).thousands_sep;
     }
     format_integer_symbols(integer_symbols, integer_tokens, thousand_sep, result);
   }
 
   if (!decimal_tokens.empty()) {
-    result.text += std::use_facet<std::numpunct<wchar_t>>(loc).decimal_point();
+    result.text += punct_of(loc).decimal_point;
     format_decimal_symbols(decimal_symbols, decimal_tokens, result);
   }
 }
@@ -954,32 +1058,23 @@ void format_date(double value, token_range tokens, const std::locale& loc, value
     _::format_error(result);
     return;
   }
-  std::tm tm;
 
-  try {
-    const auto p_time =  cell_value(value).to<boost::posix_time::ptime>();
-    const auto rounded_sec = std::round(p_time.time_of_day().total_milliseconds() / 1000.);
-    tm = boost::posix_time::to_tm(boost::posix_time::ptime(p_time.date(), boost::posix_time::seconds(static_cast<long long>(rounded_sec))));
-  } catch (const std::exception&) {
+  const auto dt = civil::from_serial(value);
+  if (!dt) {
     _::format_error(result);
     return;
   }
 
-  auto stringify = [&tm, &loc](const wchar_t* fmt) {
-    std::wstringstream stream;
-    stream.imbue(loc);
-    stream << std::put_time(&tm, fmt);
-    return stream.str();
-  };
+  const auto& names = date_names_of(loc);
 
   for (auto tok_it = tokens.begin(); tok_it != tokens.end(); ++tok_it) {
     switch (tok_it->type) {
     case token_type::yy:
-      result.text += std::to_wstring((tm.tm_year + 1900) % 100);
+      result.text += std::to_wstring(dt->year % 100);
       break;
 
     case token_type::yyyy:
-      result.text += std::to_wstring(tm.tm_year + 1900);
+      result.text += std::to_wstring(dt->year);
       break;
 
     // Месяц или минута. Если предыдущий токен час или последующий токен секунда, то это минута.
@@ -999,85 +1094,59 @@ void format_date(double value, token_range tokens, const std::locale& loc, value
             }
           }
         }
-        if (is_month) {
-          std::wstring str = std::to_wstring(tm.tm_mon + 1);
-          if (tok_it->type == token_type::mm && str.size() < 2) {
-            result.text += L'0';
-          }
-          result.text += str;
-        } else {
-          std::wstring str = stringify(L"%M");
-          ED_ASSERT(str.size() == 2);
-          if (tok_it->type == token_type::m && str.front() == L'0') {
-            result.text += str.back();
-          } else {
-            result.text += str;
-          }
-        }
+        append_two_digits(is_month ? dt->month : dt->minute, tok_it->type == token_type::mm, result.text);
       }
       break;
 
     case token_type::mmm:
-      result.text += stringify(L"%b");
+      result.text += names.short_months[dt->month - 1];
       break;
 
     case token_type::mmmm:
-      result.text += stringify(L"%B");
+      result.text += names.full_months[dt->month - 1];
       break;
 
     case token_type::mmmmm:
-      result.text += stringify(L"%b").front();
+      result.text += names.short_months[dt->month - 1].front();
       break;
 
     case token_type::d:
-      result.text += std::to_wstring(tm.tm_mday);
-      break;
-
     case token_type::dd:
-      result.text += stringify(L"%d");
+      append_two_digits(dt->day, tok_it->type == token_type::dd, result.text);
       break;
 
     case token_type::ddd:
-      result.text += stringify(L"%a");
+      result.text += names.short_days[dt->weekday];
       break;
 
     case token_type::dddd:
-      result.text += stringify(L"%A");
+      result.text += names.full_days[dt->weekday];
       break;
 
     case token_type::h:
     case token_type::hh: {
-        std::wstring str = std::any_of(tokens.begin(), tokens.end(), is_am_pm) ? stringify(L"%I") : stringify(L"%H");
-        ED_ASSERT(str.size() == 2);
-        if (tok_it->type == token_type::h && str.front() == L'0') {
-          result.text += str.back();
-        } else {
-          result.text += str;
+        auto hour = dt->hour;
+        if (std::any_of(tokens.begin(), tokens.end(), is_am_pm)) {
+          hour = hour % 12 == 0 ? 12 : hour % 12;
         }
+        append_two_digits(hour, tok_it->type == token_type::hh, result.text);
       }
       break;
 
     case token_type::s:
-    case token_type::ss: {
-        std::wstring str = stringify(L"%S");
-        ED_ASSERT(str.size() == 2);
-        if (tok_it->type == token_type::s && str.front() == L'0') {
-          result.text += str.back();
-        } else {
-          result.text += str;
-        }
-      }
+    case token_type::ss:
+      append_two_digits(dt->second, tok_it->type == token_type::ss, result.text);
       break;
 
     case token_type::am_pm:
       if (tok_it->text.size() == 3) {
-        if (tm.tm_hour < 12) {
+        if (dt->hour < 12) {
           result.text += tok_it->text[0];
         } else {
           result.text += tok_it->text[2];
         }
       } else if (tok_it->text.size() == 5) {
-        if (tm.tm_hour < 12) {
+        if (dt->hour < 12) {
           result.text += tok_it->text.substr(0, 2);
         } else {
           result.text += tok_it->text.substr(3, 2);
@@ -1096,25 +1165,21 @@ void format_date(double value, token_range tokens, const std::locale& loc, value
 
 
 void format_duration(double value, token_range tokens, const std::locale& loc, value_format::result& result) {
-  // В продолжительности не должно быть больше 3 токенов '0'
+  // В продолжительности не должно быть больше 3 токенов '0', миллисекунды должны помещаться в std::int64_t.
   const auto zero_tokens = number_of_token(tokens, token_type::zero);
-  if (value < 0 || zero_tokens > 3) {
+  if (value < 0 || zero_tokens > 3 || value * civil::ms_per_day >= 9.2e18) {
     _::format_error(result);
     return;
   }
 
   // Если количетсво токенов '0' больше нуля, то не происходит округление в большую сторону и выводятся миллисекунды.
-  boost::posix_time::time_duration duration;
-  if (zero_tokens > 0) {
-    duration = cell_value(value).to<boost::posix_time::time_duration>();
-  } else {
-    const auto temp = cell_value(value).to<boost::posix_time::time_duration>();
-    const auto rounded_sec = std::round(temp.total_milliseconds() / 1000.);
-    duration = boost::posix_time::seconds(static_cast<long long>(rounded_sec));
+  auto duration = static_cast<std::int64_t>(value * civil::ms_per_day);
+  if (zero_tokens == 0) {
+    duration = static_cast<std::int64_t>(std::round(duration / 1000.)) * 1000;
   }
 
-  auto milliseconds = duration.total_milliseconds() - duration.total_seconds() * 1000; // Получаем миллисекунды
-  auto pow          = 2;                                                               // Для разбиения на десятичные разряды (сотни, десятки, еденицы)
+  auto milliseconds = duration % 1000; // Получаем миллисекунды
+  auto pow          = 2;               // Для разбиения на десятичные разряды (сотни, десятки, еденицы)
   for (auto& tok : tokens) {
     switch (tok.type) {
     case token_type::m:
@@ -1122,32 +1187,32 @@ void format_duration(double value, token_range tokens, const std::locale& loc, v
     case token_type::mmm:
     case token_type::mmmm:
     case token_type::mmmmm:
-      result.text += to_string(duration.minutes(), tok.text.size(), 0);
+      result.text += to_string(duration / (60 * 1000) % 60, tok.text.size(), 0);
       break;
 
     case token_type::s:
     case token_type::ss:
-      result.text += to_string(duration.seconds(), tok.text.size(), 0);
+      result.text += to_string(duration / 1000 % 60, tok.text.size(), 0);
       break;
 
     case token_type::h_sqb: {
-      auto total_h = duration.total_seconds() / (60 * 60);
+      auto total_h = duration / (60 * 60 * 1000);
       result.text += to_string(total_h, tok.text.size(), 0);
-      duration -= boost::posix_time::hours(total_h);
+      duration -= total_h * 60 * 60 * 1000;
     }
     break;
 
     case token_type::m_sqb: {
-      auto total_m = duration.total_seconds() / 60;
+      auto total_m = duration / (60 * 1000);
       result.text += to_string(total_m, tok.text.size(), 0);
-      duration -= boost::posix_time::minutes(total_m);
+      duration -= total_m * 60 * 1000;
     }
     break;
 
     case token_type::s_sqb: {
-      auto total_s = duration.total_seconds();
+      auto total_s = duration / 1000;
       result.text += to_string(total_s, tok.text.size(), 0);
-      duration -= boost::posix_time::seconds(total_s);
+      duration -= total_s * 1000;
     }
     break;
     case token_type::zero: {
@@ -1256,6 +1321,61 @@ value_format::value_format(const std::wstring& format, std::locale loc)
 value_format::~value_format() = default;
 
 
+value_format::ptr value_format::compiled(const std::wstring& format, const std::locale& loc) {
+  // Количество разных форматов в книгах невелико, но строки вводятся пользователем.
+  // При переполнении кэш просто очищается, выданные объекты продолжают жить у владельцев.
+  constexpr std::size_t max_size = 1024;
+
+  using entries = std::vector<std::pair<std::locale, ptr>>;
+  static std::shared_mutex                         mutex;
+  static std::unordered_map<std::wstring, entries> cache;
+
+  // Ячейки подряд обычно в одном формате: "General" или простая маска вроде "0.00".
+  // Последний формат потока отдаётся без блокировки и поиска по общему кэшу.
+  thread_local std::wstring last_format;
+  thread_local std::locale  last_loc;
+  thread_local ptr          last;
+
+  if (last && last_format == format && last_loc == loc) {
+    return last;
+  }
+
+  auto remember = [&format, &loc](const ptr& fmt) {
+    last_format = format;
+    last_loc = loc;
+    last = fmt;
+    return fmt;
+  };
+
+  {
+    std::shared_lock lock(mutex);
+    if (auto i = cache.find(format); i != cache.end()) {
+      for (auto& [l, fmt] : i->second) {
+        if (l == loc) {
+          return remember(fmt);
+        }
+      }
+    }
+  }
+
+  auto result = std::make_shared<const value_format>(format, loc);
+
+  std::unique_lock lock(mutex);
+  if (cache.size() >= max_size) {
+    cache.clear();
+  }
+
+  auto& list = cache[format];
+  for (auto& [l, fmt] : list) {
+    if (l == loc) {
+      return remember(fmt);
+    }
+  }
+  list.emplace_back(loc, result);
+  return remember(result);
+}
+
+
 value_format::result value_format::operator()(const cell_value& value) const {
   value_format::result result;
 
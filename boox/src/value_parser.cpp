@@ -1,12 +1,17 @@
 ﻿#include <lde/cellfy/boox/src/value_parser.h>
 
 #include <cmath>
-#include <ctime>
+#include <cstdint>
+#include <cwctype>
+#include <memory>
+#include <mutex>
 #include <optional>
+#include <shared_mutex>
 #include <tuple>
 #include <type_traits>
 #include <utility>
 #include <variant>
+#include <vector>
 
 #include <boost/date_time.hpp>
 #include <boost/format.hpp>
@@ -14,6 +19,8 @@
 
 #include <ed/core/assert.h>
 
+#include <lde/cellfy/boox/src/civil_date.h>
+
 
 namespace lde::cellfy::boox  {
 
@@ -134,35 +141,21 @@ std::pair<std::size_t, std::size_t> brut_frac(double desired_fraction, double ep
 
 
 bool validate_dmy(const date_time& date) {
-  std::tm t = {
-    .tm_mday = date.day.first,
-    .tm_mon  = date.month.first,
-    .tm_year = date.year.first
-  };
-  std::tm copy = t;
-  std::mktime(&copy);
-  return t.tm_mday == copy.tm_mday &&
-         t.tm_mon  == copy.tm_mon &&
-         t.tm_year == copy.tm_year;
+  const int year = date.year.first + 1900;
+  const auto month = static_cast<unsigned>(date.month.first + 1);
+  return year >= civil::min_year && year <= civil::max_year &&
+         month >= 1 && month <= 12 &&
+         date.day.first >= 1 && static_cast<unsigned>(date.day.first) <= civil::last_day_of_month(year, month);
 }
 
 
 std::pair<cell_value, std::wstring> cell_value_from_time(const date_time& time) {
-  using namespace boost::posix_time;
-  using namespace boost::gregorian;
-
-  ptime ptime{
-    date{
-      static_cast<date::year_type>(time.year.first + 1900),
-      static_cast<date::month_type>(time.month.first + 1),
-      static_cast<date::day_type>(time.day.first)
-    },
-    time_duration{
-      static_cast<time_duration::hour_type>(time.hours.first),
-      static_cast<time_duration::min_type>(time.minute.first),
-      static_cast<time_duration::sec_type>(time.sec.first)
-    }
-  };
+  const std::int64_t seconds = (static_cast<std::int64_t>(time.hours.first) * 60 + time.minute.first) * 60 + time.sec.first;
+  const double value = civil::to_serial(
+    time.year.first + 1900,
+    static_cast<unsigned>(time.month.first + 1),
+    static_cast<unsigned>(time.day.first),
+    seconds * 1000);
 
   std::wstring result;
 
@@ -178,33 +171,29 @@ std::pair<cell_value, std::wstring> cell_value_from_time(const date_time& time)
     result += time.date_separator + time.year.second;
   }
 
-  auto time_of_day = ptime.time_of_day();
-  if (time_of_day.seconds() != 0) {
+  const auto time_of_day = seconds % (24 * 60 * 60);
+  if (time_of_day % 60 != 0) {
     result += L' ' + time.hours.second + L":mm:" + time.sec.second;
-  } else if (time_of_day.minutes() != 0) {
+  } else if (time_of_day / 60 % 60 != 0) {
     result += L' ' + time.hours.second + L":" + time.minute.second + L":ss";
-  } else if (time_of_day.hours() != 0) {
+  } else if (time_of_day / (60 * 60) != 0) {
     result += L' ' + time.hours.second + L":mm";
   }
 
-  return {ptime, std::move(result)};
+  return {value, std::move(result)};
 }
 
 
 std::pair<cell_value, std::wstring> cell_value_from_duration(const duration& time) {
-  using namespace boost::posix_time;
-
-  time_duration dur_out{
-    static_cast<time_duration::hour_type>(time.hours.value_or(0)),
-    static_cast<time_duration::min_type>(time.min.value_or(0)),
-    static_cast<time_duration::sec_type>(time.sec.value_or(0)),
-    static_cast<time_duration::fractional_seconds_type>(time.milliseconds.value_or(0) * 1000)
-  };
+  const std::int64_t milliseconds =
+    ((static_cast<std::int64_t>(time.hours.value_or(0)) * 60 + time.min.value_or(0)) * 60 + time.sec.value_or(0)) * 1000 +
+    time.milliseconds.value_or(0);
+  const auto hours = milliseconds / (60 * 60 * 1000);
 
   std::wstring result;
-  std::wstring hours_format = dur_out.hours() < 10 ? L"h:"
-                                                   : dur_out.hours() < 24 ? L"hh:"
-                                                                          : L"[h]:";
+  std::wstring hours_format = hours < 10 ? L"h:"
+                                         : hours < 24 ? L"hh:"
+                                                      : L"[h]:";
   if (time.sec) {
     result += hours_format + L"mm:ss";
   } else if (time.min) {
@@ -213,7 +202,7 @@ std::pair<cell_value, std::wstring> cell_value_from_duration(const duration& tim
     result += hours_format + L"mm";
   }
 
-  return {dur_out, std::move(result)};
+  return {static_cast<double>(milliseconds) / static_cast<double>(civil::ms_per_day), std::move(result)};
 }
 
 
@@ -402,34 +391,45 @@ auto create_duration_rule() {
 };
 
 
-auto create_number_rule(std::wstring& number_format, const std::locale& loc) {
+/// Число и формат, найденные create_number_rule.
+struct number final {
+  double       value = 0.;
+  std::wstring format;
+};
+
+
+auto create_number_rule(wchar_t decimal_point) {
   using namespace boost::spirit::x3;
 
   real_parser<double, _::delimeter_real_polices<double>> ts_real;
-  ts_real.policies.dot = std::use_facet<std::numpunct<wchar_t>>(loc).decimal_point();
+  ts_real.policies.dot = decimal_point;
 
   const auto number_callback  = [](auto& ctx) {
-    get<double>(ctx) = _attr(ctx);
+    get<number>(ctx).value = _attr(ctx);
   };
 
-  const auto percent_callback = [&number_format](auto& ctx) {
-    number_format = L"0.00%";
-    get<double>(ctx) /= 100;
+  const auto percent_callback = [](auto& ctx) {
+    auto& n = get<number>(ctx);
+    n.format = L"0.00%";
+    n.value /= 100;
   };
 
-  const auto post_currency_callback = [&number_format](auto& ctx) {
-    number_format = L"#,##0.00 ";
-    number_format += _attr(ctx);
+  const auto post_currency_callback = [](auto& ctx) {
+    auto& n = get<number>(ctx);
+    n.format = L"#,##0.00 ";
+    n.format += _attr(ctx);
   };
 
-  const auto pref_currency_callback = [&number_format](auto& ctx) {
-    number_format = _attr(ctx);
-    number_format += L" #,##0.00";
+  const auto pref_currency_callback = [](auto& ctx) {
+    auto& n = get<number>(ctx);
+    n.format = _attr(ctx);
+    n.format += L" #,##0.00";
   };
 
-  const auto exponent_callback = [&number_format](auto& ctx) {
-    number_format = L"0.00E+00";
-    get<double>(ctx) *= std::pow(10, _attr(ctx));
+  const auto exponent_callback = [](auto& ctx) {
+    auto& n = get<number>(ctx);
+    n.format = L"0.00E+00";
+    n.value *= std::pow(10, _attr(ctx));
   };
 
   // Форматы :
@@ -529,39 +529,110 @@ auto create_variant_from_pair(F&& f, S&& s) {
 }
 
 
+/// Правила x3_parser. Строятся один раз, от локали зависит только десятичный разделитель.
+/// Правила не изменяются при разборе и могут использоваться из нескольких потоков.
+class grammar final {
+public:
+  explicit grammar(wchar_t decimal_point)
+    : date_rule(create_date_rule())
+    , duration_rule(create_duration_rule())
+    , number_rule(create_number_rule(decimal_point))
+    , bool_rule(create_bool_rule()) {
+  }
+
+  grammar(const grammar&) = delete;
+  grammar& operator=(const grammar&) = delete;
+
+  static const grammar& of(const std::locale& loc) {
+    using entries = std::vector<std::pair<wchar_t, std::unique_ptr<const grammar>>>;
+    static std::shared_mutex mutex;
+    static entries           cache;
+
+    const wchar_t decimal_point = std::use_facet<std::numpunct<wchar_t>>(loc).decimal_point();
+
+    {
+      std::shared_lock lock(mutex);
+      for (auto& [dp, g] : cache) {
+        if (dp == decimal_point) {
+          return *g;
+        }
+      }
+    }
+
+    auto result = std::make_unique<const grammar>(decimal_point);
+
+    std::unique_lock lock(mutex);
+    for (auto& [dp, g] : cache) {
+      if (dp == decimal_point) {
+        return *g;
+      }
+    }
+    return *cache.emplace_back(decimal_point, std::move(result)).second;
+  }
+
+public:
+  const decltype(create_date_rule())       date_rule;
+  const decltype(create_duration_rule())   duration_rule;
+  const decltype(create_number_rule(L'.')) number_rule;
+  const decltype(create_bool_rule())       bool_rule;
+};
+
+
 /// @brief Парсим строку и получаем дату, процент c форматом, если он есть.
 /// Ищем dd mm yyyy, dd mmmm yyyy, dd mm, dd mmmm, mmmm yyyy, mm yyyy, double%.
 /// Если ничего не найдено, возвращаем std::variant с пустой строкой.
 variant x3_parser(const std::wstring& text, bool mixed_fraction_search, const std::locale& loc) {
   using namespace boost::spirit::x3;
 
-  std::wstring number_format;
-  const auto date_rule     = create_date_rule();
-  const auto duration_rule = create_duration_rule();
-  const auto number_rule   = create_number_rule(number_format, loc);
-  const auto bool_rule     = create_bool_rule();
+  if (text.empty()) {
+    return std::wstring{};
+  }
+
+  const auto& rules = grammar::of(loc);
+
+  // Ветки, которые заведомо не подойдут, не пробуем: дробь есть только с '/', дата - с '.' или '/',
+  // продолжительность начинается с цифры и содержит ':', логическое значение начинается с буквы.
+  const bool is_digit_first = std::iswdigit(text.front()) != 0;
+  const bool has_slash      = text.find(L'/') != std::wstring::npos;
+  const bool has_date_sep   = has_slash || text.find(L'.') != std::wstring::npos;
+  const bool has_time_sep   = is_digit_first && text.find(L':') != std::wstring::npos;
+  const bool may_be_bool    = std::iswalpha(text.front()) != 0;
 
-  _::date_time time;
-  _::duration dur;
-  double number;
-  bool bool_result;
-  x3_rule::result fraction_result;
   decltype (text.begin()) beg;
 
   // Ищем дробь. Есть два паттерна поиска. 1 - Ищем целую часть и дробную. 2 - Целая часть опциональна, но дробную так же ищем.
-  if (mixed_fraction_search ? parse(beg = text.begin(), text.end(), x3_rule::opt_mixed_fraction, fraction_result)
-                            : parse(beg = text.begin(), text.end(), x3_rule::mixed_fraction, fraction_result) && beg == text.end()) {
-    return fraction_result;
+  if (has_slash) {
+    x3_rule::result fraction_result;
+    if (mixed_fraction_search ? parse(beg = text.begin(), text.end(), x3_rule::opt_mixed_fraction, fraction_result)
+                              : parse(beg = text.begin(), text.end(), x3_rule::mixed_fraction, fraction_result) && beg == text.end()) {
+      return fraction_result;
+    }
+  }
+
   // Ищем дату.
-  } else if (parse(beg = text.begin(), text.end(), with<_::date_time>(time)[date_rule]) && beg == text.end()) {
-    return time;
+  if (has_date_sep) {
+    _::date_time time;
+    if (parse(beg = text.begin(), text.end(), with<_::date_time>(time)[rules.date_rule]) && beg == text.end()) {
+      return time;
+    }
+  }
+
   // Ищем продолжительность.
-  } else if (parse(beg = text.begin(), text.end(), with<_::duration>(dur)[duration_rule]) && beg == text.end()) {
-    return dur;
+  if (has_time_sep) {
+    _::duration dur;
+    if (parse(beg = text.begin(), text.end(), with<_::duration>(dur)[rules.duration_rule]) && beg == text.end()) {
+      return dur;
+    }
+  }
+
   // Ищем число/процент.
-  } else if (parse(beg = text.begin(), text.end(), with<double>(number)[number_rule]) && beg == text.end()) {
-    return create_variant_from_pair<pair<double>>(number, std::move(number_format));
-  } else if (parse(beg = text.begin(), text.end(), bool_rule, bool_result)) {
+  _::number num;
+  if (parse(beg = text.begin(), text.end(), with<_::number>(num)[rules.number_rule]) && beg == text.end()) {
+    return create_variant_from_pair<pair<double>>(num.value, std::move(num.format));
+  }
+
+  bool bool_result;
+  if (may_be_bool && parse(beg = text.begin(), text.end(), rules.bool_rule, bool_result)) {
     return bool_result;
   }
   return std::wstring{};
@@ -580,7 +651,6 @@ value_parser::value_with_format value_parser::operator()(const std::wstring& tex
   return std::visit (
     [&text](auto&& arg) {
       using T = std::decay_t<decltype(arg)>;
-      using boost::gregorian::date;
       if constexpr (std::is_same_v<T, _::date_time>) {
         return _::validate_dmy(arg) ? _::cell_value_from_time(arg)
                                     : value_with_format{text, {}};
@@ -1,7 +1,15 @@
 #include <lde/cellfy/boox/workbook.h>
 
+#include <algorithm>
+#include <chrono>
+#include <fstream>
+#include <ios>
 #include <iterator>
+#include <ostream>
+#include <unordered_map>
+#include <utility>
 
+#include <boost/functional/hash.hpp>
 #include <boost/range/adaptor/map.hpp>
 
 #include <ed/core/assert.h>
@@ -9,10 +17,119 @@
 
 #include <lde/cellfy/boox/exception.h>
 #include <lde/cellfy/boox/scoped_transaction.h>
+#include <lde/cellfy/boox/snapshot.h>
 
 
 namespace lde::cellfy::boox {
 
+namespace _ {
+namespace {
+
+
+/// Формат копии: ключ в лесу копии и сам формат.
+using copied_formats = std::unordered_map<node_key_type, std::pair<node_key_type, cell_format::ptr>, boost::hash<node_key_type>>;
+
+
+/// Узел со ссылкой на формат копии. Узел без ключа формата не держит и формат книги.
+template<typename Node>
+Node copy_node(const Node& n, const copied_formats& formats) {
+  Node copy = n;
+  if (n.format_key) {
+    auto& [key, format] = formats.at(*n.format_key);
+    copy.format_key = key;
+    copy.format = format;
+  } else {
+    copy.format = nullptr;
+  }
+  return copy;
+}
+
+
+/// Копия книги в отдельном лесу для фоновой записи.
+/// Строки ячеек разделяются с книгой: shared_string неизменяема, а пул строк потокобезопасен.
+/// Форматы копируются, чтобы ссылки из копии не мешали книге собирать неиспользуемые форматы.
+std::unique_ptr<forest_t> copy_forest(const forest_t& from, workbook_node::it book) {
+  auto to = std::make_unique<forest_t>();
+
+  // Та же схема, что у леса книги.
+  auto& book_meta = to->allow<workbook_node>(1, 1);
+  book_meta.allow<cell_format_node>(0, forest::infinite);
+  auto& sheet_meta = book_meta.allow<worksheet_node>(1, forest::infinite);
+  sheet_meta.allow<column_node>(0, forest::infinite);
+  auto& row_meta = sheet_meta.allow<row_node>(0, forest::infinite);
+  sheet_meta.allow<format_run_node>(0, forest::infinite);
+  auto& cell_meta = row_meta.allow<cell_node>(0, forest::infinite);
+  cell_meta.allow<cell_data_node>(0, 1);
+  cell_meta.allow<cell_formula_node>(0, 1);
+  cell_meta.allow<text_run_node>(0, forest::infinite);
+
+  scoped_transaction tr(*to);
+  auto to_book = to->push_back(workbook_node(*book));
+
+  copied_formats formats;
+  auto format_nodes = from.get<cell_format_node>(book);
+  for (auto node = format_nodes.begin(); node != format_nodes.end(); ++node) {
+    cell_format_node n;
+    n.format = std::make_shared<cell_format>(*node->format);
+    auto format = n.format;
+    formats.emplace(forest_t::key_of(node), std::pair(forest_t::key_of(to->push_back(to_book, std::move(n))), std::move(format)));
+  }
+
+  auto sheets = from.get<worksheet_node>(book);
+  for (auto sheet = sheets.begin(); sheet != sheets.end(); ++sheet) {
+    auto sheet_copy = copy_node(*sheet, formats);
+    sheet_copy.sheet = nullptr;
+    sheet_copy.deferred = nullptr;
+    auto to_sheet = to->push_back(to_book, std::move(sheet_copy));
+
+    for (auto& column : from.get<column_node>(sheet)) {
+      to->push_back(to_sheet, copy_node(column, formats));
+    }
+
+    for (auto& run : from.get<format_run_node>(sheet)) {
+      to->push_back(to_sheet, copy_node(run, formats));
+    }
+
+    auto rows = from.get<row_node>(sheet);
+    for (auto row = rows.begin(); row != rows.end(); ++row) {
+      auto to_row = to->push_back(to_sheet, copy_node(*row, formats));
+
+      auto cells = from.get<cell_node>(row);
+      for (auto cell = cells.begin(); cell != cells.end(); ++cell) {
+        // Layout книги в копию не попадает: его кэш и счётчики ссылок остаются в потоке книги.
+        auto cell_copy = copy_node(*cell, formats);
+        cell_copy.merged_with_node = nullptr;
+        cell_copy.layout = nullptr;
+        cell_copy.is_layout_dirty = true;
+        auto to_cell = to->push_back(to_row, std::move(cell_copy));
+
+        for (auto& data : from.get<cell_data_node>(cell)) {
+          to->push_back(to_cell, cell_data_node(data));
+        }
+
+        // Разобранная формула в копии не нужна, записи нужны текст и результат.
+        for (auto& formula : from.get<cell_formula_node>(cell)) {
+          cell_formula_node n;
+          n.formula = formula.formula;
+          n.is_result_dirty = formula.is_result_dirty;
+          n.result = formula.result;
+          to->push_back(to_cell, std::move(n));
+        }
+
+        for (auto& run : from.get<text_run_node>(cell)) {
+          to->push_back(to_cell, text_run_node(run));
+        }
+      }
+    }
+  }
+
+  tr.commit();
+  to->clear_undo_stack();
+  return to;
+}
+
+}} // namespace _
+
 
 workbook::workbook() {
   can_undo.attach(can_undo_);
@@ -25,6 +142,7 @@ workbook::workbook() {
   auto& sheet_meta = book_meta.allow<worksheet_node>(1, forest::infinite);
   auto& column_meta = sheet_meta.allow<column_node>(0, forest::infinite);
   auto& row_meta = sheet_meta.allow<row_node>(0, forest::infinite);
+  auto& format_run_meta = sheet_meta.allow<format_run_node>(0, forest::infinite);
   auto& cell_meta = row_meta.allow<cell_node>(0, forest::infinite);
   auto& cell_data_meta = cell_meta.allow<cell_data_node>(0, 1);
   auto& cell_formula_meta = cell_meta.allow<cell_formula_node>(0, 1);
@@ -41,17 +159,7 @@ workbook::workbook() {
   forest_conns_.emplace_back(forest_.changes_finished += [this](forest::changes_cause cause) {
     // Удаление не используемых форматов
     if (cause == forest::changes_cause::commit) {
-      ED_ASSERT(forest_.in_transaction());
-      ed::scoped_assign _(formats_gc_at_work_, true);
-
-      for (auto i = cell_formats_.begin(); i != cell_formats_.end();) {
-        if ((*i)->format.use_count() == 1) {
-          forest_.erase((*i));
-          i = cell_formats_.erase(i);
-        } else {
-          ++i;
-        }
-      }
+      collect_formats();
     }
 
     for (auto&& sheet : sheets_) {
@@ -131,6 +239,7 @@ workbook::workbook() {
   });
 
   forest_conns_.emplace_back(column_meta.erased += [this](column_node::it node) {
+    release_format(node->format_key);
     auto sheet_node = forest_.ancestor<worksheet_node>(node);
     ED_ASSERT(sheet_node->sheet);
     sheet_node->sheet->erased(node);
@@ -149,6 +258,7 @@ workbook::workbook() {
   });
 
   forest_conns_.emplace_back(row_meta.erased += [this](row_node::it node) {
+    release_format(node->format_key);
     auto sheet_node = forest_.ancestor<worksheet_node>(node);
     ED_ASSERT(sheet_node->sheet);
     sheet_node->sheet->erased(node);
@@ -160,6 +270,25 @@ workbook::workbook() {
     sheet_node->sheet->modified(node);
   });
 
+  forest_conns_.emplace_back(format_run_meta.inserted += [this](format_run_node::it node) {
+    auto sheet_node = forest_.ancestor<worksheet_node>(node);
+    ED_ASSERT(sheet_node->sheet);
+    sheet_node->sheet->inserted(node);
+  });
+
+  forest_conns_.emplace_back(format_run_meta.erased += [this](format_run_node::it node) {
+    release_format(node->format_key);
+    auto sheet_node = forest_.ancestor<worksheet_node>(node);
+    ED_ASSERT(sheet_node->sheet);
+    sheet_node->sheet->erased(node);
+  });
+
+  forest_conns_.emplace_back(format_run_meta.modified += [this](format_run_node::it node) {
+    auto sheet_node = forest_.ancestor<worksheet_node>(node);
+    ED_ASSERT(sheet_node->sheet);
+    sheet_node->sheet->modified(node);
+  });
+
   forest_conns_.emplace_back(cell_meta.inserted += [this](cell_node::it node) {
     auto sheet_node = forest_.ancestor<worksheet_node>(node);
     ED_ASSERT(sheet_node->sheet);
@@ -167,6 +296,7 @@ workbook::workbook() {
   });
 
   forest_conns_.emplace_back(cell_meta.erased += [this](cell_node::it node) {
+    release_format(node->format_key);
     auto sheet_node = forest_.ancestor<worksheet_node>(node);
     ED_ASSERT(sheet_node->sheet);
     sheet_node->sheet->erased(node);
@@ -232,10 +362,20 @@ workbook::workbook() {
     sheet_node->sheet->modified(node);
   });
 
+  file_readers_[ed::mime_type::known::application_x_cellfy] = make_snapshot_reader();
+  add_file_writer(ed::mime_type::known::application_x_cellfy, make_snapshot_writer());
+
   open();
 }
 
 
+workbook::~workbook() {
+  if (background_save_.valid()) {
+    background_save_.wait();
+  }
+}
+
+
 workbook_node::it workbook::node() const noexcept {
   return book_node_;
 }
@@ -320,10 +460,11 @@ worksheet& workbook::emplace_sheet(std::size_t index) {
   }
   n.name = name;
 
+  scoped_transaction tr(*this);
+
   auto pos = forest_.get<worksheet_node>(book_node_).begin();
   std::advance(pos, index);
 
-  scoped_transaction tr(forest_);
   auto sheet_node = forest_.insert(book_node_, pos, std::move(n));
   tr.commit();
 
@@ -332,15 +473,81 @@ worksheet& workbook::emplace_sheet(std::size_t index) {
 }
 
 
+void workbook::load_sheet(const worksheet& sheet) const {
+  const auto deferred = sheet.node()->deferred;
+  if (!deferred) {
+    return;
+  }
+
+  // Чтение не меняет книгу: узлы листа появляются без сигналов, как при открытии. В чистой истории оно
+  // не оставляет следа. После изменений лес заносит чтение в историю: внутри транзакции оно входит в неё,
+  // иначе становится отдельным шагом, который undo и redo проходят вместе с соседним (history_step::load).
+  auto& self = const_cast<workbook&>(*this);
+  const bool in_transaction = forest_.in_transaction();
+  const bool clean_history = !in_transaction && !forest_.can_undo() && !forest_.can_redo();
+  for (auto& conn : self.forest_conns_) {
+    conn.block(true);
+  }
+  try {
+    deferred->load(self.forest_, sheet.node());
+  } catch (...) {
+    for (auto& conn : self.forest_conns_) {
+      conn.block(false);
+    }
+    throw;
+  }
+  for (auto& conn : self.forest_conns_) {
+    conn.block(false);
+  }
+  if (clean_history) {
+    self.forest_.clear_undo_stack();
+  } else if (!in_transaction) {
+    self.history_committed(true);
+  }
+
+  const_cast<worksheet&>(sheet).actualize();
+
+  // Формулы считаются по уже прочитанным листам: чтение посреди расчёта меняло бы лес под обходом ячеек. CEL-314.
+  for (auto& name : sheet.referenced_sheets_) {
+    if (auto other = sheet_by_name(name)) {
+      load_sheet(*other);
+    }
+  }
+}
+
+
+void workbook::load_sheets() const {
+  for (auto& sheet : sheets_) {
+    load_sheet(sheet);
+  }
+}
+
+
 void workbook::undo() {
-  if (forest_.can_undo()) {
+  // Чтение листа после изменений не видно пользователю и отменяется вместе с изменением под ним.
+  while (forest_.can_undo()) {
+    const bool load = !undo_steps_.empty() && undo_steps_.back().load;
+    if (!undo_steps_.empty()) {
+      redo_steps_.push_back(std::move(undo_steps_.back()));
+      undo_steps_.pop_back();
+    }
     forest_.undo();
+    if (!load) {
+      break;
+    }
   }
 }
 
 
 void workbook::redo() {
-  if (forest_.can_redo()) {
+  // Повтор изменения повторяет и чтения листов, сделанные сразу после него.
+  bool first = true;
+  while (forest_.can_redo() && (first || (!redo_steps_.empty() && redo_steps_.back().load))) {
+    first = false;
+    if (!redo_steps_.empty()) {
+      undo_steps_.push_back(std::move(redo_steps_.back()));
+      redo_steps_.pop_back();
+    }
     forest_.redo();
   }
 }
@@ -368,7 +575,12 @@ workbook::mimes_range workbook::writable_file_formats() const noexcept {
 
 void workbook::add_file_reader(const ed::mime_type& format, file_reader&& fn) {
   ED_EXPECTS(fn);
-  file_readers_[format] = std::move(fn);
+  // Снимки книга читает сама, а внешняя функция остаётся для файлов прежнего формата.
+  if (format == ed::mime_type::known::application_x_cellfy) {
+    file_readers_[format] = make_snapshot_reader(std::move(fn));
+  } else {
+    file_readers_[format] = std::move(fn);
+  }
 }
 
 
@@ -438,6 +650,11 @@ void workbook::open() {
 
 
 void workbook::open(const ed::mime_type& format, std::istream& is) {
+  open(format, is, nullptr);
+}
+
+
+void workbook::open(const ed::mime_type& format, std::istream& is, const std::function<void(forest_t&)>& after_read) {
   auto fr_it = file_readers_.find(format);
   if (fr_it == file_readers_.end()) {
     ED_THROW_EXCEPTION(unsupported_file_format());
@@ -447,6 +664,9 @@ void workbook::open(const ed::mime_type& format, std::istream& is) {
 
   try {
     fr_it->second(is, forest_);
+    if (after_read) {
+      after_read(forest_);
+    }
   } catch (const std::exception&) {
     open();
     throw;
@@ -456,29 +676,203 @@ void workbook::open(const ed::mime_type& format, std::istream& is) {
 }
 
 
+void workbook::open(const ed::mime_type& format, const std::filesystem::path& path) {
+  open(format, path, nullptr);
+}
+
+
+void workbook::open(const ed::mime_type& format, const std::filesystem::path& path, const std::function<void(forest_t&)>& after_read) {
+  // Снимок отображается в память и не копируется, листы читаются из отображения при первом обращении.
+  if (format == ed::mime_type::known::application_x_cellfy && is_snapshot_file(path)) {
+    pre_open(true);
+
+    try {
+      read_snapshot(path, forest_);
+      if (after_read) {
+        after_read(forest_);
+      }
+    } catch (const std::exception&) {
+      open();
+      throw;
+    }
+
+    post_open(true);
+    return;
+  }
+
+  std::ifstream is(path, std::ios::binary);
+  if (!is) {
+    ED_THROW_EXCEPTION(std::ios_base::failure("workbook open failed"));
+  }
+  open(format, is, after_read);
+}
+
+
 void workbook::save(const ed::mime_type& format, std::ostream& os) const {
   auto fw_it = file_writers_.find(format);
   if (fw_it == file_writers_.end()) {
     ED_THROW_EXCEPTION(unsupported_file_format());
   }
+  load_sheets();
   fw_it->second(os, forest_);
 }
 
 
+void workbook::save_in_background(const ed::mime_type& format, std::shared_ptr<std::ostream> os) {
+  ED_EXPECTS(os);
+
+  auto fw_it = file_writers_.find(format);
+  if (fw_it == file_writers_.end()) {
+    ED_THROW_EXCEPTION(unsupported_file_format());
+  }
+
+  wait_saved();
+
+  load_sheets();
+  auto copy = _::copy_forest(forest_, book_node_);
+  background_save_ = std::async(std::launch::async, [write = fw_it->second, copy = std::move(copy), os = std::move(os)]() mutable {
+    std::exception_ptr error;
+    try {
+      write(*os, *copy);
+      os->flush();
+      if (!*os) {
+        ED_THROW_EXCEPTION(std::ios_base::failure("workbook write failed"));
+      }
+    } catch (...) {
+      error = std::current_exception();
+    }
+
+    // Копия освобождается здесь же, а не в потоке, который дождётся записи.
+    copy.reset();
+    os.reset();
+    return error;
+  });
+}
+
+
+void workbook::wait_saved() {
+  if (background_save_.valid()) {
+    saved(background_save_.get());
+  }
+}
+
+
+bool workbook::poll_saved() {
+  if (background_save_.valid() && background_save_.wait_for(std::chrono::seconds(0)) == std::future_status::ready) {
+    saved(background_save_.get());
+  }
+  return !background_save_.valid();
+}
+
+
 cell_format_node::it workbook::ensure_format(cell_format&& fmt) {
   if (auto i = cell_formats_.find(fmt); i != cell_formats_.end()) {
+    ensured_formats_.push_back(forest_t::key_of(*i));
     return *i;
   }
 
-  scoped_transaction tr(forest_);
+  scoped_transaction tr(*this);
   cell_format_node n;
   n.format = std::make_shared<cell_format>(std::move(fmt));
   auto it = forest_.push_back(book_node_, std::move(n));
   tr.commit();
+  ensured_formats_.push_back(forest_t::key_of(it));
+  // Если новый формат так и не будет использован, он удалится в конце транзакции.
+  release_format(forest_t::key_of(it));
   return it;
 }
 
 
+void workbook::release_format(const std::optional<node_key_type>& key) {
+  if (key) {
+    released_formats_.push_back(*key);
+  }
+}
+
+
+void workbook::release_format(const cell_format& fmt) {
+  if (auto i = cell_formats_.find(fmt); i != cell_formats_.end()) {
+    released_formats_.push_back(forest_t::key_of(*i));
+  }
+}
+
+
+void workbook::collect_formats() {
+  ED_ASSERT(forest_.in_transaction());
+  ed::scoped_assign _(formats_gc_at_work_, true);
+
+  auto unused = [](cell_format_node::it node) {
+    return node->format.use_count() == 1;
+  };
+
+  history_committed(false);
+
+  // Первая фиксация может ещё держать историю redo, поэтому ключи проверяются history_formats_rechecks раз.
+  if (formats_rechecks_ > 0) {
+    released_formats_.insert(released_formats_.end(), history_formats_.begin(), history_formats_.end());
+    if (--formats_rechecks_ == 0) {
+      history_formats_.clear();
+    }
+  }
+
+  auto& by_key_index = cell_formats_.get<by_key>();
+
+  // Ссылки на формат могут уйти и без release_format, например вместе с историей undo.
+  // Такие форматы собирает полный обход, который выполняется, когда таблица выросла вдвое.
+  if (cell_formats_.size() >= 2 * std::max(formats_swept_size_, min_formats_sweep_size)) {
+    for (auto i = cell_formats_.begin(); i != cell_formats_.end();) {
+      if (unused(*i)) {
+        forest_.erase(*i);
+        i = cell_formats_.erase(i);
+      } else {
+        ++i;
+      }
+    }
+    released_formats_.clear();
+    formats_swept_size_ = cell_formats_.size();
+    return;
+  }
+
+  auto released = std::move(released_formats_);
+  released_formats_.clear();
+
+  for (auto key : released) {
+    if (auto i = by_key_index.find(key); i != by_key_index.end() && unused(*i)) {
+      forest_.erase(*i);
+      by_key_index.erase(i);
+    }
+  }
+}
+
+
+void workbook::history_committed(bool load) {
+  // Форматы, назначенные в этой транзакции, понадобятся, если её отменят.
+  std::sort(ensured_formats_.begin(), ensured_formats_.end());
+  ensured_formats_.erase(std::unique(ensured_formats_.begin(), ensured_formats_.end()), ensured_formats_.end());
+  undo_steps_.push_back({std::move(ensured_formats_), load});
+  ensured_formats_.clear();
+
+  // Новая фиксация отбрасывает историю redo. Назначенные отменёнными фиксациями форматы
+  // после undo держала только она, release_format для них никто не вызовет.
+  if (!redo_steps_.empty()) {
+    for (auto& step : redo_steps_) {
+      history_formats_.insert(history_formats_.end(), step.formats.begin(), step.formats.end());
+    }
+    redo_steps_.clear();
+    formats_rechecks_ = history_formats_rechecks;
+  }
+}
+
+
+void workbook::clear_history_steps() {
+  ensured_formats_.clear();
+  undo_steps_.clear();
+  redo_steps_.clear();
+  history_formats_.clear();
+  formats_rechecks_ = 0;
+}
+
+
 void workbook::set_calc_mode(const calc_mode mode) {
   if (calc_mode_ != mode) {
     calc_mode_ = mode;
@@ -521,6 +915,8 @@ void workbook::pre_open(bool block_signals) {
 
   sheets_.clear();
   cell_formats_.clear();
+  released_formats_.clear();
+  clear_history_steps();
   forest_.clear();
 }
 
@@ -540,6 +936,9 @@ void workbook::post_open(bool unblock_signals) {
   for (auto node = cell_format_nodes.begin(); node != cell_format_nodes.end(); ++node) {
     cell_formats_.insert(node);
   }
+  released_formats_.clear();
+  clear_history_steps();
+  formats_swept_size_ = cell_formats_.size();
 
   auto sheet_nodes = forest_.get<worksheet_node>(book_node_);
   ED_EXPECTS(!sheet_nodes.empty());
@@ -557,12 +956,15 @@ void workbook::post_open(bool unblock_signals) {
   // Формулы могут ссылаться на разные листы.
   // Если сначала создать 1 лист, а у него будет ссылка на лист 2. То формула не рассчитается.
   // После создания всех листов, обновляем layout всех ячеек, чтобы в каждом листе были посчитаны формулы. CEL-314.
+  // Результаты, сохранённые в файле, остаются: пересчитываются только формулы без результата.
+  // Отложенные листы снимка пока пусты: их формулы разбираются при чтении листа (load_sheet).
   for (auto& sheet_node : sheet_nodes) {
-    sheet_node.sheet->update_formulas();
+    sheet_node.sheet->update_formulas(true);
   }
 
   sheets_count_ = sheets_.size();
   active_sheet_ = nullptr;
+  // Из снимка сразу читается только активный лист.
   sheets().front().activate();
 
   opened();
@@ -1,6 +1,8 @@
 #include <lde/cellfy/boox/worksheet.h>
 
 #include <algorithm>
+#include <optional>
+#include <variant>
 
 #include <boost/iostreams/device/array.hpp>
 #include <boost/iostreams/stream.hpp>
@@ -18,16 +20,54 @@
 #include <lde/cellfy/boox/workbook.h>
 #include <lde/cellfy/boox/src/cell_op.h>
 #include <lde/cellfy/boox/src/column_op.h>
+#include <lde/cellfy/boox/src/format_runs.h>
+#include <lde/cellfy/boox/src/layout_cache.h>
+#include <lde/cellfy/boox/src/paint_cache.h>
+#include <lde/cellfy/boox/src/row_height_index.h>
 #include <lde/cellfy/boox/src/row_op.h>
 
 
 namespace lde::cellfy::boox {
+namespace _ {
+namespace {
+
+
+format_run_node make_format_run(const area& ar, cell_format_node::it format_node) {
+  ED_ASSERT(format_node->format);
+  format_run_node n;
+  n.first = ar.top_left().index();
+  n.last = ar.bottom_right().index();
+  n.format_key = forest_t::key_of(format_node);
+  n.format = format_node->format;
+  return n;
+}
+
+
+/// Объединение областей, если они прилегают друг к другу целой стороной.
+std::optional<area> join_adjacent(const area& a, const area& b) noexcept {
+  const bool same_rows = a.top_row() == b.top_row() && a.bottom_row() == b.bottom_row();
+  const bool same_columns = a.left_column() == b.left_column() && a.right_column() == b.right_column();
+  if ((same_rows && (a.right_column() + 1 == b.left_column() || b.right_column() + 1 == a.left_column())) ||
+      (same_columns && (a.bottom_row() + 1 == b.top_row() || b.bottom_row() + 1 == a.top_row()))) {
+    return area(
+      cell_addr(std::min(a.left_column(), b.left_column()), std::min(a.top_row(), b.top_row())),
+      cell_addr(std::max(a.right_column(), b.right_column()), std::max(a.bottom_row(), b.bottom_row())));
+  }
+  return std::nullopt;
+}
+
+}} // namespace _
+
 
 
 worksheet::worksheet(workbook& book, worksheet_node::it sheet_node)
   : book_(book)
   , sheet_node_(sheet_node)
-  , cells_(*this) {
+  , cells_(*this)
+  , format_runs_(std::make_unique<format_runs>(book.forest(), sheet_node))
+  , layouts_(std::make_unique<layout_cache>())
+  , paint_cache_(std::make_unique<paint_cache>())
+  , row_heights_(std::make_unique<row_height_index>()) {
 
   sheet_node->sheet = this;
 
@@ -45,16 +85,15 @@ worksheet::worksheet(workbook& book, worksheet_node::it sheet_node)
   default_column_width_ = layout.width() + 2_px;
   default_row_height_ = layout.height() + 2_px;
 
-  actualize_format();
-  cells_.apply(actualize_column_format_op());
-  cells_.apply(actualize_row_format_op());
-  cells_.apply(parse_formulas_op()); // Вынес отдельно, чтобы при actualize_layout_op формула уже была готова.
-  cells_.apply(actualize_cell_format_op() | actualize_layout_op());
+  actualize();
 
   changed += std::ref(book_.changed);
 }
 
 
+worksheet::~worksheet() = default;
+
+
 worksheet_node::it worksheet::node() const noexcept {
   return sheet_node_;
 }
@@ -77,22 +116,26 @@ std::size_t worksheet::index() const noexcept {
 }
 
 
-range worksheet::cells() const noexcept {
+range worksheet::cells() const {
+  book_.load_sheet(*this);
   return cells_;
 }
 
 
 range worksheet::cells(cell_addr first, cell_addr last) const {
+  book_.load_sheet(*this);
   return cells_.cells(first, last);
 }
 
 
 range worksheet::cells(std::wstring_view a1) const {
+  book_.load_sheet(*this);
   return cells_.cells(a1);
 }
 
 
 range worksheet::cell(cell_addr addr) const {
+  book_.load_sheet(*this);
   return cells_.cell(addr);
 }
 
@@ -152,6 +195,8 @@ ed::twips<double> worksheet::rows_height(row_index from, row_index to) const noe
 
 
 void worksheet::activate() {
+  book_.load_sheet(*this);
+
   auto active = *book_.active_sheet;
 
   if (active == this) {
@@ -187,7 +232,7 @@ bool worksheet::rename(std::wstring_view name) {
   auto n = *sheet_node_;
   n.name = name;
 
-  scoped_transaction tr(book().forest());
+  scoped_transaction tr(book());
   {
     book_.forest().modify(sheet_node_) = std::move(n);
   }
@@ -198,7 +243,7 @@ bool worksheet::rename(std::wstring_view name) {
 
 bool worksheet::remove() {
   if (*book_.sheets_count > 1) {
-    scoped_transaction tr(book().forest());
+    scoped_transaction tr(book());
     {
       book().forest().erase(sheet_node_);
     }
@@ -215,7 +260,7 @@ void worksheet::paste(const ed::mime_type& format, const ed::buffer& data) {
     ED_THROW_EXCEPTION(unsupported_clipboard_format());
   }
 
-  scoped_transaction tr(book().forest());
+  scoped_transaction tr(book());
   {
     boost::iostreams::stream<boost::iostreams::array_source> is(data.data(), data.size());
     range dst = *active_cell_;
@@ -225,14 +270,15 @@ void worksheet::paste(const ed::mime_type& format, const ed::buffer& data) {
 }
 
 
-void worksheet::update_formulas() {
-  cells_.apply(parse_formulas_op());
-  cells_.apply(actualize_layout_op());
+void worksheet::update_formulas(const bool keep_results) {
+  cells_.apply(parse_formulas_op(keep_results));
+  cells_.apply(invalidate_layout_op());
 }
 
 
 void worksheet::update_formulas_and_view() {
   update_formulas();
+  paint_cache_->clear();
   changed(cells_);
 }
 
@@ -269,6 +315,121 @@ cell_node::opt_it worksheet::find_cell(cell_addr addr) const noexcept {
 }
 
 
+format_run_node::opt_it worksheet::find_format_run(cell_addr addr) const {
+  return format_runs_->find(addr);
+}
+
+
+std::vector<format_run_node::it> worksheet::find_format_runs(const area& ar) const {
+  return format_runs_->find(ar);
+}
+
+
+void worksheet::change_format_runs(const area& ar, const cell_format::changes& changes, bool cover_empty) {
+  auto& forest = book_.forest();
+  area::list uncovered{ar};
+
+  for (auto run_i : find_format_runs(ar)) {
+    ED_ASSERT(run_i->format_key);
+    const auto run_ar = format_runs::area_of(*run_i);
+    const auto common = run_ar.intersect(ar);
+    ED_ASSERT(common);
+
+    if (cover_empty) {
+      area::list rest;
+      for (auto& u : uncovered) {
+        for (auto& piece : u.disjoin(*common)) {
+          rest.push_back(piece);
+        }
+      }
+      uncovered = std::move(rest);
+    }
+
+    auto old_format_node = forest.find<cell_format_node>(*run_i->format_key);
+    ED_ASSERT(old_format_node->format);
+    auto new_fmt = old_format_node->format->apply(changes);
+    if (new_fmt == *old_format_node->format) {
+      continue;
+    }
+
+    auto format_node = book_.ensure_format(std::move(new_fmt));
+    ED_ENSURES(format_node->format);
+
+    // Часть области вне ar сохраняет прежний формат.
+    for (auto& piece : run_ar.disjoin(*common)) {
+      forest.push_back(sheet_node_, _::make_format_run(piece, old_format_node));
+    }
+    forest.modify(run_i) = _::make_format_run(*common, format_node);
+    book_.release_format(forest_t::key_of(old_format_node));
+  }
+
+  if (cover_empty && !uncovered.empty()) {
+    const cell_format base = sheet_node_->format ? *sheet_node_->format : cell_format();
+    auto fmt = base.apply(changes);
+    if (fmt != base) {
+      auto format_node = book_.ensure_format(std::move(fmt));
+      ED_ENSURES(format_node->format);
+
+      for (auto& piece : uncovered) {
+        forest.push_back(sheet_node_, _::make_format_run(piece, format_node));
+      }
+    }
+  }
+
+  merge_format_runs(ar);
+}
+
+
+void worksheet::clear_format_runs(const area& ar) {
+  auto& forest = book_.forest();
+
+  for (auto run_i : find_format_runs(ar)) {
+    auto pieces = format_runs::area_of(*run_i).disjoin(ar);
+    if (pieces.empty()) {
+      forest.erase(run_i);
+    } else {
+      ED_ASSERT(run_i->format_key);
+      auto format_node = forest.find<cell_format_node>(*run_i->format_key);
+      for (auto i = std::next(pieces.begin()); i != pieces.end(); ++i) {
+        forest.push_back(sheet_node_, _::make_format_run(*i, format_node));
+      }
+      forest.modify(run_i) = _::make_format_run(pieces.front(), format_node);
+    }
+  }
+}
+
+
+void worksheet::merge_format_runs(const area& ar) {
+  auto& forest = book_.forest();
+
+  // Соседи ar тоже сливаются с изменёнными областями.
+  const area around(
+    cell_addr(ar.left_column() > 0 ? ar.left_column() - 1 : 0, ar.top_row() > 0 ? ar.top_row() - 1 : 0),
+    cell_addr(std::min<column_index>(ar.right_column() + 1, cell_addr::max_column_count - 1),
+              std::min<row_index>(ar.bottom_row() + 1, cell_addr::max_row_count - 1)));
+
+  for (bool merged = true; merged;) {
+    merged = false;
+    auto runs = find_format_runs(around);
+    for (auto a = runs.begin(); a != runs.end() && !merged; ++a) {
+      for (auto b = std::next(a); b != runs.end(); ++b) {
+        if ((*a)->format_key != (*b)->format_key) {
+          continue;
+        }
+        if (auto joined = _::join_adjacent(format_runs::area_of(**a), format_runs::area_of(**b))) {
+          ED_ASSERT((*a)->format_key);
+          auto format_node = forest.find<cell_format_node>(*(*a)->format_key);
+          forest.erase(*b);
+          forest.modify(*a) = _::make_format_run(*joined, format_node);
+          merged = true;
+          break;
+        }
+      }
+    }
+  }
+}
+
+
 void worksheet::changes_started() {
 
 }
@@ -291,16 +452,40 @@ void worksheet::changes_finished(const calc_mode mode) {
 
   if (!changes_.empty()) {
     actualize_format();
+    actualize_format_runs();
     changes_.apply(actualize_column_format_op());
-    changes_.apply(actualize_row_format_op());
-    changes_.apply(invalidate_layout_op() | actualize_cell_format_op() | actualize_layout_op() | erase_empty_cells_op());
-    changes_.apply(actualize_row_height_op());
+    // Форматы строк, ячейки и высота строк - за один обход строк.
+    // Layout ячеек считается лениво. Высота строки сама досчитывает layout своих ячеек.
+    changes_.apply(make_pipeline(
+      actualize_row_format_op(),
+      invalidate_layout_op(),
+      actualize_cell_format_op(),
+      erase_empty_cells_op(),
+      after_cells(actualize_row_height_op())));
+    paint_cache_->erase(changes_);
+    // После обхода: erase_empty_cells_op тоже удаляет ячейки.
+    if (!changed_rows_.empty()) {
+      rows_changed(changed_rows_);
+      changed_rows_.clear();
+    }
+    if (properties_changed_) {
+      properties_changed_ = false;
+      properties_changed();
+    }
     changed(changes_);
     changes_ = range();
   }
 }
 
 
+void worksheet::row_changed(const row_index row) {
+  // Ячейки одной строки обычно меняются подряд.
+  if (changed_rows_.empty() || changed_rows_.back() != row) {
+    changed_rows_.push_back(row);
+  }
+}
+
+
 void worksheet::modified(worksheet_node::it node) {
   ED_ASSERT(node->sheet == this);
   if (node->name.size() != name_->size() || !std::equal(node->name.begin(), node->name.end(), name_->begin())) {
@@ -312,57 +497,100 @@ void worksheet::modified(worksheet_node::it node) {
       modifier);
   }
   changes_ = cells_;
+  properties_changed_ = true;
   cells_.apply(invalidate_layout_op());
 }
 
 
 void worksheet::inserted(column_node::it node) {
   changes_ = changes_.join(cells_.entire_column(node->index));
+  properties_changed_ = true;
   cells_.entire_column(node->index).apply(invalidate_layout_width_op());
+  paint_cache_->erase(cells_.entire_column(node->index));
 }
 
 
 void worksheet::erased(column_node::it node) {
   changes_ = changes_.join(cells_.entire_column(node->index));
+  properties_changed_ = true;
   cells_.entire_column(node->index).apply(invalidate_layout_width_op());
+  paint_cache_->erase(cells_.entire_column(node->index));
 }
 
 
 void worksheet::modified(column_node::it node) {
   changes_ = changes_.join(cells_.entire_column(node->index));
+  properties_changed_ = true;
   cells_.entire_column(node->index).apply(invalidate_layout_width_op());
+  paint_cache_->erase(cells_.entire_column(node->index));
 }
 
 
 void worksheet::inserted(row_node::it node) {
   changes_ = changes_.join(cells_.entire_row(node->index));
+  row_changed(node->index);
+  paint_cache_->erase(cells_.entire_row(node->index));
 }
 
 
 void worksheet::erased(row_node::it node) {
   changes_ = changes_.join(cells_.entire_row(node->index));
+  row_changed(node->index);
+  paint_cache_->erase(cells_.entire_row(node->index));
 }
 
 
 void worksheet::modified(row_node::it node) {
   changes_ = changes_.join(cells_.entire_row(node->index));
+  row_changed(node->index);
+  paint_cache_->erase(cells_.entire_row(node->index));
+}
+
+
+void worksheet::inserted(format_run_node::it node) {
+  const auto ar = format_runs::area_of(*node);
+  changes_ = changes_.join(cells(ar.top_left(), ar.bottom_right()));
+  properties_changed_ = true;
+  format_runs_->invalidate();
+}
+
+
+void worksheet::erased(format_run_node::it node) {
+  const auto ar = format_runs::area_of(*node);
+  changes_ = changes_.join(cells(ar.top_left(), ar.bottom_right()));
+  properties_changed_ = true;
+  format_runs_->invalidate();
+}
+
+
+void worksheet::modified(format_run_node::it node) {
+  const auto ar = format_runs::area_of(*node);
+  changes_ = changes_.join(cells(ar.top_left(), ar.bottom_right()));
+  properties_changed_ = true;
+  format_runs_->invalidate();
 }
 
 
 void worksheet::inserted(cell_node::it node) {
   changes_ = changes_.join(cell(node->index));
+  row_changed(cell_addr(node->index).row());
   node->is_layout_dirty = true;
 }
 
 
 void worksheet::erased(cell_node::it node) {
   changes_ = changes_.join(cell(node->index));
+  row_changed(cell_addr(node->index).row());
   volatile_cells_.erase(node);
+  layouts_->erase(*node);
+  row_heights_->erase(*node);
+  paint_cache_->erase(cell(node->index));
 }
 
 
 void worksheet::modified(cell_node::it node) {
   changes_ = changes_.join(cell(node->index));
+  row_changed(cell_addr(node->index).row());
   node->is_layout_dirty = true;
 }
 
@@ -370,6 +598,7 @@ void worksheet::modified(cell_node::it node) {
 void worksheet::inserted(cell_data_node::it node) {
   auto parent = book().forest().ancestor<cell_node>(node);
   changes_ = changes_.join(cell(parent->index));
+  row_changed(cell_addr(parent->index).row());
   parent->is_layout_dirty = true;
 }
 
@@ -377,6 +606,7 @@ void worksheet::inserted(cell_data_node::it node) {
 void worksheet::erased(cell_data_node::it node) {
   auto parent = book().forest().ancestor<cell_node>(node);
   changes_ = changes_.join(cell(parent->index));
+  row_changed(cell_addr(parent->index).row());
   parent->is_layout_dirty = true;
 }
 
@@ -384,6 +614,7 @@ void worksheet::erased(cell_data_node::it node) {
 void worksheet::modified(cell_data_node::it node) {
   auto parent = book().forest().ancestor<cell_node>(node);
   changes_ = changes_.join(cell(parent->index));
+  row_changed(cell_addr(parent->index).row());
   parent->is_layout_dirty = true;
 }
 
@@ -391,6 +622,7 @@ void worksheet::modified(cell_data_node::it node) {
 void worksheet::inserted(text_run_node::it node) {
   auto parent = book().forest().ancestor<cell_node>(node);
   changes_ = changes_.join(cell(parent->index));
+  row_changed(cell_addr(parent->index).row());
   parent->is_layout_dirty = true;
 }
 
@@ -398,6 +630,7 @@ void worksheet::inserted(text_run_node::it node) {
 void worksheet::erased(text_run_node::it node) {
   auto parent = book().forest().ancestor<cell_node>(node);
   changes_ = changes_.join(cell(parent->index));
+  row_changed(cell_addr(parent->index).row());
   parent->is_layout_dirty = true;
 }
 
@@ -405,6 +638,7 @@ void worksheet::erased(text_run_node::it node) {
 void worksheet::modified(text_run_node::it node) {
   auto parent = book().forest().ancestor<cell_node>(node);
   changes_ = changes_.join(cell(parent->index));
+  row_changed(cell_addr(parent->index).row());
   parent->is_layout_dirty = true;
 }
 
@@ -412,6 +646,7 @@ void worksheet::modified(text_run_node::it node) {
 void worksheet::inserted(cell_formula_node::it node) {
   auto parent = book().forest().ancestor<cell_node>(node);
   changes_ = changes_.join(cell(parent->index));
+  row_changed(cell_addr(parent->index).row());
   parent->is_layout_dirty = true;
   parse_formula(node);
 }
@@ -420,6 +655,7 @@ void worksheet::inserted(cell_formula_node::it node) {
 void worksheet::erased(cell_formula_node::it node) {
   auto parent = book().forest().ancestor<cell_node>(node);
   changes_ = changes_.join(cell(parent->index));
+  row_changed(cell_addr(parent->index).row());
   parent->is_layout_dirty = true;
   volatile_cells_.erase(parent);
 }
@@ -428,20 +664,21 @@ void worksheet::erased(cell_formula_node::it node) {
 void worksheet::modified(cell_formula_node::it node) {
   auto parent = book().forest().ancestor<cell_node>(node);
   changes_ = changes_.join(cell(parent->index));
+  row_changed(cell_addr(parent->index).row());
   parent->is_layout_dirty = true;
   parse_formula(node);
 }
 
 
-void worksheet::parse_formula(cell_node::it node) {
+void worksheet::parse_formula(cell_node::it node, const bool keep_result) {
   ED_ASSERT(node->has_formula);
   auto children = book().forest().get<cell_formula_node>(node);
   ED_EXPECTS(children.size() == 1);
-  parse_formula(children.begin());
+  parse_formula(children.begin(), keep_result);
 }
 
 
-void worksheet::parse_formula(cell_formula_node::it node) {
+void worksheet::parse_formula(cell_formula_node::it node, const bool keep_result) {
   auto parent = book().forest().ancestor<cell_node>(node);
   bool is_volatile = false;
 
@@ -450,7 +687,9 @@ void worksheet::parse_formula(cell_formula_node::it node) {
 
     // TODO: Доработать определение is_volatile и зависимостей
     node->is_volatile = true;
-    node->is_result_dirty = true;
+    if (!keep_result) {
+      node->is_result_dirty = true;
+    }
 
     if (node->is_volatile) {
       volatile_cells_.insert(parent);
@@ -458,6 +697,12 @@ void worksheet::parse_formula(cell_formula_node::it node) {
     } else {
       // TODO: Определение зависемостей и подписка на их изменение
     }
+
+    for (auto& token : node->ast) {
+      if (auto* ref = std::get_if<fx::ast::reference>(&token); ref && !ref->sheet.empty() && ref->sheet != *name_) {
+        referenced_sheets_.insert(ref->sheet);
+      }
+    }
   } catch (const std::exception&) {
     node->is_volatile = false;
     node->is_result_dirty = false;
@@ -482,4 +727,26 @@ void worksheet::actualize_format() {
 }
 
 
+void worksheet::actualize_format_runs() {
+  for (auto& run : book_.forest_.get<format_run_node>(sheet_node_)) {
+    ED_ASSERT(run.format_key);
+    run.format = book_.forest_.find<cell_format_node>(*run.format_key)->format;
+    ED_ASSERT(run.format);
+  }
+}
+
+
+void worksheet::actualize() {
+  actualize_format();
+  actualize_format_runs();
+  format_runs_->invalidate();
+  cells_.apply(actualize_column_format_op());
+  cells_.apply(actualize_row_format_op());
+  cells_.apply(parse_formulas_op(true));
+  // Layout ячеек считается лениво: при отрисовке или при расчёте высоты строки.
+  cells_.apply(actualize_cell_format_op());
+  paint_cache_->clear();
+}
+
+
 } // namespace lde::cellfy::boox
@@ -0,0 +1,43 @@
+#include <gtest/gtest.h>
+
+#include <lde/cellfy/boox/src/civil_date.h>
+
+
+using namespace lde::cellfy::boox;
+
+
+TEST(civil_date, round_trip) {
+  for (std::int64_t days = civil::days_from_civil(1400, 1, 1); days < civil::days_from_civil(10000, 1, 1); days += 13) {
+    const auto d = civil::civil_from_days(days);
+    ASSERT_EQ(civil::days_from_civil(d.year, d.month, d.day), days);
+  }
+
+  ASSERT_EQ(civil::days_from_civil(1970, 1, 1), 0);
+  ASSERT_EQ(civil::weekday_from_days(0), 4u);
+  ASSERT_EQ(civil::last_day_of_month(1900, 2), 28u);
+  ASSERT_EQ(civil::last_day_of_month(2000, 2), 29u);
+}
+
+
+TEST(civil_date, serial) {
+  ASSERT_EQ(civil::to_serial(1900, 1, 1, 0), 2.);
+  ASSERT_EQ(civil::to_serial(2015, 1, 1, 6 * 60 * 60 * 1000), 42005.25);
+
+  const auto dt = civil::from_serial(42005.25);
+  ASSERT_TRUE(dt);
+  ASSERT_EQ(dt->year, 2015);
+  ASSERT_EQ(dt->month, 1u);
+  ASSERT_EQ(dt->day, 1u);
+  ASSERT_EQ(dt->weekday, 4u);
+  ASSERT_EQ(dt->hour, 6u);
+  ASSERT_EQ(dt->minute, 0u);
+
+  // 23:59:59.6 округляется до следующего дня.
+  const auto next = civil::from_serial(42005. + 86399.6 / 86400.);
+  ASSERT_TRUE(next);
+  ASSERT_EQ(next->day, 2u);
+  ASSERT_EQ(next->hour, 0u);
+  ASSERT_EQ(next->second, 0u);
+
+  ASSERT_FALSE(civil::from_serial(1e12));
+}
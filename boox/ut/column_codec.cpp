@@ -0,0 +1,70 @@
+#include <gtest/gtest.h>
+
+#include <bit>
+#include <cstdint>
+#include <limits>
+#include <vector>
+
+#include <lde/cellfy/boox/src/column_codec.h>
+
+
+using namespace lde::cellfy::boox;
+
+
+TEST(column_codec, integers) {
+  const std::vector<std::uint64_t> values = {
+    0, 1, 2, 3, 16384, 16385, 16386, 7, 7, 7, 7, ~std::uint64_t(0), 0, 5, 1u << 31
+  };
+
+  blob::writer out;
+  codec::integer_writer w(out);
+  for (auto v : values) {
+    w.push(v);
+  }
+  w.finish();
+
+  blob::reader in(out.data());
+  codec::integer_reader r(in);
+  for (auto v : values) {
+    ASSERT_EQ(r.next(), v);
+  }
+  r.finish();
+  ASSERT_TRUE(in.at_end());
+}
+
+
+TEST(column_codec, numbers) {
+  std::vector<double> times;
+  std::vector<double> prices;
+  for (int i = 0; i < 1000; ++i) {
+    times.push_back(45000 + i / 1440.0);
+    prices.push_back(100 + (i % 17) * 0.25);
+  }
+  const std::vector<std::vector<double>> columns = {
+    times,
+    prices,
+    {1, 1, 1, 2, 3, -4, 0, 9007199254740992.0},
+    {-0.0, 0.5, std::numeric_limits<double>::infinity(), std::numeric_limits<double>::quiet_NaN(), 1e300, 1},
+  };
+
+  blob::writer out;
+  for (auto& values : columns) {
+    codec::write_numbers(out, values);
+  }
+
+  blob::reader in(out.data());
+  for (auto& values : columns) {
+    std::vector<double> result;
+    codec::read_numbers(in, values.size(), result);
+    ASSERT_EQ(result.size(), values.size());
+    for (std::size_t i = 0; i < result.size(); ++i) {
+      ASSERT_EQ(std::bit_cast<std::uint64_t>(result[i]), std::bit_cast<std::uint64_t>(values[i]));
+    }
+  }
+  ASSERT_TRUE(in.at_end());
+
+  // Тысяча повторов занимает не больше одного несжатого числа.
+  blob::writer repeated;
+  codec::write_numbers(repeated, std::vector<double>(1000, 42));
+  ASSERT_LE(repeated.size(), sizeof(double));
+}
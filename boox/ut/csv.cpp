@@ -0,0 +1,247 @@
+#include <gtest/gtest.h>
+
+#include <cstddef>
+#include <locale>
+#include <map>
+#include <sstream>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <variant>
+
+#include <lde/cellfy/boox/cell_addr.h>
+#include <lde/cellfy/boox/csv.h>
+#include <lde/cellfy/boox/node.h>
+#include <lde/cellfy/boox/workbook.h>
+
+
+using namespace lde::cellfy::boox;
+
+
+namespace {
+
+
+struct cell final {
+  cell_value   value;
+  std::wstring format;
+
+  bool operator==(const cell& rhs) const {
+    return value == rhs.value && format == rhs.format;
+  }
+};
+
+
+/// Ячейки первого листа по (строка, колонка).
+using cells = std::map<std::pair<row_index, column_index>, cell>;
+
+
+cells cells_of(const forest_t& forest) {
+  cells result;
+
+  auto books = forest.get<workbook_node>();
+  auto sheets = forest.get<worksheet_node>(books.begin());
+  auto rows = forest.get<row_node>(sheets.begin());
+  for (auto row = rows.begin(); row != rows.end(); ++row) {
+    auto row_cells = forest.get<cell_node>(row);
+    for (auto node = row_cells.begin(); node != row_cells.end(); ++node) {
+      cell c;
+      if (node->value_type == cell_value_type::string) {
+        c.value = std::get<shared_string>(forest.get<cell_data_node>(node).front().data);
+      } else if (node->value) {
+        std::visit([&](auto&& v) { c.value = cell_value(v); }, *node->value);
+      }
+      if (node->format_key) {
+        c.format = forest.find<cell_format_node>(*node->format_key)->format->get_or_default<number_format>();
+      }
+
+      const cell_addr addr(node->index);
+      EXPECT_EQ(addr.row(), row->index);
+      result.emplace(std::make_pair(addr.row(), addr.column()), std::move(c));
+    }
+  }
+
+  return result;
+}
+
+
+cells read(std::string_view text, const csv_options& options = {}) {
+  forest_t forest;
+  read_csv(text, forest, options);
+  return cells_of(forest);
+}
+
+
+std::string write(const workbook& book, const csv_options& options = {}) {
+  std::ostringstream os;
+  write_csv(os, book.forest(), options);
+  return os.str();
+}
+
+
+/// Блок, повторённый на несколько частей разбора (больше 1 МБ каждая), читается так же, как по одному.
+void expect_repeated(std::string_view block, row_index block_rows, const cells& single) {
+  std::string text;
+  std::size_t blocks = 0;
+  for (; text.size() < (std::size_t(3) << 20) + 1; ++blocks) {
+    text += block;
+  }
+
+  const auto result = read(text);
+  ASSERT_EQ(result.size(), single.size() * blocks);
+  for (std::size_t i = 0; i < blocks; ++i) {
+    for (auto& [pos, c] : single) {
+      const auto j = result.find({static_cast<row_index>(pos.first + i * block_rows), pos.second});
+      ASSERT_NE(j, result.end());
+      ASSERT_EQ(j->second, c);
+    }
+  }
+}
+
+
+/// Десятичный разделитель - запятая, как в русской локали.
+struct comma_decimal_point final : std::numpunct<wchar_t> {
+  wchar_t do_decimal_point() const override {
+    return L',';
+  }
+};
+
+} // namespace
+
+
+TEST(csv, quoted_fields) {
+  const auto result = read("\"a,b\",\"say \"\"hi\"\"\",\"line\nbreak\"\nx\"y,\"\"\n");
+
+  const cells expected = {
+    {{0, 0}, {cell_value(L"a,b"), {}}},
+    {{0, 1}, {cell_value(L"say \"hi\""), {}}},
+    {{0, 2}, {cell_value(L"line\nbreak"), {}}},
+    {{1, 0}, {cell_value(L"x\"y"), {}}},
+  };
+  ASSERT_EQ(result, expected);
+}
+
+
+TEST(csv, crlf_and_bom) {
+  const auto result = read("\xEF\xBB\xBF" "a,b\r\n\"c\r\nd\",e\r\n");
+
+  const cells expected = {
+    {{0, 0}, {cell_value(L"a"), {}}},
+    {{0, 1}, {cell_value(L"b"), {}}},
+    {{1, 0}, {cell_value(L"c\r\nd"), {}}},
+    {{1, 1}, {cell_value(L"e"), {}}},
+  };
+  ASSERT_EQ(result, expected);
+}
+
+
+TEST(csv, empty_rows_and_fields) {
+  const auto result = read("a,,c\n\n,b,\n,,\n\nd");
+
+  const cells expected = {
+    {{0, 0}, {cell_value(L"a"), {}}},
+    {{0, 2}, {cell_value(L"c"), {}}},
+    {{2, 1}, {cell_value(L"b"), {}}},
+    {{5, 0}, {cell_value(L"d"), {}}},
+  };
+  ASSERT_EQ(result, expected);
+  ASSERT_TRUE(read("").empty());
+}
+
+
+TEST(csv, typed_values) {
+  csv_options options;
+  options.delimiter = ';';
+  const auto result = read("42;-0.5;15.01.2024;12%;TRUE;text\n", options);
+
+  const cells expected = {
+    {{0, 0}, {cell_value(42.0), {}}},
+    {{0, 1}, {cell_value(-0.5), {}}},
+    {{0, 2}, {cell_value(45306.0), L"dd.mm.yyyy"}},
+    {{0, 3}, {cell_value(0.12), L"0.00%"}},
+    {{0, 4}, {cell_value(true), {}}},
+    {{0, 5}, {cell_value(L"text"), {}}},
+  };
+  ASSERT_EQ(result, expected);
+}
+
+
+TEST(csv, chunks_match_single_chunk) {
+  // Кавычки в блоке парные, поля в кавычках с переводами строк попадают на границы частей.
+  const std::string_view block = "1,\"a \"\"quoted\"\"\ntext\",x\n15.01.2024,\"b\nc\"\n";
+  const auto single = read(block);
+  ASSERT_EQ(single.size(), 5u);
+  expect_repeated(block, 2, single);
+}
+
+
+TEST(csv, chunks_fall_back_on_unbalanced_quotes) {
+  // Кавычка внутри поля без кавычек делает число кавычек в блоке нечётным и сбивает угадывание границ частей.
+  const std::string_view block = "1,\"a \"\"quoted\"\"\ntext\",x\"y\n15.01.2024,\"b\nc\"\n";
+  const auto single = read(block);
+  ASSERT_EQ(single.size(), 5u);
+  expect_repeated(block, 2, single);
+}
+
+
+TEST(csv, write_quotes_special_characters) {
+  workbook book;
+  auto& sheet = *book.sheets().begin();
+  sheet.cell({0, 0}).set_value(L"a,b");
+  sheet.cell({1, 0}).set_value(L"say \"hi\"");
+  sheet.cell({2, 0}).set_value(L"two\nlines");
+  sheet.cell({3, 0}).set_value(L"plain");
+
+  ASSERT_EQ(write(book), "\"a,b\",\"say \"\"hi\"\"\",\"two\nlines\",plain\n");
+
+  csv_options options;
+  options.delimiter = ';';
+  ASSERT_EQ(write(book, options), "a,b;\"say \"\"hi\"\"\";\"two\nlines\";plain\n");
+}
+
+
+TEST(csv, write_numbers) {
+  workbook book;
+  auto& sheet = *book.sheets().begin();
+  sheet.cell({0, 0}).set_value(3.14159);
+  sheet.cell({1, 0}).set_value(3.14159);
+  sheet.cell({1, 0}).set_format<number_format>(L"0.00");
+  sheet.cell({2, 0}).set_value(0.1);
+  sheet.cell({3, 0}).set_value(-2.0);
+
+  ASSERT_EQ(write(book), "3.14159,3.14,0.1,-2\n");
+
+  // Запятая в числе совпадает с разделителем полей, такие числа берутся в кавычки.
+  csv_options options;
+  options.loc = std::locale(std::locale::classic(), new comma_decimal_point);
+  ASSERT_EQ(write(book, options), "\"3,14159\",\"3,14\",\"0,1\",-2\n");
+
+  options.delimiter = ';';
+  ASSERT_EQ(write(book, options), "3,14159;3,14;0,1;-2\n");
+}
+
+
+TEST(csv, write_skipped_rows_columns_and_merges) {
+  workbook book;
+  auto& sheet = *book.sheets().begin();
+  sheet.cell({1, 1}).set_value(L"b");
+  sheet.cell({0, 3}).set_value(L"m");
+  sheet.cells(L"A4:B4").merge();
+  sheet.cell({2, 3}).set_value(L"c");
+
+  ASSERT_EQ(write(book), "\n,b\n\nm,,c\n");
+}
+
+
+TEST(csv, write_read_round_trip) {
+  workbook book;
+  auto& sheet = *book.sheets().begin();
+  sheet.cell({0, 0}).set_value(L"a,\"b\"\nc");
+  sheet.cell({1, 0}).set_value(-0.5);
+  sheet.cell({2, 0}).set_value(true);
+  sheet.cell({0, 2}).set_value(45306.0);
+  sheet.cell({0, 2}).set_format<number_format>(L"dd.mm.yyyy");
+  sheet.cell({3, 2}).set_value(L"text");
+
+  const auto text = write(book);
+  ASSERT_EQ(read(text), cells_of(book.forest()));
+}
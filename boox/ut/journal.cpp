@@ -0,0 +1,298 @@
+#include <gtest/gtest.h>
+
+#include <cstdint>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <iterator>
+#include <string>
+#include <string_view>
+
+#include <lde/cellfy/boox/journal.h>
+#include <lde/cellfy/boox/snapshot.h>
+#include <lde/cellfy/boox/workbook.h>
+
+
+using namespace lde::cellfy::boox;
+
+
+namespace {
+
+
+const auto& mime = ed::mime_type::known::application_x_cellfy;
+
+
+/// Снимок книги из sheets листов без журнала.
+std::filesystem::path make_document(std::string_view name, std::size_t sheets = 1) {
+  const auto path = std::filesystem::temp_directory_path() / name;
+  std::filesystem::remove(path.string() + ".journal");
+  std::filesystem::remove(path.string() + ".journal.broken");
+
+  workbook book;
+  book.sheets().begin()->cell({0, 0}).set_value(0.0);
+  for (std::size_t index = 1; index < sheets; ++index) {
+    book.emplace_sheet(index);
+  }
+  std::ofstream os(path, std::ios::binary);
+  book.save(mime, os);
+  return path;
+}
+
+
+std::string read_file(const std::filesystem::path& path) {
+  std::ifstream is(path, std::ios::binary);
+  return std::string(std::istreambuf_iterator<char>(is), std::istreambuf_iterator<char>());
+}
+
+
+void write_file(const std::filesystem::path& path, std::string_view data) {
+  std::ofstream os(path, std::ios::binary | std::ios::trunc);
+  os.write(data.data(), static_cast<std::streamsize>(data.size()));
+}
+
+
+/// Кадр журнала: размер записи, сумма FNV-1a и сама запись.
+std::string frame(std::string_view payload) {
+  std::uint32_t hash = 2166136261u;
+  for (auto c : payload) {
+    hash = (hash ^ static_cast<unsigned char>(c)) * 16777619u;
+  }
+  const auto size = static_cast<std::uint32_t>(payload.size());
+  std::string out(8, '\0');
+  std::memcpy(out.data(), &size, sizeof(size));
+  std::memcpy(out.data() + 4, &hash, sizeof(hash));
+  out += payload;
+  return out;
+}
+
+} // namespace
+
+
+TEST(journal, recovers_changes_after_snapshot) {
+  const auto path = std::filesystem::temp_directory_path() / "lde-cellfy-boox-ut-journal.cellfy";
+  std::filesystem::remove(path.string() + ".journal");
+
+  {
+    workbook book;
+    book.sheets().begin()->cell({0, 0}).set_value(1.0);
+    std::ofstream os(path, std::ios::binary);
+    book.save(mime, os);
+  }
+
+  {
+    workbook book;
+    journal log(book, path);
+    log.open();
+
+    auto& sheet = *book.sheets().begin();
+    sheet.cell({0, 0}).set_value(2.0);
+    sheet.cell({1, 5}).set_value(L"abc");
+    sheet.cell({1, 5}).set_format<number_format>(L"0.00");
+    book.emplace_sheet(1).cell({2, 2}).set_value(true);
+    log.flush();
+    ASSERT_GT(log.size(), 16u);
+  }
+
+  {
+    // Недописанная запись отбрасывается.
+    std::ofstream os(path.string() + ".journal", std::ios::binary | std::ios::app);
+    os << "torn";
+  }
+
+  workbook book;
+  journal log(book, path);
+  log.open();
+
+  // Записи журнала - часть открытого документа, а не правки, которые можно отменить.
+  ASSERT_FALSE(*book.can_undo);
+  ASSERT_EQ(book.sheets().size(), 2u);
+  auto& sheet = *book.sheets().begin();
+  ASSERT_EQ(sheet.cell({0, 0}).value(), cell_value(2.0));
+  ASSERT_EQ(sheet.cell({1, 5}).value(), cell_value(L"abc"));
+  ASSERT_EQ(sheet.cell({1, 5}).format().get_or_default<number_format>(), L"0.00");
+  ASSERT_EQ(std::next(book.sheets().begin())->cell({2, 2}).value(), cell_value(true));
+
+  log.compact();
+  ASSERT_EQ(log.size(), 16u);
+}
+
+
+TEST(journal, sheet_properties_skip_rows) {
+  const auto path = std::filesystem::temp_directory_path() / "lde-cellfy-boox-ut-journal-properties.cellfy";
+  std::filesystem::remove(path.string() + ".journal");
+
+  {
+    workbook book;
+    auto& sheet = *book.sheets().begin();
+    for (row_index row = 0; row < 1000; ++row) {
+      sheet.cell({1, row}).set_value(L"row " + std::to_wstring(row));
+    }
+    std::ofstream os(path, std::ios::binary);
+    book.save(mime, os);
+  }
+
+  ed::twips<double> width;
+  {
+    workbook book;
+    journal log(book, path);
+    log.open();
+
+    // Переименование и ширина столбца пишутся заголовком листа, без строк, которые они задевают.
+    auto& sheet = *book.sheets().begin();
+    ASSERT_TRUE(sheet.rename(L"Renamed"));
+    sheet.cell({0, 1}).set_column_width(ed::twips<double>{3000});
+    width = sheet.columns_width(1, 1);
+    log.flush();
+    ASSERT_LT(log.size(), 1024u);
+  }
+
+  workbook book;
+  journal log(book, path);
+  log.open();
+
+  auto& sheet = *book.sheets().begin();
+  ASSERT_EQ(*sheet.name, L"Renamed");
+  ASSERT_EQ(sheet.columns_width(1, 1), width);
+  ASSERT_EQ(sheet.cell({1, 999}).value(), cell_value(L"row 999"));
+}
+
+
+TEST(journal, drops_broken_last_record) {
+  const auto path = make_document("lde-cellfy-boox-ut-journal-tail.cellfy");
+  const auto journal_path = std::filesystem::path(path.string() + ".journal");
+
+  std::uint64_t first_size = 0;
+  {
+    workbook book;
+    journal log(book, path);
+    log.open();
+    book.sheets().begin()->cell({0, 0}).set_value(1.0);
+    log.flush();
+    first_size = log.size();
+    book.sheets().begin()->cell({0, 1}).set_value(2.0);
+    log.flush();
+  }
+  const auto records = read_file(journal_path);
+  ASSERT_GT(records.size(), first_size);
+
+  auto check_first_record_only = [&] {
+    workbook book;
+    journal log(book, path);
+    log.open();
+    auto& sheet = *book.sheets().begin();
+    ASSERT_EQ(sheet.cell({0, 0}).value(), cell_value(1.0));
+    ASSERT_EQ(sheet.cell({0, 1}).value(), cell_value());
+    ASSERT_EQ(log.size(), first_size);
+    ASSERT_EQ(std::filesystem::file_size(journal_path), first_size);
+  };
+
+  // Последний кадр оборван.
+  write_file(journal_path, std::string_view(records).substr(0, records.size() - 3));
+  check_first_record_only();
+
+  // Последний кадр не сходится с суммой.
+  auto corrupt = records;
+  corrupt.back() = static_cast<char>(corrupt.back() ^ 0x5a);
+  write_file(journal_path, corrupt);
+  check_first_record_only();
+}
+
+
+TEST(journal, skips_other_generation) {
+  const auto path = make_document("lde-cellfy-boox-ut-journal-generation.cellfy");
+
+  {
+    workbook book;
+    journal log(book, path);
+    log.open();
+    book.sheets().begin()->cell({0, 0}).set_value(1.0);
+    log.flush();
+  }
+
+  {
+    // Снимок записан заново без журнала, например другой копией программы.
+    workbook book;
+    book.sheets().begin()->cell({0, 0}).set_value(3.0);
+    std::ofstream os(path, std::ios::binary | std::ios::trunc);
+    write_snapshot(os, book.forest(), 7);
+  }
+
+  workbook book;
+  journal log(book, path);
+  log.open();
+  ASSERT_EQ(book.sheets().begin()->cell({0, 0}).value(), cell_value(3.0));
+  ASSERT_EQ(log.size(), 16u);
+}
+
+
+TEST(journal, recovers_sheet_removal) {
+  const auto path = make_document("lde-cellfy-boox-ut-journal-removal.cellfy", 3);
+
+  {
+    workbook book;
+    journal log(book, path);
+    log.open();
+    ASSERT_TRUE(book.sheet_by_index(1)->rename(L"Removed"));
+    ASSERT_TRUE(book.sheet_by_index(1)->remove());
+    book.sheet_by_index(1)->cell({2, 2}).set_value(5.0);
+    log.flush();
+  }
+
+  workbook book;
+  journal log(book, path);
+  log.open();
+  ASSERT_EQ(book.sheets().size(), 2u);
+  ASSERT_EQ(book.sheet_by_name(L"Removed"), nullptr);
+  ASSERT_EQ(book.sheet_by_index(1)->cell({2, 2}).value(), cell_value(5.0));
+}
+
+
+TEST(journal, compacts_after_sheet_shift) {
+  const auto path = make_document("lde-cellfy-boox-ut-journal-shift.cellfy", 2);
+
+  {
+    workbook book;
+    journal log(book, path);
+    log.open();
+    book.sheets().begin()->cell({0, 0}).set_value(1.0);
+    ASSERT_GT(log.size(), 16u);
+
+    // Перемещение листа записью не выражается: следующая запись сворачивает журнал в снимок.
+    book.sheet_shifted(*book.sheets().begin());
+    book.sheets().begin()->cell({0, 0}).set_value(4.0);
+    ASSERT_EQ(log.size(), 16u);
+  }
+
+  ASSERT_EQ(snapshot_generation(read_file(path)), 1u);
+
+  workbook book;
+  journal log(book, path);
+  log.open();
+  ASSERT_EQ(book.sheets().begin()->cell({0, 0}).value(), cell_value(4.0));
+}
+
+
+TEST(journal, opens_snapshot_when_record_is_broken) {
+  const auto path = make_document("lde-cellfy-boox-ut-journal-broken.cellfy");
+  const auto journal_path = std::filesystem::path(path.string() + ".journal");
+
+  {
+    workbook book;
+    journal log(book, path);
+    log.open();
+  }
+
+  {
+    // Сумма сходится, но запись объявляет больше форматов, чем в ней есть.
+    std::ofstream os(journal_path, std::ios::binary | std::ios::app);
+    os << frame(std::string_view("\xff\xff\xff\xff", 4));
+  }
+  const auto records = read_file(journal_path);
+
+  workbook book;
+  journal log(book, path);
+  log.open();
+  ASSERT_EQ(book.sheets().begin()->cell({0, 0}).value(), cell_value(0.0));
+  ASSERT_EQ(log.size(), 16u);
+  ASSERT_EQ(read_file(journal_path.string() + ".broken"), records);
+}
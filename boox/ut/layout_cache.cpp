@@ -0,0 +1,55 @@
+#include <gtest/gtest.h>
+
+#include <lde/cellfy/boox/src/layout_cache.h>
+
+
+using namespace lde::cellfy::boox;
+
+
+TEST(layout_cache, eviction) {
+  layout_cache cache(2);
+  cell_node a{0}, b{1}, c{2};
+
+  for (auto* n : {&a, &b, &c}) {
+    n->is_layout_dirty = false;
+  }
+
+  cache.touch(a);
+  cache.touch(b);
+  cache.touch(a);
+  cache.touch(c);
+
+  ASSERT_EQ(cache.size(), 2);
+  ASSERT_FALSE(a.is_layout_dirty);
+  ASSERT_TRUE(b.is_layout_dirty);
+  ASSERT_FALSE(c.is_layout_dirty);
+
+  cache.erase(a);
+  ASSERT_EQ(cache.size(), 1);
+  ASSERT_FALSE(a.is_layout_dirty);
+}
+
+
+TEST(layout_cache, revision) {
+  layout_cache cache(2);
+  cell_node a{0}, b{1}, c{2};
+
+  const auto r0 = cache.revision();
+  cache.attached(a);
+  ASSERT_GT(cache.revision(), r0);
+
+  const auto r1 = cache.revision();
+  cache.touch(a);
+  ASSERT_EQ(cache.revision(), r1);
+
+  cache.attached(b);
+  const auto r2 = cache.revision();
+  cache.touch(c); // Вытесняет a
+  ASSERT_GT(cache.revision(), r2);
+
+  const auto r3 = cache.revision();
+  cache.erase(a);
+  ASSERT_EQ(cache.revision(), r3);
+  cache.erase(b);
+  ASSERT_GT(cache.revision(), r3);
+}
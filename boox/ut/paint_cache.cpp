@@ -0,0 +1,83 @@
+#include <gtest/gtest.h>
+
+#include <lde/cellfy/boox/src/paint_cache.h>
+
+
+using namespace lde::cellfy::boox;
+
+
+TEST(paint_cache, tile_area) {
+  ASSERT_EQ(paint_cache::tile_area(cell_addr(0, 0)), area(cell_addr(0, 0), cell_addr(paint_cache::tile_columns - 1, paint_cache::tile_rows - 1)));
+  ASSERT_EQ(paint_cache::tile_area(cell_addr(paint_cache::tile_columns + 3, paint_cache::tile_rows)).top_left(), cell_addr(paint_cache::tile_columns, paint_cache::tile_rows));
+
+  const auto last = paint_cache::tile_area(cell_addr(cell_addr::max_column_count - 1, cell_addr::max_row_count - 1));
+  ASSERT_EQ(last.bottom_right(), cell_addr(cell_addr::max_column_count - 1, cell_addr::max_row_count - 1));
+}
+
+
+TEST(paint_cache, tiles) {
+  paint_cache cache;
+  const cell_addr first(0, 0);
+  const cell_addr second(paint_cache::tile_columns, 0);
+
+  ASSERT_EQ(cache.find(first, 1.), nullptr);
+
+  auto& tile = cache.reset(first, 1.);
+  ASSERT_EQ(tile.model.rows_count(), paint_cache::tile_rows);
+  ASSERT_EQ(tile.model.columns_count(), paint_cache::tile_columns);
+  ASSERT_EQ(cache.find(first, 1.), &tile);
+  ASSERT_EQ(cache.find(first, 2.), nullptr);
+
+  cache.reset(second, 1.);
+  cache.erase(area(L"C3"));
+  ASSERT_EQ(cache.find(first, 1.), nullptr);
+  ASSERT_NE(cache.find(second, 1.), nullptr);
+
+  // Объединение из второй плитки задевает первую.
+  cache.reset(first, 1.);
+  cache.reset(second, 1.).reach = area(L"A1:Z1");
+  cache.erase(area(L"B1"));
+  ASSERT_EQ(cache.find(first, 1.), nullptr);
+  ASSERT_EQ(cache.find(second, 1.), nullptr);
+
+  cache.reset(first, 1.);
+  cache.clear();
+  ASSERT_EQ(cache.find(first, 1.), nullptr);
+}
+
+
+TEST(paint_cache, view) {
+  paint_cache cache;
+  const area ar(L"B2:D5");
+
+  ASSERT_EQ(cache.find_view(ar, 1., 0), nullptr);
+
+  auto& model = cache.reset_view(ar, 1., 1);
+  ASSERT_EQ(model.rows_count(), 4);
+  ASSERT_EQ(model.columns_count(), 3);
+  ASSERT_EQ(cache.find_view(ar, 1., 1), &model);
+
+  ASSERT_EQ(cache.find_view(ar, 1., 2), nullptr);
+  ASSERT_EQ(cache.find_view(ar, 2., 1), nullptr);
+  ASSERT_EQ(cache.find_view(area(L"B2:D6"), 1., 1), nullptr);
+
+  cache.erase(area(L"Z100"));
+  ASSERT_EQ(cache.find_view(ar, 1., 1), &model);
+
+  cache.erase(area(L"C3"));
+  ASSERT_EQ(cache.find_view(ar, 1., 1), nullptr);
+
+  cache.reset_view(ar, 1., 1);
+  cache.clear();
+  ASSERT_EQ(cache.find_view(ar, 1., 1), nullptr);
+}
+
+
+TEST(paint_cache, capacity) {
+  paint_cache cache;
+  for (row_index row = 0; row < (paint_cache::max_tiles + 10) * paint_cache::tile_rows; row += paint_cache::tile_rows) {
+    cache.reset(cell_addr(0, row), 1.);
+  }
+  ASSERT_EQ(cache.find(cell_addr(0, 0), 1.), nullptr);
+  ASSERT_NE(cache.find(cell_addr(0, (paint_cache::max_tiles + 9) * paint_cache::tile_rows), 1.), nullptr);
+}
@@ -0,0 +1,53 @@
+#include <gtest/gtest.h>
+
+#include <atomic>
+#include <numeric>
+#include <stdexcept>
+#include <vector>
+
+#include <lde/cellfy/boox/src/parallel.h>
+
+
+using namespace lde::cellfy::boox;
+
+
+TEST(parallel, covers_all) {
+  std::vector<int> values(10007, 0);
+  for (int pass = 0; pass < 3; ++pass) {
+    parallel_blocks(values.size(), 16, [&](std::size_t first, std::size_t last) {
+      for (auto i = first; i < last; ++i) {
+        ++values[i];
+      }
+    });
+  }
+  ASSERT_EQ(std::accumulate(values.begin(), values.end(), 0), 3 * 10007);
+}
+
+
+TEST(parallel, nested) {
+  std::atomic<std::size_t> total = 0;
+  parallel_blocks(64, 1, [&](std::size_t first, std::size_t last) {
+    for (auto i = first; i < last; ++i) {
+      parallel_blocks(100, 1, [&](std::size_t f, std::size_t l) {
+        total += l - f;
+      });
+    }
+  });
+  ASSERT_EQ(total, 6400);
+}
+
+
+TEST(parallel, exception_waits_for_all_blocks) {
+  std::vector<int> values(4096, 0);
+  ASSERT_THROW(
+    parallel_blocks(values.size(), 1, [&](std::size_t first, std::size_t last) {
+      for (auto i = first; i < last; ++i) {
+        values[i] = 1;
+      }
+      if (first == 0) {
+        throw std::runtime_error("block");
+      }
+    }),
+    std::runtime_error);
+  ASSERT_EQ(std::accumulate(values.begin(), values.end(), 0), 4096);
+}
@@ -4,6 +4,7 @@
 #include <ctime>
 #include <string_view>
 #include <utility>
+#include <vector>
 
 #include "boost/date_time/posix_time/posix_time.hpp"
 
@@ -67,6 +68,28 @@ TEST(range, format) {
 }
 
 
+TEST(range, format_many_sources) {
+  workbook book;
+  auto& sheet = *book.sheets().begin();
+  sheet.cells(L"A1:A3").set_format<font_name>("Arial");
+  sheet.cells(L"B1:B3").set_format<font_name>("Tahoma");
+  sheet.cells(L"A1:C3").set_format<font_italic>(true);
+
+  for (auto [name, font] : {std::pair{L"A1:A3", "Arial"}, std::pair{L"B1:B3", "Tahoma"}}) {
+    auto fmt = sheet.cells(name).format();
+    ASSERT_EQ(fmt.get_or_default<font_name>(), font);
+    ASSERT_EQ(fmt.get_optional<font_italic>(), true);
+  }
+
+  auto format_c = sheet.cells(L"C1:C3").format();
+  ASSERT_EQ(format_c.get_optional<font_name>(), std::nullopt);
+  ASSERT_EQ(format_c.get_optional<font_italic>(), true);
+
+  auto format_d = sheet.cells(L"D1:D3").format();
+  ASSERT_EQ(format_d.get_optional<font_italic>(), std::nullopt);
+}
+
+
 TEST(range, value) {
   workbook book;
   auto& sheet = *book.sheets().begin();
@@ -89,6 +112,17 @@ TEST(range, value) {
   book.undo();
   ASSERT_EQ(sheet.cell({0, 0}).value(), cell_value(L"abc"));
 
+  sheet.cell({1, 1}).set_value(true);
+  ASSERT_EQ(sheet.cell({1, 1}).value(), cell_value(true));
+  sheet.cell({1, 1}).set_value(cell_value_error::na);
+  ASSERT_EQ(sheet.cell({1, 1}).value(), cell_value(cell_value_error::na));
+  sheet.cell({1, 1}).set_value(L"x");
+  ASSERT_EQ(sheet.cell({1, 1}).value(), cell_value(L"x"));
+  book.undo();
+  book.undo();
+  book.undo();
+  ASSERT_EQ(sheet.cell({1, 1}).value(), cell_value(0.123));
+
   sheet.cells({0, 0}, {2, 2}).set_value({});
   ASSERT_EQ(sheet.cells({0, 1}, {2, 2}).value(), cell_value());
   ASSERT_EQ(sheet.cells({0, 0}, {2, 0}).value(), cell_value());
@@ -781,3 +815,100 @@ TEST(range, general_horizontal_alignment) {
     ASSERT_EQ(rng.format().template get<text_horizontal_alignment>(), horizontal_alignment::center);
   });
 }
+
+
+// Проверяется обход существующих ячеек и колонок/строк через range-for.
+TEST(range, cursors) {
+  workbook book;
+  auto& sheet = *book.sheets().begin();
+
+  sheet.cell({1, 1}).set_value(1.);
+  sheet.cell({3, 1}).set_value(2.);
+  sheet.cell({2, 4}).set_value(L"A");
+  sheet.cell({5, 5}).set_value(3.);
+
+  auto cells = sheet.cells({0, 0}, {4, 4});
+  std::vector<cell_addr> addrs;
+  for (auto&& cell : cells.existing()) {
+    addrs.push_back(cell.addr());
+  }
+
+  ASSERT_EQ(addrs.size(), 3);
+  ASSERT_EQ(addrs[0], cell_addr(1, 1));
+  ASSERT_EQ(addrs[1], cell_addr(3, 1));
+  ASSERT_EQ(addrs[2], cell_addr(2, 4));
+
+  double sum = 0;
+  for (auto&& cell : cells.existing()) {
+    if (cell.value_type() == cell_value_type::number) {
+      sum += cell.value().as<double>();
+    }
+  }
+  ASSERT_DOUBLE_EQ(sum, 3.);
+
+  ASSERT_TRUE(sheet.cells({6, 6}, {8, 8}).existing().empty());
+
+  std::size_t count = 0;
+  for (auto&& info : sheet.cells({2, 0}, {6, 0}).columns()) {
+    ASSERT_EQ(info.index, 2 + count);
+    ++count;
+  }
+  ASSERT_EQ(count, 5);
+
+  count = 0;
+  for (auto&& info : sheet.cells({0, 3}, {0, 5}).rows()) {
+    ASSERT_EQ(info.index, 3 + count);
+    ++count;
+  }
+  ASSERT_EQ(count, 3);
+}
+
+
+TEST(range, format_runs) {
+  workbook book;
+  auto& sheet = *book.sheets().begin();
+
+  auto big = sheet.cells(L"A1:Z200");
+  big.set_format<font_name>("Arial");
+
+  ASSERT_TRUE(big.existing().empty());
+  ASSERT_EQ(big.format().get_optional<font_name>(), "Arial");
+  ASSERT_EQ(sheet.cells(L"C150").format().get_optional<font_name>(), "Arial");
+  ASSERT_EQ(sheet.cells(L"AA1").format().get_optional<font_name>(), std::nullopt);
+
+  sheet.cells(L"B2").set_value(1.);
+  ASSERT_EQ(sheet.cells(L"B2").format().get_optional<font_name>(), "Arial");
+
+  sheet.cells(L"B2:D3").set_format<font_size>(20._pt);
+  ASSERT_EQ(sheet.cells(L"C3").format().get_optional<font_name>(), "Arial");
+  ASSERT_EQ(sheet.cells(L"C3").format().get_optional<font_size>(), 20._pt);
+  ASSERT_EQ(sheet.cells(L"E3").format().get_optional<font_size>(), std::nullopt);
+
+  big.clear_format();
+  ASSERT_EQ(sheet.cells(L"C150").format().get_optional<font_name>(), std::nullopt);
+  ASSERT_EQ(sheet.cells(L"B2").format().get_optional<font_name>(), std::nullopt);
+}
+
+
+TEST(range, format_runs_merge) {
+  workbook book;
+  auto& sheet = *book.sheets().begin();
+  const auto runs_count = [&] {
+    return book.forest().get<format_run_node>(sheet.node()).size();
+  };
+
+  sheet.cells(L"A1:Z400").set_format<font_name>("Arial");
+  ASSERT_EQ(runs_count(), 1u);
+
+  sheet.cells(L"A100:Z200").set_format<font_name>("Times");
+  ASSERT_EQ(runs_count(), 3u);
+  ASSERT_EQ(sheet.cells(L"C150").format().get_optional<font_name>(), "Times");
+
+  // Вернувшая прежний формат середина сливается с соседями.
+  sheet.cells(L"A100:Z200").set_format<font_name>("Arial");
+  ASSERT_EQ(runs_count(), 1u);
+
+  sheet.cells(L"AA1:AZ400").set_format<font_name>("Arial");
+  ASSERT_EQ(runs_count(), 1u);
+  ASSERT_EQ(sheet.cells(L"A1:AZ400").format().get_optional<font_name>(), "Arial");
+}
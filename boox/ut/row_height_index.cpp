@@ -0,0 +1,49 @@
+#include <gtest/gtest.h>
+
+#include <memory>
+
+#include <ed/rasta/text_layout.h>
+
+#include <lde/cellfy/boox/cell_addr.h>
+#include <lde/cellfy/boox/format.h>
+#include <lde/cellfy/boox/src/row_height_index.h>
+
+
+using namespace lde::cellfy::boox;
+
+
+TEST(row_height_index, max_height) {
+  auto layout = std::make_shared<ed::rasta::text_layout>();
+  layout->add(L"0", make_text_format(font_format()));
+
+  row_height_index index;
+  cell_node a{cell_addr(0, 3).index()};
+  cell_node b{cell_addr(5, 3).index()};
+  cell_node c{cell_addr(0, 4).index()};
+
+  ASSERT_FALSE(row_height_index::content_height(c));
+  ASSERT_FALSE(index.complete(3));
+  ASSERT_FALSE(index.max_height(3));
+
+  a.layout = layout;
+  b.layout = layout;
+  index.update(a);
+  index.update(b);
+  index.update(c); // Без layout не учитывается
+  index.mark_complete(3);
+
+  ASSERT_TRUE(index.complete(3));
+  ASSERT_FALSE(index.complete(4));
+  ASSERT_EQ(index.max_height(3), row_height_index::content_height(a));
+  ASSERT_FALSE(index.max_height(4));
+
+  // Вытесненный из кэша layout высоту ячейки не сбрасывает
+  a.layout = nullptr;
+  ASSERT_EQ(index.max_height(3), row_height_index::content_height(b));
+
+  index.erase(a);
+  ASSERT_EQ(index.max_height(3), row_height_index::content_height(b));
+  index.erase(b);
+  ASSERT_FALSE(index.max_height(3));
+  ASSERT_TRUE(index.complete(3));
+}
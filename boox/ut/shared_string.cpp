@@ -0,0 +1,72 @@
+#include <gtest/gtest.h>
+
+#include <lde/cellfy/boox/cell_value.h>
+#include <lde/cellfy/boox/shared_string.h>
+#include <lde/cellfy/boox/workbook.h>
+
+
+using namespace lde::cellfy::boox;
+
+
+TEST(shared_string, interning) {
+  shared_string a(L"Category");
+  shared_string b(std::wstring(L"Category"));
+  shared_string c(L"category");
+
+  ASSERT_EQ(a, b);
+  ASSERT_EQ(&a.str(), &b.str());
+  ASSERT_NE(a, c);
+  ASSERT_EQ(a.hash(), b.hash());
+  ASSERT_EQ(a.str(), L"Category");
+
+  ASSERT_TRUE(iequals(a, c));
+  ASSERT_FALSE(iequals(a, shared_string(L"Categories")));
+  ASSERT_EQ(a.folded(), L"category");
+}
+
+
+TEST(shared_string, empty) {
+  shared_string a;
+  shared_string b(L"");
+
+  ASSERT_TRUE(a.empty());
+  ASSERT_EQ(a, b);
+  ASSERT_EQ(a.size(), 0);
+}
+
+
+TEST(shared_string, release) {
+  {
+    shared_string a(L"temporary");
+  }
+  shared_string b(L"temporary");
+  ASSERT_EQ(b.str(), L"temporary");
+  ASSERT_EQ(b, shared_string(L"temporary"));
+}
+
+
+TEST(shared_string, cell_value) {
+  // Значения вне ячеек в пул не попадают.
+  cell_value a(L"Category");
+  cell_value b(std::wstring(L"Category"));
+
+  ASSERT_TRUE(a.is<std::wstring>());
+  ASSERT_FALSE(a.is<shared_string>());
+  ASSERT_EQ(a, b);
+  ASSERT_EQ(a, cell_value(shared_string(L"Category")));
+  ASSERT_EQ(a.to<shared_string>(), shared_string(L"Category"));
+  ASSERT_NE(a, cell_value(L"category"));
+  ASSERT_LT(a, cell_value(L"Categoryz"));
+  ASSERT_LT(cell_value(shared_string(L"Category")), cell_value(L"Categoryz"));
+
+  // Записанная в ячейки строка - одна запись пула, чтение ячейки её не копирует.
+  workbook book;
+  auto& sheet = *book.sheets().begin();
+  sheet.cell({0, 0}).set_value(a);
+  sheet.cell({1, 0}).set_value(b);
+  const auto x = sheet.cell({0, 0}).value();
+  const auto y = sheet.cell({1, 0}).value();
+  ASSERT_TRUE(x.is<shared_string>());
+  ASSERT_EQ(&x.as<std::wstring>(), &y.as<std::wstring>());
+  ASSERT_EQ(x, a);
+}
@@ -51,6 +51,16 @@ TEST(value_format, number) {
 }
 
 
+TEST(value_format, number_simple) {
+  ASSERT_EQ(value_format(L"")(1234.5).text, L"1234.5");
+  ASSERT_EQ(value_format(L"")(-0.125).text, L"-0.125");
+  ASSERT_EQ(value_format(L"0")(41.5).text, L"42");
+  ASSERT_EQ(value_format(L"0.00")(3.14159).text, L"3.14");
+  ASSERT_EQ(value_format(L"#,##0.00")(1234567.891).text, L"1,234,567.89");
+  ASSERT_EQ(value_format(L"#,##0.00")(0.5).text, L"0.50");
+}
+
+
 TEST(value_format, fraction) {
   ASSERT_EQ(value_format(LR"(#$$???$/$000#$)")(-5.25).text, L"-5$$  1$/$0004$");
   ASSERT_EQ(value_format(LR"(# ???/???)")(5.25).text, L"5   1/4  ");
@@ -179,3 +189,14 @@ TEST(value_format, system_information) {
   ASSERT_EQ(value_format(L"[$-F800]dd.mm.yyyy")(time).text,         L"03.02.2021");
   ASSERT_EQ(value_format(L"[$ABFDFS-FBAF8]dd.mm.yyyy")(time).text,  L"03.02.2021");
 }
+
+
+TEST(value_format, compiled) {
+  auto fmt1 = value_format::compiled(L"0.00");
+  auto fmt2 = value_format::compiled(L"0.00");
+  auto fmt3 = value_format::compiled(L"0.000");
+
+  ASSERT_EQ(fmt1, fmt2);
+  ASSERT_NE(fmt1, fmt3);
+  ASSERT_EQ((*fmt1)(1.5).text, value_format(L"0.00")(1.5).text);
+}
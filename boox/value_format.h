@@ -26,7 +26,13 @@ public:
     std::vector<std::size_t>   white_positions; /// Позиции в тексте символов, которые не должны рисоваться, но должны занимать свою ширину.
   };
 
+  using ptr = std::shared_ptr<const value_format>;
+
 public:
+  /// Разобранный формат из общего кэша. Разбор строки выполняется один раз на пару (format, loc).
+  /// Объект неизменяем и может использоваться из нескольких потоков.
+  static ptr compiled(const std::wstring& format, const std::locale& loc = std::locale());
+
   /// format - строка форматирования. https://developers.google.com/sheets/api/guides/formats
   /// loc - локаль для форматирования.
   explicit value_format(const std::wstring& format, std::locale loc = std::locale());
@@ -1,10 +1,14 @@
 #pragma once
 
 
+#include <exception>
+#include <filesystem>
 #include <functional>
+#include <future>
 #include <iosfwd>
 #include <locale>
 #include <memory>
+#include <optional>
 #include <string>
 #include <unordered_map>
 #include <vector>
@@ -31,13 +35,9 @@ namespace lde::cellfy::boox {
 
 /// Книга
 class workbook final {
-  friend class change_existing_cell_format_op;
-  friend class change_cell_format_op;
-  friend class change_existing_column_format_op;
-  friend class change_column_format_op;
-  friend class change_existing_row_format_op;
-  friend class change_row_format_op;
+  friend class format_transitions;
   friend class range;
+  friend class range_op_ctx;
   friend class worksheet;
 
 public:
@@ -77,9 +77,11 @@ public:
   ed::signal<const range&>           changed;
   ed::signal<>                       about_to_close;
   ed::signal<>                       opened;
+  ed::signal<std::exception_ptr>     saved;
 
 public:
   workbook();
+  ~workbook();
 
   workbook(const workbook&) = delete;
   workbook& operator=(const workbook&) = delete;
@@ -109,7 +111,15 @@ public:
   /// Добавить новый лист
   worksheet& emplace_sheet(std::size_t index);
 
-  /// Отменить действие.
+  /// Прочитать содержимое листа, отложенное при открытии снимка (deferred_sheet), и листы, на которые ссылаются
+  /// его формулы. Не испускает сигналов изменений. В чистой истории не заносится в undo/redo, после изменений
+  /// входит в открытую транзакцию или становится шагом, который undo и redo проходят вместе с соседним.
+  void load_sheet(const worksheet& sheet) const;
+
+  /// Прочитать все отложенные листы перед записью.
+  void load_sheets() const;
+
+  /// Отменить действие. Отмена шага, в котором лист был прочитан, возвращает лист в снимок.
   void undo();
 
   /// Повторить действие.
@@ -123,6 +133,7 @@ public:
   mimes_range writable_file_formats() const noexcept;
 
   /// Добавить поддержку определенного формата файла.
+  /// Снимки application/x-cellfy книга читает сама, fn для этого формата читает файлы прежнего формата без сигнатуры снимка.
   void add_file_reader(const ed::mime_type& format, file_reader&& fn);
   void add_file_writer(const ed::mime_type& format, file_writer&& fn);
 
@@ -147,9 +158,29 @@ public:
   /// Открыть книгу из потока
   void open(const ed::mime_type& format, std::istream& is);
 
+  /// Открыть книгу из потока. after_read получает прочитанный лес до создания листов, его изменения
+  /// не попадают ни в историю undo, ни в сигналы изменений. Так журнал (journal.h) применяет свои записи.
+  void open(const ed::mime_type& format, std::istream& is, const std::function<void(forest_t&)>& after_read);
+
+  /// Открыть книгу из файла. Снимок application/x-cellfy отображается в память (read_snapshot), остальные файлы
+  /// читаются потоком. after_read - как у чтения из потока.
+  void open(const ed::mime_type& format, const std::filesystem::path& path);
+  void open(const ed::mime_type& format, const std::filesystem::path& path, const std::function<void(forest_t&)>& after_read);
+
   /// Сохранить книгу в поток
   void save(const ed::mime_type& format, std::ostream& os) const;
 
+  /// Сохранить книгу в поток в фоновом потоке. Копия книги снимается сразу, и книгу можно менять, пока идёт запись:
+  /// в поток попадёт то же, что записал бы save в момент вызова. Предыдущая фоновая запись сначала дожидается окончания.
+  /// saved с nullptr или с исключением записи вызывается в потоке книги из wait_saved или poll_saved.
+  void save_in_background(const ed::mime_type& format, std::shared_ptr<std::ostream> os);
+
+  /// Дождаться окончания фоновой записи и вызвать saved.
+  void wait_saved();
+
+  /// Если фоновая запись закончилась, вызвать saved. Не ждёт. Возвращает true, если фоновой записи больше нет.
+  bool poll_saved();
+
   /// Задать режим расчёта для книги.
   void set_calc_mode(calc_mode mode);
   /// Получить текущий режим расчёта.
@@ -163,6 +194,10 @@ public:
 protected:
   cell_format_node::it ensure_format(cell_format&& fmt);
 
+  /// Формат мог перестать использоваться. Проверяется при сборке неиспользуемых форматов в конце транзакции.
+  void release_format(const std::optional<node_key_type>& key);
+  void release_format(const cell_format& fmt);
+
   void pre_open(bool block_signals);
   void post_open(bool unblock_signals);
 
@@ -224,23 +259,57 @@ private:
     >
   >;
 
-  ed::property<bool>        can_undo_           = {false};
-  ed::property<bool>        can_redo_           = {false};
-  ed::property<std::size_t> sheets_count_       = 0;
-  ed::property<worksheet*>  active_sheet_       = {nullptr};
-  forest_t                  forest_;
-  any_connections           forest_conns_;
-  workbook_node::it         book_node_;
-  fx::parser                formula_parser_;
-  file_readers              file_readers_;
-  file_writers              file_writers_;
-  clipboard_readers         clipboard_readers_;
-  clipboard_writers         clipboard_writers_;
-  sheets_container          sheets_;
-  cell_formats_container    cell_formats_;
-  bool                      formats_gc_at_work_ = false;
-  std::locale               locale_             = {};
-  calc_mode                 calc_mode_          = calc_mode::automatic;
+  /// Полный обход таблицы форматов не чаще, чем при удвоении её размера, но не меньше этого числа форматов.
+  static constexpr std::size_t min_formats_sweep_size = 1024;
+
+  /// Сколько фиксаций проверяют форматы, которые держала отброшенная история redo.
+  /// Первая фиксация может ещё держать историю redo, со второй её ссылки точно ушли.
+  static constexpr std::size_t history_formats_rechecks = 2;
+
+  /// Удалить неиспользуемые форматы. Вызывается при фиксации транзакции.
+  void collect_formats();
+
+  using format_keys = std::vector<node_key_type>;
+
+  /// Шаг истории undo/redo со стороны книги. Шаги идут вместе с историей леса: undo_steps_ - история undo,
+  /// redo_steps_ - история redo. Когда новая фиксация отбрасывает историю redo, её форматы попадают
+  /// в history_formats_ и проверяются, хотя release_format для них не вызывался.
+  struct history_step final {
+    format_keys formats;      /// Форматы, назначенные через ensure_format.
+    bool        load = false; /// Чтение отложенного листа, а не изменение.
+  };
+
+  /// Фиксация добавила шаг в историю undo. Форматы шага - назначенные в транзакции (ensured_formats_).
+  void history_committed(bool load);
+
+  /// Забыть шаги вместе с историей undo/redo.
+  void clear_history_steps();
+
+  ed::property<bool>                  can_undo_           = {false};
+  ed::property<bool>                  can_redo_           = {false};
+  ed::property<std::size_t>           sheets_count_       = 0;
+  ed::property<worksheet*>            active_sheet_       = {nullptr};
+  forest_t                            forest_;
+  any_connections                     forest_conns_;
+  workbook_node::it                   book_node_;
+  fx::parser                          formula_parser_;
+  file_readers                        file_readers_;
+  file_writers                        file_writers_;
+  clipboard_readers                   clipboard_readers_;
+  clipboard_writers                   clipboard_writers_;
+  sheets_container                    sheets_;
+  cell_formats_container              cell_formats_;
+  std::vector<node_key_type>          released_formats_;
+  format_keys                         ensured_formats_;
+  std::vector<history_step>           undo_steps_;
+  std::vector<history_step>           redo_steps_;
+  format_keys                         history_formats_;
+  std::size_t                         formats_rechecks_   = 0;
+  std::size_t                         formats_swept_size_ = 0;
+  bool                                formats_gc_at_work_ = false;
+  std::locale                         locale_             = {};
+  calc_mode                           calc_mode_          = calc_mode::automatic;
+  std::future<std::exception_ptr>     background_save_;
 };
 
 
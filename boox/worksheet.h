@@ -4,6 +4,7 @@
 #include <memory>
 #include <string>
 #include <unordered_set>
+#include <vector>
 
 #include <ed/core/fwd.h>
 #include <ed/core/mime.h>
@@ -19,25 +20,38 @@
 namespace lde::cellfy::boox {
 
 
+class format_runs;
+class layout_cache;
+class paint_cache;
+class row_height_index;
+
+
 /// Лист
 class worksheet final {
   friend class range;
+  friend class range_op_ctx;
   friend class workbook;
   friend class parse_formulas_op;
   friend class change_existing_cell_format_op;
   friend class change_cell_format_op;
 
 public:
-  ed::ro_proxy_property<std::wstring> name;
-  ed::ro_proxy_property<bool>         active;
-  ed::ro_proxy_property<range>        selection;
-  ed::ro_proxy_property<range>        active_cell;
-  ed::signal<const range&>            changed;
-  ed::signal<>                        removed;
+  ed::ro_proxy_property<std::wstring>       name;
+  ed::ro_proxy_property<bool>               active;
+  ed::ro_proxy_property<range>              selection;
+  ed::ro_proxy_property<range>              active_cell;
+  ed::signal<const range&>                  changed;
+  /// Изменения узлов за транзакцию, для журнала (journal.h). Испускаются перед changed.
+  /// rows_changed - строки с изменёнными строками и ячейками, properties_changed - узел листа, столбцы или области форматов.
+  ed::signal<const std::vector<row_index>&> rows_changed;
+  ed::signal<>                              properties_changed;
+  ed::signal<>                              removed;
 
 public:
   worksheet(workbook& book, worksheet_node::it sheet_node);
 
+  ~worksheet();
+
   worksheet(const worksheet&) = delete;
   worksheet& operator=(const worksheet&) = delete;
 
@@ -49,8 +63,8 @@ public:
   /// Индекс листа в книге
   std::size_t index() const noexcept;
 
-  /// Все ячейки.
-  range cells() const noexcept;
+  /// Все ячейки. Здесь и ниже отложенное содержимое листа читается при первом обращении (workbook::load_sheet).
+  range cells() const;
 
   /// Ячейки из диапазона.
   range cells(cell_addr first, cell_addr last) const;
@@ -83,8 +97,9 @@ public:
   /// Вставить данные определенного формата.
   void paste(const ed::mime_type& format, const ed::buffer& data);
 
-  /// Обновить layout всех ячеек на листе, не заносится в undo/redo.
-  void update_formulas();
+  /// Пометить устаревшими результаты формул и layout всех ячеек на листе, не заносится в undo/redo.
+  /// Пересчёт выполняется при отрисовке. keep_results - оставить результаты, сохранённые в файле.
+  void update_formulas(bool keep_results = false);
 
   /// Заново рассчитать все формулы на листе и обновить gui, не заносится в undo/redo.
   void update_formulas_and_view();
@@ -94,9 +109,28 @@ private:
   row_node::opt_it find_row(row_index index) const noexcept;
   cell_node::opt_it find_cell(cell_addr addr) const noexcept;
 
+  /// Область формата, содержащая ячейку.
+  format_run_node::opt_it find_format_run(cell_addr addr) const;
+
+  /// Области формата, пересекающиеся с ar.
+  std::vector<format_run_node::it> find_format_runs(const area& ar) const;
+
+  /// Применить изменения формата к областям формата внутри ar.
+  /// cover_empty - покрыть новыми областями и ту часть ar, где областей ещё нет.
+  void change_format_runs(const area& ar, const cell_format::changes& changes, bool cover_empty);
+
+  /// Убрать области формата из ar.
+  void clear_format_runs(const area& ar);
+
+  /// Слить соседние области с одинаковым форматом рядом с ar, иначе изменения только дробят области.
+  void merge_format_runs(const area& ar);
+
   void changes_started();
   void changes_finished(calc_mode mode);
 
+  /// Запомнить строку для rows_changed.
+  void row_changed(row_index row);
+
   void modified(worksheet_node::it node);
 
   void inserted(column_node::it node);
@@ -107,6 +141,10 @@ private:
   void erased(row_node::it node);
   void modified(row_node::it node);
 
+  void inserted(format_run_node::it node);
+  void erased(format_run_node::it node);
+  void modified(format_run_node::it node);
+
   void inserted(cell_node::it node);
   void erased(cell_node::it node);
   void modified(cell_node::it node);
@@ -123,25 +161,37 @@ private:
   void erased(cell_formula_node::it node);
   void modified(cell_formula_node::it node);
 
-  void parse_formula(cell_node::it node);
-  void parse_formula(cell_formula_node::it node);
+  void parse_formula(cell_node::it node, bool keep_result = false);
+  void parse_formula(cell_formula_node::it node, bool keep_result = false);
 
   void actualize_format();
+  void actualize_format_runs();
+
+  /// Форматы и разобранные формулы узлов листа. При создании листа и после чтения отложенного содержимого.
+  void actualize();
 
 private:
   using volatile_cells = std::unordered_set<cell_node::it>;
-
-  ed::property<std::wstring> name_;
-  ed::property<bool>         active_ = {false};
-  ed::property<range>        selection_;
-  ed::property<range>        active_cell_;
-  workbook&                  book_;
-  worksheet_node::it         sheet_node_;
-  range                      cells_;
-  range                      changes_;
-  ed::twips<double>          default_column_width_;
-  ed::twips<double>          default_row_height_;
-  volatile_cells             volatile_cells_;
+  using sheet_names    = std::unordered_set<std::wstring>;
+
+  ed::property<std::wstring>        name_;
+  ed::property<bool>                active_ = {false};
+  ed::property<range>               selection_;
+  ed::property<range>               active_cell_;
+  workbook&                         book_;
+  worksheet_node::it                sheet_node_;
+  range                             cells_;
+  range                             changes_;
+  std::vector<row_index>            changed_rows_;
+  bool                              properties_changed_ = false;
+  ed::twips<double>                 default_column_width_;
+  ed::twips<double>                 default_row_height_;
+  volatile_cells                    volatile_cells_;
+  sheet_names                       referenced_sheets_; // Листы из ссылок формул, читаются вместе с этим листом
+  std::unique_ptr<format_runs>      format_runs_;
+  std::unique_ptr<layout_cache>     layouts_;
+  std::unique_ptr<paint_cache>      paint_cache_;
+  std::unique_ptr<row_height_index> row_heights_;
 };
 
 